@@ -155,20 +155,16 @@ dkim_canon_free(DKIM *dkim, DKIM_CANON *canon)
 			/* NOTREACHED */
 		}
 
-		dkim_mfree(dkim->dkim_libhandle, dkim->dkim_closure,
-		           canon->canon_hash);
+		DKIM_FREE(dkim, canon->canon_hash);
 	}
 
 	if (canon->canon_hashbuf != NULL)
-	{
-		dkim_mfree(dkim->dkim_libhandle, dkim->dkim_closure,
-		           canon->canon_hashbuf);
-	}
+		DKIM_FREE(dkim, canon->canon_hashbuf);
 
 	if (canon->canon_buf != NULL)
 		dkim_dstring_free(canon->canon_buf);
 
-	dkim_mfree(dkim->dkim_libhandle, dkim->dkim_closure, canon);
+	DKIM_FREE(dkim, canon);
 }
 
 /*
@@ -878,8 +874,7 @@ dkim_add_canon(DKIM *dkim, _Bool hdr, dkim_canon_t canon, int hashtype,
 		}
 	}
 
-	new = (DKIM_CANON *) dkim_malloc(dkim->dkim_libhandle,
-	                                 dkim->dkim_closure, sizeof *new);
+	new = (DKIM_CANON *) DKIM_MALLOC(dkim, sizeof *new);
 	if (new == NULL)
 	{
 		dkim_error(dkim, "unable to allocate %d byte(s)", sizeof *new);
@@ -995,9 +990,7 @@ dkim_canon_selecthdrs(DKIM *dkim, u_char *hdrlist, struct dkim_header **ptrs,
 
 	if (dkim->dkim_hdrlist == NULL)
 	{
-		dkim->dkim_hdrlist = dkim_malloc(dkim->dkim_libhandle,
-		                                 dkim->dkim_closure,
-		                                 DKIM_MAXHEADER);
+		dkim->dkim_hdrlist = DKIM_MALLOC(dkim, DKIM_MAXHEADER);
 		if (dkim->dkim_hdrlist == NULL)
 		{
 			dkim_error(dkim, "unable to allocate %d bytes(s)",
@@ -1123,7 +1116,6 @@ DKIM_STAT
 dkim_canon_runheaders(DKIM *dkim)
 {
 	_Bool signing;
-	u_char savechar;
 	int c;
 	int n;
 	int in;
@@ -1138,6 +1130,7 @@ dkim_canon_runheaders(DKIM *dkim)
 	struct dkim_header **hdrset;
 	struct dkim_header tmphdr;
 	u_char tmpbuf[BUFRSZ];
+	u_char name[DKIM_MAXHEADER + 1];
 
 	assert(dkim != NULL);
 
@@ -1242,17 +1235,26 @@ dkim_canon_runheaders(DKIM *dkim)
 					continue;
 				}
 
-				/* could be space, could be colon ... */
-				savechar = hdr->hdr_text[hdr->hdr_namelen];
+				/*
+				**  Test a copy of the header field name;
+				**  the text itself may be borrowed.
+				*/
 
-				/* terminate the header field name and test */
-				hdr->hdr_text[hdr->hdr_namelen] = '\0';
-				status = regexec(hdrtest,
-				                 (char *) hdr->hdr_text,
-				                 0, NULL, 0);
+				if (hdr->hdr_namelen < sizeof name)
+				{
+					memcpy(name, hdr->hdr_text,
+					       hdr->hdr_namelen);
+					name[hdr->hdr_namelen] = '\0';
+				}
+				else
+				{
+					strlcpy((char *) name,
+					        (char *) hdr->hdr_text,
+					        sizeof name);
+				}
 
-				/* restore the character */
-				hdr->hdr_text[hdr->hdr_namelen] = savechar;
+				status = regexec(hdrtest, (char *) name,
+				                 0, NULL, 0);
 
 				if (status == 0)
 				{
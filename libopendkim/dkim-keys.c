@@ -94,6 +94,8 @@ dkim_get_key_dns(DKIM *dkim, DKIM_SIGINFO *sig, u_char *buf, size_t buflen)
 	unsigned char qname[DKIM_MAXHOSTNAMELEN + 1];
 	unsigned char ansbuf[MAXPACKET];
 	struct timeval timeout;
+	struct timeval qstart;
+	struct timeval qend;
 	HEADER hdr;
 
 	assert(dkim != NULL);
@@ -148,6 +150,8 @@ dkim_get_key_dns(DKIM *dkim, DKIM_SIGINFO *sig, u_char *buf, size_t buflen)
 			return DKIM_STAT_KEYFAIL;
 		}
 
+		(void) gettimeofday(&qstart, NULL);
+
 		status = lib->dkiml_dns_start(lib->dkiml_dns_service, T_TXT,
 		                              qname, ansbuf, anslen, &q);
 
@@ -156,6 +160,8 @@ dkim_get_key_dns(DKIM *dkim, DKIM_SIGINFO *sig, u_char *buf, size_t buflen)
 			dkim_error(dkim, "'%s' query failed", qname);
 			return DKIM_STAT_KEYFAIL;
 		}
+
+		dkim->dkim_dns_queries++;
 	
 		if (lib->dkiml_dns_callback == NULL)
 		{
@@ -209,8 +215,17 @@ dkim_get_key_dns(DKIM *dkim, DKIM_SIGINFO *sig, u_char *buf, size_t buflen)
 			}
 		}
 
+		/* ignore the clock being stepped backward */
+		(void) gettimeofday(&qend, NULL);
+		if (timercmp(&qend, &qstart, >))
+		{
+			dkim->dkim_dns_usec += (qend.tv_sec - qstart.tv_sec) * 1000000 +
+			                       (qend.tv_usec - qstart.tv_usec);
+		}
+
 		if (status == DKIM_DNS_EXPIRED)
 		{
+			dkim->dkim_dns_timeouts++;
 			(void) lib->dkiml_dns_cancel(lib->dkiml_dns_service, q);
 			dkim_error(dkim, "'%s' query timed out", qname);
 			return DKIM_STAT_KEYFAIL;
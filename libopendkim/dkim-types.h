@@ -80,6 +80,33 @@ struct dkim_dstring
 	unsigned char *		ds_buf;
 };
 
+/* union dkim_arena_align -- alignment of arena allocations */
+union dkim_arena_align
+{
+	long double		aa_ldouble;
+	long long		aa_llong;
+	void *			aa_ptr;
+	void			(*aa_func) (void);
+};
+
+/* struct dkim_arena_blk -- a block of memory owned by a DKIM_ARENA */
+struct dkim_arena_blk
+{
+	size_t			ab_size;
+	struct dkim_arena_blk *	ab_next;
+	union dkim_arena_align	ab_data[];
+};
+
+/* struct dkim_arena -- per-handle allocation arena */
+struct dkim_arena
+{
+	size_t			arena_chunksz;
+	size_t			arena_used;
+	struct dkim_arena_blk *	arena_chunks;
+	struct dkim_arena_blk *	arena_spare;
+	struct dkim_arena_blk *	arena_big;
+};
+
 /* struct dkim_header -- an RFC2822 header of some kind */
 struct dkim_header
 {
@@ -93,6 +120,7 @@ struct dkim_header
 
 /* hdr_flags bits */
 #define	DKIM_HDR_SIGNED		0x01
+#define	DKIM_HDR_BORROWED	0x02		/* hdr_text not ours */
 
 /* struct dkim_plist -- a parameter/value pair */
 struct dkim_plist
@@ -280,6 +308,9 @@ struct dkim
 	u_int			dkim_cache_queries;
 	u_int			dkim_cache_hits;
 #endif /* QUERY_CACHE */
+	u_int			dkim_dns_queries;
+	u_int			dkim_dns_timeouts;
+	u_long			dkim_dns_usec;
 	u_int			dkim_version;
 	u_int			dkim_sigcount;
 	size_t			dkim_margin;
@@ -333,6 +364,7 @@ struct dkim
 	struct dkim_test_dns_data * dkim_dnstesth;
 	struct dkim_test_dns_data * dkim_dnstestt;
 	regex_t *		dkim_hdrre;
+	struct dkim_arena *	dkim_arena;
 	DKIM_LIB *		dkim_libhandle;
 };
 
@@ -348,6 +380,7 @@ struct dkim_lib
 	u_int			dkiml_flsize;
 	u_int			dkiml_minkeybits;
 	uint32_t		dkiml_flags;
+	size_t			dkiml_arenasz;
 	uint64_t		dkiml_fixedtime;
 	uint64_t		dkiml_sigttl;
 	uint64_t		dkiml_clockdrift;
@@ -77,6 +77,275 @@ dkim_mfree(DKIM_LIB *libhandle, void *closure, void *ptr)
 		libhandle->dkiml_free(closure, ptr);
 }
 
+/*
+**  DKIM_ARENA_NEW -- attach an allocation arena to a handle
+**
+**  Parameters:
+**  	dkim -- DKIM handle
+**  	chunksz -- size of the chunks the arena carves allocations from
+**
+**  Return value:
+**  	TRUE on success, FALSE on failure.
+**
+**  Notes:
+**  	Once an arena is attached, DKIM_MALLOC() carves memory out of
+**  	chunks obtained from the library's allocator, DKIM_FREE() of such
+**  	memory is a no-op, and the lot is handed back by dkim_arena_free()
+**  	when the handle is destroyed.  Requests larger than a quarter of
+**  	a chunk get a block of their own which DKIM_FREE() does release,
+**  	so dstrings that keep growing don't strand their old buffers.
+*/
+
+_Bool
+dkim_arena_new(DKIM *dkim, size_t chunksz)
+{
+	struct dkim_arena *arena;
+
+	assert(dkim != NULL);
+	assert(dkim->dkim_arena == NULL);
+
+	arena = dkim_malloc(dkim->dkim_libhandle, dkim->dkim_closure,
+	                    sizeof(struct dkim_arena));
+	if (arena == NULL)
+		return FALSE;
+
+	chunksz = ((chunksz + sizeof(union dkim_arena_align) - 1) /
+	           sizeof(union dkim_arena_align)) *
+	          sizeof(union dkim_arena_align);
+
+	arena->arena_chunksz = chunksz;
+	arena->arena_used = chunksz;
+	arena->arena_chunks = NULL;
+	arena->arena_spare = NULL;
+	arena->arena_big = NULL;
+
+	dkim->dkim_arena = arena;
+
+	return TRUE;
+}
+
+/*
+**  DKIM_ARENA_FREE -- release a handle's allocation arena
+**
+**  Parameters:
+**  	dkim -- DKIM handle
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Everything allocated from the arena becomes invalid.
+*/
+
+void
+dkim_arena_free(DKIM *dkim)
+{
+	struct dkim_arena *arena;
+	struct dkim_arena_blk *blk;
+	struct dkim_arena_blk *next;
+
+	assert(dkim != NULL);
+
+	arena = dkim->dkim_arena;
+	if (arena == NULL)
+		return;
+
+	dkim_arena_reset(dkim);
+
+	for (blk = arena->arena_spare; blk != NULL; blk = next)
+	{
+		next = blk->ab_next;
+		dkim_mfree(dkim->dkim_libhandle, dkim->dkim_closure, blk);
+	}
+
+	dkim_mfree(dkim->dkim_libhandle, dkim->dkim_closure, arena);
+
+	dkim->dkim_arena = NULL;
+}
+
+/*
+**  DKIM_ARENA_RESET -- discard everything allocated from an arena
+**
+**  Parameters:
+**  	dkim -- DKIM handle
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Large blocks are released.  One chunk is kept aside and handed
+**  	out again before any new one is requested; the rest are released
+**  	too, so an idle handle holds at most one chunk however large its
+**  	last message was.
+*/
+
+void
+dkim_arena_reset(DKIM *dkim)
+{
+	struct dkim_arena *arena;
+	struct dkim_arena_blk *blk;
+	struct dkim_arena_blk *next;
+
+	assert(dkim != NULL);
+
+	arena = dkim->dkim_arena;
+	if (arena == NULL)
+		return;
+
+	for (blk = arena->arena_chunks; blk != NULL; blk = next)
+	{
+		next = blk->ab_next;
+		blk->ab_next = arena->arena_spare;
+		arena->arena_spare = blk;
+	}
+
+	if (arena->arena_spare != NULL)
+	{
+		for (blk = arena->arena_spare->ab_next; blk != NULL; blk = next)
+		{
+			next = blk->ab_next;
+			dkim_mfree(dkim->dkim_libhandle, dkim->dkim_closure,
+			           blk);
+		}
+
+		arena->arena_spare->ab_next = NULL;
+	}
+
+	for (blk = arena->arena_big; blk != NULL; blk = next)
+	{
+		next = blk->ab_next;
+		dkim_mfree(dkim->dkim_libhandle, dkim->dkim_closure, blk);
+	}
+
+	arena->arena_chunks = NULL;
+	arena->arena_big = NULL;
+	arena->arena_used = arena->arena_chunksz;
+}
+
+/*
+**  DKIM_HALLOC -- allocate memory that belongs to a handle
+**
+**  Parameters:
+**  	dkim -- DKIM handle
+**  	nbytes -- number of bytes desired
+**
+**  Return value:
+**  	Pointer to allocated memory, or NULL on failure.
+*/
+
+void *
+dkim_halloc(DKIM *dkim, size_t nbytes)
+{
+	u_char *p;
+	struct dkim_arena *arena;
+	struct dkim_arena_blk *blk;
+
+	assert(dkim != NULL);
+
+	arena = dkim->dkim_arena;
+	if (arena == NULL)
+	{
+		return dkim_malloc(dkim->dkim_libhandle, dkim->dkim_closure,
+		                   nbytes);
+	}
+
+	nbytes = ((nbytes + sizeof(union dkim_arena_align) - 1) /
+	          sizeof(union dkim_arena_align)) *
+	         sizeof(union dkim_arena_align);
+
+	if (nbytes > arena->arena_chunksz / 4)
+	{
+		blk = dkim_malloc(dkim->dkim_libhandle, dkim->dkim_closure,
+		                  sizeof(struct dkim_arena_blk) + nbytes);
+		if (blk == NULL)
+			return NULL;
+
+		blk->ab_size = nbytes;
+		blk->ab_next = arena->arena_big;
+		arena->arena_big = blk;
+
+		return blk->ab_data;
+	}
+
+	if (arena->arena_used + nbytes > arena->arena_chunksz)
+	{
+		blk = arena->arena_spare;
+		if (blk != NULL)
+		{
+			arena->arena_spare = blk->ab_next;
+		}
+		else
+		{
+			blk = dkim_malloc(dkim->dkim_libhandle,
+			                  dkim->dkim_closure,
+			                  sizeof(struct dkim_arena_blk) +
+			                  arena->arena_chunksz);
+			if (blk == NULL)
+				return NULL;
+		}
+
+		blk->ab_size = arena->arena_chunksz;
+		blk->ab_next = arena->arena_chunks;
+		arena->arena_chunks = blk;
+		arena->arena_used = 0;
+	}
+
+	p = (u_char *) arena->arena_chunks->ab_data + arena->arena_used;
+	arena->arena_used += nbytes;
+
+	return p;
+}
+
+/*
+**  DKIM_HFREE -- release memory that belongs to a handle
+**
+**  Parameters:
+**  	dkim -- DKIM handle
+**  	ptr -- pointer to memory to be freed
+**
+**  Return value:
+**  	None.
+*/
+
+void
+dkim_hfree(DKIM *dkim, void *ptr)
+{
+	struct dkim_arena *arena;
+
+	assert(dkim != NULL);
+
+	arena = dkim->dkim_arena;
+	if (arena != NULL && ptr != NULL)
+	{
+		u_char *p = ptr;
+		struct dkim_arena_blk *blk;
+		struct dkim_arena_blk **prev;
+
+		for (blk = arena->arena_chunks; blk != NULL; blk = blk->ab_next)
+		{
+			if (p >= (u_char *) blk->ab_data &&
+			    p < (u_char *) blk->ab_data + blk->ab_size)
+				return;
+		}
+
+		for (prev = &arena->arena_big;
+		     *prev != NULL;
+		     prev = &(*prev)->ab_next)
+		{
+			blk = *prev;
+			if (p == (u_char *) blk->ab_data)
+			{
+				*prev = blk->ab_next;
+				dkim_mfree(dkim->dkim_libhandle,
+				           dkim->dkim_closure, blk);
+				return;
+			}
+		}
+	}
+
+	dkim_mfree(dkim->dkim_libhandle, dkim->dkim_closure, ptr);
+}
+
 /*
 **  DKIM_STRDUP -- duplicate a string
 **
@@ -101,7 +370,7 @@ dkim_strdup(DKIM *dkim, const unsigned char *str, size_t len)
 	if (len == 0)
 		len = strlen((char *) str);
 
-	new = dkim_malloc(dkim->dkim_libhandle, dkim->dkim_closure, len + 1);
+	new = DKIM_MALLOC(dkim, len + 1);
 	if (new != NULL)
 	{
 		memcpy(new, str, len);
@@ -193,7 +462,6 @@ dkim_dstring_resize(struct dkim_dstring *dstr, int len)
 	int newsz;
 	unsigned char *new;
 	DKIM *dkim;
-	DKIM_LIB *lib;
 
 	assert(dstr != NULL);
 	assert(len > 0);
@@ -202,7 +470,6 @@ dkim_dstring_resize(struct dkim_dstring *dstr, int len)
 		return TRUE;
 
 	dkim = dstr->ds_dkim;
-	lib = dkim->dkim_libhandle;
 
 	/* must resize */
 	for (newsz = dstr->ds_alloc * 2;
@@ -231,7 +498,7 @@ dkim_dstring_resize(struct dkim_dstring *dstr, int len)
 		}
 	}
 
-	new = dkim_malloc(lib, dkim->dkim_closure, newsz);
+	new = DKIM_MALLOC(dkim, newsz);
 	if (new == NULL)
 	{
 		dkim_error(dkim, "unable to allocate %d byte(s)", newsz);
@@ -240,7 +507,7 @@ dkim_dstring_resize(struct dkim_dstring *dstr, int len)
 
 	memcpy(new, dstr->ds_buf, dstr->ds_alloc);
 
-	dkim_mfree(lib, dkim->dkim_closure, dstr->ds_buf);
+	DKIM_FREE(dkim, dstr->ds_buf);
 
 	dstr->ds_alloc = newsz;
 	dstr->ds_buf = new;
@@ -265,7 +532,6 @@ struct dkim_dstring *
 dkim_dstring_new(DKIM *dkim, int len, int maxlen)
 {
 	struct dkim_dstring *new;
-	DKIM_LIB *lib;
 
 	assert(dkim != NULL);
 
@@ -273,12 +539,10 @@ dkim_dstring_new(DKIM *dkim, int len, int maxlen)
 	if ((maxlen > 0 && len > maxlen) || len < 0)
 		return NULL;
 
-	lib = dkim->dkim_libhandle;
-
 	if (len < BUFRSZ)
 		len = BUFRSZ;
 
-	new = dkim_malloc(lib, dkim->dkim_closure, sizeof(struct dkim_dstring));
+	new = DKIM_MALLOC(dkim, sizeof(struct dkim_dstring));
 	if (new == NULL)
 	{
 		dkim_error(dkim, "unable to allocate %d byte(s)",
@@ -286,12 +550,12 @@ dkim_dstring_new(DKIM *dkim, int len, int maxlen)
 		return NULL;
 	}
 
-	new->ds_buf = dkim_malloc(lib, dkim->dkim_closure, len);
+	new->ds_buf = DKIM_MALLOC(dkim, len);
 	if (new->ds_buf == NULL)
 	{
 		dkim_error(dkim, "unable to allocate %d byte(s)",
 		           sizeof(struct dkim_dstring));
-		dkim_mfree(lib, dkim->dkim_closure, new);
+		DKIM_FREE(dkim, new);
 		return NULL;
 	}
 
@@ -317,16 +581,14 @@ dkim_dstring_new(DKIM *dkim, int len, int maxlen)
 void
 dkim_dstring_free(struct dkim_dstring *dstr)
 {
-	DKIM_LIB *lib;
 	DKIM *dkim;
 
 	assert(dstr != NULL);
 
 	dkim = dstr->ds_dkim;
-	lib = dkim->dkim_libhandle;
 
-	dkim_mfree(lib, dkim->dkim_closure, dstr->ds_buf);
-	dkim_mfree(lib, dkim->dkim_closure, dstr);
+	DKIM_FREE(dkim, dstr->ds_buf);
+	DKIM_FREE(dkim, dstr);
 }
 
 /*
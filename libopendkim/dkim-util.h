@@ -21,13 +21,16 @@
 #include "dkim.h"
 
 /* macros */
-#define	DKIM_MALLOC(x,y)	dkim_malloc((x)->dkim_libhandle, \
-				            (x)->dkim_closure, y)
-#define	DKIM_FREE(x,y)		dkim_mfree((x)->dkim_libhandle, \
-				           (x)->dkim_closure, y)
+#define	DKIM_MALLOC(x,y)	dkim_halloc((x), y)
+#define	DKIM_FREE(x,y)		dkim_hfree((x), y)
 
 extern void *dkim_malloc __P((DKIM_LIB *, void *, size_t));
 extern void dkim_mfree __P((DKIM_LIB *, void *, void *));
+extern void *dkim_halloc __P((DKIM *, size_t));
+extern void dkim_hfree __P((DKIM *, void *));
+extern _Bool dkim_arena_new __P((DKIM *, size_t));
+extern void dkim_arena_free __P((DKIM *));
+extern void dkim_arena_reset __P((DKIM *));
 extern unsigned char *dkim_strdup __P((DKIM *, const unsigned char *, size_t));
 extern DKIM_STAT dkim_tmpfile __P((DKIM *, int *, _Bool));
 
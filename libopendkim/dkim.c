@@ -160,7 +160,7 @@ void dkim_error __P((DKIM *, const char *, ...));
 
 #define	CLOBBER(x)	if ((x) != NULL) \
 			{ \
-				dkim_mfree(dkim->dkim_libhandle, dkim->dkim_closure, (x)); \
+				DKIM_FREE(dkim, (x)); \
 				(x) = NULL; \
 			}
 
@@ -3896,6 +3896,7 @@ dkim_eom_verify(DKIM *dkim, _Bool *testkey)
 		{
 			u_char *domain;
 			u_char *user;
+			u_char *from;
 
 			hdr = dkim_get_header(dkim, (u_char *) DKIM_FROMHEADER,
 			                      DKIM_FROMHEADER_LEN, 0);
@@ -3913,16 +3914,27 @@ dkim_eom_verify(DKIM *dkim, _Bool *testkey)
 				return DKIM_STAT_CANTVRFY;
 			}
 
-			status = dkim_mail_parse(hdr->hdr_colon + 1,
-			                         &user, &domain);
+			/*
+			**  dkim_mail_parse() rewrites its input, and the
+			**  header text may be borrowed from the caller and
+			**  shared with other handles; parse a copy.
+			*/
+
+			from = dkim_strdup(dkim, hdr->hdr_colon + 1, 0);
+			if (from == NULL)
+				return DKIM_STAT_NORESOURCE;
+
+			status = dkim_mail_parse(from, &user, &domain);
 			if (status != 0 || domain == NULL || domain[0] == '\0')
 			{
+				DKIM_FREE(dkim, from);
 				dkim_error(dkim, "%s header malformed",
 				           DKIM_FROMHEADER);
 				return DKIM_STAT_CANTVRFY;
 			}
 
 			dkim->dkim_domain = dkim_strdup(dkim, domain, 0);
+			DKIM_FREE(dkim, from);
 			if (dkim->dkim_domain == NULL)
 				return DKIM_STAT_NORESOURCE;
 		}
@@ -4286,6 +4298,7 @@ dkim_init(void *(*caller_mallocf)(void *closure, size_t nbytes),
 	libhandle->dkiml_sigttl = 0;
 	libhandle->dkiml_clockdrift = DEFCLOCKDRIFT;
 	libhandle->dkiml_minkeybits = DEFMINKEYBITS;
+	libhandle->dkiml_arenasz = 0;
 
 	libhandle->dkiml_key_lookup = NULL;
 	libhandle->dkiml_sig_handle = NULL;
@@ -4527,6 +4540,20 @@ dkim_options(DKIM_LIB *lib, int op, dkim_opts_t opt, void *ptr, size_t len)
 
 		return DKIM_STAT_OK;
 
+	  case DKIM_OPTS_ARENASZ:
+		if (ptr == NULL)
+			return DKIM_STAT_INVALID;
+
+		if (len != sizeof lib->dkiml_arenasz)
+			return DKIM_STAT_INVALID;
+
+		if (op == DKIM_OP_GETOPT)
+			memcpy(ptr, &lib->dkiml_arenasz, len);
+		else
+			memcpy(&lib->dkiml_arenasz, ptr, len);
+
+		return DKIM_STAT_OK;
+
 	  case DKIM_OPTS_SIGNATURETTL:
 		if (ptr == NULL)
 			return DKIM_STAT_INVALID;
@@ -4806,17 +4833,18 @@ dkim_options(DKIM_LIB *lib, int op, dkim_opts_t opt, void *ptr, size_t len)
 }
 
 /*
-**  DKIM_FREE -- destroy a DKIM handle
+**  DKIM_RELEASE -- release the per-message state of a DKIM handle
 **
 **  Parameters:
-**  	dkim -- DKIM handle to destroy
+**  	dkim -- DKIM handle
+**  	keep -- retain the signing parameters and the reusable buffers
 **
 **  Return value:
 **  	A DKIM_STAT constant.
 */
 
-DKIM_STAT
-dkim_free(DKIM *dkim)
+static DKIM_STAT
+dkim_release(DKIM *dkim, _Bool keep)
 {
 	assert(dkim != NULL);
 
@@ -4835,11 +4863,18 @@ dkim_free(DKIM *dkim)
 	}
 #endif /* _FFR_RESIGN */
 
+	/*
+	**  Memory carved from an arena goes away with the arena, so with
+	**  one attached only the objects that hold other resources need
+	**  to be visited below.
+	*/
+
 	/* blast the headers */
 #ifdef _FFR_RESIGN
-	if (dkim->dkim_resign == NULL && dkim->dkim_hhead != NULL)
+	if (dkim->dkim_arena == NULL &&
+	    dkim->dkim_resign == NULL && dkim->dkim_hhead != NULL)
 #else /* _FFR_RESIGN */
-	if (dkim->dkim_hhead != NULL)
+	if (dkim->dkim_arena == NULL && dkim->dkim_hhead != NULL)
 #endif /* _FFR_RESIGN */
 	{
 		struct dkim_header *next;
@@ -4849,7 +4884,8 @@ dkim_free(DKIM *dkim)
 		{
 			next = hdr->hdr_next;
 
-			CLOBBER(hdr->hdr_text);
+			if ((hdr->hdr_flags & DKIM_HDR_BORROWED) == 0)
+				CLOBBER(hdr->hdr_text);
 			CLOBBER(hdr);
 
 			hdr = next;
@@ -4858,9 +4894,10 @@ dkim_free(DKIM *dkim)
 
 	/* blast the data sets */
 #ifdef _FFR_RESIGN
-	if (dkim->dkim_resign == NULL && dkim->dkim_sethead != NULL)
+	if (dkim->dkim_arena == NULL &&
+	    dkim->dkim_resign == NULL && dkim->dkim_sethead != NULL)
 #else /* _FFR_RESIGN */
-	if (dkim->dkim_sethead != NULL)
+	if (dkim->dkim_arena == NULL && dkim->dkim_sethead != NULL)
 #endif /* _FFR_RESIGN */
 	{
 		DKIM_SET *set;
@@ -4922,7 +4959,7 @@ dkim_free(DKIM *dkim)
 		CLOBBER(dkim->dkim_siglist);
 	}
 
-	if (dkim->dkim_querymethods != NULL)
+	if (dkim->dkim_arena == NULL && dkim->dkim_querymethods != NULL)
 	{
 		struct dkim_qmethod *cur;
 		struct dkim_qmethod *next;
@@ -4939,7 +4976,7 @@ dkim_free(DKIM *dkim)
 		}
 	}
 
-	if (dkim->dkim_xtags != NULL)
+	if (dkim->dkim_arena == NULL && dkim->dkim_xtags != NULL)
 	{
 		struct dkim_xtag *cur;
 		struct dkim_xtag *next;
@@ -4950,7 +4987,7 @@ dkim_free(DKIM *dkim)
 			next = cur->xt_next;
 			CLOBBER(cur->xt_tag);
 			CLOBBER(cur->xt_value);
-			free(cur);
+			CLOBBER(cur);
 			cur = next;
 		}
 	}
@@ -4964,26 +5001,159 @@ dkim_free(DKIM *dkim)
 	/* destroy canonicalizations */
 	dkim_canon_cleanup(dkim);
 
-	CLOBBER(dkim->dkim_b64sig);
-	CLOBBER(dkim->dkim_selector);
-	CLOBBER(dkim->dkim_domain);
-	CLOBBER(dkim->dkim_user);
-	CLOBBER(dkim->dkim_key);
-	CLOBBER(dkim->dkim_sender);
-	CLOBBER(dkim->dkim_signer);
-	CLOBBER(dkim->dkim_error);
-	CLOBBER(dkim->dkim_zdecode);
-	CLOBBER(dkim->dkim_hdrlist);
-
-	DSTRING_CLOBBER(dkim->dkim_hdrbuf);
-	DSTRING_CLOBBER(dkim->dkim_canonbuf);
-	DSTRING_CLOBBER(dkim->dkim_sslerrbuf);
+	if (dkim->dkim_arena == NULL)
+	{
+		CLOBBER(dkim->dkim_b64sig);
+		CLOBBER(dkim->dkim_user);
+		CLOBBER(dkim->dkim_sender);
+		CLOBBER(dkim->dkim_signer);
+		CLOBBER(dkim->dkim_error);
+
+		if (!keep)
+		{
+			CLOBBER(dkim->dkim_zdecode);
+			CLOBBER(dkim->dkim_hdrlist);
+
+			DSTRING_CLOBBER(dkim->dkim_hdrbuf);
+			DSTRING_CLOBBER(dkim->dkim_canonbuf);
+			DSTRING_CLOBBER(dkim->dkim_sslerrbuf);
+		}
+	}
+
+	/* signing parameters are allocated before any arena is attached */
+	if (!keep || dkim->dkim_mode != DKIM_MODE_SIGN)
+	{
+		CLOBBER(dkim->dkim_selector);
+		CLOBBER(dkim->dkim_domain);
+		CLOBBER(dkim->dkim_key);
+	}
+
+	return DKIM_STAT_OK;
+}
+
+/*
+**  DKIM_FREE -- destroy a DKIM handle
+**
+**  Parameters:
+**  	dkim -- DKIM handle to destroy
+**
+**  Return value:
+**  	A DKIM_STAT constant.
+*/
+
+DKIM_STAT
+dkim_free(DKIM *dkim)
+{
+	DKIM_STAT status;
+
+	assert(dkim != NULL);
+
+	status = dkim_release(dkim, FALSE);
+	if (status != DKIM_STAT_OK)
+		return status;
+
+	dkim_arena_free(dkim);
 
 	dkim_mfree(dkim->dkim_libhandle, dkim->dkim_closure, dkim);
 
 	return DKIM_STAT_OK;
 }
 
+/*
+**  DKIM_RESET -- prepare a DKIM handle for another message
+**
+**  Parameters:
+**  	dkim -- DKIM handle to reset
+**  	id -- identification string (e.g. job ID) for the next message
+**
+**  Return value:
+**  	A DKIM_STAT constant.
+**
+**  Notes:
+**  	The handle is returned to the state dkim_sign() or dkim_verify()
+**  	left it in; a signing handle keeps its key, selector, domain,
+**  	algorithms and length.  Anything set since then (user context,
+**  	margin, signer, extra tags, etc.) has to be applied again.
+**  	Buffers the next message is likely to need are kept and emptied
+**  	rather than freed, or, if the handle has an arena, one of its
+**  	chunks is kept for reuse instead.
+*/
+
+DKIM_STAT
+dkim_reset(DKIM *dkim, const unsigned char *id)
+{
+	DKIM_STAT status;
+	struct dkim old;
+
+	assert(dkim != NULL);
+
+	status = dkim_release(dkim, TRUE);
+	if (status != DKIM_STAT_OK)
+		return status;
+
+	memcpy(&old, dkim, sizeof old);
+
+	if (old.dkim_arena != NULL)
+	{
+		dkim_arena_reset(dkim);
+
+		old.dkim_zdecode = NULL;
+		old.dkim_hdrlist = NULL;
+		old.dkim_hdrbuf = NULL;
+		old.dkim_canonbuf = NULL;
+		old.dkim_sslerrbuf = NULL;
+	}
+	else
+	{
+		if (old.dkim_hdrbuf != NULL)
+			dkim_dstring_blank(old.dkim_hdrbuf);
+		if (old.dkim_canonbuf != NULL)
+			dkim_dstring_blank(old.dkim_canonbuf);
+		if (old.dkim_sslerrbuf != NULL)
+			dkim_dstring_blank(old.dkim_sslerrbuf);
+	}
+
+	/* populate defaults, as dkim_new() does */
+	memset(dkim, '\0', sizeof(struct dkim));
+	dkim->dkim_id = id;
+	dkim->dkim_mode = old.dkim_mode;
+	dkim->dkim_chunkcrlf = DKIM_CRLF_UNKNOWN;
+	dkim->dkim_state = DKIM_STATE_INIT;
+	dkim->dkim_margin = (size_t) DKIM_HDRMARGIN;
+	dkim->dkim_closure = old.dkim_closure;
+	dkim->dkim_libhandle = old.dkim_libhandle;
+	dkim->dkim_tmpdir = old.dkim_libhandle->dkiml_tmpdir;
+	dkim->dkim_timeout = old.dkim_libhandle->dkiml_timeout;
+	dkim->dkim_arena = old.dkim_arena;
+
+	if (old.dkim_mode == DKIM_MODE_SIGN)
+	{
+		dkim->dkim_signalg = old.dkim_signalg;
+		dkim->dkim_hdrcanonalg = old.dkim_hdrcanonalg;
+		dkim->dkim_bodycanonalg = old.dkim_bodycanonalg;
+		dkim->dkim_key = old.dkim_key;
+		dkim->dkim_keylen = old.dkim_keylen;
+		dkim->dkim_selector = old.dkim_selector;
+		dkim->dkim_domain = old.dkim_domain;
+		dkim->dkim_signlen = old.dkim_signlen;
+	}
+	else
+	{
+		dkim->dkim_signalg = DKIM_SIGN_UNKNOWN;
+		dkim->dkim_hdrcanonalg = DKIM_CANON_UNKNOWN;
+		dkim->dkim_bodycanonalg = DKIM_CANON_UNKNOWN;
+	}
+
+	/* reusable buffers */
+	dkim->dkim_zdecode = old.dkim_zdecode;
+	dkim->dkim_hdrlist = old.dkim_hdrlist;
+	dkim->dkim_hdrbuf = old.dkim_hdrbuf;
+	dkim->dkim_canonbuf = old.dkim_canonbuf;
+	dkim->dkim_sslerrbuf = old.dkim_sslerrbuf;
+
+	return DKIM_STAT_OK;
+}
+
 /*
 **  DKIM_SIGN -- allocate a handle for use in a signature operation
 **
@@ -5094,6 +5264,19 @@ dkim_sign(DKIM_LIB *libhandle, const unsigned char *id, void *memclosure,
 			new->dkim_signlen = ULONG_MAX;
 		else
 			new->dkim_signlen = length;
+
+		/*
+		**  Attach the arena only now, so the signing parameters
+		**  above survive dkim_reset().
+		*/
+
+		if (libhandle->dkiml_arenasz != 0 &&
+		    !dkim_arena_new(new, libhandle->dkiml_arenasz))
+		{
+			*statp = DKIM_STAT_NORESOURCE;
+			dkim_free(new);
+			return NULL;
+		}
 	}
 
 	return new;
@@ -5125,8 +5308,18 @@ dkim_verify(DKIM_LIB *libhandle, const unsigned char *id, void *memclosure,
 	               DKIM_CANON_UNKNOWN, DKIM_SIGN_UNKNOWN, statp);
 
 	if (new != NULL)
+	{
 		new->dkim_mode = DKIM_MODE_VERIFY;
 
+		if (libhandle->dkiml_arenasz != 0 &&
+		    !dkim_arena_new(new, libhandle->dkiml_arenasz))
+		{
+			*statp = DKIM_STAT_NORESOURCE;
+			dkim_free(new);
+			return NULL;
+		}
+	}
+
 	return new;
 }
 
@@ -5998,19 +6191,21 @@ dkim_diffheaders(DKIM *dkim, dkim_canon_t canon, int maxcost,
 }
 
 /*
-**  DKIM_HEADER -- process a header
+**  DKIM_HEADER_ADD -- process a header, copying or borrowing its text
 **
 **  Parameters:
 **  	dkim -- DKIM handle
 **  	hdr -- header text
 **  	len -- bytes available at "hdr"
+**  	copy -- if FALSE, reference "hdr" rather than copying it where
+**  	        no line endings need repair
 **
 **  Return value:
 **  	A DKIM_STAT_* constant.
 */
 
-DKIM_STAT
-dkim_header(DKIM *dkim, u_char *hdr, size_t len)
+static DKIM_STAT
+dkim_header_add(DKIM *dkim, u_char *hdr, size_t len, _Bool copy)
 {
 	u_char *colon;
 	u_char *semicolon;
@@ -6102,7 +6297,30 @@ dkim_header(DKIM *dkim, u_char *hdr, size_t len)
 		return DKIM_STAT_NORESOURCE;
 	}
 
-	if ((dkim->dkim_libhandle->dkiml_flags & DKIM_LIBFLAGS_FIXCRLF) != 0)
+	/* a borrowed header can't be repaired in place; copy those */
+	if (!copy &&
+	    (dkim->dkim_libhandle->dkiml_flags & DKIM_LIBFLAGS_FIXCRLF) != 0)
+	{
+		u_char prev = '\0';
+
+		for (c = 0; c < len; c++)
+		{
+			if ((hdr[c] == '\n' && prev != '\r') ||
+			    (prev == '\r' && hdr[c] != '\n'))
+				break;
+
+			prev = hdr[c];
+		}
+
+		if (c < len || prev == '\r')
+			copy = TRUE;
+	}
+
+	if (!copy)
+	{
+		h->hdr_text = hdr;
+	}
+	else if ((dkim->dkim_libhandle->dkiml_flags & DKIM_LIBFLAGS_FIXCRLF) != 0)
 	{
 		u_char prev = '\0';
 		u_char *p;
@@ -6162,7 +6380,7 @@ dkim_header(DKIM *dkim, u_char *hdr, size_t len)
 		h->hdr_colon = NULL;
 	else
 		h->hdr_colon = h->hdr_text + (colon - hdr);
-	h->hdr_flags = 0;
+	h->hdr_flags = copy ? 0 : DKIM_HDR_BORROWED;
 	h->hdr_next = NULL;
 
 	if (dkim->dkim_hhead == NULL)
@@ -6200,6 +6418,57 @@ dkim_header(DKIM *dkim, u_char *hdr, size_t len)
 	return DKIM_STAT_OK;
 }
 
+/*
+**  DKIM_HEADER -- process a header
+**
+**  Parameters:
+**  	dkim -- DKIM handle
+**  	hdr -- header text
+**  	len -- bytes available at "hdr"
+**
+**  Return value:
+**  	A DKIM_STAT_* constant.
+*/
+
+DKIM_STAT
+dkim_header(DKIM *dkim, u_char *hdr, size_t len)
+{
+	assert(dkim != NULL);
+	assert(hdr != NULL);
+	assert(len != 0);
+
+	return dkim_header_add(dkim, hdr, len, TRUE);
+}
+
+/*
+**  DKIM_HEADER_REF -- process a header without copying it
+**
+**  Parameters:
+**  	dkim -- DKIM handle
+**  	hdr -- header text, NUL-terminated at "hdr[len]"
+**  	len -- bytes available at "hdr"
+**
+**  Return value:
+**  	A DKIM_STAT_* constant.
+**
+**  Notes:
+**  	The caller must not change or release "hdr" until the handle has
+**  	been passed to dkim_free() or dkim_reset().
+*/
+
+DKIM_STAT
+dkim_header_ref(DKIM *dkim, u_char *hdr, size_t len)
+{
+	assert(dkim != NULL);
+	assert(hdr != NULL);
+	assert(len != 0);
+
+	if (hdr[len] != '\0')
+		return DKIM_STAT_INVALID;
+
+	return dkim_header_add(dkim, hdr, len, FALSE);
+}
+
 /*
 **  DKIM_EOH -- declare end-of-headers
 ** 
@@ -8206,6 +8475,73 @@ dkim_getcachestats(DKIM_LIB *lib, u_int *queries, u_int *hits, u_int *expired,
 #endif /* QUERY_CACHE */
 }
 
+/*
+**  DKIM_GETDNSSTATS -- retrieve a handle's key query counts
+**
+**  Parameters:
+**  	dkim -- DKIM handle
+**  	queries -- number of DNS queries sent (returned)
+**  	hits -- number of keys found in the cache (returned)
+**  	timeouts -- number of DNS queries that timed out (returned)
+**
+**  Return value:
+**  	DKIM_STAT_OK -- request completed
+**
+**  Notes:
+**  	Any of the parameters may be NULL if the corresponding datum
+**  	is not of interest.  Keys retrieved from a cache hit or from a
+**  	file, or copied from another signature on the same message, are
+**  	not counted as queries.
+*/
+
+DKIM_STAT
+dkim_getdnsstats(DKIM *dkim, u_int *queries, u_int *hits, u_int *timeouts)
+{
+	assert(dkim != NULL);
+
+	if (queries != NULL)
+		*queries = dkim->dkim_dns_queries;
+
+	if (hits != NULL)
+	{
+#ifdef QUERY_CACHE
+		*hits = dkim->dkim_cache_hits;
+#else /* QUERY_CACHE */
+		*hits = 0;
+#endif /* QUERY_CACHE */
+	}
+
+	if (timeouts != NULL)
+		*timeouts = dkim->dkim_dns_timeouts;
+
+	return DKIM_STAT_OK;
+}
+
+/*
+**  DKIM_GETDNSTIME -- retrieve time spent waiting for a handle's keys
+**
+**  Parameters:
+**  	dkim -- DKIM handle
+**  	usec -- microseconds spent on DNS queries (returned)
+**
+**  Return value:
+**  	DKIM_STAT_OK -- request completed
+**
+**  Notes:
+**  	This covers only the queries counted by dkim_getdnsstats().
+*/
+
+DKIM_STAT
+dkim_getdnstime(DKIM *dkim, u_long *usec)
+{
+	assert(dkim != NULL);
+	assert(usec != NULL);
+
+	*usec = dkim->dkim_dns_usec;
+
+	return DKIM_STAT_OK;
+}
+
 /*
 **  DKIM_GET_SIGSUBSTRING -- retrieve a minimal signature substring for
 **                           disambiguation
@@ -9109,14 +9445,17 @@ dkim_sig_getqueries(DKIM *dkim, DKIM_SIGINFO *sig,
 	assert(qi != NULL);
 	assert(nqi != NULL);
 
-	new = DKIM_MALLOC(dkim, sizeof(struct dkim_queryinfo *));
+	/* the caller frees these, so they can't come from the arena */
+	new = dkim_malloc(dkim->dkim_libhandle, dkim->dkim_closure,
+	                  sizeof(struct dkim_queryinfo *));
 	if (new == NULL)
 		return DKIM_STAT_NORESOURCE;
 
-	newp = DKIM_MALLOC(dkim, sizeof(struct dkim_queryinfo));
+	newp = dkim_malloc(dkim->dkim_libhandle, dkim->dkim_closure,
+	                   sizeof(struct dkim_queryinfo));
 	if (newp == NULL)
 	{
-		DKIM_FREE(dkim, new);
+		dkim_mfree(dkim->dkim_libhandle, dkim->dkim_closure, new);
 		return DKIM_STAT_NORESOURCE;
 	}
 
@@ -255,6 +255,7 @@ typedef int dkim_opts_t;
 #define	DKIM_OPTS_MUSTBESIGNED	13
 #define	DKIM_OPTS_MINKEYBITS	14
 #define	DKIM_OPTS_REQUIREDHDRS	15
+#define	DKIM_OPTS_ARENASZ	16
 
 #define	DKIM_LIBFLAGS_NONE		0x00000000
 #define	DKIM_LIBFLAGS_TMPFILES		0x00000001
@@ -470,6 +471,26 @@ extern DKIM_STAT dkim_resign __P((DKIM *news, DKIM *olds, _Bool hdrbind));
 
 extern DKIM_STAT dkim_header __P((DKIM *dkim, u_char *hdr, size_t len));
 
+/*
+**  DKIM_HEADER_REF -- process a header without copying it
+**
+**  Parameters:
+**  	dkim -- a DKIM handle previously returned by dkim_sign() or
+**  	        dkim_verify()
+**  	hdr -- the header to be processed, in canonical format and
+**  	       NUL-terminated at "hdr[len]"
+**  	len -- number of bytes to process starting at "hdr"
+**
+**  Return value:
+**  	A DKIM_STAT value.
+**
+**  Notes:
+**  	"hdr" must remain unchanged until the handle is passed to
+**  	dkim_free() or dkim_reset().
+*/
+
+extern DKIM_STAT dkim_header_ref __P((DKIM *dkim, u_char *hdr, size_t len));
+
 /*
 **  DKIM_EOH -- identify end of headers
 **
@@ -592,6 +613,39 @@ extern DKIM_STAT dkim_getcachestats __P((DKIM_LIB *, u_int *queries, u_int *hits
                                          u_int *expired, u_int *keys,
                                          _Bool reset));
 
+/*
+**  DKIM_GETDNSSTATS -- retrieve a handle's key query counts
+**
+**  Parameters:
+**  	dkim -- DKIM handle
+**  	queries -- number of DNS queries sent (returned)
+**  	hits -- number of keys found in the cache (returned)
+**  	timeouts -- number of DNS queries that timed out (returned)
+**
+**  Return value:
+**  	DKIM_STAT_OK -- statistics returned
+**
+**  Notes:
+**  	Any of the parameters may be NULL if the corresponding datum
+**  	is not of interest.
+*/
+
+extern DKIM_STAT dkim_getdnsstats __P((DKIM *, u_int *queries, u_int *hits,
+                                       u_int *timeouts));
+
+/*
+**  DKIM_GETDNSTIME -- retrieve time spent waiting for a handle's keys
+**
+**  Parameters:
+**  	dkim -- DKIM handle
+**  	usec -- microseconds spent on DNS queries (returned)
+**
+**  Return value:
+**  	DKIM_STAT_OK -- request completed
+*/
+
+extern DKIM_STAT dkim_getdnstime __P((DKIM *, u_long *usec));
+
 /*
 **  DKIM_FLUSH_CACHE -- purge expired records from the database, reclaiming
 **                      space for use by new data
@@ -1213,6 +1267,20 @@ extern DKIM_STAT dkim_sig_process __P((DKIM *dkim, DKIM_SIGINFO *sig));
 
 extern DKIM_STAT dkim_free __P((DKIM *dkim));
 
+/*
+**  DKIM_RESET -- prepare a DKIM handle for another message
+**
+**  Parameters:
+**  	dkim -- a DKIM handle previously returned by dkim_sign() or
+**  	        dkim_verify()
+**  	id -- identification string (e.g. job ID) for the next message
+**
+**  Return value:
+**  	A DKIM_STAT value.
+*/
+
+extern DKIM_STAT dkim_reset __P((DKIM *dkim, const unsigned char *id));
+
 /*
 **  DKIM_GETERROR -- return any stored error string from within the DKIM
 **                   context handle
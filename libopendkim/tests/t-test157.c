@@ -0,0 +1,188 @@
+/*
+**  Copyright (c) 2015, The Trusted Domain Project.  All rights reserved.
+*/
+
+#include "build-config.h"
+
+/* system includes */
+#include <sys/types.h>
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+
+#ifdef USE_GNUTLS
+# include <gnutls/gnutls.h>
+#endif /* USE_GNUTLS */
+
+/* libopendkim includes */
+#include "../dkim.h"
+#include "t-testdata.h"
+
+#define	MAXHEADER	4096
+#define	NHANDLES	2
+
+#define SIG2 "v=1; a=rsa-sha1; c=relaxed/simple; d=example.com; s=test;\r\n\tt=1172620939; bh=ll/0h2aWgG+D3ewmE4Y3pY7Ukz8=;\r\n\th=Received:Received:Received:From:To:Date:Subject:Message-ID;\r\n\tb=Q4G/ki/5soDXGxs43JfV+qEKDr5X3GgTDNeZqWL3zLLC5DXWWzmnKRcU8NH4Wsfkh\r\n\t o5tMo4NRmqnB2eZtozsyXdHo2ekUPLxuAQJomM4JHaPTfsraHwkibQIkPpW5hf/Rc2\r\n\t 0QgP48iQBjxqcOSn/Vwk5QDup4Qj1vgOxBqTqwdg="
+
+/*
+**  MAIN -- program mainline
+**
+**  Parameters:
+**  	The usual.
+**
+**  Return value:
+**  	Exit status.
+*/
+
+int
+main(int argc, char **argv)
+{
+#ifdef TEST_KEEP_FILES
+	u_int flags;
+#endif /* TEST_KEEP_FILES */
+	int c;
+	int n;
+	size_t len;
+	DKIM_STAT status;
+	uint64_t fixed_time;
+	DKIM *dkim[NHANDLES];
+	DKIM_LIB *lib;
+	dkim_sigkey_t key;
+	unsigned char *hdrs[] =
+	{
+		HEADER02, HEADER03, HEADER04, HEADER05,
+		HEADER06, HEADER07, HEADER08, HEADER09,
+		NULL
+	};
+	unsigned char *refs[sizeof hdrs / sizeof hdrs[0]];
+	unsigned char block[MAXHEADER + 1];
+	unsigned char save[MAXHEADER + 1];
+	unsigned char hdr[MAXHEADER + 1];
+
+	printf("*** relaxed/simple rsa-sha1 signing with shared headers from dkim_header_ref()\n");
+
+#ifdef USE_GNUTLS
+	(void) gnutls_global_init();
+#endif /* USE_GNUTLS */
+
+	/* instantiate the library */
+	lib = dkim_init(NULL, NULL);
+	assert(lib != NULL);
+
+#ifdef TEST_KEEP_FILES
+	/* set flags */
+	flags = (DKIM_LIBFLAGS_TMPFILES|DKIM_LIBFLAGS_KEEPFILES);
+	(void) dkim_options(lib, DKIM_OP_SETOPT, DKIM_OPTS_FLAGS, &flags,
+	                    sizeof flags);
+#endif /* TEST_KEEP_FILES */
+
+	/* fix signing time */
+	fixed_time = 1172620939;
+	(void) dkim_options(lib, DKIM_OP_SETOPT, DKIM_OPTS_FIXEDTIME,
+	                    &fixed_time, sizeof fixed_time);
+
+	/* lay the header fields out in one block, each NUL-terminated */
+	len = 0;
+	for (n = 0; hdrs[n] != NULL; n++)
+	{
+		assert(len + strlen(hdrs[n]) + 1 <= sizeof block);
+		refs[n] = &block[len];
+		memcpy(refs[n], hdrs[n], strlen(hdrs[n]) + 1);
+		len += strlen(hdrs[n]) + 1;
+	}
+	refs[n] = NULL;
+	memcpy(save, block, len);
+
+	key = KEY;
+
+	for (c = 0; c < NHANDLES; c++)
+	{
+		dkim[c] = dkim_sign(lib, JOBID, NULL, key, SELECTOR, DOMAIN,
+		                    DKIM_CANON_RELAXED, DKIM_CANON_SIMPLE,
+		                    DKIM_SIGN_RSASHA1, -1L, &status);
+		assert(dkim[c] != NULL);
+	}
+
+	/* the text must be terminated where the caller says it ends */
+	status = dkim_header_ref(dkim[0], refs[0], strlen(refs[0]) - 1);
+	assert(status == DKIM_STAT_INVALID);
+
+	/* every handle borrows the same copy of each header field */
+	for (n = 0; refs[n] != NULL; n++)
+	{
+		for (c = 0; c < NHANDLES; c++)
+		{
+			status = dkim_header_ref(dkim[c], refs[n],
+			                         strlen(refs[n]));
+			assert(status == DKIM_STAT_OK);
+		}
+	}
+
+	for (c = 0; c < NHANDLES; c++)
+	{
+		status = dkim_eoh(dkim[c]);
+		assert(status == DKIM_STAT_OK);
+
+		status = dkim_body(dkim[c], BODY00, strlen(BODY00));
+		assert(status == DKIM_STAT_OK);
+
+		status = dkim_body(dkim[c], BODY01, strlen(BODY01));
+		assert(status == DKIM_STAT_OK);
+
+		status = dkim_body(dkim[c], BODY01A, strlen(BODY01A));
+		assert(status == DKIM_STAT_OK);
+		status = dkim_body(dkim[c], BODY01B, strlen(BODY01B));
+		assert(status == DKIM_STAT_OK);
+		status = dkim_body(dkim[c], BODY01C, strlen(BODY01C));
+		assert(status == DKIM_STAT_OK);
+		status = dkim_body(dkim[c], BODY01D, strlen(BODY01D));
+		assert(status == DKIM_STAT_OK);
+		status = dkim_body(dkim[c], BODY01E, strlen(BODY01E));
+		assert(status == DKIM_STAT_OK);
+
+		status = dkim_body(dkim[c], BODY02, strlen(BODY02));
+		assert(status == DKIM_STAT_OK);
+
+		status = dkim_body(dkim[c], BODY03, strlen(BODY03));
+		assert(status == DKIM_STAT_OK);
+
+		status = dkim_body(dkim[c], BODY04, strlen(BODY04));
+		assert(status == DKIM_STAT_OK);
+
+		status = dkim_body(dkim[c], BODY03, strlen(BODY03));
+		assert(status == DKIM_STAT_OK);
+
+		status = dkim_body(dkim[c], BODY03, strlen(BODY03));
+		assert(status == DKIM_STAT_OK);
+
+		status = dkim_body(dkim[c], BODY05, strlen(BODY05));
+		assert(status == DKIM_STAT_OK);
+
+		status = dkim_body(dkim[c], BODY03, strlen(BODY03));
+		assert(status == DKIM_STAT_OK);
+
+		status = dkim_body(dkim[c], BODY03, strlen(BODY03));
+		assert(status == DKIM_STAT_OK);
+
+		status = dkim_eom(dkim[c], NULL);
+		assert(status == DKIM_STAT_OK);
+
+		memset(hdr, '\0', sizeof hdr);
+		status = dkim_getsighdr(dkim[c], hdr, sizeof hdr,
+		                        strlen(DKIM_SIGNHEADER) + 2);
+		assert(status == DKIM_STAT_OK);
+		assert(strcmp(SIG2, hdr) == 0);
+	}
+
+	/* nothing may have been written to the shared block */
+	assert(memcmp(save, block, len) == 0);
+
+	for (c = 0; c < NHANDLES; c++)
+	{
+		status = dkim_free(dkim[c]);
+		assert(status == DKIM_STAT_OK);
+	}
+
+	dkim_close(lib);
+
+	return 0;
+}
@@ -0,0 +1,171 @@
+/*
+**  Copyright (c) 2015, The Trusted Domain Project.  All rights reserved.
+*/
+
+#include "build-config.h"
+
+/* system includes */
+#include <sys/types.h>
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+
+#ifdef USE_GNUTLS
+# include <gnutls/gnutls.h>
+#endif /* USE_GNUTLS */
+
+/* libopendkim includes */
+#include "../dkim.h"
+#include "t-testdata.h"
+
+#define	MAXHEADER	4096
+#define	NHANDLES	2
+
+/* a From: field with no domain; dkim_eom() has to parse it itself */
+#define	FROMHEADER	"From: Murray S. Kucherawy <msk@>"
+
+/*
+**  MAIN -- program mainline
+**
+**  Parameters:
+**  	The usual.
+**
+**  Return value:
+**  	Exit status.
+*/
+
+int
+main(int argc, char **argv)
+{
+	u_int flags;
+	int c;
+	int n;
+	size_t len;
+	DKIM_STAT status;
+	uint64_t fixed_time;
+	DKIM *vrfy;
+	DKIM *dkim[NHANDLES];
+	DKIM_LIB *lib;
+	dkim_sigkey_t key;
+	unsigned char *hdrs[] =
+	{
+		HEADER02, HEADER03, HEADER04, FROMHEADER,
+		HEADER06, HEADER07, HEADER08, HEADER09,
+		NULL
+	};
+	unsigned char *refs[sizeof hdrs / sizeof hdrs[0]];
+	unsigned char block[MAXHEADER + 1];
+	unsigned char save[MAXHEADER + 1];
+	unsigned char hdr[NHANDLES][MAXHEADER + 1];
+
+	printf("*** unsigned verifying and signing with shared headers from dkim_header_ref()\n");
+
+#ifdef USE_GNUTLS
+	(void) gnutls_global_init();
+#endif /* USE_GNUTLS */
+
+	/* instantiate the library */
+	lib = dkim_init(NULL, NULL);
+	assert(lib != NULL);
+
+	/* set flags; keep the verifying handle despite the bad From: */
+	flags = DKIM_LIBFLAGS_BADSIGHANDLES;
+#ifdef TEST_KEEP_FILES
+	flags |= (DKIM_LIBFLAGS_TMPFILES|DKIM_LIBFLAGS_KEEPFILES);
+#endif /* TEST_KEEP_FILES */
+	(void) dkim_options(lib, DKIM_OP_SETOPT, DKIM_OPTS_FLAGS, &flags,
+	                    sizeof flags);
+
+	/* fix signing time */
+	fixed_time = 1172620939;
+	(void) dkim_options(lib, DKIM_OP_SETOPT, DKIM_OPTS_FIXEDTIME,
+	                    &fixed_time, sizeof fixed_time);
+
+	/* lay the header fields out in one block, each NUL-terminated */
+	len = 0;
+	for (n = 0; hdrs[n] != NULL; n++)
+	{
+		assert(len + strlen(hdrs[n]) + 1 <= sizeof block);
+		refs[n] = &block[len];
+		memcpy(refs[n], hdrs[n], strlen(hdrs[n]) + 1);
+		len += strlen(hdrs[n]) + 1;
+	}
+	refs[n] = NULL;
+	memcpy(save, block, len);
+
+	key = KEY;
+
+	vrfy = dkim_verify(lib, JOBID, NULL, &status);
+	assert(vrfy != NULL);
+
+	for (c = 0; c < NHANDLES; c++)
+	{
+		dkim[c] = dkim_sign(lib, JOBID, NULL, key, SELECTOR, DOMAIN,
+		                    DKIM_CANON_RELAXED, DKIM_CANON_SIMPLE,
+		                    DKIM_SIGN_RSASHA1, -1L, &status);
+		assert(dkim[c] != NULL);
+	}
+
+	/*
+	**  The verifying handle and the first signing handle borrow the
+	**  same copy of each header field; the second signing handle gets
+	**  its own copy to compare against.
+	*/
+
+	for (n = 0; refs[n] != NULL; n++)
+	{
+		status = dkim_header_ref(vrfy, refs[n], strlen(refs[n]));
+		assert(status == DKIM_STAT_OK);
+
+		status = dkim_header_ref(dkim[0], refs[n], strlen(refs[n]));
+		assert(status == DKIM_STAT_OK);
+
+		status = dkim_header(dkim[1], hdrs[n], strlen(hdrs[n]));
+		assert(status == DKIM_STAT_OK);
+	}
+
+	(void) dkim_eoh(vrfy);
+
+	status = dkim_body(vrfy, BODY00, strlen(BODY00));
+	assert(status == DKIM_STAT_OK);
+
+	/* no signature and no domain; From: is parsed here */
+	status = dkim_eom(vrfy, NULL);
+	assert(status == DKIM_STAT_CANTVRFY);
+
+	/* nothing may have been written to the shared block */
+	assert(memcmp(save, block, len) == 0);
+
+	for (c = 0; c < NHANDLES; c++)
+	{
+		status = dkim_eoh(dkim[c]);
+		assert(status == DKIM_STAT_OK);
+
+		status = dkim_body(dkim[c], BODY00, strlen(BODY00));
+		assert(status == DKIM_STAT_OK);
+
+		status = dkim_eom(dkim[c], NULL);
+		assert(status == DKIM_STAT_OK);
+
+		memset(hdr[c], '\0', sizeof hdr[c]);
+		status = dkim_getsighdr(dkim[c], hdr[c], sizeof hdr[c],
+		                        strlen(DKIM_SIGNHEADER) + 2);
+		assert(status == DKIM_STAT_OK);
+	}
+
+	/* the signer saw the same From: as the one with its own copy */
+	assert(strcmp(hdr[0], hdr[1]) == 0);
+
+	status = dkim_free(vrfy);
+	assert(status == DKIM_STAT_OK);
+
+	for (c = 0; c < NHANDLES; c++)
+	{
+		status = dkim_free(dkim[c]);
+		assert(status == DKIM_STAT_OK);
+	}
+
+	dkim_close(lib);
+
+	return 0;
+}
@@ -0,0 +1,1043 @@
+/*
+**  Copyright (c) 2015, The Trusted Domain Project.  All rights reserved.
+*/
+
+#include "build-config.h"
+
+#ifdef _FFR_KEYSTORE
+
+/* system includes */
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif /* HAVE_SYS_INOTIFY_H */
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* libbsd if found */
+#ifdef USE_BSD_H
+# include <bsd/string.h>
+#endif /* USE_BSD_H */
+
+/* libstrl if needed */
+#ifdef USE_STRL_H
+# include <strl.h>
+#endif /* USE_STRL_H */
+
+/* opendkim includes */
+#include "keystore.h"
+#include "opendkim.h"
+
+/* macros */
+#define	KEYSTORE_HASHSIZE	1024
+
+#ifndef MAP_ANON
+# define MAP_ANON		MAP_ANONYMOUS
+#endif /* ! MAP_ANON */
+
+#ifdef HAVE_SYS_INOTIFY_H
+# define KEYSTORE_WATCHMASK	(IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | \
+				 IN_DELETE | IN_DELETE_SELF | IN_MODIFY | \
+				 IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO)
+# define KEYSTORE_EVBUFSZ	(64 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+#endif /* HAVE_SYS_INOTIFY_H */
+
+/* DATA TYPES */
+struct keystore_dir
+{
+	int		kd_wd;			/* inotify watch descriptor */
+	size_t		kd_len;			/* bytes of ke_real naming it */
+	size_t		kd_namelen;		/* bytes at kd_name */
+	const char *	kd_name;		/* next node below it */
+	dev_t		kd_dev;			/* device */
+	ino_t		kd_ino;			/* inode */
+	mode_t		kd_mode;		/* mode */
+	uid_t		kd_uid;			/* owner */
+	gid_t		kd_gid;			/* group */
+};
+
+struct keystore_watch
+{
+	int		kw_wd;			/* inotify watch descriptor */
+	unsigned int	kw_refs;		/* directories using it */
+	struct keystore_watch * kw_next;	/* list */
+};
+
+struct keystore_entry
+{
+	_Bool		ke_revalidate;		/* stat() before each use */
+	_Bool		ke_insecure;		/* cached securefile verdict */
+	int		ke_ndirs;		/* entries at ke_dirs */
+	dev_t		ke_dev;			/* device */
+	ino_t		ke_ino;			/* inode */
+	off_t		ke_size;		/* file size */
+	time_t		ke_mtime;		/* modification time */
+	time_t		ke_ctime;		/* inode change time */
+	unsigned int	ke_hash;		/* hash of path */
+	size_t		ke_datalen;		/* bytes of key data */
+	size_t		ke_maplen;		/* bytes mapped for key data */
+	char *		ke_data;		/* key data (locked memory) */
+	char *		ke_path;		/* path as requested */
+	char *		ke_real;		/* path with links resolved */
+	char *		ke_err;			/* securefile complaint */
+	struct keystore_dir * ke_dirs;		/* directories above the file */
+	struct keystore_entry * ke_next;	/* hash chain */
+};
+
+/* GLOBALS */
+static _Bool keystore_ready = FALSE;
+static _Bool keystore_watching = FALSE;
+static int keystore_ifd = -1;
+static pthread_t keystore_thread;
+static pthread_mutex_t keystore_initlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t keystore_lock;
+static struct keystore_entry *keystore_hash[KEYSTORE_HASHSIZE];
+#ifdef HAVE_SYS_INOTIFY_H
+static struct keystore_watch *keystore_watches = NULL;
+#endif /* HAVE_SYS_INOTIFY_H */
+
+/*
+**  DKIMF_KEYSTORE_HASHSTR -- hash a pathname
+**
+**  Parameters:
+**  	str -- string to hash
+**
+**  Return value:
+**  	Hash of "str".
+*/
+
+static unsigned int
+dkimf_keystore_hashstr(const char *str)
+{
+	unsigned int h = 5381;
+
+	assert(str != NULL);
+
+	while (*str != '\0')
+	{
+		h = ((h << 5) + h) ^ (unsigned char) *str;
+		str++;
+	}
+
+	return h;
+}
+
+/*
+**  DKIMF_KEYSTORE_SECALLOC -- allocate memory for key data
+**
+**  Parameters:
+**  	len -- bytes needed
+**  	maplen -- bytes actually mapped (returned)
+**
+**  Return value:
+**  	Pointer to a private anonymous mapping, or NULL on error.
+**
+**  Notes:
+**  	The mapping is locked into core where permitted and excluded from
+**  	core dumps where the platform allows it.  Failure to lock is not
+**  	fatal; RLIMIT_MEMLOCK is commonly small for unprivileged processes.
+*/
+
+static void *
+dkimf_keystore_secalloc(size_t len, size_t *maplen)
+{
+	long pagesz;
+	size_t mlen;
+	void *p;
+
+	assert(maplen != NULL);
+
+	pagesz = sysconf(_SC_PAGESIZE);
+	if (pagesz <= 0)
+		pagesz = 4096;
+
+	mlen = ((len + pagesz) / pagesz) * pagesz;
+
+	p = mmap(NULL, mlen, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON,
+	         -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+#ifdef MADV_DONTDUMP
+	(void) madvise(p, mlen, MADV_DONTDUMP);
+#endif /* MADV_DONTDUMP */
+
+	(void) mlock(p, mlen);
+
+	*maplen = mlen;
+
+	return p;
+}
+
+/*
+**  DKIMF_KEYSTORE_SECFREE -- scrub and release memory for key data
+**
+**  Parameters:
+**  	p -- mapping to release
+**  	maplen -- size of the mapping
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_keystore_secfree(void *p, size_t maplen)
+{
+	size_t c;
+	volatile char *v;
+
+	if (p == NULL)
+		return;
+
+	v = p;
+	for (c = 0; c < maplen; c++)
+		v[c] = '\0';
+
+	(void) munlock(p, maplen);
+	(void) munmap(p, maplen);
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+/*
+**  DKIMF_KEYSTORE_WATCH -- start watching a directory
+**
+**  Parameters:
+**  	dir -- directory to watch
+**
+**  Return value:
+**  	A watch descriptor, or -1 on error.
+**
+**  Notes:
+**  	Caller must hold keystore_lock for writing.  The kernel hands out
+**  	one descriptor per directory, so directories shared by several
+**  	keys (e.g. "/") are counted rather than watched again.
+*/
+
+static int
+dkimf_keystore_watch(const char *dir)
+{
+	int wd;
+	struct keystore_watch *kw;
+
+	assert(dir != NULL);
+
+	wd = inotify_add_watch(keystore_ifd, dir, KEYSTORE_WATCHMASK);
+	if (wd == -1)
+		return -1;
+
+	for (kw = keystore_watches; kw != NULL; kw = kw->kw_next)
+	{
+		if (kw->kw_wd == wd)
+		{
+			kw->kw_refs++;
+			return wd;
+		}
+	}
+
+	kw = malloc(sizeof *kw);
+	if (kw == NULL)
+	{
+		(void) inotify_rm_watch(keystore_ifd, wd);
+		return -1;
+	}
+
+	kw->kw_wd = wd;
+	kw->kw_refs = 1;
+	kw->kw_next = keystore_watches;
+	keystore_watches = kw;
+
+	return wd;
+}
+
+/*
+**  DKIMF_KEYSTORE_UNWATCH -- stop watching a directory
+**
+**  Parameters:
+**  	wd -- watch descriptor returned by dkimf_keystore_watch()
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Caller must hold keystore_lock for writing.  The watch is removed
+**  	when the last directory using it lets go.
+*/
+
+static void
+dkimf_keystore_unwatch(int wd)
+{
+	struct keystore_watch *kw;
+	struct keystore_watch **prev;
+
+	for (prev = &keystore_watches; *prev != NULL; prev = &kw->kw_next)
+	{
+		kw = *prev;
+
+		if (kw->kw_wd != wd)
+			continue;
+
+		if (--kw->kw_refs == 0)
+		{
+			*prev = kw->kw_next;
+			if (keystore_ifd != -1)
+				(void) inotify_rm_watch(keystore_ifd, wd);
+			free(kw);
+		}
+
+		return;
+	}
+}
+#endif /* HAVE_SYS_INOTIFY_H */
+
+/*
+**  DKIMF_KEYSTORE_UNWATCHDIRS -- stop watching an entry's directories
+**
+**  Parameters:
+**  	ke -- entry
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Caller must hold keystore_lock for writing if any are watched.
+*/
+
+static void
+dkimf_keystore_unwatchdirs(struct keystore_entry *ke)
+{
+	int c;
+
+	assert(ke != NULL);
+
+	for (c = 0; c < ke->ke_ndirs; c++)
+	{
+#ifdef HAVE_SYS_INOTIFY_H
+		if (ke->ke_dirs[c].kd_wd != -1)
+			dkimf_keystore_unwatch(ke->ke_dirs[c].kd_wd);
+#endif /* HAVE_SYS_INOTIFY_H */
+		ke->ke_dirs[c].kd_wd = -1;
+	}
+}
+
+/*
+**  DKIMF_KEYSTORE_FREE -- destroy a key store entry
+**
+**  Parameters:
+**  	ke -- entry to destroy
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Caller must hold keystore_lock for writing if the entry's
+**  	directories are watched.
+*/
+
+static void
+dkimf_keystore_free(struct keystore_entry *ke)
+{
+	assert(ke != NULL);
+
+	dkimf_keystore_unwatchdirs(ke);
+
+	dkimf_keystore_secfree(ke->ke_data, ke->ke_maplen);
+	if (ke->ke_path != NULL)
+		free(ke->ke_path);
+	if (ke->ke_real != NULL)
+		free(ke->ke_real);
+	if (ke->ke_err != NULL)
+		free(ke->ke_err);
+	if (ke->ke_dirs != NULL)
+		free(ke->ke_dirs);
+	free(ke);
+}
+
+/*
+**  DKIMF_KEYSTORE_HASLINK -- see if a path goes through a symbolic link
+**
+**  Parameters:
+**  	path -- path to check
+**
+**  Return value:
+**  	TRUE iff some node named in "path" is a symbolic link, or can't
+**  	be examined.
+**
+**  Notes:
+**  	A link can be pointed elsewhere without anything changing in the
+**  	directories the resolved path goes through.
+*/
+
+static _Bool
+dkimf_keystore_haslink(const char *path)
+{
+	char *p;
+	struct stat s;
+	char buf[MAXPATHLEN + 1];
+
+	assert(path != NULL);
+
+	if (strlcpy(buf, path, sizeof buf) >= sizeof buf)
+		return TRUE;
+
+	for (p = strchr(buf + 1, '/'); p != NULL; p = strchr(p + 1, '/'))
+	{
+		*p = '\0';
+		if (lstat(buf, &s) != 0 || S_ISLNK(s.st_mode))
+			return TRUE;
+		*p = '/';
+	}
+
+	return (lstat(buf, &s) != 0 || S_ISLNK(s.st_mode));
+}
+
+/*
+**  DKIMF_KEYSTORE_SETDIRS -- list the directories above a key file
+**
+**  Parameters:
+**  	ke -- entry
+**  	path -- path to the key file
+**
+**  Return value:
+**  	TRUE on success, FALSE on error.
+**
+**  Notes:
+**  	These are the directories dkimf_securefile() examines, so the
+**  	cached verdict holds only while they are unchanged.
+*/
+
+static _Bool
+dkimf_keystore_setdirs(struct keystore_entry *ke, const char *path)
+{
+#ifdef HAVE_REALPATH
+	int c;
+	int n;
+	char *p;
+	char *q;
+	char real[MAXPATHLEN + 1];
+
+	assert(ke != NULL);
+	assert(path != NULL);
+
+	if (realpath(path, real) == NULL)
+		return FALSE;
+
+	ke->ke_real = strdup(real);
+	if (ke->ke_real == NULL)
+		return FALSE;
+
+	n = 0;
+	for (p = ke->ke_real; *p != '\0'; p++)
+	{
+		if (*p == '/')
+			n++;
+	}
+
+	ke->ke_dirs = malloc(n * sizeof *ke->ke_dirs);
+	if (ke->ke_dirs == NULL)
+		return FALSE;
+
+	for (c = 0, p = ke->ke_real; c < n; c++, p = q)
+	{
+		q = strchr(p + 1, '/');
+		if (q == NULL)
+			q = p + strlen(p);
+
+		ke->ke_dirs[c].kd_wd = -1;
+		ke->ke_dirs[c].kd_len = (c == 0 ? 1 : p - ke->ke_real);
+		ke->ke_dirs[c].kd_name = p + 1;
+		ke->ke_dirs[c].kd_namelen = q - p - 1;
+	}
+
+	ke->ke_ndirs = n;
+#endif /* HAVE_REALPATH */
+
+	return TRUE;
+}
+
+/*
+**  DKIMF_KEYSTORE_DIRNAME -- get the name of one of an entry's directories
+**
+**  Parameters:
+**  	ke -- entry
+**  	n -- which directory
+**  	buf -- buffer to receive the name
+**
+**  Return value:
+**  	"buf".
+*/
+
+static char *
+dkimf_keystore_dirname(struct keystore_entry *ke, int n, char *buf)
+{
+	size_t len;
+
+	assert(ke != NULL);
+	assert(n >= 0 && n < ke->ke_ndirs);
+	assert(buf != NULL);
+
+	len = ke->ke_dirs[n].kd_len;
+	memcpy(buf, ke->ke_real, len);
+	buf[len] = '\0';
+
+	return buf;
+}
+
+/*
+**  DKIMF_KEYSTORE_DIRSTALE -- see if directories above a file have changed
+**
+**  Parameters:
+**  	ke -- entry to check
+**  	path -- path to the key file
+**
+**  Return value:
+**  	TRUE iff "path" now leads somewhere else, or a directory above the
+**  	file is not the one, or doesn't have the owner or mode, recorded
+**  	when the entry was made.
+*/
+
+static _Bool
+dkimf_keystore_dirstale(struct keystore_entry *ke, const char *path)
+{
+	int c;
+	struct stat s;
+	struct keystore_dir *kd;
+	char dir[MAXPATHLEN + 1];
+
+	assert(ke != NULL);
+	assert(path != NULL);
+
+#ifdef HAVE_REALPATH
+	if (realpath(path, dir) == NULL || strcmp(dir, ke->ke_real) != 0)
+		return TRUE;
+#endif /* HAVE_REALPATH */
+
+	for (c = 0; c < ke->ke_ndirs; c++)
+	{
+		kd = &ke->ke_dirs[c];
+
+		if (stat(dkimf_keystore_dirname(ke, c, dir), &s) != 0 ||
+		    s.st_dev != kd->kd_dev || s.st_ino != kd->kd_ino ||
+		    s.st_mode != kd->kd_mode || s.st_uid != kd->kd_uid ||
+		    s.st_gid != kd->kd_gid)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*
+**  DKIMF_KEYSTORE_STALE -- see if a file no longer matches an entry
+**
+**  Parameters:
+**  	ke -- entry to check
+**  	s -- result of stat() on the file
+**
+**  Return value:
+**  	TRUE iff "s" describes a different file or a modified one.
+*/
+
+static _Bool
+dkimf_keystore_stale(struct keystore_entry *ke, struct stat *s)
+{
+	assert(ke != NULL);
+	assert(s != NULL);
+
+	return (s->st_dev != ke->ke_dev ||
+	        s->st_ino != ke->ke_ino ||
+	        s->st_size != ke->ke_size ||
+	        s->st_mtime != ke->ke_mtime ||
+	        s->st_ctime != ke->ke_ctime);
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+/*
+**  DKIMF_KEYSTORE_INVALIDATE -- discard entries affected by a change
+**
+**  Parameters:
+**  	wd -- watch descriptor on which the event arrived (-1 for "all")
+**  	name -- name within the watched directory (NULL for "all")
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Caller must hold keystore_lock for writing.  The next request for
+**  	a discarded key reloads it and installs a complete replacement, so
+**  	readers see either the old key or the new one, never a mixture.
+**
+**  	An entry is affected by a change to any directory above its file
+**  	(a new owner or mode changes the dkimf_securefile() verdict), or
+**  	to the node below one of them that leads to the file.
+*/
+
+static void
+dkimf_keystore_invalidate(int wd, const char *name)
+{
+	int c;
+	int d;
+	_Bool hit;
+	struct keystore_dir *kd;
+	struct keystore_entry *ke;
+	struct keystore_entry *prev;
+	struct keystore_entry *next;
+
+	for (c = 0; c < KEYSTORE_HASHSIZE; c++)
+	{
+		prev = NULL;
+
+		for (ke = keystore_hash[c]; ke != NULL; ke = next)
+		{
+			next = ke->ke_next;
+
+			hit = (wd == -1);
+
+			for (d = 0; !hit && d < ke->ke_ndirs; d++)
+			{
+				kd = &ke->ke_dirs[d];
+
+				if (kd->kd_wd != wd)
+					continue;
+
+				hit = (name == NULL ||
+				       (strlen(name) == kd->kd_namelen &&
+				        strncmp(name, kd->kd_name,
+				                kd->kd_namelen) == 0));
+			}
+
+			if (!hit)
+			{
+				prev = ke;
+				continue;
+			}
+
+			if (prev == NULL)
+				keystore_hash[c] = next;
+			else
+				prev->ke_next = next;
+
+			dkimf_keystore_free(ke);
+		}
+	}
+}
+
+/*
+**  DKIMF_KEYSTORE_WATCHER -- thread that tracks changes to key directories
+**
+**  Parameters:
+**  	arg -- unused
+**
+**  Return value:
+**  	Always NULL.
+*/
+
+static void *
+dkimf_keystore_watcher(void *arg)
+{
+	ssize_t len;
+	char *p;
+	struct inotify_event *ev;
+	char buf[KEYSTORE_EVBUFSZ]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+	/* dkimf_keystore_close() may only stop this while it waits */
+	(void) pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	for (;;)
+	{
+		(void) pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		len = read(keystore_ifd, buf, sizeof buf);
+		(void) pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		if (len < 0 && errno == EINTR)
+			continue;
+
+		if (len <= 0)
+		{
+			/* lost the event source; fall back to stat() checks */
+			pthread_rwlock_wrlock(&keystore_lock);
+			dkimf_keystore_invalidate(-1, NULL);
+			(void) close(keystore_ifd);
+			keystore_ifd = -1;
+			pthread_rwlock_unlock(&keystore_lock);
+			break;
+		}
+
+		pthread_rwlock_wrlock(&keystore_lock);
+
+		for (p = buf; p < buf + len; p += sizeof *ev + ev->len)
+		{
+			ev = (struct inotify_event *) p;
+
+			if ((ev->mask & IN_Q_OVERFLOW) != 0)
+				dkimf_keystore_invalidate(-1, NULL);
+			else if (ev->len == 0)
+				dkimf_keystore_invalidate(ev->wd, NULL);
+			else
+				dkimf_keystore_invalidate(ev->wd, ev->name);
+		}
+
+		pthread_rwlock_unlock(&keystore_lock);
+	}
+
+	return NULL;
+}
+#endif /* HAVE_SYS_INOTIFY_H */
+
+/*
+**  DKIMF_KEYSTORE_INIT -- initialize the in-memory key store
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	0 -- success
+**  	-1 -- error; errno will be set
+**
+**  Notes:
+**  	Safe to call more than once.  If change notification can't be set
+**  	up, entries are revalidated with stat() on each use instead.
+*/
+
+int
+dkimf_keystore_init(void)
+{
+	int status;
+
+	pthread_mutex_lock(&keystore_initlock);
+
+	if (keystore_ready)
+	{
+		pthread_mutex_unlock(&keystore_initlock);
+		return 0;
+	}
+
+	status = pthread_rwlock_init(&keystore_lock, NULL);
+	if (status != 0)
+	{
+		pthread_mutex_unlock(&keystore_initlock);
+		errno = status;
+		return -1;
+	}
+
+	memset(keystore_hash, '\0', sizeof keystore_hash);
+
+#ifdef HAVE_SYS_INOTIFY_H
+	keystore_ifd = inotify_init();
+	if (keystore_ifd != -1)
+	{
+		status = pthread_create(&keystore_thread, NULL,
+		                        dkimf_keystore_watcher, NULL);
+		if (status == 0)
+		{
+			keystore_watching = TRUE;
+		}
+		else
+		{
+			(void) close(keystore_ifd);
+			keystore_ifd = -1;
+		}
+	}
+#endif /* HAVE_SYS_INOTIFY_H */
+
+	keystore_ready = TRUE;
+
+	pthread_mutex_unlock(&keystore_initlock);
+
+	return 0;
+}
+
+/*
+**  DKIMF_KEYSTORE_GET -- retrieve a key file's contents from the key store
+**
+**  Parameters:
+**  	path -- path to the key file
+**  	buf -- buffer to receive the key (may be the same as "path")
+**  	buflen -- size of "buf" on input; bytes copied on output
+**  	insecure -- cached "key file is not secure" verdict (returned)
+**  	err -- buffer to receive the cached complaint, if any
+**  	errlen -- bytes available at "err"
+**
+**  Return value:
+**  	TRUE iff a current copy was found and copied to "buf".
+*/
+
+_Bool
+dkimf_keystore_get(const char *path, char *buf, size_t *buflen,
+                   _Bool *insecure, char *err, size_t errlen)
+{
+	unsigned int h;
+	struct keystore_entry *ke;
+	struct stat s;
+
+	assert(path != NULL);
+	assert(buf != NULL);
+	assert(buflen != NULL);
+	assert(insecure != NULL);
+
+	if (!keystore_ready)
+		return FALSE;
+
+	h = dkimf_keystore_hashstr(path);
+
+	pthread_rwlock_rdlock(&keystore_lock);
+
+	for (ke = keystore_hash[h % KEYSTORE_HASHSIZE];
+	     ke != NULL;
+	     ke = ke->ke_next)
+	{
+		if (ke->ke_hash == h && strcmp(ke->ke_path, path) == 0)
+			break;
+	}
+
+	if (ke == NULL)
+	{
+		pthread_rwlock_unlock(&keystore_lock);
+		return FALSE;
+	}
+
+	if (ke->ke_revalidate || keystore_ifd == -1)
+	{
+		if (stat(path, &s) != 0 || dkimf_keystore_stale(ke, &s) ||
+		    dkimf_keystore_dirstale(ke, path))
+		{
+			pthread_rwlock_unlock(&keystore_lock);
+			return FALSE;
+		}
+	}
+
+	*insecure = ke->ke_insecure;
+	if (ke->ke_insecure && err != NULL && ke->ke_err != NULL)
+		strlcpy(err, ke->ke_err, errlen);
+
+	*buflen = MIN(ke->ke_datalen, *buflen);
+	memcpy(buf, ke->ke_data, *buflen);
+
+	pthread_rwlock_unlock(&keystore_lock);
+
+	return TRUE;
+}
+
+/*
+**  DKIMF_KEYSTORE_PUT -- add or replace a key file's contents in the store
+**
+**  Parameters:
+**  	path -- path to the key file
+**  	sb -- result of fstat() on the descriptor from which "data" was read
+**  	data -- key data
+**  	datalen -- bytes at "data"
+**  	insecure -- result of dkimf_securefile() on "path"
+**  	err -- complaint from dkimf_securefile(), if any
+**  	checked -- time at which dkimf_securefile() was called
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Failure to cache is silent; the caller already has the key.
+**
+**  	The directory watches are placed, and the file and the directories
+**  	above it checked once more, while the write lock is held; a change
+**  	that lands between the caller's checks and this call is thus either
+**  	detected here or delivered to the watcher after the new entry is
+**  	visible.  A directory changed since "checked" may have changed after
+**  	dkimf_securefile() looked at it, so the entry isn't kept.
+*/
+
+void
+dkimf_keystore_put(const char *path, struct stat *sb, const char *data,
+                   size_t datalen, _Bool insecure, const char *err,
+                   time_t checked)
+{
+	int c;
+	unsigned int h;
+	struct keystore_entry *ke;
+	struct keystore_entry *cur;
+	struct keystore_entry **prev;
+	struct keystore_dir *kd;
+	struct stat s;
+	char dir[MAXPATHLEN + 1];
+
+	assert(path != NULL);
+	assert(sb != NULL);
+	assert(data != NULL);
+
+	if (!keystore_ready)
+		return;
+
+	ke = malloc(sizeof *ke);
+	if (ke == NULL)
+		return;
+
+	memset(ke, '\0', sizeof *ke);
+
+	ke->ke_path = strdup(path);
+	ke->ke_data = dkimf_keystore_secalloc(datalen, &ke->ke_maplen);
+	if (insecure && err != NULL)
+		ke->ke_err = strdup(err);
+	if (ke->ke_path == NULL || ke->ke_data == NULL ||
+	    (insecure && err != NULL && ke->ke_err == NULL) ||
+	    !dkimf_keystore_setdirs(ke, path))
+	{
+		dkimf_keystore_free(ke);
+		return;
+	}
+
+	memcpy(ke->ke_data, data, datalen);
+	ke->ke_datalen = datalen;
+	ke->ke_insecure = insecure;
+	ke->ke_dev = sb->st_dev;
+	ke->ke_ino = sb->st_ino;
+	ke->ke_size = sb->st_size;
+	ke->ke_mtime = sb->st_mtime;
+	ke->ke_ctime = sb->st_ctime;
+	ke->ke_hash = h = dkimf_keystore_hashstr(path);
+
+	/* a link's target may live in a directory nobody is watching */
+	if (dkimf_keystore_haslink(path))
+		ke->ke_revalidate = TRUE;
+
+	pthread_rwlock_wrlock(&keystore_lock);
+
+#ifdef HAVE_SYS_INOTIFY_H
+	for (c = 0;
+	     keystore_ifd != -1 && !ke->ke_revalidate && c < ke->ke_ndirs;
+	     c++)
+	{
+		kd = &ke->ke_dirs[c];
+
+		kd->kd_wd = dkimf_keystore_watch(dkimf_keystore_dirname(ke, c,
+		                                                        dir));
+		if (kd->kd_wd == -1)
+		{
+			dkimf_keystore_unwatchdirs(ke);
+			ke->ke_revalidate = TRUE;
+		}
+	}
+#endif /* HAVE_SYS_INOTIFY_H */
+
+	for (c = 0; c < ke->ke_ndirs; c++)
+	{
+		kd = &ke->ke_dirs[c];
+
+		if (stat(dkimf_keystore_dirname(ke, c, dir), &s) != 0 ||
+		    s.st_ctime >= checked)
+			break;
+
+		kd->kd_dev = s.st_dev;
+		kd->kd_ino = s.st_ino;
+		kd->kd_mode = s.st_mode;
+		kd->kd_uid = s.st_uid;
+		kd->kd_gid = s.st_gid;
+	}
+
+	if (c < ke->ke_ndirs ||
+	    stat(path, &s) != 0 || dkimf_keystore_stale(ke, &s))
+	{
+		dkimf_keystore_free(ke);
+		pthread_rwlock_unlock(&keystore_lock);
+		return;
+	}
+
+	prev = &keystore_hash[h % KEYSTORE_HASHSIZE];
+	for (cur = *prev; cur != NULL; cur = cur->ke_next)
+	{
+		if (cur->ke_hash == h && strcmp(cur->ke_path, path) == 0)
+		{
+			*prev = cur->ke_next;
+			dkimf_keystore_free(cur);
+			break;
+		}
+
+		prev = &cur->ke_next;
+	}
+
+	ke->ke_next = keystore_hash[h % KEYSTORE_HASHSIZE];
+	keystore_hash[h % KEYSTORE_HASHSIZE] = ke;
+
+	pthread_rwlock_unlock(&keystore_lock);
+}
+
+/*
+**  DKIMF_KEYSTORE_FLUSH -- discard everything in the key store
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Used on configuration reload so that keys, and the permissions of
+**  	every directory leading to them, are examined afresh.
+*/
+
+void
+dkimf_keystore_flush(void)
+{
+	int c;
+	struct keystore_entry *ke;
+	struct keystore_entry *next;
+
+	if (!keystore_ready)
+		return;
+
+	pthread_rwlock_wrlock(&keystore_lock);
+
+	for (c = 0; c < KEYSTORE_HASHSIZE; c++)
+	{
+		for (ke = keystore_hash[c]; ke != NULL; ke = next)
+		{
+			next = ke->ke_next;
+			dkimf_keystore_free(ke);
+		}
+
+		keystore_hash[c] = NULL;
+	}
+
+	pthread_rwlock_unlock(&keystore_lock);
+}
+
+/*
+**  DKIMF_KEYSTORE_CLOSE -- shut down the key store
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	None.
+*/
+
+void
+dkimf_keystore_close(void)
+{
+	if (!keystore_ready)
+		return;
+
+	dkimf_keystore_flush();
+
+#ifdef HAVE_SYS_INOTIFY_H
+	/* stop the watcher before taking its descriptor away */
+	if (keystore_watching)
+	{
+		(void) pthread_cancel(keystore_thread);
+		(void) pthread_join(keystore_thread, NULL);
+		keystore_watching = FALSE;
+	}
+
+	pthread_rwlock_wrlock(&keystore_lock);
+	if (keystore_ifd != -1)
+	{
+		(void) close(keystore_ifd);
+		keystore_ifd = -1;
+	}
+	pthread_rwlock_unlock(&keystore_lock);
+#endif /* HAVE_SYS_INOTIFY_H */
+}
+#endif /* _FFR_KEYSTORE */
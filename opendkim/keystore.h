@@ -0,0 +1,38 @@
+/*
+**  Copyright (c) 2015, The Trusted Domain Project.  All rights reserved.
+*/
+
+#ifndef _KEYSTORE_H_
+#define _KEYSTORE_H_
+
+#include "build-config.h"
+
+/* system includes */
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#endif /* HAVE_STDBOOL_H */
+
+#ifdef __STDC__
+# ifndef __P
+#  define __P(x)  x
+# endif /* ! __P */
+#else /* __STDC__ */
+# ifndef __P
+#  define __P(x)  ()
+# endif /* ! __P */
+#endif /* __STDC__ */
+
+/* prototypes */
+extern void dkimf_keystore_close __P((void));
+extern void dkimf_keystore_flush __P((void));
+extern _Bool dkimf_keystore_get __P((const char *, char *, size_t *, _Bool *,
+                                     char *, size_t));
+extern int dkimf_keystore_init __P((void));
+extern void dkimf_keystore_put __P((const char *, struct stat *,
+                                    const char *, size_t, _Bool,
+                                    const char *, time_t));
+
+#endif /* _KEYSTORE_H_ */
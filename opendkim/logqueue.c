@@ -0,0 +1,548 @@
+/*
+**  Copyright (c) 2015, The Trusted Domain Project.  All rights reserved.
+*/
+
+#include "build-config.h"
+
+#ifdef _FFR_LOG_QUEUE
+
+/* system includes */
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+
+/* opendkim includes */
+#include "logqueue.h"
+#include "opendkim.h"
+#include "util.h"
+
+/* opendkim.h points syslog() here; this file needs the real one */
+#undef syslog
+
+/* macros */
+#define	DKIMF_LOGQ_MAXLINE	1024
+
+/* DATA TYPES */
+struct dkimf_logq_slot
+{
+	int		ls_pri;			/* priority */
+	size_t		ls_len;			/* bytes at ls_text */
+	struct timeval	ls_time;		/* when logged */
+	char		ls_text[DKIMF_LOGQ_MAXLINE];	/* the message */
+};
+
+/*
+**  Messages go into a ring of fixed-size slots.  A thread logging
+**  something formats it first and then takes the lock only to copy it
+**  into the next free slot; if there is none, the message is counted
+**  and discarded rather than waited on.  The writer takes the lock
+**  only to see how many slots are filled and, later, to hand them
+**  back; while it's passing them on to syslog or the log file, nobody
+**  else touches them.  So a stalled syslog daemon or disk can only
+**  cost messages, never stall a thread handling mail.
+*/
+
+/* GLOBALS */
+static _Bool logq_enabled = FALSE;		/* dkimf_logq_init() done */
+static _Bool logq_running;			/* accepting messages */
+static _Bool logq_die;				/* writer should exit */
+static _Bool logq_reopening;			/* writer should reopen */
+static int logq_fd = -1;			/* log file */
+static u_int logq_size;				/* slots in the ring */
+static u_long logq_head;			/* messages added */
+static u_long logq_tail;			/* messages written */
+static u_long logq_dropped;			/* messages discarded */
+static char *logq_path;				/* log file path */
+static struct dkimf_logq_slot *logq_slots;	/* the ring */
+static pthread_t logq_writer;			/* writer thread */
+static pthread_mutex_t logq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t logq_cond = PTHREAD_COND_INITIALIZER;
+
+/* indexed by LOG_EMERG through LOG_DEBUG */
+static char *logq_levels[] =
+{
+	"emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"
+};
+
+/*
+**  DKIMF_LOGQ_OPEN -- open the log file
+**
+**  Parameters:
+**  	path -- file to append to
+**
+**  Return value:
+**  	An open descriptor, or -1 on error.
+*/
+
+static int
+dkimf_logq_open(char *path)
+{
+	int fd;
+
+	fd = open(path, O_WRONLY|O_APPEND|O_CREAT, 0640);
+	if (fd != -1)
+		(void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	return fd;
+}
+
+/*
+**  DKIMF_LOGQ_FORMAT -- render a message as a structured log line
+**
+**  Parameters:
+**  	out -- dstring to which to append it
+**  	slot -- message to render
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Each message becomes one line holding a JSON object with its
+**  	time (UTC, to the microsecond), process ID, level and text.
+*/
+
+static void
+dkimf_logq_format(struct dkimf_dstring *out, struct dkimf_logq_slot *slot)
+{
+	int pri;
+	size_t c;
+	u_char ch;
+	struct tm tm;
+	char stamp[BUFRSZ];
+
+	(void) gmtime_r(&slot->ls_time.tv_sec, &tm);
+	(void) strftime(stamp, sizeof stamp, "%Y-%m-%dT%H:%M:%S", &tm);
+
+	pri = LOG_PRI(slot->ls_pri);
+
+	dkimf_dstring_printf(out,
+	                     "{\"time\":\"%s.%06ldZ\",\"pid\":%ld,\"level\":\"%s\",\"msg\":\"",
+	                     stamp, (long) slot->ls_time.tv_usec,
+	                     (long) getpid(), logq_levels[pri]);
+
+	for (c = 0; c < slot->ls_len; c++)
+	{
+		ch = (u_char) slot->ls_text[c];
+
+		if (ch == '"' || ch == '\\')
+		{
+			dkimf_dstring_cat1(out, '\\');
+			dkimf_dstring_cat1(out, ch);
+		}
+		else if (ch < 0x20 || ch == 0x7f)
+		{
+			dkimf_dstring_printf(out, "\\u%04x", ch);
+		}
+		else
+		{
+			dkimf_dstring_cat1(out, ch);
+		}
+	}
+
+	dkimf_dstring_cat(out, (u_char *) "\"}\n");
+}
+
+/*
+**  DKIMF_LOGQ_FLUSH -- pass messages on
+**
+**  Parameters:
+**  	first -- number of the first message to write
+**  	count -- how many to write
+**  	dropped -- messages discarded since the last flush
+**  	out -- dstring to use for formatting (NULL if logging to syslog)
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_logq_flush(u_long first, u_long count, u_long dropped,
+                 struct dkimf_dstring *out)
+{
+	u_long c;
+	ssize_t n;
+	size_t len;
+	u_char *p;
+	struct dkimf_logq_slot *slot;
+	struct dkimf_logq_slot note;
+
+	if (dropped != 0)
+	{
+		note.ls_pri = LOG_WARNING;
+		note.ls_len = snprintf(note.ls_text, sizeof note.ls_text,
+		                       "log queue full; %lu message(s) dropped",
+		                       dropped);
+		(void) gettimeofday(&note.ls_time, NULL);
+	}
+
+	if (out == NULL)
+	{
+		if (dropped != 0)
+			syslog(note.ls_pri, "%s", note.ls_text);
+
+		for (c = 0; c < count; c++)
+		{
+			slot = &logq_slots[(first + c) % logq_size];
+			syslog(slot->ls_pri, "%s", slot->ls_text);
+		}
+
+		return;
+	}
+
+	dkimf_dstring_blank(out);
+
+	if (dropped != 0)
+		dkimf_logq_format(out, &note);
+
+	for (c = 0; c < count; c++)
+		dkimf_logq_format(out, &logq_slots[(first + c) % logq_size]);
+
+	if (logq_fd == -1)
+	{
+		logq_fd = dkimf_logq_open(logq_path);
+		if (logq_fd == -1)
+		{
+			syslog(LOG_ERR, "%s: open(): %s", logq_path,
+			       strerror(errno));
+			return;
+		}
+	}
+
+	p = dkimf_dstring_get(out);
+	len = dkimf_dstring_len(out);
+
+	while (len > 0)
+	{
+		n = write(logq_fd, p, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+
+		if (n <= 0)
+		{
+			syslog(LOG_ERR, "%s: write(): %s", logq_path,
+			       strerror(errno));
+
+			/* try a fresh descriptor next time */
+			(void) close(logq_fd);
+			logq_fd = -1;
+			return;
+		}
+
+		p += n;
+		len -= n;
+	}
+}
+
+/*
+**  DKIMF_LOGQ_WRITER -- log writer thread
+**
+**  Parameters:
+**  	arg -- unused
+**
+**  Return value:
+**  	Always NULL.
+*/
+
+static void *
+dkimf_logq_writer(void *arg)
+{
+	_Bool die;
+	_Bool reopen;
+	u_long first;
+	u_long count;
+	u_long dropped;
+	struct dkimf_dstring *out = NULL;
+
+	if (logq_path != NULL)
+		out = dkimf_dstring_new(BUFRSZ, 0);
+
+	for (;;)
+	{
+		pthread_mutex_lock(&logq_lock);
+
+		while (logq_head == logq_tail && logq_dropped == 0 &&
+		       !logq_die && !logq_reopening)
+			pthread_cond_wait(&logq_cond, &logq_lock);
+
+		first = logq_tail;
+		count = logq_head - logq_tail;
+		dropped = logq_dropped;
+		logq_dropped = 0;
+		reopen = logq_reopening;
+		logq_reopening = FALSE;
+		die = logq_die;
+
+		pthread_mutex_unlock(&logq_lock);
+
+		if (reopen && logq_fd != -1)
+		{
+			(void) close(logq_fd);
+			logq_fd = -1;
+		}
+
+		/* with no memory for formatting, this falls back to syslog */
+		dkimf_logq_flush(first, count, dropped, out);
+
+		/* hand the slots back */
+		pthread_mutex_lock(&logq_lock);
+		logq_tail += count;
+		pthread_mutex_unlock(&logq_lock);
+
+		/* once told to exit, finish what's queued first */
+		if (die && count == 0 && dropped == 0)
+			break;
+	}
+
+	if (out != NULL)
+		dkimf_dstring_free(out);
+
+	return NULL;
+}
+
+/*
+**  DKIMF_LOGQ_SYSLOG -- log a message through the queue
+**
+**  Parameters:
+**  	pri -- priority, as for syslog()
+**  	fmt -- format, as for syslog()
+**  	... -- arguments
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Called in place of syslog().  Until dkimf_logq_init() succeeds
+**  	and after dkimf_logq_shutdown(), messages go straight to syslog.
+**  	Messages longer than DKIMF_LOGQ_MAXLINE are truncated.
+*/
+
+void
+dkimf_logq_syslog(int pri, const char *fmt, ...)
+{
+	int n;
+	va_list ap;
+	struct dkimf_logq_slot *slot;
+	struct timeval now;
+	char text[DKIMF_LOGQ_MAXLINE];
+
+	va_start(ap, fmt);
+
+	if (!logq_enabled)
+	{
+		vsyslog(pri, fmt, ap);
+		va_end(ap);
+		return;
+	}
+
+	n = vsnprintf(text, sizeof text, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+	if ((size_t) n >= sizeof text)
+		n = sizeof text - 1;
+
+	(void) gettimeofday(&now, NULL);
+
+	pthread_mutex_lock(&logq_lock);
+
+	if (!logq_running)
+	{
+		pthread_mutex_unlock(&logq_lock);
+		syslog(pri, "%s", text);
+		return;
+	}
+
+	if (logq_head - logq_tail >= logq_size)
+	{
+		logq_dropped++;
+		pthread_mutex_unlock(&logq_lock);
+		return;
+	}
+
+	slot = &logq_slots[logq_head % logq_size];
+	slot->ls_pri = pri;
+	slot->ls_len = n;
+	slot->ls_time = now;
+	memcpy(slot->ls_text, text, n + 1);
+
+	/* the writer only waits when the ring is empty */
+	if (logq_head++ == logq_tail)
+		pthread_cond_signal(&logq_cond);
+
+	pthread_mutex_unlock(&logq_lock);
+}
+
+/*
+**  DKIMF_LOGQ_REOPEN -- arrange for the log file to be reopened
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Called on SIGUSR1, so the log file can be rotated.
+*/
+
+void
+dkimf_logq_reopen(void)
+{
+	if (!logq_enabled)
+		return;
+
+	pthread_mutex_lock(&logq_lock);
+	logq_reopening = TRUE;
+	pthread_cond_signal(&logq_cond);
+	pthread_mutex_unlock(&logq_lock);
+}
+
+/*
+**  DKIMF_LOGQ_INIT -- start queueing log messages
+**
+**  Parameters:
+**  	size -- number of messages the queue can hold
+**  	path -- file to which to write them, or NULL to use syslog
+**  	err -- error string (returned)
+**
+**  Return value:
+**  	0 on success, -1 on error.
+*/
+
+int
+dkimf_logq_init(u_int size, char *path, char **err)
+{
+	int status;
+
+	assert(size > 0);
+	assert(err != NULL);
+
+	if (logq_enabled)
+		return 0;
+
+	logq_slots = (struct dkimf_logq_slot *) malloc(size *
+	                                               sizeof(struct dkimf_logq_slot));
+	if (logq_slots == NULL)
+	{
+		*err = strerror(errno);
+		return -1;
+	}
+
+	if (path != NULL)
+	{
+		logq_path = strdup(path);
+		if (logq_path == NULL)
+		{
+			*err = strerror(errno);
+			free(logq_slots);
+			logq_slots = NULL;
+			return -1;
+		}
+
+		/* open it now, so mistakes are reported at startup */
+		logq_fd = dkimf_logq_open(logq_path);
+		if (logq_fd == -1)
+		{
+			*err = strerror(errno);
+			free(logq_path);
+			logq_path = NULL;
+			free(logq_slots);
+			logq_slots = NULL;
+			return -1;
+		}
+	}
+
+	logq_size = size;
+	logq_head = 0;
+	logq_tail = 0;
+	logq_dropped = 0;
+	logq_die = FALSE;
+	logq_reopening = FALSE;
+
+	status = pthread_create(&logq_writer, NULL, dkimf_logq_writer, NULL);
+	if (status != 0)
+	{
+		*err = strerror(status);
+		if (logq_fd != -1)
+		{
+			(void) close(logq_fd);
+			logq_fd = -1;
+		}
+		if (logq_path != NULL)
+		{
+			free(logq_path);
+			logq_path = NULL;
+		}
+		free(logq_slots);
+		logq_slots = NULL;
+		return -1;
+	}
+
+	logq_running = TRUE;
+	logq_enabled = TRUE;
+
+	return 0;
+}
+
+/*
+**  DKIMF_LOGQ_SHUTDOWN -- write out what's queued and stop queueing
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Anything logged afterward goes straight to syslog.
+*/
+
+void
+dkimf_logq_shutdown(void)
+{
+	if (!logq_enabled)
+		return;
+
+	pthread_mutex_lock(&logq_lock);
+
+	if (!logq_running)
+	{
+		pthread_mutex_unlock(&logq_lock);
+		return;
+	}
+
+	logq_running = FALSE;
+	logq_die = TRUE;
+	pthread_cond_signal(&logq_cond);
+
+	pthread_mutex_unlock(&logq_lock);
+
+	(void) pthread_join(logq_writer, NULL);
+
+	if (logq_fd != -1)
+	{
+		(void) close(logq_fd);
+		logq_fd = -1;
+	}
+
+	/* nothing can reach the slots now */
+	free(logq_slots);
+	logq_slots = NULL;
+	if (logq_path != NULL)
+	{
+		free(logq_path);
+		logq_path = NULL;
+	}
+}
+#endif /* _FFR_LOG_QUEUE */
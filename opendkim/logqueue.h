@@ -0,0 +1,29 @@
+/*
+**  Copyright (c) 2015, The Trusted Domain Project.  All rights reserved.
+*/
+
+#ifndef _LOGQUEUE_H_
+#define _LOGQUEUE_H_
+
+#include "build-config.h"
+
+/* system includes */
+#include <sys/types.h>
+
+#ifdef __STDC__
+# ifndef __P
+#  define __P(x)  x
+# endif /* ! __P */
+#else /* __STDC__ */
+# ifndef __P
+#  define __P(x)  ()
+# endif /* ! __P */
+#endif /* __STDC__ */
+
+/* prototypes */
+extern int dkimf_logq_init __P((u_int, char *, char **));
+extern void dkimf_logq_reopen __P((void));
+extern void dkimf_logq_shutdown __P((void));
+extern void dkimf_logq_syslog __P((int, const char *, ...));
+
+#endif /* _LOGQUEUE_H_ */
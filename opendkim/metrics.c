@@ -0,0 +1,1381 @@
+/*
+**  Copyright (c) 2015, The Trusted Domain Project.  All rights reserved.
+*/
+
+#include "build-config.h"
+
+#ifdef _FFR_METRICS
+
+/* system includes */
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/* libbsd if found */
+#ifdef USE_BSD_H
+# include <bsd/string.h>
+#endif /* USE_BSD_H */
+
+/* libstrl if needed */
+#ifdef USE_STRL_H
+# include <strl.h>
+#endif /* USE_STRL_H */
+
+/* libopendkim includes */
+#include <dkim.h>
+
+/* opendkim includes */
+#include "metrics.h"
+#include "opendkim.h"
+#include "opendkim-db.h"
+#include "util.h"
+
+/* macros */
+#define	DKIMF_METRICS_BACKLOG	16
+#define	DKIMF_METRICS_PREFIX	"opendkim_"
+#define	DKIMF_METRICS_REQMAX	4096
+#define	DKIMF_METRICS_TIMEOUT	1000		/* ms */
+
+#define	DKIMF_METRICS_NSTATS	(DKIM_STAT_SIGGEN + 1)
+#define	DKIMF_METRICS_NSIGERRS	(DKIM_SIGERROR_KEYTOOSMALL + 1)
+#define	DKIMF_METRICS_NDBTYPES	(DKIMF_DB_TYPE_CTABLE + 1)
+#define	DKIMF_METRICS_NPHASES	(DKIMF_METRIC_PHASE_CLOSE + 1)
+#define	DKIMF_METRICS_NOPS	(DKIMF_METRIC_OP_STATSWRITE + 1)
+
+#define	DKIMF_METRICS_HBITS	2		/* sub-bucket bits */
+#define	DKIMF_METRICS_HRANGE	27		/* log2 of last bound (usec) */
+#define	DKIMF_METRICS_HSUB	(1 << DKIMF_METRICS_HBITS)
+#define	DKIMF_METRICS_HFINITE	((DKIMF_METRICS_HRANGE - DKIMF_METRICS_HBITS + 1) * \
+				 DKIMF_METRICS_HSUB)
+#define	DKIMF_METRICS_HOVER	DKIMF_METRICS_HFINITE		/* too slow */
+#define	DKIMF_METRICS_HSUM	(DKIMF_METRICS_HFINITE + 1)	/* total usec */
+#define	DKIMF_METRICS_HWIDTH	(DKIMF_METRICS_HFINITE + 2)
+
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL		0
+#endif /* ! MSG_NOSIGNAL */
+
+/* DATA TYPES */
+struct dkimf_metric
+{
+	char *		m_name;			/* name, less prefix */
+	char *		m_help;			/* HELP text */
+	char *		m_label;		/* label name (NULL if none) */
+	int		m_nlabels;		/* label values, plus "other" */
+	_Bool		m_hist;			/* histogram? */
+	int		m_base;			/* first slot in a shard */
+};
+
+/*
+**  A histogram takes DKIMF_METRICS_HWIDTH slots per label value: the
+**  bucket counts, then an overflow bucket, then the sum of everything
+**  observed.  Times are kept in microseconds.  Buckets are log-linear:
+**  each power of two is split into DKIMF_METRICS_HSUB equal parts, so
+**  any time is placed to within 25% of its value from 1us up to about
+**  two minutes.  Only the powers of two are published as bucket bounds,
+**  to keep scrapes small; the finer buckets serve the quantiles that
+**  dkimf_metrics_dump() logs.
+*/
+
+/*
+**  Each thread that counts anything gets a shard of its own, and only
+**  that thread ever writes to it, so counting needs no lock.  A reader
+**  sums the shards; a count it misses by racing the owner shows up on
+**  the next read.  Shards of threads that exit go on a free list for the
+**  next new thread, keeping what they've counted, so the totals never
+**  go down and the number of shards never exceeds the number of threads
+**  that were running at once.
+*/
+
+struct dkimf_metrics_shard
+{
+	struct dkimf_metrics_shard * ms_next;	/* all shards */
+	struct dkimf_metrics_shard * ms_free;	/* free list */
+	u_long		ms_count[1];		/* counters */
+};
+
+/* GLOBALS */
+static _Bool metrics_enabled = FALSE;
+static _Bool metrics_die = FALSE;
+static int metrics_fd = -1;
+static int metrics_nslots;
+static char *metrics_path = NULL;
+static u_long *metrics_totals = NULL;
+static pthread_t metrics_thread;
+static pthread_key_t metrics_key;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dkimf_metrics_shard *metrics_shards = NULL;
+static struct dkimf_metrics_shard *metrics_free = NULL;
+
+static struct dkimf_metric metrics[DKIMF_METRIC_MAX + 1] =
+{
+	{ "messages_total", "Messages signed or verified.",
+	  "mode", 3, FALSE, 0 },
+	{ "verify_results_total", "Verifications completed, by result.",
+	  "result", DKIMF_METRICS_NSTATS + 1, FALSE, 0 },
+	{ "signature_errors_total", "Signatures evaluated, by error.",
+	  "error", DKIMF_METRICS_NSIGERRS + 1, FALSE, 0 },
+	{ "dns_queries_total", "Key queries sent to the resolver.",
+	  NULL, 1, FALSE, 0 },
+	{ "dns_cache_hits_total", "Keys found in the library's cache.",
+	  NULL, 1, FALSE, 0 },
+	{ "dns_timeouts_total", "Key queries that timed out.",
+	  NULL, 1, FALSE, 0 },
+	{ "dataset_lookups_total", "Data set lookups, by backend.",
+	  "backend", DKIMF_METRICS_NDBTYPES + 1, FALSE, 0 },
+	{ "crypto_operations_total", "Signatures generated or checked.",
+	  "op", 3, FALSE, 0 },
+	{ "body_bytes_hashed_total",
+	  "Canonicalized body bytes hashed, counted once per signature.",
+	  NULL, 1, FALSE, 0 },
+	{ "callback_seconds", "Time spent in each milter callback.",
+	  "phase", DKIMF_METRICS_NPHASES + 1, TRUE, 0 },
+	{ "operation_seconds", "Time spent on operations within callbacks.",
+	  "op", DKIMF_METRICS_NOPS + 1, TRUE, 0 },
+	{ "dataset_lookup_seconds", "Time spent on data set lookups, by backend.",
+	  "backend", DKIMF_METRICS_NDBTYPES + 1, TRUE, 0 }
+};
+
+static char *metrics_modes[] = { "signed", "verified" };
+static char *metrics_ops[] = { "sign", "verify" };
+
+/* indexed by DKIMF_METRIC_PHASE_* */
+static char *metrics_phases[DKIMF_METRICS_NPHASES] =
+{
+	"connect", "envfrom", "envrcpt", "header", "eoh", "body", "eom",
+	"abort", "close"
+};
+
+/* indexed by DKIMF_METRIC_OP_* */
+static char *metrics_optypes[DKIMF_METRICS_NOPS] =
+{
+	"keyfetch", "sign", "verify", "lua_setup", "lua_screen",
+	"lua_stats", "lua_final", "stats_record", "stats_write"
+};
+
+/* indexed by DKIMF_DB_TYPE_* */
+static char *metrics_dbtypes[DKIMF_METRICS_NDBTYPES] =
+{
+	"file", "refile", "csl", "db", "dsn", "ldap", "lua", "memcache",
+	"repute", "socket", "mdb", "erlang", "ctable"
+};
+
+/*
+**  DKIMF_METRICS_RELEASE -- return a thread's shard to the free list
+**
+**  Parameters:
+**  	arg -- shard (from pthread_getspecific())
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Called via pthread_key_create() when a thread that has counted
+**  	something exits.
+*/
+
+static void
+dkimf_metrics_release(void *arg)
+{
+	struct dkimf_metrics_shard *shard;
+
+	shard = (struct dkimf_metrics_shard *) arg;
+
+	pthread_mutex_lock(&metrics_lock);
+	shard->ms_free = metrics_free;
+	metrics_free = shard;
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+/*
+**  DKIMF_METRICS_SHARD -- get this thread's shard
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	The calling thread's shard, or NULL if none could be had.
+*/
+
+static struct dkimf_metrics_shard *
+dkimf_metrics_shard(void)
+{
+	struct dkimf_metrics_shard *shard;
+
+	shard = (struct dkimf_metrics_shard *) pthread_getspecific(metrics_key);
+	if (shard != NULL)
+		return shard;
+
+	/* first count by this thread */
+	pthread_mutex_lock(&metrics_lock);
+
+	if (metrics_free != NULL)
+	{
+		shard = metrics_free;
+		metrics_free = shard->ms_free;
+	}
+	else
+	{
+		shard = (struct dkimf_metrics_shard *) calloc(1, sizeof *shard +
+		                                              (metrics_nslots - 1) * sizeof(u_long));
+		if (shard != NULL)
+		{
+			shard->ms_next = metrics_shards;
+			metrics_shards = shard;
+		}
+	}
+
+	pthread_mutex_unlock(&metrics_lock);
+
+	if (shard != NULL && pthread_setspecific(metrics_key, shard) != 0)
+	{
+		dkimf_metrics_release(shard);
+		shard = NULL;
+	}
+
+	return shard;
+}
+
+/*
+**  DKIMF_METRICS_ADD -- add to a counter in a shard
+**
+**  Parameters:
+**  	shard -- shard to update
+**  	metric -- DKIMF_METRIC_* constant
+**  	label -- label value; anything out of range is counted as "other"
+**  	n -- amount to add
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_metrics_add(struct dkimf_metrics_shard *shard, int metric, int label,
+                  u_long n)
+{
+	struct dkimf_metric *m;
+
+	m = &metrics[metric];
+
+	if (label < 0 || label >= m->m_nlabels - 1)
+		label = m->m_nlabels - 1;
+
+	shard->ms_count[m->m_base + label] += n;
+}
+
+/*
+**  DKIMF_METRICS_BUCKET -- find the histogram bucket for a time
+**
+**  Parameters:
+**  	usec -- elapsed time, in microseconds
+**
+**  Return value:
+**  	Bucket index, which is DKIMF_METRICS_HOVER if it's out of range.
+*/
+
+static int
+dkimf_metrics_bucket(u_long usec)
+{
+	int msb;
+
+	if (usec < DKIMF_METRICS_HSUB)
+		return (int) usec;
+
+	for (msb = DKIMF_METRICS_HBITS; (usec >> msb) > 1; msb++)
+		continue;
+
+	if (msb >= DKIMF_METRICS_HRANGE)
+		return DKIMF_METRICS_HOVER;
+
+	return (msb - DKIMF_METRICS_HBITS + 1) * DKIMF_METRICS_HSUB +
+	       (int) ((usec >> (msb - DKIMF_METRICS_HBITS)) &
+	              (DKIMF_METRICS_HSUB - 1));
+}
+
+/*
+**  DKIMF_METRICS_BOUND -- find the upper bound of a histogram bucket
+**
+**  Parameters:
+**  	bucket -- bucket index, less than DKIMF_METRICS_HFINITE
+**
+**  Return value:
+**  	The smallest time, in microseconds, too large for that bucket.
+*/
+
+static u_long
+dkimf_metrics_bound(int bucket)
+{
+	int exp;
+
+	if (bucket < DKIMF_METRICS_HSUB)
+		return (u_long) bucket + 1;
+
+	exp = bucket / DKIMF_METRICS_HSUB;
+
+	return (u_long) (DKIMF_METRICS_HSUB + bucket % DKIMF_METRICS_HSUB + 1)
+	       << (exp - 1);
+}
+
+/*
+**  DKIMF_METRICS_OBSERVE -- add a time to a histogram in a shard
+**
+**  Parameters:
+**  	shard -- shard to update
+**  	metric -- DKIMF_METRIC_* constant (a histogram)
+**  	label -- label value; anything out of range is counted as "other"
+**  	usec -- elapsed time, in microseconds
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_metrics_observe(struct dkimf_metrics_shard *shard, int metric,
+                      int label, u_long usec)
+{
+	u_long *h;
+	struct dkimf_metric *m;
+
+	m = &metrics[metric];
+
+	assert(m->m_hist);
+
+	if (label < 0 || label >= m->m_nlabels - 1)
+		label = m->m_nlabels - 1;
+
+	h = &shard->ms_count[m->m_base + label * DKIMF_METRICS_HWIDTH];
+
+	h[dkimf_metrics_bucket(usec)]++;
+	h[DKIMF_METRICS_HSUM] += usec;
+}
+
+/*
+**  DKIMF_METRICS_ELAPSED -- microseconds since a start time
+**
+**  Parameters:
+**  	start -- start time
+**
+**  Return value:
+**  	Microseconds elapsed, or 0 if the clock was set back.
+*/
+
+static u_long
+dkimf_metrics_elapsed(struct timeval *start)
+{
+	struct timeval now;
+
+	(void) gettimeofday(&now, NULL);
+
+	if (timercmp(&now, start, <))
+		return 0;
+
+	return (u_long) ((now.tv_sec - start->tv_sec) * 1000000L +
+	                 (now.tv_usec - start->tv_usec));
+}
+
+/*
+**  DKIMF_METRICS_COUNT -- count something
+**
+**  Parameters:
+**  	metric -- DKIMF_METRIC_* constant
+**  	label -- label value (ignored for metrics without one)
+**  	n -- amount to add
+**
+**  Return value:
+**  	None.
+*/
+
+void
+dkimf_metrics_count(int metric, int label, u_long n)
+{
+	struct dkimf_metrics_shard *shard;
+
+	assert(metric >= 0 && metric <= DKIMF_METRIC_MAX);
+
+	if (!metrics_enabled)
+		return;
+
+	shard = dkimf_metrics_shard();
+	if (shard != NULL)
+		dkimf_metrics_add(shard, metric, label, n);
+}
+
+/*
+**  DKIMF_METRICS_START -- note the start of something to be timed
+**
+**  Parameters:
+**  	start -- start time (returned)
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	The clock isn't read at all unless metrics are being served.
+*/
+
+void
+dkimf_metrics_start(struct timeval *start)
+{
+	assert(start != NULL);
+
+	if (metrics_enabled)
+		(void) gettimeofday(start, NULL);
+	else
+		timerclear(start);
+}
+
+/*
+**  DKIMF_METRICS_TIME -- record the time taken by something
+**
+**  Parameters:
+**  	metric -- DKIMF_METRIC_* constant (a histogram)
+**  	label -- label value
+**  	start -- start time, from dkimf_metrics_start()
+**
+**  Return value:
+**  	None.
+*/
+
+void
+dkimf_metrics_time(int metric, int label, struct timeval *start)
+{
+	struct dkimf_metrics_shard *shard;
+
+	assert(metric >= 0 && metric <= DKIMF_METRIC_MAX);
+	assert(start != NULL);
+
+	if (!metrics_enabled || !timerisset(start))
+		return;
+
+	shard = dkimf_metrics_shard();
+	if (shard != NULL)
+	{
+		dkimf_metrics_observe(shard, metric, label,
+		                      dkimf_metrics_elapsed(start));
+	}
+}
+
+/*
+**  DKIMF_METRICS_SIGNED -- count a signature generated
+**
+**  Parameters:
+**  	dkim -- signing handle, after a successful dkim_eom()
+**
+**  Return value:
+**  	None.
+*/
+
+void
+dkimf_metrics_signed(DKIM *dkim)
+{
+	ssize_t msglen;
+	ssize_t canonlen;
+	ssize_t signlen;
+	DKIM_SIGINFO *sig;
+	struct dkimf_metrics_shard *shard;
+
+	assert(dkim != NULL);
+
+	if (!metrics_enabled)
+		return;
+
+	shard = dkimf_metrics_shard();
+	if (shard == NULL)
+		return;
+
+	dkimf_metrics_add(shard, DKIMF_METRIC_CRYPTO, DKIMF_METRIC_SIGN, 1);
+
+	sig = dkim_getsignature(dkim);
+	if (sig != NULL &&
+	    dkim_sig_getcanonlen(dkim, sig, &msglen, &canonlen,
+	                         &signlen) == DKIM_STAT_OK &&
+	    canonlen > 0)
+		dkimf_metrics_add(shard, DKIMF_METRIC_HASHED, 0, canonlen);
+}
+
+/*
+**  DKIMF_METRICS_VERIFIED -- count a completed verification
+**
+**  Parameters:
+**  	dkim -- verifying handle
+**  	status -- what dkim_eom() returned for it
+**  	start -- when dkim_eom() was called, from dkimf_metrics_start()
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	The time spent waiting for keys is recorded separately and
+**  	not included in the time recorded for verifying.
+*/
+
+void
+dkimf_metrics_verified(DKIM *dkim, DKIM_STAT status, struct timeval *start)
+{
+	int c;
+	int err;
+	int nsigs;
+	u_int queries;
+	u_int hits;
+	u_int timeouts;
+	u_long elapsed = 0;
+	u_long dnstime;
+	ssize_t msglen;
+	ssize_t canonlen;
+	ssize_t signlen;
+	DKIM_SIGINFO **sigs;
+	struct dkimf_metrics_shard *shard;
+
+	assert(dkim != NULL);
+	assert(start != NULL);
+
+	if (!metrics_enabled)
+		return;
+
+	if (timerisset(start))
+		elapsed = dkimf_metrics_elapsed(start);
+
+	shard = dkimf_metrics_shard();
+	if (shard == NULL)
+		return;
+
+	dkimf_metrics_add(shard, DKIMF_METRIC_MESSAGES, DKIMF_METRIC_VERIFY, 1);
+	dkimf_metrics_add(shard, DKIMF_METRIC_RESULTS, status, 1);
+
+	if (dkim_getdnsstats(dkim, &queries, &hits,
+	                     &timeouts) == DKIM_STAT_OK)
+	{
+		dkimf_metrics_add(shard, DKIMF_METRIC_DNSQUERIES, 0, queries);
+		dkimf_metrics_add(shard, DKIMF_METRIC_DNSHITS, 0, hits);
+		dkimf_metrics_add(shard, DKIMF_METRIC_DNSTIMEOUTS, 0, timeouts);
+
+		if (queries > 0 &&
+		    dkim_getdnstime(dkim, &dnstime) == DKIM_STAT_OK)
+		{
+			dkimf_metrics_observe(shard, DKIMF_METRIC_OPTIME,
+			                      DKIMF_METRIC_OP_KEYFETCH, dnstime);
+			elapsed = (elapsed > dnstime ? elapsed - dnstime : 0);
+		}
+	}
+
+	if (timerisset(start))
+	{
+		dkimf_metrics_observe(shard, DKIMF_METRIC_OPTIME,
+		                      DKIMF_METRIC_OP_VERIFY, elapsed);
+	}
+
+	if (dkim_getsiglist(dkim, &sigs, &nsigs) != DKIM_STAT_OK)
+		return;
+
+	for (c = 0; c < nsigs; c++)
+	{
+		if ((dkim_sig_getflags(sigs[c]) & DKIM_SIGFLAG_IGNORE) != 0)
+			continue;
+
+		err = dkim_sig_geterror(sigs[c]);
+		dkimf_metrics_add(shard, DKIMF_METRIC_SIGERRORS, err, 1);
+
+		/* the key was applied only if it got this far */
+		if ((dkim_sig_getflags(sigs[c]) & DKIM_SIGFLAG_PROCESSED) != 0 &&
+		    (err == DKIM_SIGERROR_OK || err == DKIM_SIGERROR_BADSIG))
+		{
+			dkimf_metrics_add(shard, DKIMF_METRIC_CRYPTO,
+			                  DKIMF_METRIC_VERIFY, 1);
+		}
+
+		if (dkim_sig_getcanonlen(dkim, sigs[c], &msglen, &canonlen,
+		                         &signlen) == DKIM_STAT_OK &&
+		    canonlen > 0)
+			dkimf_metrics_add(shard, DKIMF_METRIC_HASHED, 0, canonlen);
+	}
+}
+
+/*
+**  DKIMF_METRICS_LABEL -- get the text of a label value
+**
+**  Parameters:
+**  	metric -- DKIMF_METRIC_* constant
+**  	label -- label value
+**
+**  Return value:
+**  	Text to use for that label value.
+*/
+
+static const char *
+dkimf_metrics_label(int metric, int label)
+{
+	const char *str = NULL;
+
+	if (label == metrics[metric].m_nlabels - 1)
+		return "other";
+
+	switch (metric)
+	{
+	  case DKIMF_METRIC_MESSAGES:
+		str = metrics_modes[label];
+		break;
+
+	  case DKIMF_METRIC_RESULTS:
+		str = dkim_getresultstr(label);
+		break;
+
+	  case DKIMF_METRIC_SIGERRORS:
+		str = dkim_sig_geterrorstr(label);
+		break;
+
+	  case DKIMF_METRIC_DBLOOKUPS:
+	  case DKIMF_METRIC_DBTIME:
+		str = metrics_dbtypes[label];
+		break;
+
+	  case DKIMF_METRIC_PHASETIME:
+		str = metrics_phases[label];
+		break;
+
+	  case DKIMF_METRIC_OPTIME:
+		str = metrics_optypes[label];
+		break;
+
+	  case DKIMF_METRIC_CRYPTO:
+		str = metrics_ops[label];
+		break;
+	}
+
+	return (str == NULL ? "other" : str);
+}
+
+/*
+**  DKIMF_METRICS_SUM -- add up the shards
+**
+**  Parameters:
+**  	totals -- array of metrics_nslots counters to fill in
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_metrics_sum(u_long *totals)
+{
+	int c;
+	struct dkimf_metrics_shard *shard;
+
+	memset(totals, '\0', metrics_nslots * sizeof(u_long));
+
+	pthread_mutex_lock(&metrics_lock);
+
+	for (shard = metrics_shards; shard != NULL; shard = shard->ms_next)
+	{
+		for (c = 0; c < metrics_nslots; c++)
+			totals[c] += shard->ms_count[c];
+	}
+
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+/*
+**  DKIMF_METRICS_SERIES -- render the start of a labelled series
+**
+**  Parameters:
+**  	out -- dstring to receive it
+**  	metric -- DKIMF_METRIC_* constant
+**  	suffix -- text to append to the metric name
+**  	label -- label value
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	The label set is left open so more can be added.
+*/
+
+static void
+dkimf_metrics_series(struct dkimf_dstring *out, int metric, char *suffix,
+                     int label)
+{
+	const char *p;
+	struct dkimf_metric *m;
+
+	m = &metrics[metric];
+
+	dkimf_dstring_printf(out, "%s%s%s{%s=\"", DKIMF_METRICS_PREFIX,
+	                     m->m_name, suffix, m->m_label);
+
+	for (p = dkimf_metrics_label(metric, label); *p != '\0'; p++)
+	{
+		if (*p == '\\' || *p == '"')
+			dkimf_dstring_cat1(out, '\\');
+		dkimf_dstring_cat1(out, *p);
+	}
+
+	dkimf_dstring_cat1(out, '"');
+}
+
+/*
+**  DKIMF_METRICS_HISTOGRAM -- render one series of a histogram
+**
+**  Parameters:
+**  	out -- dstring to receive it
+**  	metric -- DKIMF_METRIC_* constant
+**  	label -- label value
+**  	h -- the series' slots in a set of totals
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_metrics_histogram(struct dkimf_dstring *out, int metric, int label,
+                        u_long *h)
+{
+	int c;
+	u_long bound;
+	u_long count = 0;
+
+	for (c = 0; c < DKIMF_METRICS_HFINITE; c++)
+	{
+		count += h[c];
+
+		/* publish only the powers of two */
+		if ((c + 1) % DKIMF_METRICS_HSUB != 0)
+			continue;
+
+		bound = dkimf_metrics_bound(c);
+		dkimf_metrics_series(out, metric, "_bucket", label);
+		dkimf_dstring_printf(out, ",le=\"%lu.%06lu\"} %lu\n",
+		                     bound / 1000000, bound % 1000000, count);
+	}
+
+	count += h[DKIMF_METRICS_HOVER];
+
+	dkimf_metrics_series(out, metric, "_bucket", label);
+	dkimf_dstring_printf(out, ",le=\"+Inf\"} %lu\n", count);
+
+	dkimf_metrics_series(out, metric, "_sum", label);
+	dkimf_dstring_printf(out, "} %lu.%06lu\n",
+	                     h[DKIMF_METRICS_HSUM] / 1000000,
+	                     h[DKIMF_METRICS_HSUM] % 1000000);
+
+	dkimf_metrics_series(out, metric, "_count", label);
+	dkimf_dstring_printf(out, "} %lu\n", count);
+}
+
+/*
+**  DKIMF_METRICS_FORMAT -- render the current totals
+**
+**  Parameters:
+**  	out -- dstring to receive Prometheus text exposition format
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_metrics_format(struct dkimf_dstring *out)
+{
+	int c;
+	int d;
+	int l;
+	u_long *h;
+	struct dkimf_metric *m;
+
+	dkimf_metrics_sum(metrics_totals);
+
+	for (c = 0; c <= DKIMF_METRIC_MAX; c++)
+	{
+		m = &metrics[c];
+
+		dkimf_dstring_printf(out, "# HELP %s%s %s\n",
+		                     DKIMF_METRICS_PREFIX, m->m_name, m->m_help);
+		dkimf_dstring_printf(out, "# TYPE %s%s %s\n",
+		                     DKIMF_METRICS_PREFIX, m->m_name,
+		                     m->m_hist ? "histogram" : "counter");
+
+		if (m->m_label == NULL)
+		{
+			dkimf_dstring_printf(out, "%s%s %lu\n",
+			                     DKIMF_METRICS_PREFIX, m->m_name,
+			                     metrics_totals[m->m_base]);
+			continue;
+		}
+
+		for (l = 0; l < m->m_nlabels; l++)
+		{
+			if (m->m_hist)
+			{
+				h = &metrics_totals[m->m_base +
+				                    l * DKIMF_METRICS_HWIDTH];
+
+				/* only list label values that have been seen */
+				for (d = 0; d <= DKIMF_METRICS_HOVER; d++)
+				{
+					if (h[d] != 0)
+						break;
+				}
+
+				if (d <= DKIMF_METRICS_HOVER)
+					dkimf_metrics_histogram(out, c, l, h);
+
+				continue;
+			}
+
+			/* only list label values that have been seen */
+			if (metrics_totals[m->m_base + l] == 0)
+				continue;
+
+			dkimf_metrics_series(out, c, "", l);
+			dkimf_dstring_printf(out, "} %lu\n",
+			                     metrics_totals[m->m_base + l]);
+		}
+	}
+}
+
+/*
+**  DKIMF_METRICS_QUANTILE -- estimate a quantile of a histogram
+**
+**  Parameters:
+**  	h -- the series' slots in a set of totals
+**  	count -- number of observations in the series
+**  	pct -- percentile wanted
+**  	buf -- buffer to receive a description of the result
+**  	buflen -- bytes available at "buf"
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_metrics_quantile(u_long *h, u_long count, u_int pct, char *buf,
+                       size_t buflen)
+{
+	int c;
+	u_long rank;
+	u_long seen = 0;
+
+	rank = (count * pct + 99) / 100;
+
+	for (c = 0; c < DKIMF_METRICS_HFINITE; c++)
+	{
+		seen += h[c];
+		if (seen >= rank)
+		{
+			snprintf(buf, buflen, "<%luus", dkimf_metrics_bound(c));
+			return;
+		}
+	}
+
+	snprintf(buf, buflen, ">=%luus",
+	         dkimf_metrics_bound(DKIMF_METRICS_HFINITE - 1));
+}
+
+/*
+**  DKIMF_METRICS_DUMP -- log a summary of the latency histograms
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Each series seen so far gets a line giving its count, its mean
+**  	and bounds on its median, 90th and 99th percentiles.
+*/
+
+void
+dkimf_metrics_dump(void)
+{
+	int c;
+	int d;
+	int l;
+	u_long count;
+	u_long *h;
+	u_long *totals;
+	struct dkimf_metric *m;
+	char p50[BUFRSZ];
+	char p90[BUFRSZ];
+	char p99[BUFRSZ];
+
+	if (!metrics_enabled)
+		return;
+
+	/* the listener owns metrics_totals */
+	totals = (u_long *) malloc(metrics_nslots * sizeof(u_long));
+	if (totals == NULL)
+	{
+		syslog(LOG_ERR, "metrics: malloc(): %s", strerror(errno));
+		return;
+	}
+
+	dkimf_metrics_sum(totals);
+
+	for (c = 0; c <= DKIMF_METRIC_MAX; c++)
+	{
+		m = &metrics[c];
+		if (!m->m_hist)
+			continue;
+
+		for (l = 0; l < m->m_nlabels; l++)
+		{
+			h = &totals[m->m_base + l * DKIMF_METRICS_HWIDTH];
+
+			count = 0;
+			for (d = 0; d <= DKIMF_METRICS_HOVER; d++)
+				count += h[d];
+
+			if (count == 0)
+				continue;
+
+			dkimf_metrics_quantile(h, count, 50, p50, sizeof p50);
+			dkimf_metrics_quantile(h, count, 90, p90, sizeof p90);
+			dkimf_metrics_quantile(h, count, 99, p99, sizeof p99);
+
+			syslog(LOG_INFO,
+			       "metrics: %s %s=%s: count %lu, mean %luus, p50 %s, p90 %s, p99 %s",
+			       m->m_name, m->m_label,
+			       dkimf_metrics_label(c, l), count,
+			       h[DKIMF_METRICS_HSUM] / count, p50, p90, p99);
+		}
+	}
+
+	free(totals);
+}
+
+/*
+**  DKIMF_METRICS_WRITE -- write all of a buffer to a client
+**
+**  Parameters:
+**  	fd -- descriptor
+**  	buf -- data to write
+**  	len -- bytes at "buf"
+**
+**  Return value:
+**  	0 on success, -1 on error.
+*/
+
+static int
+dkimf_metrics_write(int fd, u_char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0)
+	{
+		n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+**  DKIMF_METRICS_SERVE -- answer one client
+**
+**  Parameters:
+**  	fd -- connected descriptor
+**  	out -- dstring to use for formatting
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	A client that sends an HTTP GET request gets an HTTP response, so
+**  	Prometheus can scrape the socket directly; anything else (including
+**  	saying nothing for a second) gets just the metrics.
+*/
+
+static void
+dkimf_metrics_serve(int fd, struct dkimf_dstring *out)
+{
+	_Bool http = FALSE;
+	size_t len = 0;
+	ssize_t n;
+	struct pollfd pfd;
+	char hdr[BUFRSZ];
+	char req[DKIMF_METRICS_REQMAX + 1];
+
+	/* read a request, if there is one, up to its blank line */
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	while (len < DKIMF_METRICS_REQMAX)
+	{
+		pfd.revents = 0;
+		if (poll(&pfd, 1, DKIMF_METRICS_TIMEOUT) <= 0)
+			break;
+
+		n = read(fd, req + len, DKIMF_METRICS_REQMAX - len);
+		if (n <= 0)
+			break;
+
+		len += n;
+		req[len] = '\0';
+
+		if (strstr(req, "\r\n\r\n") != NULL ||
+		    strstr(req, "\n\n") != NULL)
+			break;
+	}
+
+	if (len >= 4 && strncmp(req, "GET ", 4) == 0)
+		http = TRUE;
+
+	dkimf_dstring_blank(out);
+	dkimf_metrics_format(out);
+
+	if (http)
+	{
+		snprintf(hdr, sizeof hdr,
+		         "HTTP/1.0 200 OK\r\n"
+		         "Content-Type: text/plain; version=0.0.4\r\n"
+		         "Content-Length: %lu\r\n"
+		         "Connection: close\r\n\r\n",
+		         (u_long) dkimf_dstring_len(out));
+
+		if (dkimf_metrics_write(fd, (u_char *) hdr, strlen(hdr)) != 0)
+			return;
+	}
+
+	(void) dkimf_metrics_write(fd, dkimf_dstring_get(out),
+	                           dkimf_dstring_len(out));
+}
+
+/*
+**  DKIMF_METRICS_LISTENER -- metrics listener thread
+**
+**  Parameters:
+**  	arg -- unused
+**
+**  Return value:
+**  	Always NULL.
+*/
+
+static void *
+dkimf_metrics_listener(void *arg)
+{
+	int fd;
+	struct pollfd pfd;
+	struct dkimf_dstring *out;
+
+	out = dkimf_dstring_new(BUFRSZ, 0);
+	if (out == NULL)
+		return NULL;
+
+	pfd.fd = metrics_fd;
+	pfd.events = POLLIN;
+
+	while (!metrics_die)
+	{
+		/* wake up now and then to check for shutdown */
+		pfd.revents = 0;
+		if (poll(&pfd, 1, DKIMF_METRICS_TIMEOUT) <= 0)
+			continue;
+
+		fd = accept(metrics_fd, NULL, NULL);
+		if (fd == -1)
+			continue;
+
+		dkimf_metrics_serve(fd, out);
+
+		(void) close(fd);
+	}
+
+	dkimf_dstring_free(out);
+
+	return NULL;
+}
+
+/*
+**  DKIMF_METRICS_LISTEN -- open the metrics socket
+**
+**  Parameters:
+**  	spec -- "/path" for a UNIX domain socket, or "port@address"
+**  	err -- error string (returned)
+**
+**  Return value:
+**  	A listening descriptor, or -1 on error.
+*/
+
+static int
+dkimf_metrics_listen(char *spec, char **err)
+{
+	int fd;
+	int on = 1;
+	int status;
+	socklen_t salen;
+	char *at;
+	char *q;
+	uint16_t port;
+	struct sockaddr *sa;
+	struct sockaddr_un sun;
+	struct sockaddr_in sin4;
+#ifdef AF_INET6
+	struct sockaddr_in6 sin6;
+#endif /* AF_INET6 */
+	char portstr[BUFRSZ + 1];
+
+	if (spec[0] == '/')
+	{					/* UNIX domain */
+		memset(&sun, '\0', sizeof sun);
+		sun.sun_family = AF_UNIX;
+#ifdef HAVE_SUN_LEN
+		sun.sun_len = sizeof(sun);
+#endif /* HAVE_SUN_LEN */
+		if (strlcpy(sun.sun_path, spec,
+		            sizeof sun.sun_path) >= sizeof sun.sun_path)
+		{
+			*err = strerror(ENAMETOOLONG);
+			return -1;
+		}
+
+		/* clear away one left behind by an earlier run */
+		snprintf(portstr, sizeof portstr, "local:%s", spec);
+		status = dkimf_socket_cleanup(portstr);
+		if (status != 0)
+		{
+			*err = strerror(status);
+			return -1;
+		}
+
+		sa = (struct sockaddr *) &sun;
+		salen = sizeof sun;
+	}
+	else
+	{					/* port@address */
+		at = strchr(spec, '@');
+		if (at == NULL || at == spec ||
+		    (size_t) (at - spec) > sizeof portstr - 1)
+		{
+			*err = strerror(EINVAL);
+			return -1;
+		}
+
+		memcpy(portstr, spec, at - spec);
+		portstr[at - spec] = '\0';
+
+		port = (uint16_t) strtoul(portstr, &q, 10);
+		if (*q != '\0')
+		{
+			struct servent *srv;
+
+			srv = getservbyname(portstr, "tcp");
+			if (srv == NULL)
+			{
+				*err = strerror(EINVAL);
+				return -1;
+			}
+
+			port = srv->s_port;
+		}
+		else
+		{
+			port = htons(port);
+		}
+
+		memset(&sin4, '\0', sizeof sin4);
+#ifdef AF_INET6
+		memset(&sin6, '\0', sizeof sin6);
+#endif /* AF_INET6 */
+
+		if (inet_pton(AF_INET, at + 1, &sin4.sin_addr) == 1)
+		{
+			sin4.sin_family = AF_INET;
+			sin4.sin_port = port;
+			sa = (struct sockaddr *) &sin4;
+			salen = sizeof sin4;
+		}
+#ifdef AF_INET6
+		else if (inet_pton(AF_INET6, at + 1, &sin6.sin6_addr) == 1)
+		{
+			sin6.sin6_family = AF_INET6;
+			sin6.sin6_port = port;
+			sa = (struct sockaddr *) &sin6;
+			salen = sizeof sin6;
+		}
+#endif /* AF_INET6 */
+		else
+		{
+			*err = "address must be an IP address";
+			return -1;
+		}
+	}
+
+	fd = socket(sa->sa_family, SOCK_STREAM, 0);
+	if (fd == -1)
+	{
+		*err = strerror(errno);
+		return -1;
+	}
+
+	if (sa->sa_family != AF_UNIX)
+	{
+		(void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on,
+		                  sizeof on);
+	}
+
+	if (bind(fd, sa, salen) != 0 ||
+	    listen(fd, DKIMF_METRICS_BACKLOG) != 0)
+	{
+		*err = strerror(errno);
+		(void) close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+**  DKIMF_METRICS_INIT -- start serving metrics
+**
+**  Parameters:
+**  	spec -- socket on which to listen; see dkimf_metrics_listen()
+**  	err -- error string (returned)
+**
+**  Return value:
+**  	0 on success, -1 on error.
+**
+**  Notes:
+**  	Until this succeeds nothing is counted, so programs that share
+**  	code with the filter but don't serve metrics pay nothing for it.
+*/
+
+int
+dkimf_metrics_init(char *spec, char **err)
+{
+	int c;
+	int status;
+
+	assert(spec != NULL);
+	assert(err != NULL);
+
+	if (metrics_enabled)
+		return 0;
+
+	/* lay out the shards */
+	metrics_nslots = 0;
+	for (c = 0; c <= DKIMF_METRIC_MAX; c++)
+	{
+		metrics[c].m_base = metrics_nslots;
+		if (metrics[c].m_hist)
+		{
+			metrics_nslots += metrics[c].m_nlabels *
+			                  DKIMF_METRICS_HWIDTH;
+		}
+		else
+		{
+			metrics_nslots += metrics[c].m_nlabels;
+		}
+	}
+
+	metrics_totals = (u_long *) malloc(metrics_nslots * sizeof(u_long));
+	if (metrics_totals == NULL)
+	{
+		*err = strerror(errno);
+		return -1;
+	}
+
+	if (spec[0] == '/')
+	{
+		metrics_path = strdup(spec);
+		if (metrics_path == NULL)
+		{
+			*err = strerror(errno);
+			free(metrics_totals);
+			metrics_totals = NULL;
+			return -1;
+		}
+	}
+
+	metrics_fd = dkimf_metrics_listen(spec, err);
+	if (metrics_fd == -1)
+	{
+		free(metrics_totals);
+		metrics_totals = NULL;
+		if (metrics_path != NULL)
+		{
+			free(metrics_path);
+			metrics_path = NULL;
+		}
+		return -1;
+	}
+
+	status = pthread_key_create(&metrics_key, dkimf_metrics_release);
+	if (status == 0)
+	{
+		status = pthread_create(&metrics_thread, NULL,
+		                        dkimf_metrics_listener, NULL);
+		if (status != 0)
+			(void) pthread_key_delete(metrics_key);
+	}
+
+	if (status != 0)
+	{
+		*err = strerror(status);
+		(void) close(metrics_fd);
+		metrics_fd = -1;
+		if (metrics_path != NULL)
+		{
+			(void) unlink(metrics_path);
+			free(metrics_path);
+			metrics_path = NULL;
+		}
+		free(metrics_totals);
+		metrics_totals = NULL;
+		return -1;
+	}
+
+	metrics_enabled = TRUE;
+
+	return 0;
+}
+
+/*
+**  DKIMF_METRICS_SHUTDOWN -- stop serving metrics
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Shards are left allocated; threads still running may yet count.
+*/
+
+void
+dkimf_metrics_shutdown(void)
+{
+	if (metrics_fd == -1)
+		return;
+
+	metrics_die = TRUE;
+	(void) pthread_join(metrics_thread, NULL);
+
+	(void) close(metrics_fd);
+	metrics_fd = -1;
+
+	if (metrics_path != NULL)
+	{
+		(void) unlink(metrics_path);
+		free(metrics_path);
+		metrics_path = NULL;
+	}
+}
+#endif /* _FFR_METRICS */
@@ -0,0 +1,78 @@
+/*
+**  Copyright (c) 2015, The Trusted Domain Project.  All rights reserved.
+*/
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include "build-config.h"
+
+/* system includes */
+#include <sys/types.h>
+#include <sys/time.h>
+
+/* libopendkim includes */
+#include <dkim.h>
+
+#ifdef __STDC__
+# ifndef __P
+#  define __P(x)  x
+# endif /* ! __P */
+#else /* __STDC__ */
+# ifndef __P
+#  define __P(x)  ()
+# endif /* ! __P */
+#endif /* __STDC__ */
+
+/* metrics; labels are in parentheses */
+#define	DKIMF_METRIC_MESSAGES	0	/* messages (DKIMF_METRIC_SIGN etc.) */
+#define	DKIMF_METRIC_RESULTS	1	/* verifications (DKIM_STAT_*) */
+#define	DKIMF_METRIC_SIGERRORS	2	/* signatures (DKIM_SIGERROR_*) */
+#define	DKIMF_METRIC_DNSQUERIES	3	/* key queries sent */
+#define	DKIMF_METRIC_DNSHITS	4	/* keys found in the library cache */
+#define	DKIMF_METRIC_DNSTIMEOUTS 5	/* key queries timed out */
+#define	DKIMF_METRIC_DBLOOKUPS	6	/* data set lookups (DKIMF_DB_TYPE_*) */
+#define	DKIMF_METRIC_CRYPTO	7	/* crypto operations (DKIMF_METRIC_SIGN etc.) */
+#define	DKIMF_METRIC_HASHED	8	/* body bytes hashed */
+#define	DKIMF_METRIC_PHASETIME	9	/* callback latency (DKIMF_METRIC_PHASE_*) */
+#define	DKIMF_METRIC_OPTIME	10	/* operation latency (DKIMF_METRIC_OP_*) */
+#define	DKIMF_METRIC_DBTIME	11	/* data set latency (DKIMF_DB_TYPE_*) */
+#define	DKIMF_METRIC_MAX	11
+
+#define	DKIMF_METRIC_SIGN	0
+#define	DKIMF_METRIC_VERIFY	1
+
+/* milter callbacks */
+#define	DKIMF_METRIC_PHASE_CONNECT	0
+#define	DKIMF_METRIC_PHASE_ENVFROM	1
+#define	DKIMF_METRIC_PHASE_ENVRCPT	2
+#define	DKIMF_METRIC_PHASE_HEADER	3
+#define	DKIMF_METRIC_PHASE_EOH		4
+#define	DKIMF_METRIC_PHASE_BODY		5
+#define	DKIMF_METRIC_PHASE_EOM		6
+#define	DKIMF_METRIC_PHASE_ABORT	7
+#define	DKIMF_METRIC_PHASE_CLOSE	8
+
+/* operations within them */
+#define	DKIMF_METRIC_OP_KEYFETCH	0
+#define	DKIMF_METRIC_OP_SIGN		1
+#define	DKIMF_METRIC_OP_VERIFY		2
+#define	DKIMF_METRIC_OP_LUASETUP	3
+#define	DKIMF_METRIC_OP_LUASCREEN	4
+#define	DKIMF_METRIC_OP_LUASTATS	5
+#define	DKIMF_METRIC_OP_LUAFINAL	6
+#define	DKIMF_METRIC_OP_STATSRECORD	7
+#define	DKIMF_METRIC_OP_STATSWRITE	8
+
+/* prototypes */
+extern void dkimf_metrics_count __P((int, int, u_long));
+extern void dkimf_metrics_dump __P((void));
+extern int dkimf_metrics_init __P((char *, char **));
+extern void dkimf_metrics_shutdown __P((void));
+extern void dkimf_metrics_signed __P((DKIM *));
+extern void dkimf_metrics_start __P((struct timeval *));
+extern void dkimf_metrics_time __P((int, int, struct timeval *));
+extern void dkimf_metrics_verified __P((DKIM *, DKIM_STAT,
+                                        struct timeval *));
+
+#endif /* _METRICS_H_ */
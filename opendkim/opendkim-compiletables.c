@@ -0,0 +1,624 @@
+/*
+**  Copyright (c) 2015, The Trusted Domain Project.  All rights reserved.
+**
+*/
+
+#include "build-config.h"
+
+/* system includes */
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sysexits.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifndef FALSE
+# define FALSE		0
+#endif /* ! FALSE */
+#ifndef TRUE
+# define TRUE		1
+#endif /* ! TRUE */
+
+/* libopendkim includes */
+#include <dkim.h>
+
+/* opendkim includes */
+#include "opendkim-db.h"
+#include "opendkim-ctable.h"
+#include "util.h"
+
+/* definitions */
+#define	BUFRSZ		65536
+#define	CMDLINEOPTS	"v"
+#define	MAXSALTS	64
+#define	MAXSEEDS	65536
+#define	PAD4(x)		(((x) + 3) & ~((size_t) 3))
+
+/* data types */
+struct entry
+{
+	uint32_t	e_index;		/* position in the data set */
+	uint32_t	e_keylen;		/* key length */
+	uint32_t	e_vallen;		/* value length */
+	_Bool		e_hasval;		/* value present */
+	char *		e_key;			/* key */
+	char *		e_val;			/* value */
+};
+
+struct ckey
+{
+	uint32_t	k_first;		/* first entry */
+	uint32_t	k_count;		/* entries with this key */
+	uint32_t	k_bucket;		/* bucket */
+};
+
+/* globals */
+char *progname;
+
+/*
+**  USAGE -- print usage message and exit
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	EX_USAGE
+*/
+
+int
+usage(void)
+{
+	fprintf(stderr, "%s: usage: %s [opts] dataset outfile\n"
+	                "\t-v          \tverbose output\n",
+		progname, progname);
+
+	return EX_USAGE;
+}
+
+/*
+**  ENTRY_CMP -- qsort() callback to sort entries
+**
+**  Parameters:
+**  	a, b -- entries to compare
+**
+**  Return value:
+**  	Entries with keys that differ only in case are adjacent, and
+**  	otherwise stay in data set order.
+*/
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+	int c;
+	const struct entry *ea = a;
+	const struct entry *eb = b;
+
+	if (ea->e_keylen != eb->e_keylen)
+		return (ea->e_keylen < eb->e_keylen ? -1 : 1);
+
+	c = strncasecmp(ea->e_key, eb->e_key, ea->e_keylen);
+	if (c != 0)
+		return c;
+
+	return (ea->e_index < eb->e_index ? -1 : 1);
+}
+
+/*
+**  CKEY_SIZECMP -- qsort() callback to order keys by bucket size
+**
+**  Parameters:
+**  	a, b -- pointers into the bucket index
+**
+**  Return value:
+**  	Keys in larger buckets sort first; keys in the same bucket are
+**  	adjacent.
+*/
+
+static uint32_t *bsizes;
+
+static int
+ckey_sizecmp(const void *a, const void *b)
+{
+	const struct ckey *ka = *(const struct ckey **) a;
+	const struct ckey *kb = *(const struct ckey **) b;
+
+	if (bsizes[ka->k_bucket] != bsizes[kb->k_bucket])
+		return (bsizes[ka->k_bucket] > bsizes[kb->k_bucket] ? -1 : 1);
+
+	if (ka->k_bucket != kb->k_bucket)
+		return (ka->k_bucket < kb->k_bucket ? -1 : 1);
+
+	return (ka < kb ? -1 : 1);
+}
+
+/*
+**  BUILDHASH -- find seeds that give every key its own slot
+**
+**  Parameters:
+**  	ents -- sorted entries
+**  	keys -- distinct keys
+**  	nkeys -- number of keys
+**  	nbuckets -- number of buckets
+**  	disp -- bucket seeds (returned)
+**  	slotkey -- key in each slot (returned)
+**  	salt -- bucket hash seed (returned)
+**
+**  Return value:
+**  	TRUE on success, FALSE if no set of seeds was found.
+*/
+
+static _Bool
+buildhash(struct entry *ents, struct ckey *keys, uint32_t nkeys,
+          uint32_t nbuckets, uint32_t *disp, uint32_t *slotkey,
+          uint32_t *salt)
+{
+	_Bool ok = FALSE;
+	uint32_t c;
+	uint32_t n;
+	uint32_t b;
+	uint32_t d;
+	uint32_t s;
+	uint32_t next;
+	uint32_t start;
+	uint32_t bsize;
+	uint32_t *tried;
+	struct ckey **order;
+	struct entry *e;
+
+	bsizes = (uint32_t *) malloc(sizeof(uint32_t) * nbuckets);
+	order = (struct ckey **) malloc(sizeof(struct ckey *) * nkeys);
+	tried = (uint32_t *) malloc(sizeof(uint32_t) * nkeys);
+	if (bsizes == NULL || order == NULL || tried == NULL)
+	{
+		free(bsizes);
+		free(order);
+		free(tried);
+		return FALSE;
+	}
+
+	for (s = 0; s < MAXSALTS && !ok; s++)
+	{
+		memset(bsizes, '\0', sizeof(uint32_t) * nbuckets);
+		memset(disp, '\0', sizeof(uint32_t) * nbuckets);
+		for (c = 0; c < nkeys; c++)
+			slotkey[c] = UINT32_MAX;
+
+		for (c = 0; c < nkeys; c++)
+		{
+			e = &ents[keys[c].k_first];
+			keys[c].k_bucket = dkimf_ctable_hash(e->e_key,
+			                                     e->e_keylen,
+			                                     s) % nbuckets;
+			bsizes[keys[c].k_bucket]++;
+			order[c] = &keys[c];
+		}
+
+		qsort(order, nkeys, sizeof *order, ckey_sizecmp);
+
+		ok = TRUE;
+		next = 0;
+
+		for (start = 0; start < nkeys && ok; start += bsize)
+		{
+			b = order[start]->k_bucket;
+			bsize = bsizes[b];
+
+			/* singletons take whatever slot is left */
+			if (bsize == 1)
+			{
+				while (slotkey[next] != UINT32_MAX)
+					next++;
+				slotkey[next] = order[start] - keys;
+				disp[b] = next | DKIMF_CTABLE_DIRECT;
+				continue;
+			}
+
+			for (d = 0; d < MAXSEEDS; d++)
+			{
+				for (n = 0; n < bsize; n++)
+				{
+					e = &ents[order[start + n]->k_first];
+					tried[n] = dkimf_ctable_hash(e->e_key,
+					                             e->e_keylen,
+					                             s + 1 + d) % nkeys;
+					if (slotkey[tried[n]] != UINT32_MAX)
+						break;
+					for (c = 0; c < n; c++)
+					{
+						if (tried[c] == tried[n])
+							break;
+					}
+					if (c < n)
+						break;
+				}
+
+				if (n == bsize)
+					break;
+			}
+
+			if (d == MAXSEEDS)
+			{
+				ok = FALSE;
+				break;
+			}
+
+			for (n = 0; n < bsize; n++)
+				slotkey[tried[n]] = order[start + n] - keys;
+			disp[b] = d;
+		}
+
+		if (ok)
+			*salt = s;
+	}
+
+	free(bsizes);
+	free(order);
+	free(tried);
+
+	return ok;
+}
+
+/*
+**  MAIN -- program mainline
+**
+**  Parameters:
+**  	argc, argv -- the usual
+**
+**  Return value:
+**  	Exit status.
+*/
+
+int
+main(int argc, char **argv)
+{
+	int c;
+	int fd;
+	int status;
+	int verbose = 0;
+	uint32_t n;
+	uint32_t nents = 0;
+	uint32_t nkeys = 0;
+	uint32_t nbuckets;
+	uint32_t nfields;
+	uint32_t salt = 0;
+	uint32_t *disp;
+	uint32_t *slotkey;
+	uint32_t *fields;
+	uint32_t *order;
+	size_t maxents = 0;
+	size_t keylen;
+	size_t size;
+	size_t off;
+	char *p;
+	char *q;
+	char *dataset;
+	char *outfile;
+	char *map;
+	char *tmpfile;
+	DKIMF_DB db;
+	struct entry *ents = NULL;
+	struct entry *e;
+	struct ckey *keys;
+	struct dkimf_ctable_hdr *hdr;
+	struct dkimf_ctable_slot *slots;
+	struct dkimf_ctable_rec *recs;
+	struct dkimf_db_data dbd;
+	static char key[BUFRSZ + 1];
+	static char value[BUFRSZ + 1];
+
+	progname = (p = strrchr(argv[0], '/')) == NULL ? argv[0] : p + 1;
+
+	while ((c = getopt(argc, argv, CMDLINEOPTS)) != -1)
+	{
+		switch (c)
+		{
+		  case 'v':
+			verbose++;
+			break;
+
+		  default:
+			return usage();
+		}
+	}
+
+	if (optind != argc - 2)
+		return usage();
+
+	dataset = argv[optind];
+	outfile = argv[optind + 1];
+
+	status = dkimf_db_open(&db, dataset, DKIMF_DB_FLAG_READONLY,
+	                       NULL, NULL);
+	if (status != 0)
+	{
+		fprintf(stderr, "%s: dkimf_db_open() failed\n", progname);
+		return 1;
+	}
+
+	if (dkimf_db_type(db) == DKIMF_DB_TYPE_REFILE)
+	{
+		fprintf(stderr, "%s: invalid data set type\n", progname);
+		(void) dkimf_db_close(db);
+		return 1;
+	}
+
+	if (verbose > 0)
+		fprintf(stderr, "%s: database opened\n", progname);
+
+	/* read everything */
+	for (n = 0; ; n++)
+	{
+		memset(key, '\0', sizeof key);
+		memset(value, '\0', sizeof value);
+		keylen = sizeof key - 1;
+		dbd.dbdata_buffer = value;
+		dbd.dbdata_buflen = sizeof value - 1;
+		dbd.dbdata_flags = DKIMF_DB_DATA_BINARY;
+
+		status = dkimf_db_walk(db, n == 0, key, &keylen, &dbd, 1);
+		if (status == -1)
+		{
+			fprintf(stderr, "%s: dkimf_db_walk(%u) failed\n",
+			        progname, n);
+			(void) dkimf_db_close(db);
+			return 1;
+		}
+		else if (status == 1)
+		{
+			break;
+		}
+
+		if (keylen >= sizeof key - 1 ||
+		    (value[0] != '\0' && dbd.dbdata_buflen >= sizeof value - 1))
+		{
+			fprintf(stderr, "%s: record %u too large\n",
+			        progname, n);
+			(void) dkimf_db_close(db);
+			return 1;
+		}
+
+		if (nents == maxents)
+		{
+			maxents = (maxents == 0 ? 1024 : maxents * 2);
+			e = (struct entry *) realloc(ents,
+			                             maxents * sizeof *ents);
+			if (e == NULL)
+			{
+				fprintf(stderr, "%s: realloc(): %s\n",
+				        progname, strerror(errno));
+				(void) dkimf_db_close(db);
+				return 1;
+			}
+			ents = e;
+		}
+
+		/* "file" values are never empty, so nothing read means none */
+		e = &ents[nents];
+		e->e_index = nents;
+		e->e_keylen = keylen;
+		e->e_hasval = (value[0] != '\0');
+		e->e_vallen = (e->e_hasval ? dbd.dbdata_buflen : 0);
+		e->e_key = malloc(keylen + 1);
+		e->e_val = malloc(e->e_vallen + 1);
+		if (e->e_key == NULL || e->e_val == NULL)
+		{
+			fprintf(stderr, "%s: malloc(): %s\n",
+			        progname, strerror(errno));
+			(void) dkimf_db_close(db);
+			return 1;
+		}
+		memcpy(e->e_key, key, keylen + 1);
+		memcpy(e->e_val, value, e->e_vallen);
+		e->e_val[e->e_vallen] = '\0';
+		nents++;
+	}
+
+	(void) dkimf_db_close(db);
+
+	if (nents >= DKIMF_CTABLE_DIRECT)
+	{
+		fprintf(stderr, "%s: too many records\n", progname);
+		return 1;
+	}
+
+	/* group records by key */
+	if (nents > 0)
+		qsort(ents, nents, sizeof *ents, entry_cmp);
+
+	keys = (struct ckey *) malloc(sizeof(struct ckey) * (nents + 1));
+	if (keys == NULL)
+	{
+		fprintf(stderr, "%s: malloc(): %s\n", progname,
+		        strerror(errno));
+		return 1;
+	}
+
+	for (n = 0; n < nents; n++)
+	{
+		if (nkeys == 0 ||
+		    ents[keys[nkeys - 1].k_first].e_keylen != ents[n].e_keylen ||
+		    strncasecmp(ents[keys[nkeys - 1].k_first].e_key,
+		                ents[n].e_key, ents[n].e_keylen) != 0)
+		{
+			keys[nkeys].k_first = n;
+			keys[nkeys].k_count = 0;
+			nkeys++;
+		}
+
+		keys[nkeys - 1].k_count++;
+	}
+
+	nbuckets = nkeys / DKIMF_CTABLE_PERBUCKET + 1;
+	disp = (uint32_t *) malloc(sizeof(uint32_t) * nbuckets);
+	slotkey = (uint32_t *) malloc(sizeof(uint32_t) * (nkeys + 1));
+	if (disp == NULL || slotkey == NULL)
+	{
+		fprintf(stderr, "%s: malloc(): %s\n", progname,
+		        strerror(errno));
+		return 1;
+	}
+
+	if (nkeys > 0 &&
+	    !buildhash(ents, keys, nkeys, nbuckets, disp, slotkey, &salt))
+	{
+		fprintf(stderr, "%s: unable to build hash table\n", progname);
+		return 1;
+	}
+
+	/* lay out the file */
+	size = PAD4(sizeof *hdr);
+	size += sizeof(uint32_t) * nbuckets;
+	size += sizeof(struct dkimf_ctable_slot) * nkeys;
+	size += sizeof(struct dkimf_ctable_rec) * nents;
+	size += sizeof(uint32_t) * nents;
+	for (n = 0; n < nents; n++)
+	{
+		e = &ents[n];
+		size += e->e_keylen + 1;
+		if (e->e_hasval)
+		{
+			size += e->e_vallen + 1;
+			size = PAD4(size);
+			size += sizeof(uint32_t);
+			for (p = e->e_val; p < e->e_val + e->e_vallen; p++)
+			{
+				if (*p == ':')
+					size += sizeof(uint32_t);
+			}
+		}
+	}
+	size = PAD4(size);
+
+	if (size > UINT32_MAX)
+	{
+		fprintf(stderr, "%s: data set too large\n", progname);
+		return 1;
+	}
+
+	map = calloc(1, size);
+	if (map == NULL)
+	{
+		fprintf(stderr, "%s: malloc(): %s\n", progname,
+		        strerror(errno));
+		return 1;
+	}
+
+	hdr = (struct dkimf_ctable_hdr *) map;
+	memcpy(hdr->ch_magic, DKIMF_CTABLE_MAGIC, sizeof hdr->ch_magic);
+	hdr->ch_version = DKIMF_CTABLE_VERSION;
+	hdr->ch_bom = DKIMF_CTABLE_BOM;
+	hdr->ch_size = size;
+	hdr->ch_salt = salt;
+	hdr->ch_nbuckets = nbuckets;
+	hdr->ch_nkeys = nkeys;
+	hdr->ch_nrecs = nents;
+
+	off = PAD4(sizeof *hdr);
+	hdr->ch_disp = off;
+	memcpy(map + off, disp, sizeof(uint32_t) * nbuckets);
+	off += sizeof(uint32_t) * nbuckets;
+
+	hdr->ch_slots = off;
+	slots = (struct dkimf_ctable_slot *) (map + off);
+	off += sizeof(struct dkimf_ctable_slot) * nkeys;
+
+	hdr->ch_recs = off;
+	recs = (struct dkimf_ctable_rec *) (map + off);
+	off += sizeof(struct dkimf_ctable_rec) * nents;
+
+	hdr->ch_order = off;
+	order = (uint32_t *) (map + off);
+	off += sizeof(uint32_t) * nents;
+
+	for (n = 0; n < nkeys; n++)
+	{
+		slots[n].cs_first = keys[slotkey[n]].k_first;
+		slots[n].cs_count = keys[slotkey[n]].k_count;
+	}
+
+	/* walks (e.g. for header lists) see the records in data set order */
+	for (n = 0; n < nents; n++)
+		order[ents[n].e_index] = n;
+
+	for (n = 0; n < nents; n++)
+	{
+		e = &ents[n];
+
+		recs[n].cr_key = off;
+		recs[n].cr_keylen = e->e_keylen;
+		memcpy(map + off, e->e_key, e->e_keylen);
+		off += e->e_keylen + 1;
+
+		if (!e->e_hasval)
+			continue;
+
+		recs[n].cr_value = off;
+		recs[n].cr_vallen = e->e_vallen;
+		memcpy(map + off, e->e_val, e->e_vallen);
+		off = PAD4(off + e->e_vallen + 1);
+
+		recs[n].cr_fields = off;
+		fields = (uint32_t *) (map + off);
+		nfields = 0;
+		fields[nfields++] = 0;
+		for (p = e->e_val; p < e->e_val + e->e_vallen; p++)
+		{
+			if (*p == ':')
+				fields[nfields++] = p - e->e_val + 1;
+		}
+		recs[n].cr_nfields = nfields;
+		off += sizeof(uint32_t) * nfields;
+	}
+
+	assert(PAD4(off) == size);
+
+	/* write it out and move it into place */
+	tmpfile = malloc(strlen(outfile) + 8);
+	if (tmpfile == NULL)
+	{
+		fprintf(stderr, "%s: malloc(): %s\n", progname,
+		        strerror(errno));
+		return 1;
+	}
+	sprintf(tmpfile, "%s.XXXXXX", outfile);
+
+	fd = mkstemp(tmpfile);
+	if (fd == -1)
+	{
+		fprintf(stderr, "%s: %s: mkstemp(): %s\n", progname,
+		        tmpfile, strerror(errno));
+		return 1;
+	}
+
+	for (p = map, q = map + size; p < q; p += status)
+	{
+		status = write(fd, p, q - p);
+		if (status <= 0)
+			break;
+	}
+
+	if (p < q || fchmod(fd, 0644) != 0 || fsync(fd) != 0 ||
+	    close(fd) != 0 || rename(tmpfile, outfile) != 0)
+	{
+		fprintf(stderr, "%s: %s: %s\n", progname, outfile,
+		        strerror(errno));
+		(void) unlink(tmpfile);
+		return 1;
+	}
+
+	if (verbose > 0)
+	{
+		fprintf(stderr,
+		        "%s: %u record(s), %u key(s), %u bucket(s), %lu byte(s)\n",
+		        progname, nents, nkeys, nbuckets, (unsigned long) size);
+	}
+
+	return 0;
+}
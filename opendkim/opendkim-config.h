@@ -37,6 +37,9 @@ struct configdef dkimf_config[] =
 	{ "AutoRestartRate",		CONFIG_TYPE_STRING,	FALSE },
 	{ "Background",			CONFIG_TYPE_BOOLEAN,	FALSE },
 	{ "BaseDirectory",		CONFIG_TYPE_STRING,	FALSE },
+#if defined(USE_DB) && defined(_FFR_BDB_SNAPSHOT)
+	{ "BerkeleyDBSnapshots",	CONFIG_TYPE_BOOLEAN,	FALSE },
+#endif /* defined(USE_DB) && defined(_FFR_BDB_SNAPSHOT) */
 	{ "BodyLengthDB",		CONFIG_TYPE_STRING,	FALSE },
 #ifdef USE_UNBOUND
 	{ "BogusKey",			CONFIG_TYPE_STRING,	FALSE },
@@ -45,6 +48,30 @@ struct configdef dkimf_config[] =
 	{ "CaptureUnknownErrors",	CONFIG_TYPE_BOOLEAN,	FALSE },
 	{ "ChangeRootDirectory",	CONFIG_TYPE_STRING,	FALSE },
 	{ "ClockDrift",			CONFIG_TYPE_INTEGER,	FALSE },
+#ifdef _FFR_DB_SHARED_POOLS
+	{ "DatabasePoolIdleTime",	CONFIG_TYPE_STRING,	FALSE },
+	{ "DatabasePoolSize",		CONFIG_TYPE_STRING,	FALSE },
+	{ "DatabaseReconnectBackoff",	CONFIG_TYPE_STRING,	FALSE },
+#endif /* _FFR_DB_SHARED_POOLS */
+#ifdef _FFR_DB_AUTORELOAD
+	{ "DatasetAutoReload",		CONFIG_TYPE_BOOLEAN,	FALSE },
+#endif /* _FFR_DB_AUTORELOAD */
+#ifdef _FFR_DB_BREAKER
+	{ "DatasetBreaker",		CONFIG_TYPE_STRING,	FALSE },
+	{ "DatasetBreakerRetry",	CONFIG_TYPE_INTEGER,	FALSE },
+	{ "DatasetBreakerSlowQuery",	CONFIG_TYPE_INTEGER,	FALSE },
+	{ "DatasetBreakerThreshold",	CONFIG_TYPE_INTEGER,	FALSE },
+#endif /* _FFR_DB_BREAKER */
+#ifdef _FFR_DB_CACHE
+	{ "DatasetCache",		CONFIG_TYPE_STRING,	FALSE },
+	{ "DatasetCacheNegativeTTL",	CONFIG_TYPE_INTEGER,	FALSE },
+	{ "DatasetCacheSize",		CONFIG_TYPE_INTEGER,	FALSE },
+	{ "DatasetCacheTTL",		CONFIG_TYPE_INTEGER,	FALSE },
+#endif /* _FFR_DB_CACHE */
+#ifdef _FFR_DB_WRITEBEHIND
+	{ "DatasetWriteBehind",		CONFIG_TYPE_INTEGER,	FALSE },
+	{ "DatasetWriteBehindSize",	CONFIG_TYPE_INTEGER,	FALSE },
+#endif /* _FFR_DB_WRITEBEHIND */
 #ifdef _FFR_DEFAULT_SENDER
 	{ "DefaultSender",		CONFIG_TYPE_STRING,	FALSE },
 #endif /* _FFR_DEFAULT_SENDER */
@@ -68,6 +95,9 @@ struct configdef dkimf_config[] =
 	{ "FlowDataFactor",		CONFIG_TYPE_INTEGER,	FALSE },
 	{ "FlowDataTTL",		CONFIG_TYPE_INTEGER,	FALSE },
 #endif /* _FFR_RATE_LIMIT */
+#ifdef _FFR_HANDLE_POOL
+	{ "HandlePoolSize",		CONFIG_TYPE_INTEGER,	FALSE },
+#endif /* _FFR_HANDLE_POOL */
 #ifdef _FFR_IDENTITY_HEADER
 	{ "IdentityHeader",		CONFIG_TYPE_STRING,     FALSE },
 	{ "IdentityHeaderRemove",	CONFIG_TYPE_BOOLEAN,    FALSE },
@@ -78,6 +108,9 @@ struct configdef dkimf_config[] =
 	{ "KeepAuthResults",		CONFIG_TYPE_BOOLEAN,	FALSE },
 	{ "KeepTemporaryFiles",		CONFIG_TYPE_BOOLEAN,	FALSE },
 	{ "KeyFile",			CONFIG_TYPE_STRING,	FALSE },
+#ifdef _FFR_KEYSTORE
+	{ "KeyStore",			CONFIG_TYPE_BOOLEAN,	FALSE },
+#endif /* _FFR_KEYSTORE */
 	{ "KeyTable",			CONFIG_TYPE_STRING,	FALSE },
 #ifdef USE_LDAP
 	{ "LDAPAuthMechanism",		CONFIG_TYPE_STRING,	FALSE },
@@ -88,6 +121,9 @@ struct configdef dkimf_config[] =
 # endif /* USE_SASL */
 	{ "LDAPBindPassword",		CONFIG_TYPE_STRING,	FALSE },
 	{ "LDAPBindUser",		CONFIG_TYPE_STRING,	FALSE },
+# ifdef _FFR_LDAP_ASYNC
+	{ "LDAPConnections",		CONFIG_TYPE_STRING,	FALSE },
+# endif /* _FFR_LDAP_ASYNC */
 	{ "LDAPDisableCache",		CONFIG_TYPE_BOOLEAN,	FALSE },
 	{ "LDAPKeepaliveIdle",		CONFIG_TYPE_STRING,	FALSE },
 	{ "LDAPKeepaliveInterval",	CONFIG_TYPE_STRING,	FALSE },
@@ -95,15 +131,27 @@ struct configdef dkimf_config[] =
 	{ "LDAPTimeout",		CONFIG_TYPE_STRING,	FALSE },
 	{ "LDAPUseTLS",			CONFIG_TYPE_BOOLEAN,	FALSE },
 #endif /* USE_LDAP */
+	{ "LibraryArenaSize",		CONFIG_TYPE_INTEGER,	FALSE },
+#ifdef _FFR_LOG_QUEUE
+	{ "LogQueue",			CONFIG_TYPE_INTEGER,	FALSE },
+	{ "LogQueueFile",		CONFIG_TYPE_STRING,	FALSE },
+#endif /* _FFR_LOG_QUEUE */
 	{ "LogResults",			CONFIG_TYPE_BOOLEAN,	FALSE },
 	{ "LogWhy",			CONFIG_TYPE_BOOLEAN,	FALSE },
 #ifdef _FFR_LUA_ONLY_SIGNING
 	{ "LuaOnlySigning",		CONFIG_TYPE_BOOLEAN,	FALSE },
 #endif /* _FFR_LUA_ONLY_SIGNING */
+#ifdef _FFR_LUA_STATE_POOLS
+	{ "LuaStatePoolSize",		CONFIG_TYPE_INTEGER,	FALSE },
+	{ "LuaStateRecycle",		CONFIG_TYPE_INTEGER,	FALSE },
+#endif /* _FFR_LUA_STATE_POOLS */
 	{ "MaximumHeaders",		CONFIG_TYPE_INTEGER,	FALSE },
 	{ "MaximumSignedBytes",		CONFIG_TYPE_INTEGER,	FALSE },
 	{ "MaximumSignaturesToVerify",	CONFIG_TYPE_INTEGER,	FALSE },
 	{ "MacroList",			CONFIG_TYPE_STRING,	FALSE },
+#ifdef _FFR_METRICS
+	{ "MetricsSocket",		CONFIG_TYPE_STRING,	FALSE },
+#endif /* _FFR_METRICS */
 	{ "MilterDebug",		CONFIG_TYPE_INTEGER,	FALSE },
 	{ "Minimum",			CONFIG_TYPE_STRING,	FALSE },
 	{ "MinimumKeyBits",		CONFIG_TYPE_INTEGER,	FALSE },
@@ -201,12 +249,18 @@ struct configdef dkimf_config[] =
 	{ "SMTPURI",			CONFIG_TYPE_STRING,	FALSE },
 #endif /* HAVE_CURL_EASY_STRERROR */
 	{ "Socket",			CONFIG_TYPE_STRING,	FALSE },
+#ifdef _FFR_SOCKETDB
+	{ "SocketDatasetConnections",	CONFIG_TYPE_INTEGER,	FALSE },
+	{ "SocketDatasetPipelining",	CONFIG_TYPE_BOOLEAN,	FALSE },
+#endif /* _FFR_SOCKETDB */
 	{ "SoftwareHeader",		CONFIG_TYPE_BOOLEAN,	FALSE },
 #if defined(USE_ODBX) || defined(USE_LDAP)
 	{ "SoftStart",			CONFIG_TYPE_BOOLEAN,	FALSE },
 #endif /* defined(USE_ODBX) || defined(USE_LDAP) */
 #ifdef _FFR_STATS
 	{ "Statistics",			CONFIG_TYPE_STRING,	FALSE },
+	{ "StatisticsAggregate",	CONFIG_TYPE_INTEGER,	FALSE },
+	{ "StatisticsFormat",		CONFIG_TYPE_STRING,	FALSE },
 	{ "StatisticsName",		CONFIG_TYPE_STRING,	FALSE },
 # ifdef USE_LUA
 #  ifdef _FFR_STATSEXT
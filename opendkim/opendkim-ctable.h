@@ -0,0 +1,76 @@
+/*
+**  Copyright (c) 2015, The Trusted Domain Project.  All rights reserved.
+*/
+
+#ifndef _OPENDKIM_CTABLE_H_
+#define _OPENDKIM_CTABLE_H_
+
+#include "build-config.h"
+
+/* system includes */
+#include <sys/types.h>
+#include <stdint.h>
+
+/*
+**  Compiled table file layout.  All integers are in host byte order and
+**  all offsets are from the start of the file.  opendkim-compiletables(8)
+**  writes these; the "ctable" data set type maps them read-only.
+**
+**  header
+**  disp[nbuckets]	per-bucket hash seed, or a slot number for buckets
+**  			holding a single key (DKIMF_CTABLE_DIRECT set)
+**  slots[nkeys]	one per distinct key (compared case-insensitively),
+**  			naming a run of consecutive records
+**  recs[nrecs]		records, in source order within each run
+**  order[nrecs]	record numbers in source order, for walking the
+**  			table
+**  strings		keys and values, NUL-terminated, each value followed
+**  			by the offsets of its colon-separated fields
+**
+**  With h(seed) being dkimf_ctable_hash() of the key, a key's bucket is
+**  h(salt) % nbuckets.  Its slot is taken from disp[] directly if
+**  DKIMF_CTABLE_DIRECT is set there, or is h(salt + 1 + disp) % nkeys
+**  otherwise.  Every key in the table lands in a different slot; keys not
+**  in the table land in an arbitrary one, so the record keys must still be
+**  compared.
+*/
+
+#define	DKIMF_CTABLE_MAGIC	"ODKIMCT1"
+#define	DKIMF_CTABLE_VERSION	2
+#define	DKIMF_CTABLE_BOM	0x01020304
+#define	DKIMF_CTABLE_DIRECT	0x80000000
+#define	DKIMF_CTABLE_PERBUCKET	4
+
+struct dkimf_ctable_hdr
+{
+	char		ch_magic[8];		/* DKIMF_CTABLE_MAGIC */
+	uint32_t	ch_version;		/* DKIMF_CTABLE_VERSION */
+	uint32_t	ch_bom;			/* DKIMF_CTABLE_BOM */
+	uint32_t	ch_size;		/* file size */
+	uint32_t	ch_salt;		/* bucket hash seed */
+	uint32_t	ch_nbuckets;		/* hash buckets */
+	uint32_t	ch_nkeys;		/* distinct keys (slots) */
+	uint32_t	ch_nrecs;		/* records */
+	uint32_t	ch_disp;		/* offset of disp[] */
+	uint32_t	ch_slots;		/* offset of slots[] */
+	uint32_t	ch_recs;		/* offset of recs[] */
+	uint32_t	ch_order;		/* offset of order[] */
+};
+
+struct dkimf_ctable_slot
+{
+	uint32_t	cs_first;		/* first record */
+	uint32_t	cs_count;		/* records with this key */
+};
+
+struct dkimf_ctable_rec
+{
+	uint32_t	cr_key;			/* offset of key */
+	uint32_t	cr_keylen;		/* key length */
+	uint32_t	cr_value;		/* offset of value (0 if none) */
+	uint32_t	cr_vallen;		/* value length */
+	uint32_t	cr_fields;		/* offset of field offsets */
+	uint32_t	cr_nfields;		/* number of fields */
+};
+
+#endif /* _OPENDKIM_CTABLE_H_ */
@@ -59,8 +59,15 @@
 # undef USE_ODBX
 # undef USE_LUA
 # undef _FFR_SOCKETDB
+# undef _FFR_METRICS
 #endif /* OPENDKIM_DB_ONLY */
 #include "opendkim-db.h"
+#ifdef _FFR_METRICS
+# include "metrics.h"
+#endif /* _FFR_METRICS */
+#ifdef _FFR_CTABLE
+# include "opendkim-ctable.h"
+#endif /* _FFR_CTABLE */
 #ifdef USE_LUA
 # include "opendkim-lua.h"
 #endif /* USE_LUA */
@@ -69,6 +76,7 @@
 /* various DB library includes */
 #ifdef _FFR_SOCKETDB
 # include <sys/socket.h>
+# include <sys/time.h>
 # include <sys/un.h>
 # include <netinet/in.h>
 # include <arpa/inet.h>
@@ -99,6 +107,15 @@
 # include <erl_interface.h>
 # include <ei.h>
 #endif /* USE_ERLANG */
+#ifdef _FFR_CTABLE
+# include <sys/mman.h>
+# include <stdint.h>
+#endif /* _FFR_CTABLE */
+#if defined(_FFR_DB_AUTORELOAD) && defined(HAVE_SYS_INOTIFY_H)
+# include <sys/inotify.h>
+# include <poll.h>
+# include <limits.h>
+#endif /* _FFR_DB_AUTORELOAD && HAVE_SYS_INOTIFY_H */
 
 /* macros */
 #define	BUFRSZ			1024
@@ -106,16 +123,74 @@
 #ifdef _FFR_DB_HANDLE_POOLS
 # define DEFPOOLMAX		10
 #endif /* _FFR_DB_HANDLE_POOLS */
+#ifdef _FFR_DB_SHARED_POOLS
+# define DKIMF_DB_DEFBACKOFF	60
+#endif /* _FFR_DB_SHARED_POOLS */
 #define DKIMF_DB_DEFASIZE	8
+#define DKIMF_DB_MGETMAX	64
 #define DKIMF_DB_MODE		0644
+#ifdef _FFR_DSN_PREPARE
+# define DKIMF_DB_STMTNAMELEN	24
+#endif /* _FFR_DSN_PREPARE */
 #define DKIMF_LDAP_MAXURIS	8
 #define DKIMF_LDAP_DEFTIMEOUT	5
+#ifdef _FFR_LDAP_ASYNC
+# define DKIMF_LDAP_DEFCONNS	1
+#endif /* _FFR_LDAP_ASYNC */
 #ifdef _FFR_LDAP_CACHING
 # define DKIMF_LDAP_TTL		600
 #endif /* _FFR_LDAP_CACHING */
 #ifdef _FFR_SOCKETDB
 # define DKIMF_SOCKET_TIMEOUT	5
+# define DKIMF_SOCKET_CONNECTIONS 1
 #endif /* _FFR_SOCKETDB */
+#ifdef USE_MDB
+# define DKIMF_DB_MDB_MAXREADERS 1024
+#endif /* USE_MDB */
+#if defined(USE_DB) && defined(_FFR_BDB_SNAPSHOT)
+# define DKIMF_DB_SNAP_CHECKINT	1
+# define DKIMF_DB_SNAP_MINBUCKETS 64
+#endif /* USE_DB && _FFR_BDB_SNAPSHOT */
+#ifdef _FFR_DB_BREAKER
+# define DKIMF_DB_BREAKER_OPEN(db) ((db)->db_breaker != NULL && \
+				    dkimf_db_breaker_tripped((db)->db_breaker))
+# define DKIMF_DB_LOOKUP(db,b,l,r,n,e) \
+	((db)->db_breaker != NULL \
+	 ? dkimf_db_breaker_lookup((db),(b),(l),(r),(n),(e)) \
+	 : dkimf_db_lookup((db),(b),(l),(r),(n),(e)))
+# define DKIMF_DB_MGET_BATCH(db,k,c,r,n,e) \
+	((db)->db_breaker != NULL \
+	 ? dkimf_db_breaker_mget((db),(k),(c),(r),(n),(e)) \
+	 : dkimf_db_mget_batch((db),(k),(c),(r),(n),(e)))
+#else /* _FFR_DB_BREAKER */
+# define DKIMF_DB_BREAKER_OPEN(db) FALSE
+# define DKIMF_DB_LOOKUP(db,b,l,r,n,e) \
+	dkimf_db_lookup((db),(b),(l),(r),(n),(e))
+# define DKIMF_DB_MGET_BATCH(db,k,c,r,n,e) \
+	dkimf_db_mget_batch((db),(k),(c),(r),(n),(e))
+#endif /* _FFR_DB_BREAKER */
+#ifdef _FFR_DB_CACHE
+# define DKIMF_DB_CACHE_SHARDS	16
+# define DKIMF_DB_CACHE_BUCKETS	256
+# define DKIMF_DB_CACHE_MAXREQ	16
+#endif /* _FFR_DB_CACHE */
+#ifdef _FFR_DB_AUTORELOAD
+# define DKIMF_DB_RELOAD_CHECKINT 5
+# define DKIMF_DB_RELOAD_GRACE	300
+# ifdef HAVE_SYS_INOTIFY_H
+#  define DKIMF_DB_RELOAD_WATCHMASK (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | \
+				     IN_DELETE | IN_MODIFY | IN_MOVED_FROM | \
+				     IN_MOVED_TO)
+#  define DKIMF_DB_RELOAD_EVBUFSZ (16 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+# endif /* HAVE_SYS_INOTIFY_H */
+# define DKIMF_DB_HANDLE(db)	dkimf_db_reload_handle(db)
+#else /* _FFR_DB_AUTORELOAD */
+# define DKIMF_DB_HANDLE(db)	((db)->db_handle)
+#endif /* _FFR_DB_AUTORELOAD */
+#ifdef _FFR_DB_WRITEBEHIND
+# define DKIMF_DB_WB_BACKLOG	4
+# define DKIMF_DB_WB_BUCKETS	1024
+#endif /* _FFR_DB_WRITEBEHIND */
 
 #define	DKIMF_DB_IFLAG_FREEARRAY 0x01
 #define	DKIMF_DB_IFLAG_RECONNECT 0x02
@@ -180,6 +255,18 @@ struct dkimf_db
 	void *			db_cursor;	/* cursor */
 	void *			db_entry;	/* entry (context) */
 	char **			db_array;
+#ifdef _FFR_DB_BREAKER
+	struct dkimf_db_breaker * db_breaker;	/* circuit breaker */
+#endif /* _FFR_DB_BREAKER */
+#ifdef _FFR_DB_CACHE
+	struct dkimf_db_cache *	db_cache;	/* result cache */
+#endif /* _FFR_DB_CACHE */
+#ifdef _FFR_DB_AUTORELOAD
+	struct dkimf_db_reload * db_reload;	/* automatic reload state */
+#endif /* _FFR_DB_AUTORELOAD */
+#ifdef _FFR_DB_WRITEBEHIND
+	struct dkimf_db_wb *	db_wb;		/* write-behind buffer */
+#endif /* _FFR_DB_WRITEBEHIND */
 };
 
 struct dkimf_db_table
@@ -202,6 +289,203 @@ struct dkimf_db_relist
 	struct dkimf_db_relist * db_relist_next;
 };
 
+#if defined(USE_DB) && defined(_FFR_BDB_SNAPSHOT)
+struct dkimf_db_snapentry
+{
+	unsigned int		se_hash;	/* hash of key */
+	size_t			se_keylen;	/* key length */
+	size_t			se_vallen;	/* value length */
+	char *			se_key;		/* key */
+	char *			se_value;	/* value (NUL-terminated) */
+	struct dkimf_db_snapentry * se_next;	/* hash chain */
+};
+
+struct dkimf_db_snapshot
+{
+	u_int			snap_nbuckets;	/* hash table size */
+	struct dkimf_db_snapentry ** snap_buckets; /* hash table */
+};
+
+struct dkimf_db_bdbsnap
+{
+	char *			bs_path;	/* file to watch */
+	struct stat		bs_stat;	/* file as last loaded */
+	struct dkimf_db_snapshot * bs_snap;	/* current snapshot */
+	pthread_rwlock_t	bs_lock;	/* protects bs_snap */
+	struct dkimf_db_bdbsnap * bs_next;	/* next registered snapshot */
+};
+#endif /* USE_DB && _FFR_BDB_SNAPSHOT */
+
+#ifdef _FFR_CTABLE
+struct dkimf_db_ctable
+{
+	size_t			ct_size;	/* bytes mapped */
+	uint32_t		ct_cursor;	/* walk position */
+	char *			ct_map;		/* the file */
+	struct dkimf_ctable_hdr * ct_hdr;	/* header */
+	uint32_t *		ct_disp;	/* bucket seeds */
+	struct dkimf_ctable_slot * ct_slots;	/* slots */
+	struct dkimf_ctable_rec * ct_recs;	/* records */
+	uint32_t *		ct_order;	/* records in source order */
+};
+#endif /* _FFR_CTABLE */
+
+#ifdef _FFR_DB_AUTORELOAD
+struct dkimf_db_retired
+{
+	time_t			rt_when;	/* when it was replaced */
+	void *			rt_handle;	/* replaced list */
+	struct dkimf_db_retired * rt_next;	/* next retired list */
+};
+
+struct dkimf_db_reload
+{
+	int			rl_wd;		/* inotify watch descriptor */
+	int			rl_type;	/* data set type */
+	time_t			rl_dropped;	/* when it stopped being watched */
+	char *			rl_name;	/* data set name, for reopening */
+	char *			rl_path;	/* file to watch */
+	struct stat		rl_stat;	/* file as last loaded */
+	DKIMF_DB		rl_db;		/* data set */
+	struct dkimf_db_retired * rl_retired;	/* replaced lists */
+	pthread_rwlock_t	rl_lock;	/* protects db_handle, db_nrecs */
+	struct dkimf_db_reload * rl_next;	/* next watched data set */
+};
+#endif /* _FFR_DB_AUTORELOAD */
+
+#ifdef _FFR_DB_BREAKER
+struct dkimf_db_breaker
+{
+	_Bool			br_open;	/* queries are being refused */
+	_Bool			br_started;	/* prober thread started */
+	_Bool			br_stop;	/* prober should exit */
+	_Bool			br_probing;	/* probe in progress */
+	_Bool			br_orphan;	/* prober closes the handle */
+	u_int			br_threshold;	/* bad queries before tripping */
+	u_int			br_slow;	/* slow query threshold (ms) */
+	u_int			br_retry;	/* seconds between probes */
+	u_int			br_bad;		/* consecutive bad queries */
+	time_t			br_opened;	/* when it last tripped */
+	unsigned long		br_queries;	/* queries sent to the backend */
+	unsigned long		br_errors;	/* queries that failed */
+	unsigned long		br_slowq;	/* queries that were slow */
+	unsigned long		br_trips;	/* times tripped */
+	unsigned long		br_refused;	/* queries refused while open */
+	unsigned long		br_maxusec;	/* slowest query (usec) */
+	unsigned long long	br_usec;	/* total query time (usec) */
+	size_t			br_probelen;	/* length of br_probe */
+	char *			br_probe;	/* key used to probe */
+	char *			br_name;	/* name for logging */
+	pthread_t		br_thread;	/* prober thread */
+	pthread_mutex_t		br_lock;	/* protects all of the above */
+	pthread_cond_t		br_wakeup;	/* wakes the prober */
+};
+#endif /* _FFR_DB_BREAKER */
+
+#ifdef _FFR_DB_CACHE
+struct dkimf_db_cval
+{
+	unsigned int		cv_flags;	/* request flags */
+	size_t			cv_len;		/* length, or (size_t) -1 */
+	size_t			cv_off;		/* offset into ce_data */
+};
+
+struct dkimf_db_centry
+{
+	_Bool			ce_exists;	/* record was found */
+	unsigned int		ce_hash;	/* hash of key */
+	unsigned int		ce_reqnum;	/* values requested */
+	time_t			ce_expire;	/* expiration time */
+	size_t			ce_keylen;	/* key length */
+	char *			ce_key;		/* key */
+	char *			ce_data;	/* value data */
+	struct dkimf_db_cval *	ce_vals;	/* value descriptors */
+	struct dkimf_db_centry * ce_hnext;	/* hash chain */
+	struct dkimf_db_centry * ce_prev;	/* LRU list */
+	struct dkimf_db_centry * ce_next;	/* LRU list */
+};
+
+struct dkimf_db_cshard
+{
+	u_int			cs_count;	/* entries */
+	unsigned long		cs_hits;	/* cache hits */
+	unsigned long		cs_misses;	/* cache misses */
+	struct dkimf_db_centry * cs_head;	/* most recently used */
+	struct dkimf_db_centry * cs_tail;	/* least recently used */
+	struct dkimf_db_centry * cs_buckets[DKIMF_DB_CACHE_BUCKETS];
+	pthread_mutex_t		cs_lock;
+};
+
+struct dkimf_db_cache
+{
+	_Bool			cache_icase;	/* case-insensitive keys */
+	u_int			cache_ttl;	/* positive TTL */
+	u_int			cache_negttl;	/* negative TTL */
+	u_int			cache_shardmax;	/* entries per shard */
+	u_int			cache_gen;	/* bumped by each flush */
+	struct dkimf_db_cshard	cache_shards[DKIMF_DB_CACHE_SHARDS];
+};
+#endif /* _FFR_DB_CACHE */
+
+#ifdef _FFR_DB_WRITEBEHIND
+struct dkimf_db_wbent
+{
+	_Bool			we_delete;	/* pending delete */
+	unsigned int		we_hash;	/* hash of key */
+	size_t			we_keylen;	/* key length */
+	size_t			we_vallen;	/* value length */
+	char *			we_key;		/* key */
+	char *			we_val;		/* value (NUL-terminated) */
+	struct dkimf_db_wbent *	we_hnext;	/* hash chain */
+	struct dkimf_db_wbent *	we_next;	/* flush order */
+};
+
+struct dkimf_db_wbset
+{
+	u_int			ws_count;	/* entries */
+	struct dkimf_db_wbent *	ws_head;	/* oldest entry */
+	struct dkimf_db_wbent *	ws_tail;	/* newest entry */
+	struct dkimf_db_wbent *	ws_buckets[DKIMF_DB_WB_BUCKETS];
+};
+
+struct dkimf_db_wb
+{
+	_Bool			wb_started;	/* flusher thread started */
+	_Bool			wb_stop;	/* flusher should exit */
+	_Bool			wb_direct;	/* no longer buffering */
+	u_int			wb_interval;	/* flush interval (seconds) */
+	u_int			wb_max;		/* flush when this many pending */
+	unsigned long		wb_writes;	/* writes absorbed */
+	unsigned long		wb_flushed;	/* writes sent to the backend */
+	unsigned long		wb_errors;	/* backend write failures */
+	pthread_t		wb_thread;	/* flusher thread */
+	pthread_mutex_t		wb_lock;	/* protects all of the above */
+	pthread_cond_t		wb_wakeup;	/* wakes the flusher */
+	pthread_cond_t		wb_done;	/* a flush completed */
+	struct dkimf_db_wbset *	wb_pending;	/* accepting writes */
+	struct dkimf_db_wbset *	wb_flushing;	/* being written out */
+};
+#endif /* _FFR_DB_WRITEBEHIND */
+
+#ifdef _FFR_DB_SHARED_POOLS
+struct dkimf_db_backoff
+{
+	u_int			bo_delay;	/* current delay (seconds) */
+	time_t			bo_until;	/* no attempts before this */
+};
+
+# if defined(USE_LDAP) || defined(USE_ODBX)
+struct dkimf_db_shpool
+{
+	u_int			sp_type;	/* DKIMF_DB_TYPE_* */
+	u_int			sp_refcnt;	/* data sets using the pool */
+	char *			sp_key;		/* connection parameters */
+	void *			sp_pool;	/* the pool */
+	struct dkimf_db_shpool * sp_next;	/* next pool */
+};
+# endif /* USE_LDAP || USE_ODBX */
+#endif /* _FFR_DB_SHARED_POOLS */
+
 #ifdef USE_ODBX
 struct dkimf_db_dsn
 {
@@ -215,10 +499,60 @@ struct dkimf_db_dsn
 	char			dsn_table[BUFRSZ];
 	char			dsn_user[BUFRSZ];
 	const char *		dsn_filter;
+# ifdef _FFR_DSN_PREPARE
+	char			dsn_stmt[DKIMF_DB_STMTNAMELEN];
+# endif /* _FFR_DSN_PREPARE */
+};
+
+# ifdef _FFR_DSN_PREPARE
+struct dkimf_db_sqlstmt
+{
+	_Bool			ss_ok;		/* prepared successfully */
+	odbx_t *		ss_odbx;	/* connection */
+	char			ss_name[DKIMF_DB_STMTNAMELEN]; /* statement */
+	char *			ss_text;	/* statement text */
+	struct dkimf_db_sqlstmt * ss_next;	/* next statement */
 };
+# endif /* _FFR_DSN_PREPARE */
 #endif /* USE_ODBX */
 
 #ifdef USE_LDAP
+# ifdef _FFR_LDAP_ASYNC
+struct dkimf_db_ldapreq
+{
+	_Bool			lr_done;	/* result received or failed */
+	int			lr_msgid;	/* message ID of the search */
+	int			lr_status;	/* LDAP_* result code */
+	LDAPMessage *		lr_result;	/* result chain (returned) */
+	pthread_cond_t		lr_cond;	/* signalled when done */
+	struct dkimf_db_ldapreq * lr_next;	/* next pending search */
+};
+
+struct dkimf_db_ldapconn
+{
+	_Bool			lc_connecting;	/* being opened; keep away */
+	_Bool			lc_dead;	/* failed; unbind when unused */
+	_Bool			lc_reading;	/* someone is collecting results */
+	u_int			lc_users;	/* searches using this connection */
+#  ifdef _FFR_DB_SHARED_POOLS
+	time_t			lc_used;	/* when last used */
+#  endif /* _FFR_DB_SHARED_POOLS */
+	LDAP *			lc_ld;		/* handle, or NULL */
+	struct dkimf_db_ldapreq * lc_pending;	/* searches awaiting results */
+};
+
+struct dkimf_db_ldappool
+{
+	u_int			lp_nconns;	/* connection slots */
+#  ifdef _FFR_DB_SHARED_POOLS
+	u_int			lp_idle;	/* idle time limit */
+	struct dkimf_db_backoff	lp_backoff;	/* reconnect backoff */
+#  endif /* _FFR_DB_SHARED_POOLS */
+	pthread_mutex_t		lp_lock;	/* protects everything here */
+	struct dkimf_db_ldapconn * lp_conns;	/* connections */
+};
+# endif /* _FFR_LDAP_ASYNC */
+
 struct dkimf_db_ldap
 {
 	int			ldap_timeout;
@@ -230,6 +564,9 @@ struct dkimf_db_ldap
 #  endif /* USE_DB */
 # endif /* _FFR_LDAP_CACHING */
 	pthread_mutex_t		ldap_lock;
+# ifdef _FFR_LDAP_ASYNC
+	struct dkimf_db_ldappool * ldap_pool;	/* connection pool */
+# endif /* _FFR_LDAP_ASYNC */
 };
 
 # ifdef _FFR_LDAP_CACHING
@@ -258,23 +595,68 @@ struct dkimf_db_lua
 	char *			lua_script;
 	size_t			lua_scriptlen;
 	char *			lua_error;
+# ifdef _FFR_LUA_STATE_POOLS
+	struct dkimf_lua_pool *	lua_pool;
+# endif /* _FFR_LUA_STATE_POOLS */
 };
 #endif /* USE_LUA */
 
 #ifdef _FFR_SOCKETDB
+struct dkimf_db_sockreq
+{
+	_Bool			sr_done;	/* reply received or failed */
+	int			sr_status;	/* errno value on failure */
+	u_int			sr_id;		/* request ID */
+	struct dkimf_dstring *	sr_reply;	/* reply (returned) */
+	pthread_cond_t		sr_cond;	/* signalled when done */
+	struct dkimf_db_sockreq * sr_next;	/* next pending request */
+};
+
+struct dkimf_db_sockconn
+{
+	_Bool			sc_busy;	/* in use (unpipelined) */
+	_Bool			sc_reading;	/* someone is reading replies */
+	_Bool			sc_connecting;	/* someone is connecting it */
+	_Bool			sc_dead;	/* failed; close when unused */
+	int			sc_fd;		/* descriptor, or -1 */
+	u_int			sc_nextid;	/* next request ID */
+	u_int			sc_writers;	/* threads sending requests */
+	struct dkimf_dstring *	sc_buf;		/* partial reply line */
+	struct dkimf_db_sockreq * sc_pending;	/* requests awaiting replies */
+	pthread_mutex_t		sc_wlock;	/* one request on the wire */
+};
+
 struct dkimf_db_socket
 {
-	int			sockdb_fd;
-	struct dkimf_dstring *	sockdb_buf;
+	_Bool			sockdb_pipeline; /* use request IDs */
+	u_int			sockdb_nconns;	/* connection slots */
+	u_int			sockdb_next;	/* next slot (pipelined) */
+	socklen_t		sockdb_addrlen;	/* peer address length */
+	struct sockaddr_storage	sockdb_addr;	/* peer address */
+	pthread_mutex_t		sockdb_lock;	/* protects all of the above */
+	pthread_cond_t		sockdb_cond;	/* a connection came free */
+						/* or finished connecting */
+	struct dkimf_db_sockconn * sockdb_conns; /* connections */
 };
 #endif /* _FFR_SOCKETDB */
 
 #ifdef USE_MDB
+struct dkimf_db_mdbtxn
+{
+	MDB_txn *		mt_txn;		/* read transaction */
+	struct dkimf_db_mdb *	mt_mdb;		/* owning environment */
+	struct dkimf_db_mdbtxn * mt_prev;	/* previous in list */
+	struct dkimf_db_mdbtxn * mt_next;	/* next in list */
+};
+
 struct dkimf_db_mdb
 {
 	MDB_env *		mdb_env;
-	MDB_txn *		mdb_txn;
+	MDB_txn *		mdb_txn;	/* transaction for walks */
 	MDB_dbi			mdb_dbi;
+	pthread_key_t		mdb_key;	/* per-thread read transaction */
+	pthread_mutex_t		mdb_lock;	/* protects mdb_txns */
+	struct dkimf_db_mdbtxn * mdb_txns;	/* all read transactions */
 };
 #endif /* USE_MDB */
 
@@ -323,10 +705,24 @@ struct dkimf_db_table dbtypes[] =
 #ifdef USE_ERLANG
 	{ "erlang",		DKIMF_DB_TYPE_ERLANG },
 #endif /* USE_ERLANG */
+#ifdef _FFR_CTABLE
+	{ "ctable",		DKIMF_DB_TYPE_CTABLE },
+#endif /* _FFR_CTABLE */
 	{ NULL,			DKIMF_DB_TYPE_UNKNOWN },
 };
 
 static char *dkimf_db_ldap_param[DKIMF_LDAP_PARAM_MAX + 1];
+static u_int dkimf_db_socket_param[DKIMF_SOCKET_PARAM_MAX + 1];
+static char *dkimf_db_pool_param[DKIMF_POOL_PARAM_MAX + 1];
+#if defined(USE_LUA) && defined(_FFR_LUA_STATE_POOLS)
+static u_int dkimf_db_lua_param[DKIMF_LUA_PARAM_MAX + 1] =
+{
+	DKIMF_LUA_DEFSTATES,
+	DKIMF_LUA_DEFRECYCLE
+};
+#else /* USE_LUA && _FFR_LUA_STATE_POOLS */
+static u_int dkimf_db_lua_param[DKIMF_LUA_PARAM_MAX + 1];
+#endif /* USE_LUA && _FFR_LUA_STATE_POOLS */
 
 #ifdef _FFR_DB_HANDLE_POOLS
 struct handle_pool
@@ -338,6 +734,11 @@ struct handle_pool
 	u_int		hp_count;
 	void *		hp_hdata;
 	void **		hp_handles;
+# ifdef _FFR_DB_SHARED_POOLS
+	u_int		hp_idle;
+	time_t *	hp_stamps;
+	struct dkimf_db_backoff hp_backoff;
+# endif /* _FFR_DB_SHARED_POOLS */
 	pthread_mutex_t	hp_lock;
 	pthread_cond_t	hp_signal;
 };
@@ -345,915 +746,5514 @@ struct handle_pool
 
 /* globals */
 static unsigned int gflags = 0;
-
-#ifdef _FFR_DB_HANDLE_POOLS
+#if defined(_FFR_DB_SHARED_POOLS) && (defined(USE_LDAP) || defined(USE_ODBX))
+static pthread_mutex_t shpool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dkimf_db_shpool *shpools = NULL;
+#endif /* _FFR_DB_SHARED_POOLS && (USE_LDAP || USE_ODBX) */
+#if defined(USE_ODBX) && defined(_FFR_DSN_PREPARE)
+static pthread_mutex_t sqlstmt_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dkimf_db_sqlstmt *sqlstmts = NULL;
+#endif /* USE_ODBX && _FFR_DSN_PREPARE */
+#if defined(USE_DB) && defined(_FFR_BDB_SNAPSHOT)
+static _Bool snap_running = FALSE;
+static pthread_t snap_thread;
+static pthread_mutex_t snap_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dkimf_db_bdbsnap *snaps = NULL;
+#endif /* USE_DB && _FFR_BDB_SNAPSHOT */
+#ifdef _FFR_DB_AUTORELOAD
+static _Bool reload_dolog = FALSE;
+static _Bool reload_running = FALSE;
+static int reload_ifd = -1;
+static pthread_t reload_thread;
+static pthread_mutex_t reload_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dkimf_db_reload *reloads = NULL;
+static struct dkimf_db_reload *reload_dropped = NULL;
+#endif /* _FFR_DB_AUTORELOAD */
+
+/* prototypes */
+static int dkimf_db_fetch __P((DKIMF_DB, void *, size_t, DKIMF_DBDATA,
+                               unsigned int, _Bool *));
+static int dkimf_db_lookup __P((DKIMF_DB, void *, size_t, DKIMF_DBDATA,
+                                unsigned int, _Bool *));
+#if defined(USE_ODBX) && defined(_FFR_DSN_PREPARE)
+static void dkimf_db_sql_forget __P((odbx_t *));
+#endif /* USE_ODBX && _FFR_DSN_PREPARE */
+#ifdef _FFR_DB_AUTORELOAD
+static void *dkimf_db_reload_handle __P((DKIMF_DB));
+#endif /* _FFR_DB_AUTORELOAD */
+#ifdef _FFR_DB_BREAKER
+static int dkimf_db_mget_batch __P((DKIMF_DB, char **, unsigned int,
+                                    DKIMF_DBDATA, unsigned int, _Bool *));
+#endif /* _FFR_DB_BREAKER */
+#ifdef _FFR_DB_WRITEBEHIND
+static int dkimf_db_datasplit __P((char *, size_t, DKIMF_DBDATA,
+                                   unsigned int));
+static int dkimf_db_remove __P((DKIMF_DB, void *, size_t));
+static int dkimf_db_store __P((DKIMF_DB, void *, size_t, void *, size_t));
+#endif /* _FFR_DB_WRITEBEHIND */
+
+#ifdef _FFR_DB_SHARED_POOLS
 /*
-**  DKIMF_DB_HP_NEW -- create a handle pool
+**  DKIMF_DB_POOL_GETPARAM -- retrieve a numeric connection pool parameter
 **
 **  Parameters:
-**  	type -- DB type
-**  	max -- maximum pool size
-**  	hdata -- data needed to make new handles
+**  	param -- DKIMF_POOL_PARAM_* code
+**  	def -- default value
 **
 **  Return value:
-**  	Pointer to a newly-allocated handle pool, or NULL on error.
+**  	The configured value, or "def" if none was set or it isn't a number.
 */
 
-static struct handle_pool *
-dkimf_db_hp_new(u_int type, u_int max, void *hdata)
+static u_int
+dkimf_db_pool_getparam(int param, u_int def)
 {
-	struct handle_pool *new;
+	u_long val;
+	char *end;
+	char *str;
 
-	new = (struct handle_pool *) malloc(sizeof *new);
-	if (new != NULL)
-	{
-		new->hp_alloc = 0;
-		new->hp_asize = 0;
-		new->hp_count = 0;
-		new->hp_dbtype = type;
-		new->hp_handles = NULL;
-		new->hp_hdata = hdata;
-		new->hp_max = max;
-		pthread_mutex_init(&new->hp_lock, NULL);
-		pthread_cond_init(&new->hp_signal, NULL);
-	}
+	assert(param >= 0 && param <= DKIMF_POOL_PARAM_MAX);
 
-	return new;
+	str = dkimf_db_pool_param[param];
+	if (str == NULL || *str == '\0')
+		return def;
+
+	val = strtoul(str, &end, 10);
+	if (*end != '\0')
+		return def;
+
+	return (u_int) val;
 }
 
 /*
-**  DKIMF_DB_HP_FREE -- free a handle pool
+**  DKIMF_DB_BACKOFF_RESET -- record a successful connection attempt
 **
 **  Parameters:
-**  	pool -- bool to free up
+**  	bo -- backoff state
 **
 **  Return value:
 **  	None.
 */
 
 static void
-dkimf_db_hp_free(struct handle_pool *pool)
+dkimf_db_backoff_reset(struct dkimf_db_backoff *bo)
 {
-	u_int c;
-
-	assert(pool != NULL);
-
-	for (c = 0; c < pool->hp_count; c++)
-	{
-		switch (pool->hp_dbtype)
-		{
-#ifdef USE_ODBX
-		  case DKIMF_DB_TYPE_DSN:
-		  {
-			odbx_t *odbx;
-
-			odbx = (odbx_t *) pool->hp_handles[c];
-
-			(void) odbx_unbind(odbx);
-			(void) odbx_finish(odbx);
-			free(odbx);
-
-			break;
-		  }
-#endif /* USE_ODBX */
-
-		  default:
-			break;
-		}
-	}
+	assert(bo != NULL);
 
-	pthread_mutex_destroy(&pool->hp_lock);
-	pthread_cond_destroy(&pool->hp_signal);
-	free(pool->hp_handles);
-	free(pool);
+	bo->bo_delay = 0;
+	bo->bo_until = 0;
 }
 
+# if defined(USE_LDAP) || defined(USE_ODBX)
 /*
-**  DKIMF_DB_HP_GET -- get a handle from a handle pool
+**  DKIMF_DB_BACKOFF_CHECK -- see if connection attempts are suspended
 **
 **  Parameters:
-**  	pool -- pool from which to get a handle
-**  	err -- error code (returned)
+**  	bo -- backoff state
 **
 **  Return value:
-**  	A handle appropriate to the associated DB type that is not currently
-**  	in use by another thread, or NULL on error.
+**  	TRUE iff a recent failure means no new connection should be
+**  	attempted yet.
+**
+**  Notes:
+**  	Caller must hold whatever lock protects "bo".
 */
 
-static void *
-dkimf_db_hp_get(struct handle_pool *pool, int *err)
+static _Bool
+dkimf_db_backoff_check(struct dkimf_db_backoff *bo)
 {
-	void *ret;
-
-	assert(pool != NULL);
-
-	pthread_mutex_lock(&pool->hp_lock);
-
-	for (;;)
-	{
-		/* if one is available, return it */
-		if (pool->hp_count > 0)
-		{
-			ret = pool->hp_handles[0];
-
-			if (pool->hp_count > 1)
-			{
-				memmove(&pool->hp_handles[0],
-				        &pool->hp_handles[1],
-				        sizeof(void *) * (pool->hp_count - 1));
-			}
-
-			pool->hp_count--;
-
-			pthread_mutex_unlock(&pool->hp_lock);
-
-			return ret;
-		}
-
-		/* if we can allocate one, do so */
-		if (pool->hp_alloc <= pool->hp_max)
-		{
-			switch (pool->hp_dbtype)
-			{
-#ifdef USE_ODBX
-			  case DKIMF_DB_TYPE_DSN:
-			  {
-				int dberr;
-				odbx_t *odbx;
-				struct dkimf_db_dsn *dsn;
-
-				dsn = (struct dkimf_db_dsn *) pool->hp_hdata;
-
-				dberr = odbx_init(&odbx,
-				                  STRORNULL(dsn->dsn_backend),
-				                  STRORNULL(dsn->dsn_host),
-				                  STRORNULL(dsn->dsn_port));
-
-				if (dberr < 0)
-				{
-					if (err != NULL)
-						*err = dberr;
-
-					(void) odbx_finish(odbx);
-					pthread_mutex_unlock(&pool->hp_lock);
-
-					return NULL;
-				}
-
-				dberr = odbx_bind(odbx,
-				                        STRORNULL(dsn->dsn_dbase),
-				                        STRORNULL(dsn->dsn_user),
-				                        STRORNULL(dsn->dsn_password),
-				                        ODBX_BIND_SIMPLE);
-				if (dberr < 0)
-				{
-					if (err != NULL)
-						*err = dberr;
-
-					(void) odbx_finish(odbx);
-					pthread_mutex_unlock(&pool->hp_lock);
-
-					return NULL;
-				}
-
-				ret = odbx;
-
-				break;
-			  }
-#endif /* USE_ODBX */
-
-			  default:
-				assert(0);
-				break;
-			}
-
-			pool->hp_alloc++;
-
-			pthread_mutex_unlock(&pool->hp_lock);
+	assert(bo != NULL);
 
-			return ret;
-		}
-
-		/* already full; wait for one */
-		pthread_cond_wait(&pool->hp_signal, &pool->hp_lock);
-	}
+	return (bo->bo_until != 0 && time(NULL) < bo->bo_until);
 }
 
 /*
-**  DKIMF_DB_HP_DEAD -- report that a handle found in the pool was dead
+**  DKIMF_DB_BACKOFF_FAIL -- record a failed connection attempt
 **
 **  Parameters:
-**  	pool -- handle pool to be updated
+**  	bo -- backoff state
 **
 **  Return value:
 **  	None.
 **
 **  Notes:
-**  	The caller is expected to identify a dead handle and deallocate it.
+**  	Caller must hold whatever lock protects "bo".  The delay starts
+**  	at one second and doubles with each consecutive failure, up to
+**  	the configured maximum; a maximum of zero disables backoff.
 */
 
 static void
-dkimf_db_hp_dead(struct handle_pool *pool)
+dkimf_db_backoff_fail(struct dkimf_db_backoff *bo)
 {
-	assert(pool != NULL);
+	u_int max;
 
-	pthread_mutex_lock(&pool->hp_lock);
-	pool->hp_alloc--;
-	pthread_cond_signal(&pool->hp_signal);
-	pthread_mutex_unlock(&pool->hp_lock);
+	assert(bo != NULL);
+
+	max = dkimf_db_pool_getparam(DKIMF_POOL_PARAM_BACKOFF,
+	                             DKIMF_DB_DEFBACKOFF);
+
+	if (bo->bo_delay == 0)
+		bo->bo_delay = 1;
+	else
+		bo->bo_delay *= 2;
+
+	if (bo->bo_delay > max)
+		bo->bo_delay = max;
+
+	if (bo->bo_delay == 0)
+		bo->bo_until = 0;
+	else
+		bo->bo_until = time(NULL) + bo->bo_delay;
 }
 
 /*
-**  DKIMF_DB_HP_PUT -- put a handle back into a handle pool after use
+**  DKIMF_DB_SHPOOL_KEY -- build the key identifying a shared pool
 **
 **  Parameters:
-**  	pool -- pool from which to get a handle
-**  	handle -- handle being returned
+**  	parts -- connection and bind parameters (each may be NULL)
+**  	nparts -- number of entries in "parts"
 **
 **  Return value:
-**  	None.
+**  	A dstring holding the key, or NULL on error.
+**
+**  Notes:
+**  	Each parameter is prefixed with its length, so no two different
+**  	parameter lists give the same key whatever characters they contain.
 */
 
-static void
-dkimf_db_hp_put(struct handle_pool *pool, void *handle)
+static struct dkimf_dstring *
+dkimf_db_shpool_key(const char **parts, int nparts)
 {
-	assert(pool != NULL);
-	assert(handle != NULL);
+	int c;
+	char len[BUFRSZ];
+	struct dkimf_dstring *key;
 
-	pthread_mutex_lock(&pool->hp_lock);
+	assert(parts != NULL);
 
-	/* need to grow the array? */
-	if (pool->hp_asize == pool->hp_count)
-	{
-		u_int newasz;
+	key = dkimf_dstring_new(BUFRSZ, 0);
+	if (key == NULL)
+		return NULL;
 
-		if (pool->hp_asize == 0)
-		{
-			newasz = DKIMF_DB_DEFASIZE;
-			pool->hp_handles = (void **) malloc(newasz * sizeof(void *));
-			assert(pool->hp_handles != NULL);
-		}
-		else
+	for (c = 0; c < nparts; c++)
+	{
+		if (parts[c] == NULL)
 		{
-			void **newa;
-
-			newasz = pool->hp_asize * 2;
-			newa = (void **) realloc(pool->hp_handles,
-			                         newasz * sizeof(void *));
-			assert(newa != NULL);
-			pool->hp_handles = newa;
+			if (!dkimf_dstring_cat1(key, '-'))
+				break;
+			continue;
 		}
 
-		pool->hp_asize = newasz;
+		snprintf(len, sizeof len, "%lu:", (u_long) strlen(parts[c]));
+		if (!dkimf_dstring_cat(key, (u_char *) len) ||
+		    !dkimf_dstring_cat(key, (u_char *) parts[c]))
+			break;
 	}
 
-	/* append it */
-	pool->hp_handles[pool->hp_count] = handle;
-
-	/* increment the count */
-	pool->hp_count++;
-
-	/* signal any waiters */
-	pthread_cond_signal(&pool->hp_signal);
+	if (c < nparts)
+	{
+		dkimf_dstring_free(key);
+		return NULL;
+	}
 
-	/* all done */
-	pthread_mutex_unlock(&pool->hp_lock);
+	return key;
 }
 
-#endif /* _FFR_DB_HANDLE_POOLS */
-
 /*
-**  DKIMF_DB_FLAGS -- set global flags
+**  DKIMF_DB_SHPOOL_GET -- find a shared connection pool
 **
 **  Parameters:
-**  	flags -- new global flag mask
+**  	type -- data set type
+**  	parts -- connection and bind parameters the pool uses
+**  	nparts -- number of entries in "parts"
 **
 **  Return value:
-**  	None.
+**  	The pool, with a new reference taken on it, or NULL if there's
+**  	no pool for exactly those parameters yet.
 */
 
-void
-dkimf_db_flags(unsigned int flags)
+static void *
+dkimf_db_shpool_get(u_int type, const char **parts, int nparts)
 {
-	gflags = flags;
+	void *pool = NULL;
+	struct dkimf_db_shpool *sp;
+	struct dkimf_dstring *key;
+
+	key = dkimf_db_shpool_key(parts, nparts);
+	if (key == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&shpool_lock);
+
+	for (sp = shpools; sp != NULL; sp = sp->sp_next)
+	{
+		if (sp->sp_type == type &&
+		    strcmp(sp->sp_key, (char *) dkimf_dstring_get(key)) == 0)
+		{
+			sp->sp_refcnt++;
+			pool = sp->sp_pool;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&shpool_lock);
+
+	dkimf_dstring_free(key);
+
+	return pool;
 }
 
-#if (USE_SASL && USE_LDAP)
 /*
-**  DKIMF_DB_SASLINTERACT -- SASL binding interaction callback
+**  DKIMF_DB_SHPOOL_ADD -- make a connection pool available for sharing
 **
 **  Parameters:
-**  	ld -- LDAP handle (see below)
-**  	flags -- LDAP handling flags
-**  	defaults -- defaults pointer (see below)
-**  	interact -- SASL interaction object
+**  	type -- data set type
+**  	parts -- connection and bind parameters the pool uses
+**  	nparts -- number of entries in "parts"
+**  	pool -- the pool, referenced once by the caller
 **
 **  Return value:
-**  	LDAP_SUCCESS (for now)
+**  	None.
 **
 **  Notes:
-**  	If SASL requires additional parameters that OpenLDAP didn't provide
-**  	in its call, it uses a callback we have to provide to try to get them.
-**  	The layering here can get quite confusing.  "defaults" is an
-**  	application-specific handle that can point to a bunch of defaults
-**  	set elsewhere, but we don't need it here so it's ignored.  Similarly,
-**  	"ld" is not actually needed.
+**  	If this fails, the pool simply stays private to the caller.
 */
 
-static int
-dkimf_db_saslinteract(LDAP *ld, unsigned int flags, void *defaults,
-                      void *sasl_interact)
+static void
+dkimf_db_shpool_add(u_int type, const char **parts, int nparts, void *pool)
 {
-	sasl_interact_t *interact;
+	struct dkimf_db_shpool *sp;
+	struct dkimf_dstring *key;
 
-	assert(sasl_interact != NULL);
+	assert(pool != NULL);
 
-	interact = sasl_interact;
+	key = dkimf_db_shpool_key(parts, nparts);
+	if (key == NULL)
+		return;
 
-	switch (interact->id)
+	sp = (struct dkimf_db_shpool *) malloc(sizeof *sp);
+	if (sp == NULL)
 	{
-	  case SASL_CB_PASS:
-		interact->result = dkimf_db_ldap_param[DKIMF_LDAP_PARAM_BINDPW];
-		interact->len = strlen(interact->result);
-		break;
-
-	  case SASL_CB_GETREALM:
-		interact->result = dkimf_db_ldap_param[DKIMF_LDAP_PARAM_AUTHREALM];
-		interact->len = strlen(interact->result);
-		break;
-
-	  case SASL_CB_AUTHNAME:
-		interact->result = dkimf_db_ldap_param[DKIMF_LDAP_PARAM_AUTHNAME];
-		interact->len = strlen(interact->result);
-		break;
-
-	  case SASL_CB_USER:
-		interact->result = dkimf_db_ldap_param[DKIMF_LDAP_PARAM_AUTHUSER];
-		if (interact->result == NULL)
-			interact->len = 0;
-		else
-			interact->len = strlen(interact->result);
-		break;
-
-	  default:
-		interact->result = "";
-		interact->len = 0;
-		break;
+		dkimf_dstring_free(key);
+		return;
 	}
 
-	return SASL_OK;
-}
-#endif /* (USE_SASL && USE_LDAP) */
+	sp->sp_key = strdup((char *) dkimf_dstring_get(key));
+	dkimf_dstring_free(key);
+	if (sp->sp_key == NULL)
+	{
+		free(sp);
+		return;
+	}
 
-#ifdef USE_ODBX
-/*
-**  DKIMF_DB_HEXDIGIT -- convert a hex digit to decimal value
-**
-**  Parameters:
-**  	c -- input character
-**
-**  Return value:
-**  	Converted value, or 0 on error.
-*/
+	sp->sp_type = type;
+	sp->sp_refcnt = 1;
+	sp->sp_pool = pool;
 
-static int
-dkimf_db_hexdigit(int c)
-{
-	if (c >= '0' && c <= '9')
-		return c - '0';
-	else if (c >= 'A' && c <= 'F')
-		return c - 'A' + 10;
-	else if (c >= 'a' && c <= 'f')
-		return c - 'f' + 10;
-	else
-		return 0;
+	pthread_mutex_lock(&shpool_lock);
+	sp->sp_next = shpools;
+	shpools = sp;
+	pthread_mutex_unlock(&shpool_lock);
 }
-#endif /* USE_ODBX */
 
 /*
-**  DKIMF_DB_DATASPLIT -- split a database value or set of values into a
-**                        request array
+**  DKIMF_DB_SHPOOL_PUT -- drop a reference to a connection pool
 **
 **  Parameters:
-**  	buf -- data buffer
-**  	buflen -- buffer length
-**  	req -- request array
-**  	reqnum -- length of request array
+**  	pool -- the pool
 **
 **  Return value:
-**  	0 -- successful data split
-**  	-1 -- not enough elements present to fulfill the request
+**  	TRUE iff that was the last reference, in which case the caller
+**  	has to destroy the pool.
 */
 
-static int
-dkimf_db_datasplit(char *buf, size_t buflen,
-                   DKIMF_DBDATA req, unsigned int reqnum)
+static _Bool
+dkimf_db_shpool_put(void *pool)
 {
-	int ridx;
-	int ret = 0;
-	size_t clen;
-	size_t remain;
-	char *p;
-
-	assert(buf != NULL);
+	_Bool last = TRUE;
+	struct dkimf_db_shpool *sp;
+	struct dkimf_db_shpool **prev;
 
-	if (req == NULL || reqnum == 0)
-		return 0;
+	assert(pool != NULL);
 
-	p = buf;
-	remain = buflen;
+	pthread_mutex_lock(&shpool_lock);
 
-	for (ridx = 0; ridx < reqnum; ridx++)
+	for (prev = &shpools; *prev != NULL; prev = &(*prev)->sp_next)
 	{
-		if (remain <= 0)
-			break;
+		sp = *prev;
 
-		if ((req[ridx].dbdata_flags & DKIMF_DB_DATA_BINARY) != 0)
-		{
-			clen = MIN(remain, req[ridx].dbdata_buflen);
-			memcpy(req[ridx].dbdata_buffer, p, clen);
-			req[ridx].dbdata_buflen = remain;
-			remain = 0;
-		}
-		else if (ridx == reqnum - 1)
+		if (sp->sp_pool != pool)
+			continue;
+
+		sp->sp_refcnt--;
+		if (sp->sp_refcnt > 0)
 		{
-			clen = MIN(remain, req[ridx].dbdata_buflen);
-			memcpy(req[ridx].dbdata_buffer, p, clen);
-			req[ridx].dbdata_buflen = remain;
+			last = FALSE;
 		}
 		else
 		{
-			char *q;
-
-			q = strchr(p, ':');
-			if (q != NULL)
-			{
-				clen = q - p;
-				memcpy(req[ridx].dbdata_buffer, p,
-				       MIN(clen, req[ridx].dbdata_buflen));
-				req[ridx].dbdata_buflen = clen;
-				p += clen + 1;
-				remain -= (clen + 1);
-			}
-			else
-			{
-				clen = remain;
-				memcpy(req[ridx].dbdata_buffer, p,
-				       MIN(clen, req[ridx].dbdata_buflen));
-				req[ridx].dbdata_buflen = clen;
-				remain = 0;
-			}
+			*prev = sp->sp_next;
+			free(sp->sp_key);
+			free(sp);
 		}
-	}
-
-	/* mark the ones that got no data */
-	if (ridx < reqnum)
-	{
-		int c;
 
-		for (c = ridx; c < reqnum; c++)
-		{
-			if ((req[c].dbdata_flags & DKIMF_DB_DATA_OPTIONAL) == 0)
-				ret = -1;
-			req[c].dbdata_buflen = (size_t) -1;
-		}
+		break;
 	}
 
-        return ret;
-}
-
-#ifdef USE_LDAP
-# define ISRFC2254CHR(q)	((q) == 0x2a ||	\
-				 (q) == 0x28 || \
-				 (q) == 0x29 || \
-				 (q) == 0x5c || \
-				 (q) == 0x00)
+	pthread_mutex_unlock(&shpool_lock);
 
-# define ADDRFC2254CHR(x, y, z)	{ \
-					*(x)++ = '\\'; \
-					if ((y) > (x)) \
-					{ \
-						(x) += snprintf((x), \
-						                (y) - (x), \
-						                "%02x", \
-						                (z)); \
-					} \
-				}
+	return last;
+}
+# endif /* USE_LDAP || USE_ODBX */
+#endif /* _FFR_DB_SHARED_POOLS */
 
+#ifdef _FFR_DB_HANDLE_POOLS
 /*
-**  DKIMF_DB_MKLDAPQUERY -- generate an LDAP query
+**  DKIMF_DB_HP_NEW -- create a handle pool
 **
 **  Parameters:
-**  	buf -- parameter (the actual query)
-**  	query -- query string (a domain name?)
-**  	out -- outbut buffer
-**  	outlen -- size of "out"
+**  	type -- DB type
+**  	max -- maximum pool size
+**  	hdata -- data needed to make new handles
 **
 **  Return value:
-**  	None.
-**
-**  Notes:
-**  	Expands "$d" and "$D" as defined in opendkim.conf(5).
-** 
-**  	Should report overflows.
+**  	Pointer to a newly-allocated handle pool, or NULL on error.
 */
 
-static void
-dkimf_db_mkldapquery(char *buf, char *query, _Bool raw,
-                     char *out, size_t outlen)
+static struct handle_pool *
+dkimf_db_hp_new(u_int type, u_int max, void *hdata)
 {
-	char last = '\0';
-	char *p;
-	char *o;
-	char *q;
-	char *pend;
-	char *oend;
-	char *qend;
-
-	assert(buf != NULL);
-	assert(query != NULL);
-	assert(out != NULL);
-
-	p = buf;
-	pend = p + strlen(p) - 1;
-
-	q = query;
-	qend = query + strlen(query) - 1;
-
-	o = out;
-	oend = out + outlen - 1;
+	struct handle_pool *new;
 
-	while (p <= pend && o <= oend)
+	new = (struct handle_pool *) malloc(sizeof *new);
+	if (new != NULL)
 	{
-		if (last == '$')
-		{
-			if (*p == 'd')
-			{
-				for (q = query; o <= oend && q <= qend; q++)
-				{
-					if (ISRFC2254CHR(*q) && !raw)
-					{
-						ADDRFC2254CHR(o, oend, *q);
-					}
-					else
-					{
-						*o++ = *q;
-					}
-				}
-			}
-			else if (*p == 'D')
-			{
-				for (q = query; o <= oend && q <= qend; q++)
-				{
-					if (q == query)
-					{
-						o += strlcpy(o, "dc=",
-						             oend - o);
-					}
-
-					if (*q == '.')
-					{
-						o += strlcpy(o, ",dc=",
-						             oend - o);
-					}
-					else if (ISRFC2254CHR(*q))
-					{
-						ADDRFC2254CHR(o, oend, *q);
-					}
-					else
-					{
-						*o++ = *q;
-					}
-				}
-			}
-			else
-			{
-				*q++ = *p;
-			}
-		}
-		else if (*p != '$')
-		{
-			*o++ = *p;
-		}
-
-		last = *p;
-		p++;
+		new->hp_alloc = 0;
+		new->hp_asize = 0;
+		new->hp_count = 0;
+		new->hp_dbtype = type;
+		new->hp_handles = NULL;
+		new->hp_hdata = hdata;
+		new->hp_max = max;
+# ifdef _FFR_DB_SHARED_POOLS
+		new->hp_idle = dkimf_db_pool_getparam(DKIMF_POOL_PARAM_IDLETIME,
+		                                      0);
+		new->hp_stamps = NULL;
+		dkimf_db_backoff_reset(&new->hp_backoff);
+# endif /* _FFR_DB_SHARED_POOLS */
+		pthread_mutex_init(&new->hp_lock, NULL);
+		pthread_cond_init(&new->hp_signal, NULL);
 	}
+
+	return new;
 }
-#endif /* USE_LDAP */
 
-#ifdef USE_ODBX
 /*
-**  DKIMF_DB_NEXTPUNCT -- find next punctuation
+**  DKIMF_DB_HP_CLOSE -- close a handle belonging to a handle pool
 **
 **  Parameters:
-**  	str -- start of the search
+**  	pool -- pool the handle came from
+**  	handle -- handle to close
 **
 **  Return value:
-**  	Pointer to the next punctuation found, or NULL if none.
+**  	None.
 */
 
-static char *
-dkimf_db_nextpunct(char *str)
+static void
+dkimf_db_hp_close(struct handle_pool *pool, void *handle)
 {
-	char *p;
-
-	assert(str != NULL);
+	assert(pool != NULL);
+	assert(handle != NULL);
 
-	for (p = str; *p != '\0'; p++)
+	switch (pool->hp_dbtype)
 	{
-		if (*p == ':' ||
-		    *p == '/' ||
-		    *p == '@' ||
-		    *p == '+' ||
-		    *p == '=' ||
-		    *p == '?')
-			return p;
-	}
-
-	return NULL;
-}
-#endif /* USE_ODBX */
+#ifdef USE_ODBX
+	  case DKIMF_DB_TYPE_DSN:
+	  {
+		odbx_t *odbx;
 
-/*
-**  DKIMF_DB_LIST_FREE -- destroy a linked list
-**
-**  Parameters:
-**  	list -- list handle
-**
-**  Return value:
-**  	None.
-*/
+		odbx = (odbx_t *) handle;
 
-static void
-dkimf_db_list_free(struct dkimf_db_list *list)
-{
-	struct dkimf_db_list *next;
+# ifdef _FFR_DSN_PREPARE
+		dkimf_db_sql_forget(odbx);
+# endif /* _FFR_DSN_PREPARE */
+		(void) odbx_unbind(odbx);
+		(void) odbx_finish(odbx);
+		free(odbx);
 
-	assert(list != NULL);
+		break;
+	  }
+#endif /* USE_ODBX */
 
-	while (list != NULL)
-	{
-		free(list->db_list_key);
-		if (list->db_list_value != NULL)
-			free(list->db_list_value);
-		next = list->db_list_next;
-		free(list);
-		list = next;
+	  default:
+		break;
 	}
 }
-		
+
 /*
-**  DKIMF_DB_RELIST_FREE -- destroy a linked regex list
+**  DKIMF_DB_HP_FREE -- free a handle pool
 **
 **  Parameters:
-**  	list -- list handle
+**  	pool -- bool to free up
 **
 **  Return value:
 **  	None.
 */
 
 static void
-dkimf_db_relist_free(struct dkimf_db_relist *list)
+dkimf_db_hp_free(struct handle_pool *pool)
 {
-	struct dkimf_db_relist *next;
+	u_int c;
 
-	assert(list != NULL);
+	assert(pool != NULL);
 
-	while (list != NULL)
-	{
-		regfree(&list->db_relist_re);
-		if (list->db_relist_data != NULL)
-			free(list->db_relist_data);
-		next = list->db_relist_next;
-		free(list);
-		list = next;
-	}
+	for (c = 0; c < pool->hp_count; c++)
+		dkimf_db_hp_close(pool, pool->hp_handles[c]);
+
+	pthread_mutex_destroy(&pool->hp_lock);
+	pthread_cond_destroy(&pool->hp_signal);
+	free(pool->hp_handles);
+# ifdef _FFR_DB_SHARED_POOLS
+	free(pool->hp_stamps);
+# endif /* _FFR_DB_SHARED_POOLS */
+	free(pool);
 }
 
-#ifdef USE_LDAP
 /*
-**  DKIMF_DB_OPEN_LDAP -- attempt to contact an LDAP server
+**  DKIMF_DB_HP_GET -- get a handle from a handle pool
 **
 **  Parameters:
-**  	ld -- LDAP handle (updated on success)
-**  	ldap -- local LDAP data
+**  	pool -- pool from which to get a handle
+**  	err -- error code (returned)
 **
 **  Return value:
-**  	An LDAP_* constant.
+**  	A handle appropriate to the associated DB type that is not currently
+**  	in use by another thread, or NULL on error.
+**
+**  Notes:
+**  	With shared pools, handles that sat unused for longer than the
+**  	configured idle time are closed rather than handed out, and no new
+**  	handle is attempted while backing off after a failed one.
 */
 
-int
-dkimf_db_open_ldap(LDAP **ld, struct dkimf_db_ldap *ldap, char **err)
+static void *
+dkimf_db_hp_get(struct handle_pool *pool, int *err)
 {
-	int v = LDAP_VERSION3;
-	int n;
-	int lderr;
-	char *q;
-	char *r;
-	char *u;
-	struct timeval timeout;
+	void *ret;
+# ifdef _FFR_DB_SHARED_POOLS
+	time_t stamp;
+# endif /* _FFR_DB_SHARED_POOLS */
 
-	assert(ld != NULL);
-	assert(ldap != NULL);
+	assert(pool != NULL);
 
-	/* create LDAP handle */
-	lderr = ldap_initialize(ld, ldap->ldap_urilist);
-	if (lderr != LDAP_SUCCESS)
-	{
-		if (err != NULL)
-			*err = ldap_err2string(lderr);
-		return lderr;
-	}
+	pthread_mutex_lock(&pool->hp_lock);
 
-	/* set LDAP version */
-	lderr = ldap_set_option(*ld, LDAP_OPT_PROTOCOL_VERSION, &v);
-	if (lderr != LDAP_OPT_SUCCESS)
+	for (;;)
 	{
-		if (err != NULL)
-			*err = ldap_err2string(lderr);
-		ldap_unbind_ext(*ld, NULL, NULL);
-		*ld = NULL;
-		return lderr;
-	}
+		/* if one is available, return it */
+		if (pool->hp_count > 0)
+		{
+			ret = pool->hp_handles[0];
+# ifdef _FFR_DB_SHARED_POOLS
+			stamp = pool->hp_stamps[0];
+# endif /* _FFR_DB_SHARED_POOLS */
 
-	/* enable auto-restarts */
-	lderr = ldap_set_option(*ld, LDAP_OPT_RESTART, LDAP_OPT_ON);
-	if (lderr != LDAP_OPT_SUCCESS)
-	{
-		if (err != NULL)
-			*err = ldap_err2string(lderr);
-		ldap_unbind_ext(*ld, NULL, NULL);
-		*ld = NULL;
-		return lderr;
-	}
+			if (pool->hp_count > 1)
+			{
+				memmove(&pool->hp_handles[0],
+				        &pool->hp_handles[1],
+				        sizeof(void *) * (pool->hp_count - 1));
+# ifdef _FFR_DB_SHARED_POOLS
+				memmove(&pool->hp_stamps[0],
+				        &pool->hp_stamps[1],
+				        sizeof(time_t) * (pool->hp_count - 1));
+# endif /* _FFR_DB_SHARED_POOLS */
+			}
 
-	/* request timeouts */
-	q = dkimf_db_ldap_param[DKIMF_LDAP_PARAM_TIMEOUT];
-	timeout.tv_sec = DKIMF_LDAP_DEFTIMEOUT;
-	timeout.tv_usec = 0;
-	if (q != NULL)
-	{
-		errno = 0;
-		timeout.tv_sec = strtoul(q, &r, 10);
-		if (errno == ERANGE)
-			timeout.tv_sec = DKIMF_LDAP_DEFTIMEOUT;
-	}
+			pool->hp_count--;
 
-	lderr = ldap_set_option(*ld, LDAP_OPT_TIMEOUT, &timeout);
-	if (lderr != LDAP_OPT_SUCCESS)
-	{
-		if (err != NULL)
-			*err = ldap_err2string(lderr);
-		ldap_unbind_ext(*ld, NULL, NULL);
-		*ld = NULL;
-		return lderr;
+# ifdef _FFR_DB_SHARED_POOLS
+			if (pool->hp_idle > 0 &&
+			    time(NULL) - stamp >= pool->hp_idle)
+			{
+				dkimf_db_hp_close(pool, ret);
+				pool->hp_alloc--;
+				continue;
+			}
+# endif /* _FFR_DB_SHARED_POOLS */
+
+			pthread_mutex_unlock(&pool->hp_lock);
+
+			return ret;
+		}
+
+		/* if we can allocate one, do so */
+		if (pool->hp_alloc <= pool->hp_max)
+		{
+			switch (pool->hp_dbtype)
+			{
+#ifdef USE_ODBX
+			  case DKIMF_DB_TYPE_DSN:
+			  {
+				int dberr;
+				odbx_t *odbx;
+				struct dkimf_db_dsn *dsn;
+
+				dsn = (struct dkimf_db_dsn *) pool->hp_hdata;
+
+# ifdef _FFR_DB_SHARED_POOLS
+				if (dkimf_db_backoff_check(&pool->hp_backoff))
+				{
+					if (err != NULL)
+						*err = -ODBX_ERR_BACKEND;
+
+					pthread_mutex_unlock(&pool->hp_lock);
+
+					return NULL;
+				}
+# endif /* _FFR_DB_SHARED_POOLS */
+
+				dberr = odbx_init(&odbx,
+				                  STRORNULL(dsn->dsn_backend),
+				                  STRORNULL(dsn->dsn_host),
+				                  STRORNULL(dsn->dsn_port));
+
+				if (dberr < 0)
+				{
+					if (err != NULL)
+						*err = dberr;
+
+					(void) odbx_finish(odbx);
+# ifdef _FFR_DB_SHARED_POOLS
+					dkimf_db_backoff_fail(&pool->hp_backoff);
+# endif /* _FFR_DB_SHARED_POOLS */
+					pthread_mutex_unlock(&pool->hp_lock);
+
+					return NULL;
+				}
+
+				dberr = odbx_bind(odbx,
+				                        STRORNULL(dsn->dsn_dbase),
+				                        STRORNULL(dsn->dsn_user),
+				                        STRORNULL(dsn->dsn_password),
+				                        ODBX_BIND_SIMPLE);
+				if (dberr < 0)
+				{
+					if (err != NULL)
+						*err = dberr;
+
+					(void) odbx_finish(odbx);
+# ifdef _FFR_DB_SHARED_POOLS
+					dkimf_db_backoff_fail(&pool->hp_backoff);
+# endif /* _FFR_DB_SHARED_POOLS */
+					pthread_mutex_unlock(&pool->hp_lock);
+
+					return NULL;
+				}
+
+# ifdef _FFR_DB_SHARED_POOLS
+				dkimf_db_backoff_reset(&pool->hp_backoff);
+# endif /* _FFR_DB_SHARED_POOLS */
+
+				ret = odbx;
+
+				break;
+			  }
+#endif /* USE_ODBX */
+
+			  default:
+				assert(0);
+				break;
+			}
+
+			pool->hp_alloc++;
+
+			pthread_mutex_unlock(&pool->hp_lock);
+
+			return ret;
+		}
+
+		/* already full; wait for one */
+		pthread_cond_wait(&pool->hp_signal, &pool->hp_lock);
+	}
+}
+
+/*
+**  DKIMF_DB_HP_DEAD -- report that a handle found in the pool was dead
+**
+**  Parameters:
+**  	pool -- handle pool to be updated
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	The caller is expected to identify a dead handle and deallocate it.
+*/
+
+static void
+dkimf_db_hp_dead(struct handle_pool *pool)
+{
+	assert(pool != NULL);
+
+	pthread_mutex_lock(&pool->hp_lock);
+	pool->hp_alloc--;
+	pthread_cond_signal(&pool->hp_signal);
+	pthread_mutex_unlock(&pool->hp_lock);
+}
+
+/*
+**  DKIMF_DB_HP_PUT -- put a handle back into a handle pool after use
+**
+**  Parameters:
+**  	pool -- pool from which to get a handle
+**  	handle -- handle being returned
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_db_hp_put(struct handle_pool *pool, void *handle)
+{
+	assert(pool != NULL);
+	assert(handle != NULL);
+
+	pthread_mutex_lock(&pool->hp_lock);
+
+	/* need to grow the array? */
+	if (pool->hp_asize == pool->hp_count)
+	{
+		u_int newasz;
+
+		if (pool->hp_asize == 0)
+		{
+			newasz = DKIMF_DB_DEFASIZE;
+			pool->hp_handles = (void **) malloc(newasz * sizeof(void *));
+			assert(pool->hp_handles != NULL);
+		}
+		else
+		{
+			void **newa;
+
+			newasz = pool->hp_asize * 2;
+			newa = (void **) realloc(pool->hp_handles,
+			                         newasz * sizeof(void *));
+			assert(newa != NULL);
+			pool->hp_handles = newa;
+		}
+
+# ifdef _FFR_DB_SHARED_POOLS
+		pool->hp_stamps = (time_t *) realloc(pool->hp_stamps,
+		                                     newasz * sizeof(time_t));
+		assert(pool->hp_stamps != NULL);
+# endif /* _FFR_DB_SHARED_POOLS */
+
+		pool->hp_asize = newasz;
+	}
+
+	/* append it */
+	pool->hp_handles[pool->hp_count] = handle;
+# ifdef _FFR_DB_SHARED_POOLS
+	pool->hp_stamps[pool->hp_count] = time(NULL);
+# endif /* _FFR_DB_SHARED_POOLS */
+
+	/* increment the count */
+	pool->hp_count++;
+
+	/* signal any waiters */
+	pthread_cond_signal(&pool->hp_signal);
+
+	/* all done */
+	pthread_mutex_unlock(&pool->hp_lock);
+}
+
+#endif /* _FFR_DB_HANDLE_POOLS */
+
+#ifdef _FFR_DB_CACHE
+/*
+**  DKIMF_DB_CACHE_HASH -- hash a query for the result cache
+**
+**  Parameters:
+**  	key -- query
+**  	keylen -- bytes at "key"
+**  	icase -- ignore case?
+**
+**  Return value:
+**  	Hash of the query.
+*/
+
+static unsigned int
+dkimf_db_cache_hash(const char *key, size_t keylen, _Bool icase)
+{
+	size_t c;
+	unsigned int h = 5381;
+
+	for (c = 0; c < keylen; c++)
+	{
+		if (icase)
+			h = ((h << 5) + h) ^ tolower((unsigned char) key[c]);
+		else
+			h = ((h << 5) + h) ^ (unsigned char) key[c];
+	}
+
+	return h;
+}
+
+/*
+**  DKIMF_DB_CACHE_UNLINK -- remove an entry from its shard and free it
+**
+**  Parameters:
+**  	cs -- shard
+**  	ce -- entry
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Caller must hold the shard's lock.
+*/
+
+static void
+dkimf_db_cache_unlink(struct dkimf_db_cshard *cs, struct dkimf_db_centry *ce)
+{
+	struct dkimf_db_centry **pp;
+
+	assert(cs != NULL);
+	assert(ce != NULL);
+
+	for (pp = &cs->cs_buckets[ce->ce_hash % DKIMF_DB_CACHE_BUCKETS];
+	     *pp != NULL;
+	     pp = &(*pp)->ce_hnext)
+	{
+		if (*pp == ce)
+		{
+			*pp = ce->ce_hnext;
+			break;
+		}
+	}
+
+	if (ce->ce_prev == NULL)
+		cs->cs_head = ce->ce_next;
+	else
+		ce->ce_prev->ce_next = ce->ce_next;
+
+	if (ce->ce_next == NULL)
+		cs->cs_tail = ce->ce_prev;
+	else
+		ce->ce_next->ce_prev = ce->ce_prev;
+
+	cs->cs_count--;
+
+	free(ce);
+}
+
+/*
+**  DKIMF_DB_CACHE_FIND -- find a cached query
+**
+**  Parameters:
+**  	cache -- cache to search
+**  	key -- query
+**  	keylen -- bytes at "key"
+**  	h -- hash of the query
+**
+**  Return value:
+**  	Matching entry, or NULL if none.
+**
+**  Notes:
+**  	Caller must hold the lock of the shard selected by "h".
+*/
+
+static struct dkimf_db_centry *
+dkimf_db_cache_find(struct dkimf_db_cache *cache, const char *key,
+                    size_t keylen, unsigned int h)
+{
+	struct dkimf_db_cshard *cs;
+	struct dkimf_db_centry *ce;
+
+	cs = &cache->cache_shards[h % DKIMF_DB_CACHE_SHARDS];
+
+	for (ce = cs->cs_buckets[h % DKIMF_DB_CACHE_BUCKETS];
+	     ce != NULL;
+	     ce = ce->ce_hnext)
+	{
+		if (ce->ce_hash != h || ce->ce_keylen != keylen)
+			continue;
+
+		if (cache->cache_icase)
+		{
+			if (strncasecmp(ce->ce_key, key, keylen) == 0)
+				return ce;
+		}
+		else
+		{
+			if (memcmp(ce->ce_key, key, keylen) == 0)
+				return ce;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+**  DKIMF_DB_CACHE_GET -- answer a query from the result cache
+**
+**  Parameters:
+**  	cache -- result cache
+**  	key -- query
+**  	keylen -- bytes at "key"
+**  	req -- request array
+**  	reqnum -- length of request array
+**  	stale -- use an answer even if it has expired
+**  	exists -- whether or not the record was found (returned)
+**
+**  Return value:
+**  	TRUE iff the query was answered from the cache.
+**
+**  Notes:
+**  	A cached answer is only used for a request of the same shape
+**  	(number of values and their flags) as the one that produced it.
+**  	Expired answers are normally discarded; "stale" is set while the
+**  	backend is unavailable, when an old answer beats none.
+*/
+
+static _Bool
+dkimf_db_cache_get(struct dkimf_db_cache *cache, const char *key,
+                   size_t keylen, DKIMF_DBDATA req, unsigned int reqnum,
+                   _Bool stale, _Bool *exists)
+{
+	unsigned int c;
+	unsigned int h;
+	time_t now;
+	struct dkimf_db_cshard *cs;
+	struct dkimf_db_centry *ce;
+
+	assert(cache != NULL);
+	assert(key != NULL);
+	assert(exists != NULL);
+
+	h = dkimf_db_cache_hash(key, keylen, cache->cache_icase);
+	cs = &cache->cache_shards[h % DKIMF_DB_CACHE_SHARDS];
+
+	(void) time(&now);
+
+	pthread_mutex_lock(&cs->cs_lock);
+
+	ce = dkimf_db_cache_find(cache, key, keylen, h);
+	if (ce != NULL && ce->ce_expire <= now && !stale)
+	{
+		dkimf_db_cache_unlink(cs, ce);
+		ce = NULL;
+	}
+
+	if (ce != NULL && ce->ce_reqnum == reqnum)
+	{
+		for (c = 0; c < reqnum; c++)
+		{
+			if (ce->ce_vals[c].cv_flags != req[c].dbdata_flags)
+				break;
+		}
+
+		if (c < reqnum)
+			ce = NULL;
+	}
+	else
+	{
+		ce = NULL;
+	}
+
+	if (ce == NULL)
+	{
+		cs->cs_misses++;
+		pthread_mutex_unlock(&cs->cs_lock);
+		return FALSE;
+	}
+
+	cs->cs_hits++;
+
+	*exists = ce->ce_exists;
+
+	for (c = 0; c < reqnum; c++)
+	{
+		if (ce->ce_vals[c].cv_len != (size_t) -1)
+		{
+			memcpy(req[c].dbdata_buffer,
+			       ce->ce_data + ce->ce_vals[c].cv_off,
+			       MIN(ce->ce_vals[c].cv_len,
+			           req[c].dbdata_buflen));
+		}
+
+		req[c].dbdata_buflen = ce->ce_vals[c].cv_len;
+	}
+
+	/* move to the front */
+	if (ce->ce_prev != NULL)
+	{
+		ce->ce_prev->ce_next = ce->ce_next;
+		if (ce->ce_next == NULL)
+			cs->cs_tail = ce->ce_prev;
+		else
+			ce->ce_next->ce_prev = ce->ce_prev;
+
+		ce->ce_prev = NULL;
+		ce->ce_next = cs->cs_head;
+		cs->cs_head->ce_prev = ce;
+		cs->cs_head = ce;
+	}
+
+	pthread_mutex_unlock(&cs->cs_lock);
+
+	return TRUE;
+}
+
+/*
+**  DKIMF_DB_CACHE_GEN -- get a result cache's flush generation
+**
+**  Parameters:
+**  	cache -- result cache
+**
+**  Return value:
+**  	The current generation, to be passed to dkimf_db_cache_put().
+**
+**  Notes:
+**  	Read before asking the backend.  A flush bumps the generation
+**  	while holding every shard lock, so any one of them will do here.
+*/
+
+static u_int
+dkimf_db_cache_gen(struct dkimf_db_cache *cache)
+{
+	u_int gen;
+
+	assert(cache != NULL);
+
+	pthread_mutex_lock(&cache->cache_shards[0].cs_lock);
+	gen = cache->cache_gen;
+	pthread_mutex_unlock(&cache->cache_shards[0].cs_lock);
+
+	return gen;
+}
+
+/*
+**  DKIMF_DB_CACHE_PUT -- record the answer to a query in the result cache
+**
+**  Parameters:
+**  	cache -- result cache
+**  	gen -- generation returned by dkimf_db_cache_gen() before the
+**  	       backend was asked
+**  	key -- query
+**  	keylen -- bytes at "key"
+**  	req -- request array, as completed by the backend
+**  	reqsz -- buffer sizes in "req" before the backend was called
+**  	reqnum -- length of request array
+**  	exists -- whether or not the record was found
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Answers that were truncated to fit the caller's buffers are not
+**  	recorded, since a later caller might have more room.  Neither
+**  	are answers from before a flush, which may have come from data
+**  	that has since been replaced.  Failure to record is silent; the
+**  	caller already has its answer.
+*/
+
+static void
+dkimf_db_cache_put(struct dkimf_db_cache *cache, u_int gen, const char *key,
+                   size_t keylen, DKIMF_DBDATA req, size_t *reqsz,
+                   unsigned int reqnum, _Bool exists)
+{
+	unsigned int c;
+	unsigned int h;
+	size_t len;
+	size_t off;
+	time_t now;
+	struct dkimf_db_cshard *cs;
+	struct dkimf_db_centry *ce;
+	struct dkimf_db_centry *old;
+
+	assert(cache != NULL);
+	assert(key != NULL);
+
+	if (!exists && cache->cache_negttl == 0)
+		return;
+
+	len = sizeof *ce + keylen + reqnum * sizeof(struct dkimf_db_cval);
+	for (c = 0; c < reqnum; c++)
+	{
+		if (req[c].dbdata_buflen == (size_t) -1)
+			continue;
+
+		if (req[c].dbdata_buflen > reqsz[c])
+			return;
+
+		len += req[c].dbdata_buflen;
+	}
+
+	ce = (struct dkimf_db_centry *) malloc(len);
+	if (ce == NULL)
+		return;
+
+	memset(ce, '\0', sizeof *ce);
+
+	(void) time(&now);
+
+	h = dkimf_db_cache_hash(key, keylen, cache->cache_icase);
+
+	ce->ce_hash = h;
+	ce->ce_exists = exists;
+	ce->ce_expire = now + (exists ? cache->cache_ttl
+	                              : cache->cache_negttl);
+	ce->ce_reqnum = reqnum;
+	ce->ce_vals = (struct dkimf_db_cval *) (ce + 1);
+	ce->ce_key = (char *) (ce->ce_vals + reqnum);
+	ce->ce_keylen = keylen;
+	ce->ce_data = ce->ce_key + keylen;
+	memcpy(ce->ce_key, key, keylen);
+
+	for (c = 0, off = 0; c < reqnum; c++)
+	{
+		ce->ce_vals[c].cv_flags = req[c].dbdata_flags;
+		ce->ce_vals[c].cv_len = req[c].dbdata_buflen;
+		ce->ce_vals[c].cv_off = off;
+
+		if (req[c].dbdata_buflen != (size_t) -1)
+		{
+			memcpy(ce->ce_data + off, req[c].dbdata_buffer,
+			       req[c].dbdata_buflen);
+			off += req[c].dbdata_buflen;
+		}
+	}
+
+	cs = &cache->cache_shards[h % DKIMF_DB_CACHE_SHARDS];
+
+	pthread_mutex_lock(&cs->cs_lock);
+
+	if (cache->cache_gen != gen)
+	{
+		pthread_mutex_unlock(&cs->cs_lock);
+		free(ce);
+		return;
+	}
+
+	old = dkimf_db_cache_find(cache, key, keylen, h);
+	if (old != NULL)
+		dkimf_db_cache_unlink(cs, old);
+
+	while (cs->cs_count >= cache->cache_shardmax && cs->cs_tail != NULL)
+		dkimf_db_cache_unlink(cs, cs->cs_tail);
+
+	ce->ce_hnext = cs->cs_buckets[h % DKIMF_DB_CACHE_BUCKETS];
+	cs->cs_buckets[h % DKIMF_DB_CACHE_BUCKETS] = ce;
+
+	ce->ce_next = cs->cs_head;
+	if (cs->cs_head != NULL)
+		cs->cs_head->ce_prev = ce;
+	cs->cs_head = ce;
+	if (cs->cs_tail == NULL)
+		cs->cs_tail = ce;
+
+	cs->cs_count++;
+
+	pthread_mutex_unlock(&cs->cs_lock);
+}
+
+/*
+**  DKIMF_DB_CACHE_DROP -- discard a cached query
+**
+**  Parameters:
+**  	cache -- result cache
+**  	key -- query
+**  	keylen -- bytes at "key"
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_db_cache_drop(struct dkimf_db_cache *cache, const char *key,
+                    size_t keylen)
+{
+	unsigned int h;
+	struct dkimf_db_cshard *cs;
+	struct dkimf_db_centry *ce;
+
+	assert(cache != NULL);
+	assert(key != NULL);
+
+	h = dkimf_db_cache_hash(key, keylen, cache->cache_icase);
+	cs = &cache->cache_shards[h % DKIMF_DB_CACHE_SHARDS];
+
+	pthread_mutex_lock(&cs->cs_lock);
+
+	ce = dkimf_db_cache_find(cache, key, keylen, h);
+	if (ce != NULL)
+		dkimf_db_cache_unlink(cs, ce);
+
+	pthread_mutex_unlock(&cs->cs_lock);
+}
+
+# ifdef _FFR_DB_AUTORELOAD
+/*
+**  DKIMF_DB_CACHE_FLUSH -- discard everything in a result cache
+**
+**  Parameters:
+**  	cache -- result cache
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	All shards are locked at once so that the generation changes
+**  	atomically; a lookup that started before this can't record its
+**  	answer afterwards.
+*/
+
+static void
+dkimf_db_cache_flush(struct dkimf_db_cache *cache)
+{
+	int c;
+	struct dkimf_db_cshard *cs;
+
+	assert(cache != NULL);
+
+	for (c = 0; c < DKIMF_DB_CACHE_SHARDS; c++)
+		pthread_mutex_lock(&cache->cache_shards[c].cs_lock);
+
+	cache->cache_gen++;
+
+	for (c = DKIMF_DB_CACHE_SHARDS - 1; c >= 0; c--)
+	{
+		cs = &cache->cache_shards[c];
+
+		while (cs->cs_head != NULL)
+			dkimf_db_cache_unlink(cs, cs->cs_head);
+
+		pthread_mutex_unlock(&cs->cs_lock);
+	}
+}
+# endif /* _FFR_DB_AUTORELOAD */
+
+/*
+**  DKIMF_DB_CACHE_FREE -- destroy a result cache
+**
+**  Parameters:
+**  	cache -- result cache
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_db_cache_free(struct dkimf_db_cache *cache)
+{
+	int c;
+	struct dkimf_db_cshard *cs;
+
+	assert(cache != NULL);
+
+	for (c = 0; c < DKIMF_DB_CACHE_SHARDS; c++)
+	{
+		cs = &cache->cache_shards[c];
+
+		while (cs->cs_head != NULL)
+			dkimf_db_cache_unlink(cs, cs->cs_head);
+
+		pthread_mutex_destroy(&cs->cs_lock);
+	}
+
+	free(cache);
+}
+#endif /* _FFR_DB_CACHE */
+
+#ifdef _FFR_DB_WRITEBEHIND
+/*
+**  DKIMF_DB_WB_HASH -- hash a key for the write-behind buffer
+**
+**  Parameters:
+**  	key -- key
+**  	keylen -- bytes at "key"
+**
+**  Return value:
+**  	Hash of the key.
+*/
+
+static unsigned int
+dkimf_db_wb_hash(const char *key, size_t keylen)
+{
+	size_t c;
+	unsigned int h = 5381;
+
+	for (c = 0; c < keylen; c++)
+		h = ((h << 5) + h) ^ (unsigned char) key[c];
+
+	return h;
+}
+
+/*
+**  DKIMF_DB_WB_FIND -- find a pending write
+**
+**  Parameters:
+**  	ws -- set of pending writes (may be NULL)
+**  	key -- key
+**  	keylen -- bytes at "key"
+**  	h -- hash of the key
+**
+**  Return value:
+**  	Matching entry, or NULL if none.
+**
+**  Notes:
+**  	Caller must hold the buffer's lock.  Keys are compared exactly,
+**  	as the writable backends do.
+*/
+
+static struct dkimf_db_wbent *
+dkimf_db_wb_find(struct dkimf_db_wbset *ws, const char *key, size_t keylen,
+                 unsigned int h)
+{
+	struct dkimf_db_wbent *we;
+
+	if (ws == NULL)
+		return NULL;
+
+	for (we = ws->ws_buckets[h % DKIMF_DB_WB_BUCKETS];
+	     we != NULL;
+	     we = we->we_hnext)
+	{
+		if (we->we_hash == h && we->we_keylen == keylen &&
+		    memcmp(we->we_key, key, keylen) == 0)
+			return we;
+	}
+
+	return NULL;
+}
+
+/*
+**  DKIMF_DB_WB_SETFREE -- destroy a set of pending writes
+**
+**  Parameters:
+**  	ws -- set of pending writes
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_db_wb_setfree(struct dkimf_db_wbset *ws)
+{
+	struct dkimf_db_wbent *we;
+	struct dkimf_db_wbent *next;
+
+	assert(ws != NULL);
+
+	for (we = ws->ws_head; we != NULL; we = next)
+	{
+		next = we->we_next;
+		free(we->we_val);
+		free(we);
+	}
+
+	free(ws);
+}
+
+/*
+**  DKIMF_DB_WB_GET -- answer a query from the write-behind buffer
+**
+**  Parameters:
+**  	wb -- write-behind buffer
+**  	key -- query
+**  	keylen -- bytes at "key"
+**  	req -- request array
+**  	reqnum -- length of request array
+**  	exists -- whether or not the record was found (returned; may be NULL)
+**  	status -- dkimf_db_get() result (returned)
+**
+**  Return value:
+**  	TRUE iff a write to "key" is pending, in which case the query was
+**  	answered from it.
+*/
+
+static _Bool
+dkimf_db_wb_get(struct dkimf_db_wb *wb, const char *key, size_t keylen,
+                DKIMF_DBDATA req, unsigned int reqnum, _Bool *exists,
+                int *status)
+{
+	unsigned int h;
+	struct dkimf_db_wbent *we;
+
+	assert(wb != NULL);
+	assert(key != NULL);
+	assert(status != NULL);
+
+	h = dkimf_db_wb_hash(key, keylen);
+
+	pthread_mutex_lock(&wb->wb_lock);
+
+	we = dkimf_db_wb_find(wb->wb_pending, key, keylen, h);
+	if (we == NULL)
+		we = dkimf_db_wb_find(wb->wb_flushing, key, keylen, h);
+
+	if (we == NULL)
+	{
+		pthread_mutex_unlock(&wb->wb_lock);
+		return FALSE;
+	}
+
+	if (exists != NULL)
+		*exists = !we->we_delete;
+
+	*status = 0;
+	if (!we->we_delete && reqnum != 0)
+	{
+		*status = dkimf_db_datasplit(we->we_val, we->we_vallen,
+		                             req, reqnum);
+	}
+
+	pthread_mutex_unlock(&wb->wb_lock);
+
+	return TRUE;
+}
+
+/*
+**  DKIMF_DB_WB_FLUSH -- write out all pending writes
+**
+**  Parameters:
+**  	db -- DKIMF_DB handle
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Only one flush runs at a time; a second caller waits for the first
+**  	to finish and then writes whatever has accumulated since.  Reads
+**  	continue to see the writes being flushed until they have all reached
+**  	the backend, and writes to the same key made meanwhile are queued
+**  	behind them, so the backend always ends up with the latest value.
+*/
+
+static void
+dkimf_db_wb_flush(DKIMF_DB db)
+{
+	int status;
+	struct dkimf_db_wb *wb;
+	struct dkimf_db_wbset *ws;
+	struct dkimf_db_wbent *we;
+
+	assert(db != NULL);
+
+	wb = db->db_wb;
+
+	pthread_mutex_lock(&wb->wb_lock);
+
+	while (wb->wb_flushing != NULL)
+		pthread_cond_wait(&wb->wb_done, &wb->wb_lock);
+
+	ws = wb->wb_pending;
+	if (ws == NULL)
+	{
+		pthread_mutex_unlock(&wb->wb_lock);
+		return;
+	}
+
+	wb->wb_pending = NULL;
+	wb->wb_flushing = ws;
+
+	pthread_mutex_unlock(&wb->wb_lock);
+
+	for (we = ws->ws_head; we != NULL; we = we->we_next)
+	{
+		if (we->we_delete)
+		{
+			(void) dkimf_db_remove(db, we->we_key, we->we_keylen);
+			continue;
+		}
+
+		status = dkimf_db_store(db, we->we_key, we->we_keylen,
+		                        we->we_val, we->we_vallen);
+		if (status != 0)
+		{
+			pthread_mutex_lock(&wb->wb_lock);
+			wb->wb_errors++;
+			pthread_mutex_unlock(&wb->wb_lock);
+		}
+	}
+
+	pthread_mutex_lock(&wb->wb_lock);
+	wb->wb_flushed += ws->ws_count;
+	wb->wb_flushing = NULL;
+	pthread_cond_broadcast(&wb->wb_done);
+	pthread_mutex_unlock(&wb->wb_lock);
+
+	dkimf_db_wb_setfree(ws);
+}
+
+/*
+**  DKIMF_DB_WB_FLUSHER -- thread that writes out pending writes
+**
+**  Parameters:
+**  	arg -- DKIMF_DB handle
+**
+**  Return value:
+**  	Always NULL.
+**
+**  Notes:
+**  	Flushes every "interval" seconds, or sooner once "max" writes are
+**  	pending.
+*/
+
+static void *
+dkimf_db_wb_flusher(void *arg)
+{
+	DKIMF_DB db;
+	struct dkimf_db_wb *wb;
+	struct timespec deadline;
+
+	db = (DKIMF_DB) arg;
+	wb = db->db_wb;
+
+	pthread_mutex_lock(&wb->wb_lock);
+
+	while (!wb->wb_stop)
+	{
+		deadline.tv_sec = time(NULL) + wb->wb_interval;
+		deadline.tv_nsec = 0;
+
+		while (!wb->wb_stop &&
+		       (wb->wb_pending == NULL ||
+		        wb->wb_pending->ws_count < wb->wb_max))
+		{
+			if (pthread_cond_timedwait(&wb->wb_wakeup,
+			                           &wb->wb_lock,
+			                           &deadline) == ETIMEDOUT)
+				break;
+		}
+
+		if (wb->wb_stop)
+			break;
+
+		pthread_mutex_unlock(&wb->wb_lock);
+
+		dkimf_db_wb_flush(db);
+
+		pthread_mutex_lock(&wb->wb_lock);
+	}
+
+	pthread_mutex_unlock(&wb->wb_lock);
+
+	return NULL;
+}
+
+/*
+**  DKIMF_DB_WB_PUT -- queue a write in the write-behind buffer
+**
+**  Parameters:
+**  	db -- DKIMF_DB handle
+**  	key -- key
+**  	keylen -- bytes at "key"
+**  	val -- value (NULL for a delete)
+**  	vallen -- bytes at "val"
+**
+**  Return value:
+**  	0 -- success
+**  	!0 -- error code
+**
+**  Notes:
+**  	A write to a key that already has one pending replaces it.  The
+**  	flusher thread is started on the first write, which happens after
+**  	the filter has detached.  If it can't be started, or the backend
+**  	falls too far behind, the caller flushes instead.  Once the buffer
+**  	has been disabled, writes go to the backend as soon as the earlier
+**  	ones have been flushed.
+*/
+
+static int
+dkimf_db_wb_put(DKIMF_DB db, const char *key, size_t keylen,
+                const void *val, size_t vallen)
+{
+	_Bool flush = FALSE;
+	unsigned int h;
+	char *newval = NULL;
+	struct dkimf_db_wb *wb;
+	struct dkimf_db_wbset *ws;
+	struct dkimf_db_wbent *we;
+
+	assert(db != NULL);
+	assert(key != NULL);
+
+	wb = db->db_wb;
+
+	if (val != NULL)
+	{
+		newval = malloc(vallen + 1);
+		if (newval == NULL)
+			return errno;
+		memcpy(newval, val, vallen);
+		newval[vallen] = '\0';
+	}
+
+	h = dkimf_db_wb_hash(key, keylen);
+
+	pthread_mutex_lock(&wb->wb_lock);
+
+	if (wb->wb_direct)
+	{
+		while (wb->wb_pending != NULL || wb->wb_flushing != NULL)
+			pthread_cond_wait(&wb->wb_done, &wb->wb_lock);
+
+		pthread_mutex_unlock(&wb->wb_lock);
+
+		free(newval);
+
+		if (val == NULL)
+			return dkimf_db_remove(db, (void *) key, keylen);
+		else
+			return dkimf_db_store(db, (void *) key, keylen,
+			                      (void *) val, vallen);
+	}
+
+	ws = wb->wb_pending;
+	if (ws == NULL)
+	{
+		ws = (struct dkimf_db_wbset *) malloc(sizeof *ws);
+		if (ws == NULL)
+		{
+			pthread_mutex_unlock(&wb->wb_lock);
+			free(newval);
+			return ENOMEM;
+		}
+
+		memset(ws, '\0', sizeof *ws);
+		wb->wb_pending = ws;
+	}
+
+	we = dkimf_db_wb_find(ws, key, keylen, h);
+	if (we == NULL)
+	{
+		we = (struct dkimf_db_wbent *) malloc(sizeof *we + keylen);
+		if (we == NULL)
+		{
+			pthread_mutex_unlock(&wb->wb_lock);
+			free(newval);
+			return ENOMEM;
+		}
+
+		memset(we, '\0', sizeof *we);
+		we->we_hash = h;
+		we->we_keylen = keylen;
+		we->we_key = (char *) (we + 1);
+		memcpy(we->we_key, key, keylen);
+
+		we->we_hnext = ws->ws_buckets[h % DKIMF_DB_WB_BUCKETS];
+		ws->ws_buckets[h % DKIMF_DB_WB_BUCKETS] = we;
+
+		if (ws->ws_tail == NULL)
+			ws->ws_head = we;
+		else
+			ws->ws_tail->we_next = we;
+		ws->ws_tail = we;
+
+		ws->ws_count++;
+	}
+
+	free(we->we_val);
+	we->we_val = newval;
+	we->we_vallen = vallen;
+	we->we_delete = (val == NULL);
+
+	wb->wb_writes++;
+
+	if (!wb->wb_started && !wb->wb_stop)
+	{
+		if (pthread_create(&wb->wb_thread, NULL, dkimf_db_wb_flusher,
+		                   db) == 0)
+			wb->wb_started = TRUE;
+	}
+
+	if (ws->ws_count >= wb->wb_max * DKIMF_DB_WB_BACKLOG ||
+	    (!wb->wb_started && ws->ws_count >= wb->wb_max))
+		flush = TRUE;
+	else if (ws->ws_count >= wb->wb_max)
+		pthread_cond_signal(&wb->wb_wakeup);
+
+	pthread_mutex_unlock(&wb->wb_lock);
+
+	if (flush)
+		dkimf_db_wb_flush(db);
+
+	return 0;
+}
+
+/*
+**  DKIMF_DB_WB_FREE -- flush and destroy a write-behind buffer
+**
+**  Parameters:
+**  	db -- DKIMF_DB handle
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_db_wb_free(DKIMF_DB db)
+{
+	struct dkimf_db_wb *wb;
+
+	assert(db != NULL);
+
+	wb = db->db_wb;
+
+	pthread_mutex_lock(&wb->wb_lock);
+	wb->wb_stop = TRUE;
+	pthread_cond_signal(&wb->wb_wakeup);
+	pthread_mutex_unlock(&wb->wb_lock);
+
+	if (wb->wb_started)
+		(void) pthread_join(wb->wb_thread, NULL);
+
+	dkimf_db_wb_flush(db);
+
+	pthread_cond_destroy(&wb->wb_done);
+	pthread_cond_destroy(&wb->wb_wakeup);
+	pthread_mutex_destroy(&wb->wb_lock);
+
+	free(wb);
+	db->db_wb = NULL;
+}
+#endif /* _FFR_DB_WRITEBEHIND */
+
+#ifdef _FFR_DB_BREAKER
+/*
+**  DKIMF_DB_BREAKER_TRIPPED -- determine whether a circuit breaker is open
+**
+**  Parameters:
+**  	br -- circuit breaker
+**
+**  Return value:
+**  	TRUE iff queries are currently being refused.
+*/
+
+static _Bool
+dkimf_db_breaker_tripped(struct dkimf_db_breaker *br)
+{
+	_Bool open;
+
+	assert(br != NULL);
+
+	pthread_mutex_lock(&br->br_lock);
+	open = br->br_open;
+	pthread_mutex_unlock(&br->br_lock);
+
+	return open;
+}
+
+/*
+**  DKIMF_DB_BREAKER_ELAPSED -- compute time elapsed since a query began
+**
+**  Parameters:
+**  	start -- when the query began
+**
+**  Return value:
+**  	Microseconds since "start".
+*/
+
+static unsigned long
+dkimf_db_breaker_elapsed(struct timeval *start)
+{
+	struct timeval now;
+
+	assert(start != NULL);
+
+	(void) gettimeofday(&now, NULL);
+
+	if (timercmp(&now, start, <))
+		return 0;
+
+	return (now.tv_sec - start->tv_sec) * 1000000UL +
+	       now.tv_usec - start->tv_usec;
+}
+
+/*
+**  DKIMF_DB_BREAKER_PROBER -- probe a tripped data set until it recovers
+**
+**  Parameters:
+**  	arg -- DKIMF_DB handle whose breaker is to be watched
+**
+**  Return value:
+**  	Always NULL.
+**
+**  Notes:
+**  	While the breaker is open, the key whose query tripped it is
+**  	looked up again every "br_retry" seconds.  The first probe that
+**  	succeeds quickly enough closes the breaker.  If the handle is
+**  	closed while a probe is waiting on the backend, closing it is
+**  	left to this thread once the probe returns.
+*/
+
+static void *
+dkimf_db_breaker_prober(void *arg)
+{
+	_Bool found;
+	int status;
+	size_t keylen;
+	unsigned long usec;
+	time_t now;
+	time_t down;
+	char *key;
+	DKIMF_DB db;
+	struct dkimf_db_breaker *br;
+	struct timeval start;
+	struct timespec deadline;
+
+	db = (DKIMF_DB) arg;
+	br = db->db_breaker;
+
+	pthread_mutex_lock(&br->br_lock);
+
+	while (!br->br_stop)
+	{
+		if (!br->br_open)
+		{
+			pthread_cond_wait(&br->br_wakeup, &br->br_lock);
+			continue;
+		}
+
+		(void) time(&now);
+		if (now < br->br_opened + br->br_retry)
+		{
+			deadline.tv_sec = br->br_opened + br->br_retry;
+			deadline.tv_nsec = 0;
+
+			(void) pthread_cond_timedwait(&br->br_wakeup,
+			                              &br->br_lock,
+			                              &deadline);
+			continue;
+		}
+
+		/* without a key to try, let the next real query probe */
+		key = NULL;
+		keylen = br->br_probelen;
+		if (br->br_probe != NULL)
+		{
+			key = (char *) malloc(keylen + 1);
+			if (key != NULL)
+				memcpy(key, br->br_probe, keylen + 1);
+		}
+
+		br->br_probing = TRUE;
+
+		pthread_mutex_unlock(&br->br_lock);
+
+		status = 0;
+		usec = 0;
+		if (key != NULL)
+		{
+			found = FALSE;
+			(void) gettimeofday(&start, NULL);
+			status = dkimf_db_lookup(db, key, keylen, NULL, 0,
+			                         &found);
+			usec = dkimf_db_breaker_elapsed(&start);
+			free(key);
+		}
+
+		pthread_mutex_lock(&br->br_lock);
+
+		br->br_probing = FALSE;
+		if (br->br_stop)
+			break;
+
+		(void) time(&now);
+
+		if (status == 0 &&
+		    (br->br_slow == 0 || usec < br->br_slow * 1000UL))
+		{
+			br->br_open = FALSE;
+			br->br_bad = 0;
+			down = now - br->br_opened;
+
+			pthread_mutex_unlock(&br->br_lock);
+
+			syslog(LOG_NOTICE,
+			       "%s: data set recovered; resuming queries "
+			       "after %ld second(s)",
+			       br->br_name, (long) down);
+
+			pthread_mutex_lock(&br->br_lock);
+		}
+		else
+		{
+			/* try again one interval from now */
+			br->br_opened = now;
+		}
+	}
+
+	if (br->br_orphan)
+	{
+		/* nobody will join this thread */
+		br->br_started = FALSE;
+		pthread_mutex_unlock(&br->br_lock);
+
+		pthread_detach(pthread_self());
+		(void) dkimf_db_close(db);
+
+		return NULL;
+	}
+
+	pthread_mutex_unlock(&br->br_lock);
+
+	return NULL;
+}
+
+/*
+**  DKIMF_DB_BREAKER_RECORD -- account for a completed backend query
+**
+**  Parameters:
+**  	db -- DKIMF_DB handle
+**  	key -- key that was queried
+**  	keylen -- bytes at "key"
+**  	usec -- how long the query took
+**  	failed -- TRUE iff the query failed
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Trips the breaker after "br_threshold" consecutive queries that
+**  	failed or took at least "br_slow" milliseconds.  The prober thread
+**  	is started the first time that happens, which is after the filter
+**  	has detached; if it can't be started the breaker stays closed,
+**  	since nothing would ever close it again.
+*/
+
+static void
+dkimf_db_breaker_record(DKIMF_DB db, const char *key, size_t keylen,
+                        unsigned long usec, _Bool failed)
+{
+	_Bool slow;
+	char *probe;
+	struct dkimf_db_breaker *br;
+
+	br = db->db_breaker;
+
+	slow = (br->br_slow != 0 && usec >= br->br_slow * 1000UL);
+
+	pthread_mutex_lock(&br->br_lock);
+
+	br->br_queries++;
+	br->br_usec += usec;
+	if (usec > br->br_maxusec)
+		br->br_maxusec = usec;
+	if (failed)
+		br->br_errors++;
+	if (slow)
+		br->br_slowq++;
+
+	if (!failed && !slow)
+	{
+		br->br_bad = 0;
+		pthread_mutex_unlock(&br->br_lock);
+		return;
+	}
+
+	br->br_bad++;
+	if (br->br_open || br->br_bad < br->br_threshold)
+	{
+		pthread_mutex_unlock(&br->br_lock);
+		return;
+	}
+
+	if (!br->br_started)
+	{
+		if (pthread_create(&br->br_thread, NULL,
+		                   dkimf_db_breaker_prober, db) != 0)
+		{
+			pthread_mutex_unlock(&br->br_lock);
+			return;
+		}
+
+		br->br_started = TRUE;
+	}
+
+	probe = (char *) malloc(keylen + 1);
+	if (probe != NULL)
+	{
+		memcpy(probe, key, keylen);
+		probe[keylen] = '\0';
+		free(br->br_probe);
+		br->br_probe = probe;
+		br->br_probelen = keylen;
+	}
+
+	br->br_open = TRUE;
+	br->br_trips++;
+	(void) time(&br->br_opened);
+
+	pthread_cond_signal(&br->br_wakeup);
+
+	pthread_mutex_unlock(&br->br_lock);
+
+	syslog(LOG_WARNING,
+	       "%s: %u consecutive slow or failed queries; suspending queries",
+	       br->br_name, br->br_threshold);
+}
+
+/*
+**  DKIMF_DB_BREAKER_LOOKUP -- query a backend through its circuit breaker
+**
+**  Parameters:
+**  	As for dkimf_db_get().
+**
+**  Return value:
+**  	As for dkimf_db_get().  Fails at once while the breaker is open.
+*/
+
+static int
+dkimf_db_breaker_lookup(DKIMF_DB db, void *buf, size_t buflen,
+                        DKIMF_DBDATA req, unsigned int reqnum, _Bool *exists)
+{
+	int status;
+	unsigned long usec;
+	struct dkimf_db_breaker *br;
+	struct timeval start;
+
+	br = db->db_breaker;
+
+	pthread_mutex_lock(&br->br_lock);
+	if (br->br_open)
+	{
+		br->br_refused++;
+		pthread_mutex_unlock(&br->br_lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&br->br_lock);
+
+	(void) gettimeofday(&start, NULL);
+	status = dkimf_db_lookup(db, buf, buflen, req, reqnum, exists);
+	usec = dkimf_db_breaker_elapsed(&start);
+
+	dkimf_db_breaker_record(db, buf, buflen == 0 ? strlen(buf) : buflen,
+	                        usec, status != 0);
+
+	return status;
+}
+
+/*
+**  DKIMF_DB_BREAKER_MGET -- send a batch query through a circuit breaker
+**
+**  Parameters:
+**  	As for dkimf_db_mget().
+**
+**  Return value:
+**  	As for dkimf_db_mget().  Fails at once while the breaker is open.
+**
+**  Notes:
+**  	A batch counts as one query, and its first key is the one used
+**  	to probe if it trips the breaker.
+*/
+
+static int
+dkimf_db_breaker_mget(DKIMF_DB db, char **keys, unsigned int nkeys,
+                      DKIMF_DBDATA req, unsigned int reqnum, _Bool *exists)
+{
+	int status;
+	unsigned long usec;
+	struct dkimf_db_breaker *br;
+	struct timeval start;
+
+	br = db->db_breaker;
+
+	pthread_mutex_lock(&br->br_lock);
+	if (br->br_open)
+	{
+		br->br_refused++;
+		pthread_mutex_unlock(&br->br_lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&br->br_lock);
+
+	(void) gettimeofday(&start, NULL);
+	status = dkimf_db_mget_batch(db, keys, nkeys, req, reqnum, exists);
+	usec = dkimf_db_breaker_elapsed(&start);
+
+	dkimf_db_breaker_record(db, keys[0], strlen(keys[0]), usec,
+	                        status != 0);
+
+	return status;
+}
+
+/*
+**  DKIMF_DB_BREAKER_FREE -- stop and destroy a DB handle's circuit breaker
+**
+**  Parameters:
+**  	db -- DKIMF_DB handle
+**
+**  Return value:
+**  	TRUE iff a probe is still waiting on the backend; the prober will
+**  	finish closing "db" when it returns, so the caller must leave it
+**  	alone.
+**
+**  Notes:
+**  	An idle prober exits as soon as it is signalled, so joining it
+**  	doesn't wait.  One in the middle of a probe could take as long as
+**  	the backend's timeout, so a configuration reload doesn't wait for
+**  	it.
+*/
+
+static _Bool
+dkimf_db_breaker_free(DKIMF_DB db)
+{
+	_Bool started;
+	struct dkimf_db_breaker *br;
+
+	br = db->db_breaker;
+
+	pthread_mutex_lock(&br->br_lock);
+	br->br_stop = TRUE;
+	started = br->br_started;
+	if (br->br_probing)
+	{
+		br->br_orphan = TRUE;
+		pthread_mutex_unlock(&br->br_lock);
+		return TRUE;
+	}
+	pthread_cond_signal(&br->br_wakeup);
+	pthread_mutex_unlock(&br->br_lock);
+
+	if (started)
+		(void) pthread_join(br->br_thread, NULL);
+
+	pthread_cond_destroy(&br->br_wakeup);
+	pthread_mutex_destroy(&br->br_lock);
+
+	free(br->br_probe);
+	free(br->br_name);
+	free(br);
+
+	db->db_breaker = NULL;
+
+	return FALSE;
+}
+#endif /* _FFR_DB_BREAKER */
+
+/*
+**  DKIMF_DB_FLAGS -- set global flags
+**
+**  Parameters:
+**  	flags -- new global flag mask
+**
+**  Return value:
+**  	None.
+*/
+
+void
+dkimf_db_flags(unsigned int flags)
+{
+	gflags = flags;
+}
+
+#if (USE_SASL && USE_LDAP)
+/*
+**  DKIMF_DB_SASLINTERACT -- SASL binding interaction callback
+**
+**  Parameters:
+**  	ld -- LDAP handle (see below)
+**  	flags -- LDAP handling flags
+**  	defaults -- defaults pointer (see below)
+**  	interact -- SASL interaction object
+**
+**  Return value:
+**  	LDAP_SUCCESS (for now)
+**
+**  Notes:
+**  	If SASL requires additional parameters that OpenLDAP didn't provide
+**  	in its call, it uses a callback we have to provide to try to get them.
+**  	The layering here can get quite confusing.  "defaults" is an
+**  	application-specific handle that can point to a bunch of defaults
+**  	set elsewhere, but we don't need it here so it's ignored.  Similarly,
+**  	"ld" is not actually needed.
+*/
+
+static int
+dkimf_db_saslinteract(LDAP *ld, unsigned int flags, void *defaults,
+                      void *sasl_interact)
+{
+	sasl_interact_t *interact;
+
+	assert(sasl_interact != NULL);
+
+	interact = sasl_interact;
+
+	switch (interact->id)
+	{
+	  case SASL_CB_PASS:
+		interact->result = dkimf_db_ldap_param[DKIMF_LDAP_PARAM_BINDPW];
+		interact->len = strlen(interact->result);
+		break;
+
+	  case SASL_CB_GETREALM:
+		interact->result = dkimf_db_ldap_param[DKIMF_LDAP_PARAM_AUTHREALM];
+		interact->len = strlen(interact->result);
+		break;
+
+	  case SASL_CB_AUTHNAME:
+		interact->result = dkimf_db_ldap_param[DKIMF_LDAP_PARAM_AUTHNAME];
+		interact->len = strlen(interact->result);
+		break;
+
+	  case SASL_CB_USER:
+		interact->result = dkimf_db_ldap_param[DKIMF_LDAP_PARAM_AUTHUSER];
+		if (interact->result == NULL)
+			interact->len = 0;
+		else
+			interact->len = strlen(interact->result);
+		break;
+
+	  default:
+		interact->result = "";
+		interact->len = 0;
+		break;
+	}
+
+	return SASL_OK;
+}
+#endif /* (USE_SASL && USE_LDAP) */
+
+#ifdef USE_ODBX
+/*
+**  DKIMF_DB_HEXDIGIT -- convert a hex digit to decimal value
+**
+**  Parameters:
+**  	c -- input character
+**
+**  Return value:
+**  	Converted value, or 0 on error.
+*/
+
+static int
+dkimf_db_hexdigit(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	else if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	else if (c >= 'a' && c <= 'f')
+		return c - 'f' + 10;
+	else
+		return 0;
+}
+#endif /* USE_ODBX */
+
+/*
+**  DKIMF_DB_DATASPLIT -- split a database value or set of values into a
+**                        request array
+**
+**  Parameters:
+**  	buf -- data buffer
+**  	buflen -- buffer length
+**  	req -- request array
+**  	reqnum -- length of request array
+**
+**  Return value:
+**  	0 -- successful data split
+**  	-1 -- not enough elements present to fulfill the request
+*/
+
+static int
+dkimf_db_datasplit(char *buf, size_t buflen,
+                   DKIMF_DBDATA req, unsigned int reqnum)
+{
+	int ridx;
+	int ret = 0;
+	size_t clen;
+	size_t remain;
+	char *p;
+
+	assert(buf != NULL);
+
+	if (req == NULL || reqnum == 0)
+		return 0;
+
+	p = buf;
+	remain = buflen;
+
+	for (ridx = 0; ridx < reqnum; ridx++)
+	{
+		if (remain <= 0)
+			break;
+
+		if ((req[ridx].dbdata_flags & DKIMF_DB_DATA_BINARY) != 0)
+		{
+			clen = MIN(remain, req[ridx].dbdata_buflen);
+			memcpy(req[ridx].dbdata_buffer, p, clen);
+			req[ridx].dbdata_buflen = remain;
+			remain = 0;
+		}
+		else if (ridx == reqnum - 1)
+		{
+			clen = MIN(remain, req[ridx].dbdata_buflen);
+			memcpy(req[ridx].dbdata_buffer, p, clen);
+			req[ridx].dbdata_buflen = remain;
+		}
+		else
+		{
+			char *q;
+
+			q = strchr(p, ':');
+			if (q != NULL)
+			{
+				clen = q - p;
+				memcpy(req[ridx].dbdata_buffer, p,
+				       MIN(clen, req[ridx].dbdata_buflen));
+				req[ridx].dbdata_buflen = clen;
+				p += clen + 1;
+				remain -= (clen + 1);
+			}
+			else
+			{
+				clen = remain;
+				memcpy(req[ridx].dbdata_buffer, p,
+				       MIN(clen, req[ridx].dbdata_buflen));
+				req[ridx].dbdata_buflen = clen;
+				remain = 0;
+			}
+		}
+	}
+
+	/* mark the ones that got no data */
+	if (ridx < reqnum)
+	{
+		int c;
+
+		for (c = ridx; c < reqnum; c++)
+		{
+			if ((req[c].dbdata_flags & DKIMF_DB_DATA_OPTIONAL) == 0)
+				ret = -1;
+			req[c].dbdata_buflen = (size_t) -1;
+		}
+	}
+
+        return ret;
+}
+
+#ifdef USE_LDAP
+# define ISRFC2254CHR(q)	((q) == 0x2a ||	\
+				 (q) == 0x28 || \
+				 (q) == 0x29 || \
+				 (q) == 0x5c || \
+				 (q) == 0x00)
+
+# define ADDRFC2254CHR(x, y, z)	{ \
+					*(x)++ = '\\'; \
+					if ((y) > (x)) \
+					{ \
+						(x) += snprintf((x), \
+						                (y) - (x), \
+						                "%02x", \
+						                (z)); \
+					} \
+				}
+
+/*
+**  DKIMF_DB_MKLDAPQUERY -- generate an LDAP query
+**
+**  Parameters:
+**  	buf -- parameter (the actual query)
+**  	query -- query string (a domain name?)
+**  	out -- outbut buffer
+**  	outlen -- size of "out"
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Expands "$d" and "$D" as defined in opendkim.conf(5).
+** 
+**  	Should report overflows.
+*/
+
+static void
+dkimf_db_mkldapquery(char *buf, char *query, _Bool raw,
+                     char *out, size_t outlen)
+{
+	char last = '\0';
+	char *p;
+	char *o;
+	char *q;
+	char *pend;
+	char *oend;
+	char *qend;
+
+	assert(buf != NULL);
+	assert(query != NULL);
+	assert(out != NULL);
+
+	p = buf;
+	pend = p + strlen(p) - 1;
+
+	q = query;
+	qend = query + strlen(query) - 1;
+
+	o = out;
+	oend = out + outlen - 1;
+
+	while (p <= pend && o <= oend)
+	{
+		if (last == '$')
+		{
+			if (*p == 'd')
+			{
+				for (q = query; o <= oend && q <= qend; q++)
+				{
+					if (ISRFC2254CHR(*q) && !raw)
+					{
+						ADDRFC2254CHR(o, oend, *q);
+					}
+					else
+					{
+						*o++ = *q;
+					}
+				}
+			}
+			else if (*p == 'D')
+			{
+				for (q = query; o <= oend && q <= qend; q++)
+				{
+					if (q == query)
+					{
+						o += strlcpy(o, "dc=",
+						             oend - o);
+					}
+
+					if (*q == '.')
+					{
+						o += strlcpy(o, ",dc=",
+						             oend - o);
+					}
+					else if (ISRFC2254CHR(*q))
+					{
+						ADDRFC2254CHR(o, oend, *q);
+					}
+					else
+					{
+						*o++ = *q;
+					}
+				}
+			}
+			else
+			{
+				*q++ = *p;
+			}
+		}
+		else if (*p != '$')
+		{
+			*o++ = *p;
+		}
+
+		last = *p;
+		p++;
+	}
+}
+#endif /* USE_LDAP */
+
+#ifdef USE_ODBX
+/*
+**  DKIMF_DB_NEXTPUNCT -- find next punctuation
+**
+**  Parameters:
+**  	str -- start of the search
+**
+**  Return value:
+**  	Pointer to the next punctuation found, or NULL if none.
+*/
+
+static char *
+dkimf_db_nextpunct(char *str)
+{
+	char *p;
+
+	assert(str != NULL);
+
+	for (p = str; *p != '\0'; p++)
+	{
+		if (*p == ':' ||
+		    *p == '/' ||
+		    *p == '@' ||
+		    *p == '+' ||
+		    *p == '=' ||
+		    *p == '?')
+			return p;
+	}
+
+	return NULL;
+}
+#endif /* USE_ODBX */
+
+/*
+**  DKIMF_DB_LIST_FREE -- destroy a linked list
+**
+**  Parameters:
+**  	list -- list handle
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_db_list_free(struct dkimf_db_list *list)
+{
+	struct dkimf_db_list *next;
+
+	assert(list != NULL);
+
+	while (list != NULL)
+	{
+		free(list->db_list_key);
+		if (list->db_list_value != NULL)
+			free(list->db_list_value);
+		next = list->db_list_next;
+		free(list);
+		list = next;
+	}
+}
+		
+/*
+**  DKIMF_DB_RELIST_FREE -- destroy a linked regex list
+**
+**  Parameters:
+**  	list -- list handle
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_db_relist_free(struct dkimf_db_relist *list)
+{
+	struct dkimf_db_relist *next;
+
+	assert(list != NULL);
+
+	while (list != NULL)
+	{
+		regfree(&list->db_relist_re);
+		if (list->db_relist_data != NULL)
+			free(list->db_relist_data);
+		next = list->db_relist_next;
+		free(list);
+		list = next;
+	}
+}
+
+#ifdef _FFR_CTABLE
+/*
+**  DKIMF_DB_CTABLE_FREE -- unmap a compiled table
+**
+**  Parameters:
+**  	ct -- compiled table
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_db_ctable_free(struct dkimf_db_ctable *ct)
+{
+	assert(ct != NULL);
+
+	(void) munmap(ct->ct_map, ct->ct_size);
+	free(ct);
+}
+
+/*
+**  DKIMF_DB_CTABLE_RANGEOK -- see if part of a compiled table is in bounds
+**
+**  Parameters:
+**  	ct -- compiled table
+**  	off -- offset
+**  	n -- number of elements
+**  	size -- size of each element
+**
+**  Return value:
+**  	TRUE iff "n" elements of "size" bytes at "off" are within the file.
+*/
+
+static _Bool
+dkimf_db_ctable_rangeok(struct dkimf_db_ctable *ct, uint32_t off, uint32_t n,
+                        size_t size)
+{
+	assert(ct != NULL);
+
+	return (off <= ct->ct_size &&
+	        (uint64_t) n * size <= ct->ct_size - off);
+}
+
+/*
+**  DKIMF_DB_CTABLE_OPEN -- map a compiled table
+**
+**  Parameters:
+**  	path -- file to map
+**  	sb -- stat() of the file (returned)
+**  	ct -- compiled table (returned)
+**
+**  Return value:
+**  	0 on success, an errno value otherwise.
+**
+**  Notes:
+**  	Only the header is checked here, so that opening a large table
+**  	doesn't have to read all of it.  Records are checked as they are
+**  	used.
+*/
+
+static int
+dkimf_db_ctable_open(char *path, struct stat *sb, struct dkimf_db_ctable **ct)
+{
+	int fd;
+	int status;
+	void *map;
+	struct dkimf_ctable_hdr *hdr;
+	struct dkimf_db_ctable *new;
+
+	assert(path != NULL);
+	assert(sb != NULL);
+	assert(ct != NULL);
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return errno;
+
+	if (fstat(fd, sb) != 0)
+	{
+		status = errno;
+		(void) close(fd);
+		return status;
+	}
+
+	if (sb->st_size < sizeof *hdr || sb->st_size > UINT32_MAX)
+	{
+		(void) close(fd);
+		return EINVAL;
+	}
+
+	map = mmap(NULL, sb->st_size, PROT_READ, MAP_SHARED, fd, 0);
+	status = errno;
+	(void) close(fd);
+	if (map == MAP_FAILED)
+		return status;
+
+	new = (struct dkimf_db_ctable *) malloc(sizeof *new);
+	if (new == NULL)
+	{
+		status = errno;
+		(void) munmap(map, sb->st_size);
+		return status;
+	}
+
+	memset(new, '\0', sizeof *new);
+
+	new->ct_map = map;
+	new->ct_size = sb->st_size;
+	new->ct_hdr = hdr = (struct dkimf_ctable_hdr *) map;
+
+	if (memcmp(hdr->ch_magic, DKIMF_CTABLE_MAGIC,
+	           sizeof hdr->ch_magic) != 0 ||
+	    hdr->ch_version != DKIMF_CTABLE_VERSION ||
+	    hdr->ch_bom != DKIMF_CTABLE_BOM ||
+	    hdr->ch_size != new->ct_size ||
+	    (hdr->ch_nkeys != 0 && hdr->ch_nbuckets == 0) ||
+	    hdr->ch_nkeys > hdr->ch_nrecs ||
+	    hdr->ch_disp % sizeof(uint32_t) != 0 ||
+	    hdr->ch_slots % sizeof(uint32_t) != 0 ||
+	    hdr->ch_recs % sizeof(uint32_t) != 0 ||
+	    hdr->ch_order % sizeof(uint32_t) != 0 ||
+	    !dkimf_db_ctable_rangeok(new, hdr->ch_disp, hdr->ch_nbuckets,
+	                             sizeof(uint32_t)) ||
+	    !dkimf_db_ctable_rangeok(new, hdr->ch_slots, hdr->ch_nkeys,
+	                             sizeof(struct dkimf_ctable_slot)) ||
+	    !dkimf_db_ctable_rangeok(new, hdr->ch_recs, hdr->ch_nrecs,
+	                             sizeof(struct dkimf_ctable_rec)) ||
+	    !dkimf_db_ctable_rangeok(new, hdr->ch_order, hdr->ch_nrecs,
+	                             sizeof(uint32_t)))
+	{
+		dkimf_db_ctable_free(new);
+		return EINVAL;
+	}
+
+	new->ct_disp = (uint32_t *) (new->ct_map + hdr->ch_disp);
+	new->ct_slots = (struct dkimf_ctable_slot *) (new->ct_map + hdr->ch_slots);
+	new->ct_recs = (struct dkimf_ctable_rec *) (new->ct_map + hdr->ch_recs);
+	new->ct_order = (uint32_t *) (new->ct_map + hdr->ch_order);
+
+	*ct = new;
+
+	return 0;
+}
+
+/*
+**  DKIMF_DB_CTABLE_RECOK -- check a compiled table record
+**
+**  Parameters:
+**  	ct -- compiled table
+**  	cr -- record
+**
+**  Return value:
+**  	TRUE iff the key, value and field offsets of "cr" are within the file.
+*/
+
+static _Bool
+dkimf_db_ctable_recok(struct dkimf_db_ctable *ct, struct dkimf_ctable_rec *cr)
+{
+	assert(ct != NULL);
+	assert(cr != NULL);
+
+	if (cr->cr_keylen == UINT32_MAX ||
+	    !dkimf_db_ctable_rangeok(ct, cr->cr_key, cr->cr_keylen + 1, 1) ||
+	    ct->ct_map[cr->cr_key + cr->cr_keylen] != '\0')
+		return FALSE;
+
+	if (cr->cr_value == 0)
+		return TRUE;
+
+	return (cr->cr_vallen != UINT32_MAX &&
+	        dkimf_db_ctable_rangeok(ct, cr->cr_value,
+	                                cr->cr_vallen + 1, 1) &&
+	        ct->ct_map[cr->cr_value + cr->cr_vallen] == '\0' &&
+	        cr->cr_fields % sizeof(uint32_t) == 0 &&
+	        dkimf_db_ctable_rangeok(ct, cr->cr_fields, cr->cr_nfields,
+	                                sizeof(uint32_t)));
+}
+
+/*
+**  DKIMF_DB_CTABLE_SPLIT -- copy a compiled table value into a request array
+**
+**  Parameters:
+**  	ct -- compiled table
+**  	cr -- record
+**  	req -- request array
+**  	reqnum -- length of request array
+**
+**  Return value:
+**  	As for dkimf_db_datasplit().
+**
+**  Notes:
+**  	The result is the same as dkimf_db_datasplit() would produce, but
+**  	the field boundaries were found when the table was compiled.
+*/
+
+static int
+dkimf_db_ctable_split(struct dkimf_db_ctable *ct, struct dkimf_ctable_rec *cr,
+                      DKIMF_DBDATA req, unsigned int reqnum)
+{
+	_Bool done = FALSE;
+	int ret = 0;
+	unsigned int ridx;
+	uint32_t start;
+	uint32_t clen;
+	uint32_t *fields;
+	char *value;
+
+	assert(ct != NULL);
+	assert(cr != NULL);
+
+	if (req == NULL || reqnum == 0)
+		return 0;
+
+	value = ct->ct_map + cr->cr_value;
+	fields = (uint32_t *) (ct->ct_map + cr->cr_fields);
+
+	for (ridx = 0; ridx < reqnum; ridx++)
+	{
+		if (done || ridx >= cr->cr_nfields)
+			break;
+
+		start = fields[ridx];
+		if (start >= cr->cr_vallen)
+			break;
+
+		if ((req[ridx].dbdata_flags & DKIMF_DB_DATA_BINARY) != 0 ||
+		    ridx == reqnum - 1 || ridx == cr->cr_nfields - 1)
+		{
+			clen = cr->cr_vallen - start;
+			done = TRUE;
+		}
+		else
+		{
+			if (fields[ridx + 1] <= start ||
+			    fields[ridx + 1] > cr->cr_vallen)
+				break;
+
+			clen = fields[ridx + 1] - start - 1;
+		}
+
+		memcpy(req[ridx].dbdata_buffer, value + start,
+		       MIN(clen, req[ridx].dbdata_buflen));
+		req[ridx].dbdata_buflen = clen;
+	}
+
+	/* mark the ones that got no data */
+	if (ridx < reqnum)
+	{
+		int c;
+
+		for (c = ridx; c < reqnum; c++)
+		{
+			if ((req[c].dbdata_flags & DKIMF_DB_DATA_OPTIONAL) == 0)
+				ret = -1;
+			req[c].dbdata_buflen = (size_t) -1;
+		}
+	}
+
+	return ret;
+}
+
+/*
+**  DKIMF_DB_CTABLE_GET -- look up a key in a compiled table
+**
+**  Parameters:
+**  	db -- DKIMF_DB handle
+**  	buf -- key
+**  	buflen -- bytes at "buf" (use strlen() if 0)
+**  	req -- list of data requests
+**  	reqnum -- number of data requests
+**  	exists -- whether or not the record was found (returned; may be NULL)
+**
+**  Return value:
+**  	As for dkimf_db_get().
+**
+**  Notes:
+**  	Matches the way "file" data sets are searched, including duplicate
+**  	keys and DKIMF_DB_FLAG_ICASE and DKIMF_DB_FLAG_MATCHBOTH handling,
+**  	but without walking the whole list or allocating anything.
+*/
+
+static int
+dkimf_db_ctable_get(DKIMF_DB db, void *buf, size_t buflen,
+                    DKIMF_DBDATA req, unsigned int reqnum, _Bool *exists)
+{
+	_Bool matched = FALSE;
+	uint32_t c;
+	uint32_t d;
+	uint32_t s;
+	size_t keylen;
+	char *key;
+	struct dkimf_db_ctable *ct;
+	struct dkimf_ctable_hdr *hdr;
+	struct dkimf_ctable_slot *cs;
+	struct dkimf_ctable_rec *cr = NULL;
+
+	ct = (struct dkimf_db_ctable *) DKIMF_DB_HANDLE(db);
+	hdr = ct->ct_hdr;
+
+	keylen = (buflen == 0 ? strlen(buf) : buflen);
+
+	if (hdr->ch_nkeys != 0)
+	{
+		d = ct->ct_disp[dkimf_ctable_hash(buf, keylen, hdr->ch_salt) %
+		                hdr->ch_nbuckets];
+		if ((d & DKIMF_CTABLE_DIRECT) != 0)
+		{
+			s = d & ~DKIMF_CTABLE_DIRECT;
+		}
+		else
+		{
+			s = dkimf_ctable_hash(buf, keylen,
+			                      hdr->ch_salt + 1 + d) % hdr->ch_nkeys;
+		}
+
+		cs = (s < hdr->ch_nkeys ? &ct->ct_slots[s] : NULL);
+		if (cs != NULL &&
+		    (cs->cs_first > hdr->ch_nrecs ||
+		     cs->cs_count > hdr->ch_nrecs - cs->cs_first))
+			cs = NULL;
+
+		for (c = 0; cs != NULL && c < cs->cs_count; c++)
+		{
+			cr = &ct->ct_recs[cs->cs_first + c];
+			if (!dkimf_db_ctable_recok(ct, cr) ||
+			    cr->cr_keylen != keylen)
+				break;
+
+			key = ct->ct_map + cr->cr_key;
+
+			if ((db->db_flags & DKIMF_DB_FLAG_ICASE) == 0)
+				matched = (memcmp(buf, key, keylen) == 0);
+			else
+				matched = (strncasecmp(buf, key, keylen) == 0);
+
+			if (!matched)
+				continue;
+
+			if ((db->db_flags & DKIMF_DB_FLAG_MATCHBOTH) == 0 ||
+			    reqnum == 0 || cr->cr_value == 0)
+				break;
+
+			if ((db->db_flags & DKIMF_DB_FLAG_ICASE) == 0)
+			{
+				matched = (strncmp(req[0].dbdata_buffer,
+				                   ct->ct_map + cr->cr_value,
+				                   req[0].dbdata_buflen) == 0);
+			}
+			else
+			{
+				matched = (strncasecmp(req[0].dbdata_buffer,
+				                       ct->ct_map + cr->cr_value,
+				                       req[0].dbdata_buflen) == 0);
+			}
+
+			if (matched)
+				break;
+		}
+	}
+
+	if (exists != NULL)
+		*exists = matched;
+
+	if (matched && cr->cr_value != 0 && reqnum != 0)
+	{
+		if (dkimf_db_ctable_split(ct, cr, req, reqnum) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+#endif /* _FFR_CTABLE */
+
+#ifdef _FFR_DB_AUTORELOAD
+/*
+**  DKIMF_DB_RELOAD_HANDLE -- get the list currently published by a data set
+**
+**  Parameters:
+**  	db -- FILE, CSL or REFILE data set
+**
+**  Return value:
+**  	The list to search.
+**
+**  Notes:
+**  	A list replaced by a reload is not freed for another
+**  	DKIMF_DB_RELOAD_GRACE seconds, so a caller can keep using the one
+**  	it got here (e.g. across dkimf_db_rewalk() calls) without holding
+**  	a lock; it just won't see the new contents until it starts over.
+**  	The reload state is fetched once, since dkimf_db_mkarray() may
+**  	drop it meanwhile; it isn't freed for the same grace period.
+*/
+
+static void *
+dkimf_db_reload_handle(DKIMF_DB db)
+{
+	void *h;
+	struct dkimf_db_reload *rl;
+
+	rl = db->db_reload;
+	if (rl == NULL)
+		return db->db_handle;
+
+	pthread_rwlock_rdlock(&rl->rl_lock);
+	h = db->db_handle;
+	pthread_rwlock_unlock(&rl->rl_lock);
+
+	return h;
+}
+
+/*
+**  DKIMF_DB_RELOAD_STALE -- see if a data set's file has changed
+**
+**  Parameters:
+**  	a -- stat() result
+**  	b -- another stat() result
+**
+**  Return value:
+**  	TRUE iff "a" and "b" describe different files or different versions
+**  	of the same one.
+*/
+
+static _Bool
+dkimf_db_reload_stale(struct stat *a, struct stat *b)
+{
+	assert(a != NULL);
+	assert(b != NULL);
+
+	return (a->st_dev != b->st_dev ||
+	        a->st_ino != b->st_ino ||
+	        a->st_size != b->st_size ||
+	        a->st_mtime != b->st_mtime ||
+	        a->st_ctime != b->st_ctime);
+}
+
+/*
+**  DKIMF_DB_RELOAD_REAP -- free replaced lists
+**
+**  Parameters:
+**  	rl -- reload state
+**  	now -- current time, or 0 to free all of them
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_db_reload_reap(struct dkimf_db_reload *rl, time_t now)
+{
+	struct dkimf_db_retired *rt;
+	struct dkimf_db_retired *next;
+	struct dkimf_db_retired **prev;
+
+	assert(rl != NULL);
+
+	prev = &rl->rl_retired;
+
+	for (rt = rl->rl_retired; rt != NULL; rt = next)
+	{
+		next = rt->rt_next;
+
+		if (now != 0 && now - rt->rt_when < DKIMF_DB_RELOAD_GRACE)
+		{
+			prev = &rt->rt_next;
+			continue;
+		}
+
+		*prev = next;
+
+		if (rt->rt_handle != NULL)
+		{
+			if (rl->rl_type == DKIMF_DB_TYPE_REFILE)
+				dkimf_db_relist_free(rt->rt_handle);
+# ifdef _FFR_CTABLE
+			else if (rl->rl_type == DKIMF_DB_TYPE_CTABLE)
+				dkimf_db_ctable_free(rt->rt_handle);
+# endif /* _FFR_CTABLE */
+			else
+				dkimf_db_list_free(rt->rt_handle);
+		}
+
+		free(rt);
+	}
+}
+
+/*
+**  DKIMF_DB_RELOAD_FREE -- free reload state and the lists it replaced
+**
+**  Parameters:
+**  	rl -- reload state, no longer on any list
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_db_reload_free(struct dkimf_db_reload *rl)
+{
+	assert(rl != NULL);
+
+	dkimf_db_reload_reap(rl, 0);
+	pthread_rwlock_destroy(&rl->rl_lock);
+	free(rl->rl_name);
+	free(rl->rl_path);
+	free(rl);
+}
+
+# ifdef HAVE_SYS_INOTIFY_H
+/*
+**  DKIMF_DB_RELOAD_WATCH -- watch the directory containing a data set
+**
+**  Parameters:
+**  	rl -- reload state
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Caller must hold reload_lock.  The directory is watched rather than
+**  	the file so that a new copy renamed into place is noticed.  If
+**  	this fails, the watcher thread's periodic stat() still catches
+**  	the change.
+*/
+
+static void
+dkimf_db_reload_watch(struct dkimf_db_reload *rl)
+{
+	char *slash;
+	char dir[BUFRSZ + 1];
+
+	assert(rl != NULL);
+
+	if (reload_ifd == -1 || rl->rl_wd != -1)
+		return;
+
+	strlcpy(dir, rl->rl_path, sizeof dir);
+	slash = strrchr(dir, '/');
+	if (slash == NULL)
+		strlcpy(dir, ".", sizeof dir);
+	else if (slash == dir)
+		*(slash + 1) = '\0';
+	else
+		*slash = '\0';
+
+	rl->rl_wd = inotify_add_watch(reload_ifd, dir,
+	                              DKIMF_DB_RELOAD_WATCHMASK);
+}
+# endif /* HAVE_SYS_INOTIFY_H */
+
+/*
+**  DKIMF_DB_RELOAD_CHECK -- reload a data set if its file has changed
+**
+**  Parameters:
+**  	rl -- reload state
+**  	now -- current time
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Caller must hold reload_lock.  The new list is built completely
+**  	before it is swapped in under the write lock, so a query sees
+**  	either all of the old contents or all of the new.  The result
+**  	cache is flushed under the same lock, before any query can get
+**  	the new list; a query that got the old one started before the
+**  	flush, so dkimf_db_cache_put() won't record its answer.  If the
+**  	file can't be parsed, the old contents stay in use until it
+**  	changes again.
+*/
+
+static void
+dkimf_db_reload_check(struct dkimf_db_reload *rl, time_t now)
+{
+	int status;
+	char *err = NULL;
+	void *old;
+	DKIMF_DB db;
+	DKIMF_DB new;
+	struct dkimf_db_retired *rt;
+	struct stat s;
+	struct stat s2;
+
+	assert(rl != NULL);
+
+	if (stat(rl->rl_path, &s) != 0 ||
+	    !dkimf_db_reload_stale(&s, &rl->rl_stat))
+		return;
+
+	db = rl->rl_db;
+
+	status = dkimf_db_open(&new, rl->rl_name,
+	                       (db->db_flags & ~(DKIMF_DB_FLAG_AUTORELOAD |
+	                                         DKIMF_DB_FLAG_MAKELOCK)),
+	                       NULL, &err);
+	if (status != 0)
+	{
+		if (reload_dolog)
+		{
+			syslog(LOG_ERR, "%s: reload failed: %s", rl->rl_path,
+			       err == NULL ? "unknown error" : err);
+		}
+
+		memcpy(&rl->rl_stat, &s, sizeof rl->rl_stat);
+		return;
+	}
+
+	/* modified again while being read; try again on the next pass */
+	if (stat(rl->rl_path, &s2) != 0 || dkimf_db_reload_stale(&s, &s2))
+	{
+		(void) dkimf_db_close(new);
+		return;
+	}
+
+	rt = (struct dkimf_db_retired *) malloc(sizeof *rt);
+	if (rt == NULL)
+	{
+		(void) dkimf_db_close(new);
+		return;
+	}
+
+	pthread_rwlock_wrlock(&rl->rl_lock);
+# ifdef _FFR_DB_CACHE
+	if (db->db_cache != NULL)
+		dkimf_db_cache_flush(db->db_cache);
+# endif /* _FFR_DB_CACHE */
+	old = db->db_handle;
+	db->db_handle = new->db_handle;
+	db->db_nrecs = new->db_nrecs;
+	pthread_rwlock_unlock(&rl->rl_lock);
+
+	new->db_handle = NULL;
+	(void) dkimf_db_close(new);
+
+	rt->rt_when = now;
+	rt->rt_handle = old;
+	rt->rt_next = rl->rl_retired;
+	rl->rl_retired = rt;
+
+	memcpy(&rl->rl_stat, &s, sizeof rl->rl_stat);
+
+	if (reload_dolog)
+	{
+		syslog(LOG_INFO, "%s: reloaded, %d record(s)", rl->rl_path,
+		       db->db_nrecs);
+	}
+}
+
+/*
+**  DKIMF_DB_RELOAD_WATCHER -- thread that reloads changed data sets
+**
+**  Parameters:
+**  	arg -- unused
+**
+**  Return value:
+**  	Always NULL.
+**
+**  Notes:
+**  	Wakes up when inotify reports a change in one of the watched
+**  	directories, or every DKIMF_DB_RELOAD_CHECKINT seconds otherwise,
+**  	and stat()s each registered file.  Only the data sets whose files
+**  	changed are rebuilt.
+*/
+
+static void *
+dkimf_db_reload_watcher(void *arg)
+{
+	time_t now;
+	struct dkimf_db_reload *rl;
+	struct dkimf_db_reload **prev;
+# ifdef HAVE_SYS_INOTIFY_H
+	ssize_t len;
+	struct pollfd pfd;
+	char buf[DKIMF_DB_RELOAD_EVBUFSZ]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+# endif /* HAVE_SYS_INOTIFY_H */
+
+	pthread_detach(pthread_self());
+
+	for (;;)
+	{
+# ifdef HAVE_SYS_INOTIFY_H
+		if (reload_ifd != -1)
+		{
+			pfd.fd = reload_ifd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+
+			if (poll(&pfd, 1, DKIMF_DB_RELOAD_CHECKINT * 1000) > 0)
+			{
+				/* which file changed doesn't matter */
+				len = read(reload_ifd, buf, sizeof buf);
+				if (len == 0 || (len < 0 && errno != EINTR))
+				{
+					/* lost the event source; just poll */
+					pthread_mutex_lock(&reload_lock);
+					(void) close(reload_ifd);
+					reload_ifd = -1;
+					pthread_mutex_unlock(&reload_lock);
+				}
+			}
+		}
+		else
+# endif /* HAVE_SYS_INOTIFY_H */
+		(void) sleep(DKIMF_DB_RELOAD_CHECKINT);
+
+		(void) time(&now);
+
+		pthread_mutex_lock(&reload_lock);
+
+		for (rl = reloads; rl != NULL; rl = rl->rl_next)
+		{
+			dkimf_db_reload_check(rl, now);
+			dkimf_db_reload_reap(rl, now);
+		}
+
+		for (prev = &reload_dropped; *prev != NULL; )
+		{
+			rl = *prev;
+
+			dkimf_db_reload_reap(rl, now);
+
+			if (rl->rl_retired != NULL ||
+			    now - rl->rl_dropped < DKIMF_DB_RELOAD_GRACE)
+			{
+				prev = &rl->rl_next;
+				continue;
+			}
+
+			*prev = rl->rl_next;
+			dkimf_db_reload_free(rl);
+		}
+
+		pthread_mutex_unlock(&reload_lock);
+	}
+
+	return NULL;
+}
+
+/*
+**  DKIMF_DB_RELOAD_ADD -- start watching a data set for changes
+**
+**  Parameters:
+**  	db -- FILE or REFILE data set
+**  	name -- name with which it was opened
+**  	sb -- stat() of the file as it was read
+**
+**  Return value:
+**  	0 on success, -1 on error (errno will be set).
+*/
+
+static int
+dkimf_db_reload_add(DKIMF_DB db, char *name, struct stat *sb)
+{
+	int status;
+	char *path;
+	struct dkimf_db_reload *rl;
+
+	assert(db != NULL);
+	assert(name != NULL);
+	assert(sb != NULL);
+
+	path = strchr(name, ':');
+	path = (path == NULL ? name : path + 1);
+
+	rl = (struct dkimf_db_reload *) malloc(sizeof *rl);
+	if (rl == NULL)
+		return -1;
+
+	memset(rl, '\0', sizeof *rl);
+
+	rl->rl_wd = -1;
+	rl->rl_type = db->db_type;
+	rl->rl_db = db;
+	memcpy(&rl->rl_stat, sb, sizeof rl->rl_stat);
+
+	rl->rl_name = strdup(name);
+	rl->rl_path = strdup(path);
+	if (rl->rl_name == NULL || rl->rl_path == NULL)
+	{
+		if (rl->rl_name != NULL)
+			free(rl->rl_name);
+		if (rl->rl_path != NULL)
+			free(rl->rl_path);
+		free(rl);
+		return -1;
+	}
+
+	status = pthread_rwlock_init(&rl->rl_lock, NULL);
+	if (status != 0)
+	{
+		free(rl->rl_name);
+		free(rl->rl_path);
+		free(rl);
+		errno = status;
+		return -1;
+	}
+
+	pthread_mutex_lock(&reload_lock);
+
+	rl->rl_next = reloads;
+	reloads = rl;
+# ifdef HAVE_SYS_INOTIFY_H
+	dkimf_db_reload_watch(rl);
+# endif /* HAVE_SYS_INOTIFY_H */
+
+	db->db_reload = rl;
+
+	pthread_mutex_unlock(&reload_lock);
+
+	return 0;
+}
+
+/*
+**  DKIMF_DB_RELOAD_REMOVE -- stop watching a data set for changes
+**
+**  Parameters:
+**  	db -- data set
+**  	defer -- data set stays open; others may still be searching it
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Waits for a reload of this data set that is in progress.  When
+**  	the data set is being closed, nothing may still be using it, so
+**  	the lists it replaced are freed at once.  Otherwise the reload
+**  	state goes to the watcher thread, which frees those lists, and
+**  	then the state itself, DKIMF_DB_RELOAD_GRACE seconds after they
+**  	were replaced and it was dropped; a query may still have either
+**  	in hand until then.
+*/
+
+static void
+dkimf_db_reload_remove(DKIMF_DB db, _Bool defer)
+{
+	struct dkimf_db_reload *rl;
+	struct dkimf_db_reload **prev;
+# ifdef HAVE_SYS_INOTIFY_H
+	struct dkimf_db_reload *cur;
+# endif /* HAVE_SYS_INOTIFY_H */
+
+	assert(db != NULL);
+	assert(db->db_reload != NULL);
+
+	rl = db->db_reload;
+
+	pthread_mutex_lock(&reload_lock);
+
+	for (prev = &reloads; *prev != NULL; prev = &(*prev)->rl_next)
+	{
+		if (*prev == rl)
+		{
+			*prev = rl->rl_next;
+			break;
+		}
+	}
+
+# ifdef HAVE_SYS_INOTIFY_H
+	if (reload_ifd != -1 && rl->rl_wd != -1)
+	{
+		for (cur = reloads; cur != NULL; cur = cur->rl_next)
+		{
+			if (cur->rl_wd == rl->rl_wd)
+				break;
+		}
+
+		if (cur == NULL)
+			(void) inotify_rm_watch(reload_ifd, rl->rl_wd);
+	}
+# endif /* HAVE_SYS_INOTIFY_H */
+
+	db->db_reload = NULL;
+
+	if (defer)
+	{
+		rl->rl_wd = -1;
+		rl->rl_db = NULL;
+		(void) time(&rl->rl_dropped);
+		rl->rl_next = reload_dropped;
+		reload_dropped = rl;
+		pthread_mutex_unlock(&reload_lock);
+		return;
+	}
+
+	pthread_mutex_unlock(&reload_lock);
+
+	dkimf_db_reload_free(rl);
+}
+
+/*
+**  DKIMF_DB_RELOAD_START -- start reloading changed data sets
+**
+**  Parameters:
+**  	dolog -- log reloads and reload failures?
+**
+**  Return value:
+**  	0 -- success
+**  	-1 -- error; errno will be set
+**
+**  Notes:
+**  	Applies to FILE and REFILE data sets opened with
+**  	DKIMF_DB_FLAG_AUTORELOAD, including ones opened later.  Call this
+**  	after any fork(), since it starts a thread.  Safe to call more
+**  	than once.
+*/
+
+int
+dkimf_db_reload_start(_Bool dolog)
+{
+	int status;
+# ifdef HAVE_SYS_INOTIFY_H
+	struct dkimf_db_reload *rl;
+# endif /* HAVE_SYS_INOTIFY_H */
+
+	pthread_mutex_lock(&reload_lock);
+
+	reload_dolog = dolog;
+
+	if (reload_running)
+	{
+		pthread_mutex_unlock(&reload_lock);
+		return 0;
+	}
+
+# ifdef HAVE_SYS_INOTIFY_H
+	reload_ifd = inotify_init();
+	for (rl = reloads; rl != NULL; rl = rl->rl_next)
+		dkimf_db_reload_watch(rl);
+# endif /* HAVE_SYS_INOTIFY_H */
+
+	status = pthread_create(&reload_thread, NULL,
+	                        dkimf_db_reload_watcher, NULL);
+	if (status != 0)
+	{
+# ifdef HAVE_SYS_INOTIFY_H
+		if (reload_ifd != -1)
+		{
+			(void) close(reload_ifd);
+			reload_ifd = -1;
+		}
+
+		for (rl = reloads; rl != NULL; rl = rl->rl_next)
+			rl->rl_wd = -1;
+# endif /* HAVE_SYS_INOTIFY_H */
+
+		pthread_mutex_unlock(&reload_lock);
+		errno = status;
+		return -1;
+	}
+
+	reload_running = TRUE;
+
+	pthread_mutex_unlock(&reload_lock);
+
+	return 0;
+}
+#endif /* _FFR_DB_AUTORELOAD */
+
+#ifdef USE_DB
+/*
+**  DKIMF_DB_OPEN_BDB -- open a Berkeley DB file
+**
+**  Parameters:
+**  	path -- path to the file (NULL for an in-memory database)
+**  	readonly -- open read-only?
+**  	bdb -- DB handle (returned)
+**
+**  Return value:
+**  	0 on success, a Berkeley DB error code otherwise.
+*/
+
+static int
+dkimf_db_open_bdb(char *path, _Bool readonly, DB **bdb)
+{
+# if DB_VERSION_CHECK(2,0,0)
+	int dbflags = 0;
+# endif /* DB_VERSION_CHECK(2,0,0) */
+	int status = 0;
+	DBTYPE bdbtype;
+	DB *newdb;
+
+	assert(bdb != NULL);
+
+# if DB_VERSION_CHECK(2,0,0)
+	if (readonly)
+	{
+		dbflags |= DB_RDONLY;
+		bdbtype = DB_UNKNOWN;
+	}
+	else
+	{
+		dbflags |= DB_CREATE;
+		bdbtype = DB_HASH;
+	}
+# else /* DB_VERSION_CHECK(2,0,0) */
+	bdbtype = DB_HASH;
+# endif /* DB_VERSION_CHECK(2,0,0) */
+
+# if DB_VERSION_CHECK(3,0,0)
+	status = db_create(&newdb, NULL, 0);
+	if (status == 0)
+	{
+#  if DB_VERSION_CHECK(4,1,25)
+		status = newdb->open(newdb, NULL, path, NULL,
+		                     bdbtype, dbflags, 0);
+#  else /* DB_VERSION_CHECK(4,1,25) */
+		status = newdb->open(newdb, path, NULL, bdbtype,
+		                     dbflags, 0);
+#  endif /* DB_VERSION_CHECK(4,1,25) */
+	}
+# elif DB_VERSION_CHECK(2,0,0)
+	status = db_open(path, bdbtype, dbflags, DKIMF_DB_MODE,
+	                 NULL, NULL, &newdb);
+# else /* DB_VERSION_CHECK(2,0,0) */
+	newdb = dbopen(path, readonly ? O_RDONLY : (O_CREAT|O_RDWR),
+	               DKIMF_DB_MODE, bdbtype, NULL);
+	if (newdb == NULL)
+		status = errno;
+# endif /* DB_VERSION_CHECK */
+
+	if (status == 0)
+		*bdb = newdb;
+
+	return status;
+}
+
+# ifdef _FFR_BDB_SNAPSHOT
+/*
+**  DKIMF_DB_SNAP_HASH -- hash a key for a Berkeley DB snapshot
+**
+**  Parameters:
+**  	key -- key
+**  	keylen -- bytes at "key"
+**
+**  Return value:
+**  	Hash of "key".
+*/
+
+static unsigned int
+dkimf_db_snap_hash(const char *key, size_t keylen)
+{
+	size_t c;
+	unsigned int h = 5381;
+
+	for (c = 0; c < keylen; c++)
+		h = ((h << 5) + h) ^ (unsigned char) key[c];
+
+	return h;
+}
+
+/*
+**  DKIMF_DB_SNAP_FREE -- destroy a Berkeley DB snapshot
+**
+**  Parameters:
+**  	snap -- snapshot to destroy
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_db_snap_free(struct dkimf_db_snapshot *snap)
+{
+	u_int c;
+	struct dkimf_db_snapentry *se;
+	struct dkimf_db_snapentry *next;
+
+	assert(snap != NULL);
+
+	for (c = 0; c < snap->snap_nbuckets; c++)
+	{
+		for (se = snap->snap_buckets[c]; se != NULL; se = next)
+		{
+			next = se->se_next;
+			free(se);
+		}
+	}
+
+	free(snap->snap_buckets);
+	free(snap);
+}
+
+/*
+**  DKIMF_DB_SNAP_LOAD -- copy a Berkeley DB file into memory
+**
+**  Parameters:
+**  	path -- path to the file
+**  	sb -- stat() of the file, taken before it was read (returned)
+**  	snap -- new snapshot (returned)
+**
+**  Return value:
+**  	0 on success, a Berkeley DB error code or errno value otherwise.
+*/
+
+static int
+dkimf_db_snap_load(char *path, struct stat *sb,
+                   struct dkimf_db_snapshot **snap)
+{
+	_Bool first;
+	int status;
+	u_int c;
+	u_int n = 0;
+	DB *bdb;
+	DBT k;
+	DBT d;
+# if DB_VERSION_CHECK(2,0,0)
+	DBC *dbc;
+# endif /* DB_VERSION_CHECK(2,0,0) */
+	struct dkimf_db_snapentry *se;
+	struct dkimf_db_snapentry *next;
+	struct dkimf_db_snapentry *list = NULL;
+	struct dkimf_db_snapshot *new;
+
+	assert(path != NULL);
+	assert(sb != NULL);
+	assert(snap != NULL);
+
+	if (stat(path, sb) != 0)
+		return errno;
+
+	status = dkimf_db_open_bdb(path, TRUE, &bdb);
+	if (status != 0)
+		return status;
+
+# if DB_VERSION_CHECK(2,0,0)
+	status = bdb->cursor(bdb, NULL, &dbc, 0);
+	if (status != 0)
+	{
+		(void) DKIMF_DBCLOSE(bdb);
+		return status;
+	}
+# endif /* DB_VERSION_CHECK(2,0,0) */
+
+	for (first = TRUE; ; first = FALSE)
+	{
+		memset(&k, '\0', sizeof k);
+		memset(&d, '\0', sizeof d);
+
+# if DB_VERSION_CHECK(2,0,0)
+		status = dbc->c_get(dbc, &k, &d, first ? DB_FIRST : DB_NEXT);
+# else /* DB_VERSION_CHECK(2,0,0) */
+		status = bdb->seq(bdb, &k, &d, first ? R_FIRST : R_NEXT);
+# endif /* DB_VERSION_CHECK(2,0,0) */
+		if (status == DB_NOTFOUND)
+		{
+			status = 0;
+			break;
+		}
+		else if (status != 0)
+		{
+			break;
+		}
+
+		se = (struct dkimf_db_snapentry *) malloc(sizeof *se +
+		                                          k.size + d.size + 1);
+		if (se == NULL)
+		{
+			status = errno;
+			break;
+		}
+
+		se->se_key = (char *) (se + 1);
+		se->se_keylen = k.size;
+		memcpy(se->se_key, k.data, k.size);
+		se->se_value = se->se_key + k.size;
+		se->se_vallen = d.size;
+		memcpy(se->se_value, d.data, d.size);
+		se->se_value[d.size] = '\0';
+		se->se_hash = dkimf_db_snap_hash(se->se_key, se->se_keylen);
+
+		se->se_next = list;
+		list = se;
+		n++;
+	}
+
+# if DB_VERSION_CHECK(2,0,0)
+	(void) dbc->c_close(dbc);
+# endif /* DB_VERSION_CHECK(2,0,0) */
+	(void) DKIMF_DBCLOSE(bdb);
+
+	new = NULL;
+	if (status == 0)
+	{
+		new = (struct dkimf_db_snapshot *) malloc(sizeof *new);
+		if (new == NULL)
+		{
+			status = errno;
+		}
+		else
+		{
+			new->snap_nbuckets = MAX(n, DKIMF_DB_SNAP_MINBUCKETS);
+			new->snap_buckets = calloc(new->snap_nbuckets,
+			                           sizeof *new->snap_buckets);
+			if (new->snap_buckets == NULL)
+			{
+				status = errno;
+				free(new);
+				new = NULL;
+			}
+		}
+	}
+
+	if (new == NULL)
+	{
+		for (se = list; se != NULL; se = next)
+		{
+			next = se->se_next;
+			free(se);
+		}
+
+		return status;
+	}
+
+	for (se = list; se != NULL; se = next)
+	{
+		next = se->se_next;
+		c = se->se_hash % new->snap_nbuckets;
+		se->se_next = new->snap_buckets[c];
+		new->snap_buckets[c] = se;
+	}
+
+	*snap = new;
+
+	return 0;
+}
+
+/*
+**  DKIMF_DB_SNAP_CHECK -- reload a snapshot if its file has changed
+**
+**  Parameters:
+**  	bs -- snapshot state
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Caller must hold snap_lock.  The new snapshot is built completely
+**  	before it is swapped in under the write lock; readers carry on with
+**  	the old one meanwhile.  If the reload fails, the old snapshot stays
+**  	in use and the check is repeated on the next pass.
+*/
+
+static void
+dkimf_db_snap_check(struct dkimf_db_bdbsnap *bs)
+{
+	struct stat s;
+	struct dkimf_db_snapshot *new;
+	struct dkimf_db_snapshot *old;
+
+	assert(bs != NULL);
+
+	if (stat(bs->bs_path, &s) != 0 ||
+	    (s.st_dev == bs->bs_stat.st_dev &&
+	     s.st_ino == bs->bs_stat.st_ino &&
+	     s.st_size == bs->bs_stat.st_size &&
+	     s.st_mtime == bs->bs_stat.st_mtime))
+		return;
+
+	if (dkimf_db_snap_load(bs->bs_path, &s, &new) != 0)
+		return;
+
+	pthread_rwlock_wrlock(&bs->bs_lock);
+	old = bs->bs_snap;
+	bs->bs_snap = new;
+	pthread_rwlock_unlock(&bs->bs_lock);
+
+	memcpy(&bs->bs_stat, &s, sizeof bs->bs_stat);
+
+	dkimf_db_snap_free(old);
+}
+
+/*
+**  DKIMF_DB_SNAP_WATCHER -- thread that reloads changed snapshots
+**
+**  Parameters:
+**  	arg -- unused
+**
+**  Return value:
+**  	Always NULL.
+**
+**  Notes:
+**  	Every DKIMF_DB_SNAP_CHECKINT seconds, stat()s the file behind
+**  	each registered snapshot and reloads the ones that changed, so
+**  	that cost is never charged to a lookup.
+*/
+
+static void *
+dkimf_db_snap_watcher(void *arg)
+{
+	struct dkimf_db_bdbsnap *bs;
+
+	pthread_detach(pthread_self());
+
+	for (;;)
+	{
+		(void) sleep(DKIMF_DB_SNAP_CHECKINT);
+
+		pthread_mutex_lock(&snap_lock);
+
+		for (bs = snaps; bs != NULL; bs = bs->bs_next)
+			dkimf_db_snap_check(bs);
+
+		pthread_mutex_unlock(&snap_lock);
+	}
+
+	return NULL;
+}
+
+/*
+**  DKIMF_DB_SNAP_REMOVE -- stop watching a snapshot's file
+**
+**  Parameters:
+**  	bs -- snapshot state
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Waits for a reload that is in progress.
+*/
+
+static void
+dkimf_db_snap_remove(struct dkimf_db_bdbsnap *bs)
+{
+	struct dkimf_db_bdbsnap **prev;
+
+	assert(bs != NULL);
+
+	pthread_mutex_lock(&snap_lock);
+
+	for (prev = &snaps; *prev != NULL; prev = &(*prev)->bs_next)
+	{
+		if (*prev == bs)
+		{
+			*prev = bs->bs_next;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&snap_lock);
+}
+
+/*
+**  DKIMF_DB_SNAP_GET -- look up a key in a Berkeley DB snapshot
+**
+**  Parameters:
+**  	db -- DKIMF_DB handle
+**  	buf -- key
+**  	buflen -- bytes at "buf" (use strlen() if 0)
+**  	req -- list of data requests
+**  	reqnum -- number of data requests
+**  	exists -- whether or not the record was found (returned; may be NULL)
+**
+**  Return value:
+**  	As for dkimf_db_get().
+**
+**  Notes:
+**  	Readers share the snapshot under a read lock and never touch the
+**  	Berkeley DB handle or its file lock, so they proceed in parallel.
+**  	Changes to the file are picked up by dkimf_db_snap_watcher().
+*/
+
+static int
+dkimf_db_snap_get(DKIMF_DB db, void *buf, size_t buflen,
+                  DKIMF_DBDATA req, unsigned int reqnum, _Bool *exists)
+{
+	int ret = 0;
+	unsigned int h;
+	size_t keylen;
+	struct dkimf_db_bdbsnap *bs;
+	struct dkimf_db_snapentry *se;
+
+	bs = (struct dkimf_db_bdbsnap *) db->db_data;
+
+	keylen = (buflen == 0 ? strlen(buf) : buflen);
+	h = dkimf_db_snap_hash(buf, keylen);
+
+	pthread_rwlock_rdlock(&bs->bs_lock);
+
+	for (se = bs->bs_snap->snap_buckets[h % bs->bs_snap->snap_nbuckets];
+	     se != NULL;
+	     se = se->se_next)
+	{
+		if (se->se_hash == h && se->se_keylen == keylen &&
+		    memcmp(se->se_key, buf, keylen) == 0)
+			break;
+	}
+
+	if (exists != NULL)
+		*exists = (se != NULL);
+
+	if (se != NULL && reqnum != 0)
+		ret = dkimf_db_datasplit(se->se_value, se->se_vallen, req, reqnum);
+
+	pthread_rwlock_unlock(&bs->bs_lock);
+
+	return ret;
+}
+
+/*
+**  DKIMF_DB_SNAP_START -- start reloading changed Berkeley DB snapshots
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	0 -- success
+**  	-1 -- error; errno will be set
+**
+**  Notes:
+**  	Applies to snapshots of data sets opened with
+**  	DKIMF_DB_FLAG_SNAPSHOT, including ones opened later.  Call this
+**  	after any fork(), since it starts a thread.  Safe to call more
+**  	than once.
+*/
+
+int
+dkimf_db_snap_start(void)
+{
+	int status;
+
+	pthread_mutex_lock(&snap_lock);
+
+	if (snap_running)
+	{
+		pthread_mutex_unlock(&snap_lock);
+		return 0;
+	}
+
+	status = pthread_create(&snap_thread, NULL, dkimf_db_snap_watcher,
+	                        NULL);
+	if (status != 0)
+	{
+		pthread_mutex_unlock(&snap_lock);
+		errno = status;
+		return -1;
+	}
+
+	snap_running = TRUE;
+
+	pthread_mutex_unlock(&snap_lock);
+
+	return 0;
+}
+# endif /* _FFR_BDB_SNAPSHOT */
+#endif /* USE_DB */
+
+#ifdef USE_MDB
+/*
+**  DKIMF_DB_MDB_TXNFREE -- end a thread's MDB read transaction
+**
+**  Parameters:
+**  	arg -- the thread's dkimf_db_mdbtxn
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Called via pthread_key_create() when a thread that has done lookups
+**  	exits.
+*/
+
+static void
+dkimf_db_mdb_txnfree(void *arg)
+{
+	struct dkimf_db_mdbtxn *mt;
+	struct dkimf_db_mdb *mdb;
+
+	assert(arg != NULL);
+
+	mt = (struct dkimf_db_mdbtxn *) arg;
+	mdb = mt->mt_mdb;
+
+	pthread_mutex_lock(&mdb->mdb_lock);
+	if (mt->mt_prev != NULL)
+		mt->mt_prev->mt_next = mt->mt_next;
+	else
+		mdb->mdb_txns = mt->mt_next;
+	if (mt->mt_next != NULL)
+		mt->mt_next->mt_prev = mt->mt_prev;
+	pthread_mutex_unlock(&mdb->mdb_lock);
+
+	mdb_txn_abort(mt->mt_txn);
+	free(mt);
+}
+
+/*
+**  DKIMF_DB_MDB_BEGIN -- get the calling thread's MDB read transaction
+**
+**  Parameters:
+**  	mdb -- MDB environment
+**  	txn -- read transaction (returned)
+**
+**  Return value:
+**  	0 on success, an MDB error code or errno value otherwise.
+**
+**  Notes:
+**  	Each thread keeps one read-only transaction per environment, which
+**  	is renewed here and must be reset by the caller with
+**  	mdb_txn_reset() when it's done with any data it returned.
+**  	Renewing a reset transaction takes no locks, unlike beginning and
+**  	aborting a new one for every lookup.
+*/
+
+static int
+dkimf_db_mdb_begin(struct dkimf_db_mdb *mdb, MDB_txn **txn)
+{
+	int status;
+	struct dkimf_db_mdbtxn *mt;
+
+	assert(mdb != NULL);
+	assert(txn != NULL);
+
+	mt = (struct dkimf_db_mdbtxn *) pthread_getspecific(mdb->mdb_key);
+	if (mt != NULL)
+	{
+		status = mdb_txn_renew(mt->mt_txn);
+		if (status == 0)
+			*txn = mt->mt_txn;
+		return status;
+	}
+
+	mt = (struct dkimf_db_mdbtxn *) malloc(sizeof *mt);
+	if (mt == NULL)
+		return errno;
+
+	status = mdb_txn_begin(mdb->mdb_env, NULL, MDB_RDONLY, &mt->mt_txn);
+	if (status != 0)
+	{
+		free(mt);
+		return status;
+	}
+
+	status = pthread_setspecific(mdb->mdb_key, mt);
+	if (status != 0)
+	{
+		mdb_txn_abort(mt->mt_txn);
+		free(mt);
+		return status;
+	}
+
+	mt->mt_mdb = mdb;
+	mt->mt_prev = NULL;
+
+	pthread_mutex_lock(&mdb->mdb_lock);
+	mt->mt_next = mdb->mdb_txns;
+	if (mdb->mdb_txns != NULL)
+		mdb->mdb_txns->mt_prev = mt;
+	mdb->mdb_txns = mt;
+	pthread_mutex_unlock(&mdb->mdb_lock);
+
+	*txn = mt->mt_txn;
+
+	return 0;
+}
+#endif /* USE_MDB */
+
+#ifdef _FFR_SOCKETDB
+/*
+**  DKIMF_DB_SOCK_CONNECT -- open a further connection for a socket data set
+**
+**  Parameters:
+**  	sdb -- socket data set
+**
+**  Return value:
+**  	A connected descriptor, or -1 on error with errno set.
+*/
+
+static int
+dkimf_db_sock_connect(struct dkimf_db_socket *sdb)
+{
+	int fd;
+	int save_errno;
+
+	assert(sdb != NULL);
+
+	if (sdb->sockdb_addrlen == 0)
+	{
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	fd = socket(sdb->sockdb_addr.ss_family, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	if (connect(fd, (struct sockaddr *) &sdb->sockdb_addr,
+	            sdb->sockdb_addrlen) != 0)
+	{
+		save_errno = errno;
+		close(fd);
+		errno = save_errno;
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+**  DKIMF_DB_SOCK_QUERY -- query a socket data set, one query per connection
+**
+**  Parameters:
+**  	sdb -- socket data set
+**  	buf -- query
+**  	buflen -- bytes at "buf"
+**  	reply -- reply line without its newline (returned)
+**
+**  Return value:
+**  	0 on success, an errno value otherwise.
+**
+**  Notes:
+**  	A query only has to wait for a free connection, not for every other
+**  	outstanding query to be answered.  Connections are opened as they
+**  	are needed, up to the configured number, and one that fails or
+**  	times out is closed rather than reused since its state is unknown.
+*/
+
+static int
+dkimf_db_sock_query(struct dkimf_db_socket *sdb, void *buf, size_t buflen,
+                    struct dkimf_dstring *reply)
+{
+	int status = 0;
+	u_int c;
+	ssize_t rlen;
+	char *nl;
+	struct dkimf_db_sockconn *sc = NULL;
+	fd_set rfds;
+	struct timeval timeout;
+	struct iovec iov[2];
+	char inbuf[BUFRSZ];
+
+	assert(sdb != NULL);
+	assert(buf != NULL);
+	assert(reply != NULL);
+
+	pthread_mutex_lock(&sdb->sockdb_lock);
+
+	for (;;)
+	{
+		for (c = 0; c < sdb->sockdb_nconns; c++)
+		{
+			if (sdb->sockdb_conns[c].sc_busy)
+				continue;
+
+			if (sc == NULL ||
+			    (sc->sc_fd == -1 && sdb->sockdb_conns[c].sc_fd != -1))
+				sc = &sdb->sockdb_conns[c];
+		}
+
+		if (sc != NULL)
+			break;
+
+		pthread_cond_wait(&sdb->sockdb_cond, &sdb->sockdb_lock);
+	}
+
+	sc->sc_busy = TRUE;
+
+	pthread_mutex_unlock(&sdb->sockdb_lock);
+
+	if (sc->sc_fd == -1)
+	{
+		sc->sc_fd = dkimf_db_sock_connect(sdb);
+		if (sc->sc_fd == -1)
+			status = errno;
+	}
+
+	if (status == 0)
+	{
+		iov[0].iov_base = buf;
+		iov[0].iov_len = buflen;
+
+		iov[1].iov_base = "\n";
+		iov[1].iov_len = 1;
+
+		rlen = writev(sc->sc_fd, iov, 2);
+		if (rlen == -1)
+			status = errno;
+		else if ((size_t) rlen < buflen + 1)
+			status = EIO;
+	}
+
+	dkimf_dstring_blank(reply);
+
+	timeout.tv_sec = DKIMF_SOCKET_TIMEOUT;
+	timeout.tv_usec = 0;
+
+	while (status == 0)
+	{
+		FD_ZERO(&rfds);
+		FD_SET(sc->sc_fd, &rfds);
+
+		status = select(sc->sc_fd + 1, &rfds, NULL, NULL, &timeout);
+		if (status == 0)
+		{
+			status = ETIMEDOUT;
+			break;
+		}
+		else if (status < 0)
+		{
+			status = errno;
+			break;
+		}
+
+		rlen = read(sc->sc_fd, inbuf, sizeof inbuf);
+		if (rlen == -1)
+		{
+			status = errno;
+			break;
+		}
+		else if (rlen == 0)
+		{
+			status = ECONNRESET;
+			break;
+		}
+
+		status = 0;
+
+		nl = memchr(inbuf, '\n', rlen);
+		dkimf_dstring_catn(reply, (u_char *) inbuf,
+		                   nl == NULL ? (size_t) rlen : nl - inbuf);
+		if (nl != NULL)
+			break;
+	}
+
+	if (status != 0 && sc->sc_fd != -1)
+	{
+		close(sc->sc_fd);
+		sc->sc_fd = -1;
+	}
+
+	pthread_mutex_lock(&sdb->sockdb_lock);
+	sc->sc_busy = FALSE;
+	pthread_cond_signal(&sdb->sockdb_cond);
+	pthread_mutex_unlock(&sdb->sockdb_lock);
+
+	return status;
+}
+
+/*
+**  DKIMF_DB_SOCK_UNLINK -- remove a request from a connection's pending list
+**
+**  Parameters:
+**  	sc -- connection
+**  	sr -- request
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Caller must hold the data set's lock.
+*/
+
+static void
+dkimf_db_sock_unlink(struct dkimf_db_sockconn *sc, struct dkimf_db_sockreq *sr)
+{
+	struct dkimf_db_sockreq **prev;
+
+	for (prev = &sc->sc_pending; *prev != NULL; prev = &(*prev)->sr_next)
+	{
+		if (*prev == sr)
+		{
+			*prev = sr->sr_next;
+			break;
+		}
+	}
+}
+
+/*
+**  DKIMF_DB_SOCK_FAIL -- abandon a pipelined connection
+**
+**  Parameters:
+**  	sc -- connection
+**  	status -- errno value to give to the requests waiting on it
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Caller must hold the data set's lock.  If some thread is reading
+**  	replies or sending a request, the descriptor is only shut down
+**  	and marked dead; dkimf_db_sock_idle() closes it once they're done.
+*/
+
+static void
+dkimf_db_sock_fail(struct dkimf_db_sockconn *sc, int status)
+{
+	struct dkimf_db_sockreq *sr;
+
+	if (sc->sc_fd != -1)
+	{
+		if (sc->sc_reading || sc->sc_writers != 0)
+		{
+			(void) shutdown(sc->sc_fd, SHUT_RDWR);
+			sc->sc_dead = TRUE;
+		}
+		else
+		{
+			close(sc->sc_fd);
+			sc->sc_fd = -1;
+			sc->sc_dead = FALSE;
+		}
+	}
+
+	dkimf_dstring_blank(sc->sc_buf);
+
+	while ((sr = sc->sc_pending) != NULL)
+	{
+		sc->sc_pending = sr->sr_next;
+		sr->sr_done = TRUE;
+		sr->sr_status = status;
+		pthread_cond_signal(&sr->sr_cond);
+	}
+}
+
+/*
+**  DKIMF_DB_SOCK_IDLE -- close a dead pipelined connection nobody is using
+**
+**  Parameters:
+**  	sdb -- socket data set
+**  	sc -- connection
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Caller must hold the data set's lock.  Called by readers and
+**  	writers when they let go of the descriptor.
+*/
+
+static void
+dkimf_db_sock_idle(struct dkimf_db_socket *sdb, struct dkimf_db_sockconn *sc)
+{
+	if (!sc->sc_dead || sc->sc_reading || sc->sc_writers != 0)
+		return;
+
+	close(sc->sc_fd);
+	sc->sc_fd = -1;
+	sc->sc_dead = FALSE;
+
+	/* let queries waiting for the slot open a new connection */
+	pthread_cond_broadcast(&sdb->sockdb_cond);
+}
+
+/*
+**  DKIMF_DB_SOCK_DISPATCH -- hand a complete reply line to its request
+**
+**  Parameters:
+**  	sc -- connection, whose buffer holds the line without its newline
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Caller must hold the data set's lock.  Replies to requests that
+**  	have already timed out, or that carry no ID, are discarded.
+*/
+
+static void
+dkimf_db_sock_dispatch(struct dkimf_db_sockconn *sc)
+{
+	u_int id;
+	size_t len;
+	char *p;
+	char *line;
+	struct dkimf_db_sockreq *sr;
+
+	line = (char *) dkimf_dstring_get(sc->sc_buf);
+	len = dkimf_dstring_len(sc->sc_buf);
+
+	id = (u_int) strtoul(line, &p, 10);
+	if (p == line)
+		return;
+	if (*p == ' ')
+		p++;
+
+	for (sr = sc->sc_pending; sr != NULL; sr = sr->sr_next)
+	{
+		if (sr->sr_id == id)
+			break;
+	}
+
+	if (sr == NULL)
+		return;
+
+	dkimf_db_sock_unlink(sc, sr);
+
+	dkimf_dstring_catn(sr->sr_reply, (u_char *) p, len - (p - line));
+	sr->sr_done = TRUE;
+	pthread_cond_signal(&sr->sr_cond);
+}
+
+/*
+**  DKIMF_DB_SOCK_PQUERY -- query a socket data set, pipelining requests
+**
+**  Parameters:
+**  	sdb -- socket data set
+**  	buf -- query
+**  	buflen -- bytes at "buf"
+**  	reply -- reply line without its ID and newline (returned)
+**
+**  Return value:
+**  	0 on success, an errno value otherwise.
+**
+**  Notes:
+**  	Each query is sent as "<id> <query>\n" on one of the connections,
+**  	without waiting for earlier queries on it to be answered, and
+**  	the server replies with "<id> <value>\n" in any order.  There's no
+**  	reader thread; whichever waiting caller finds nobody reading
+**  	replies does so until its own reply has arrived, passing each
+**  	reply it reads to the caller that's waiting for it, and then
+**  	hands over to another waiter.
+**
+**  	Connecting, sending and reading all happen without the data set
+**  	lock, so a slow or unreachable server only holds up the queries
+**  	sent to it on that connection.  Requests on one connection are
+**  	kept from interleaving by its own write lock.
+*/
+
+static int
+dkimf_db_sock_pquery(struct dkimf_db_socket *sdb, void *buf, size_t buflen,
+                     struct dkimf_dstring *reply)
+{
+	int fd;
+	int status;
+	int save_errno;
+	ssize_t rlen;
+	char *p;
+	char *nl;
+	struct dkimf_db_sockconn *sc;
+	fd_set rfds;
+	struct timeval now;
+	struct timeval timeout;
+	struct timeval deadline;
+	struct timespec abstime;
+	struct iovec iov[3];
+	struct dkimf_db_sockreq sr;
+	char idbuf[16];
+	char inbuf[BUFRSZ];
+
+	assert(sdb != NULL);
+	assert(buf != NULL);
+	assert(reply != NULL);
+
+	(void) gettimeofday(&deadline, NULL);
+	deadline.tv_sec += DKIMF_SOCKET_TIMEOUT;
+	abstime.tv_sec = deadline.tv_sec;
+	abstime.tv_nsec = deadline.tv_usec * 1000;
+
+	dkimf_dstring_blank(reply);
+
+	memset(&sr, '\0', sizeof sr);
+	sr.sr_reply = reply;
+	pthread_cond_init(&sr.sr_cond, NULL);
+
+	pthread_mutex_lock(&sdb->sockdb_lock);
+
+	sc = &sdb->sockdb_conns[sdb->sockdb_next];
+	sdb->sockdb_next = (sdb->sockdb_next + 1) % sdb->sockdb_nconns;
+
+	/* wait out a connection attempt, or a failed connection's last users */
+	while (sc->sc_connecting || sc->sc_dead)
+	{
+		if (pthread_cond_timedwait(&sdb->sockdb_cond,
+		                           &sdb->sockdb_lock,
+		                           &abstime) == ETIMEDOUT)
+		{
+			pthread_mutex_unlock(&sdb->sockdb_lock);
+			pthread_cond_destroy(&sr.sr_cond);
+			return ETIMEDOUT;
+		}
+	}
+
+	if (sc->sc_fd == -1)
+	{
+		sc->sc_connecting = TRUE;
+
+		pthread_mutex_unlock(&sdb->sockdb_lock);
+
+		fd = dkimf_db_sock_connect(sdb);
+		save_errno = errno;
+
+		pthread_mutex_lock(&sdb->sockdb_lock);
+
+		sc->sc_connecting = FALSE;
+		sc->sc_fd = fd;
+		pthread_cond_broadcast(&sdb->sockdb_cond);
+
+		if (fd == -1)
+		{
+			pthread_mutex_unlock(&sdb->sockdb_lock);
+			pthread_cond_destroy(&sr.sr_cond);
+			return save_errno;
+		}
+	}
+
+	sr.sr_id = sc->sc_nextid++;
+	snprintf(idbuf, sizeof idbuf, "%u ", sr.sr_id);
+
+	iov[0].iov_base = idbuf;
+	iov[0].iov_len = strlen(idbuf);
+
+	iov[1].iov_base = buf;
+	iov[1].iov_len = buflen;
+
+	iov[2].iov_base = "\n";
+	iov[2].iov_len = 1;
+
+	/* listed before it's sent, so whoever reads the reply can route it */
+	sr.sr_next = sc->sc_pending;
+	sc->sc_pending = &sr;
+
+	sc->sc_writers++;
+	fd = sc->sc_fd;
+
+	pthread_mutex_unlock(&sdb->sockdb_lock);
+
+	pthread_mutex_lock(&sc->sc_wlock);
+	rlen = writev(fd, iov, 3);
+	save_errno = errno;
+	pthread_mutex_unlock(&sc->sc_wlock);
+
+	pthread_mutex_lock(&sdb->sockdb_lock);
+
+	sc->sc_writers--;
+
+	if (rlen == -1 || (size_t) rlen < iov[0].iov_len + buflen + 1)
+	{
+		/* a partial request leaves the stream unusable */
+		dkimf_db_sock_fail(sc, rlen == -1 ? save_errno : EIO);
+	}
+
+	dkimf_db_sock_idle(sdb, sc);
+
+	while (!sr.sr_done)
+	{
+		if (sc->sc_reading)
+		{
+			if (pthread_cond_timedwait(&sr.sr_cond,
+			                           &sdb->sockdb_lock,
+			                           &abstime) == ETIMEDOUT &&
+			    !sr.sr_done)
+			{
+				dkimf_db_sock_unlink(sc, &sr);
+				sr.sr_done = TRUE;
+				sr.sr_status = ETIMEDOUT;
+			}
+
+			continue;
+		}
+
+		/* nobody's reading replies; take a turn */
+		sc->sc_reading = TRUE;
+		fd = sc->sc_fd;
+
+		pthread_mutex_unlock(&sdb->sockdb_lock);
+
+		(void) gettimeofday(&now, NULL);
+		timeout.tv_sec = deadline.tv_sec - now.tv_sec;
+		timeout.tv_usec = deadline.tv_usec - now.tv_usec;
+		if (timeout.tv_usec < 0)
+		{
+			timeout.tv_sec--;
+			timeout.tv_usec += 1000000;
+		}
+		if (timeout.tv_sec < 0)
+		{
+			timeout.tv_sec = 0;
+			timeout.tv_usec = 0;
+		}
+
+		FD_ZERO(&rfds);
+		FD_SET(fd, &rfds);
+
+		rlen = 0;
+		status = select(fd + 1, &rfds, NULL, NULL, &timeout);
+		if (status > 0)
+			rlen = read(fd, inbuf, sizeof inbuf);
+		save_errno = errno;
+
+		pthread_mutex_lock(&sdb->sockdb_lock);
+
+		sc->sc_reading = FALSE;
+
+		if (sc->sc_dead)
+		{
+			/* failed while we were reading; never mind the data */
+			dkimf_db_sock_idle(sdb, sc);
+		}
+		else if (status == 0)
+		{
+			if (!sr.sr_done)
+			{
+				dkimf_db_sock_unlink(sc, &sr);
+				sr.sr_done = TRUE;
+				sr.sr_status = ETIMEDOUT;
+			}
+		}
+		else if (status < 0 || rlen <= 0)
+		{
+			dkimf_db_sock_fail(sc, rlen == 0 ? ECONNRESET
+			                                 : save_errno);
+		}
+		else
+		{
+			for (p = inbuf; p < inbuf + rlen; p = nl + 1)
+			{
+				nl = memchr(p, '\n', inbuf + rlen - p);
+				if (nl == NULL)
+				{
+					dkimf_dstring_catn(sc->sc_buf,
+					                   (u_char *) p,
+					                   inbuf + rlen - p);
+					break;
+				}
+
+				dkimf_dstring_catn(sc->sc_buf, (u_char *) p,
+				                   nl - p);
+				dkimf_db_sock_dispatch(sc);
+				dkimf_dstring_blank(sc->sc_buf);
+			}
+		}
+
+		/* let someone else read if there's more to come */
+		if (sc->sc_pending != NULL)
+			pthread_cond_signal(&sc->sc_pending->sr_cond);
+	}
+
+	status = sr.sr_status;
+
+	pthread_mutex_unlock(&sdb->sockdb_lock);
+
+	pthread_cond_destroy(&sr.sr_cond);
+
+	return status;
+}
+#endif /* _FFR_SOCKETDB */
+
+#ifdef USE_LDAP
+/*
+**  DKIMF_DB_OPEN_LDAP -- attempt to contact an LDAP server
+**
+**  Parameters:
+**  	ld -- LDAP handle (updated on success)
+**  	ldap -- local LDAP data
+**
+**  Return value:
+**  	An LDAP_* constant.
+*/
+
+int
+dkimf_db_open_ldap(LDAP **ld, struct dkimf_db_ldap *ldap, char **err)
+{
+	int v = LDAP_VERSION3;
+	int n;
+	int lderr;
+	char *q;
+	char *r;
+	char *u;
+	struct timeval timeout;
+
+	assert(ld != NULL);
+	assert(ldap != NULL);
+
+	/* create LDAP handle */
+	lderr = ldap_initialize(ld, ldap->ldap_urilist);
+	if (lderr != LDAP_SUCCESS)
+	{
+		if (err != NULL)
+			*err = ldap_err2string(lderr);
+		return lderr;
+	}
+
+	/* set LDAP version */
+	lderr = ldap_set_option(*ld, LDAP_OPT_PROTOCOL_VERSION, &v);
+	if (lderr != LDAP_OPT_SUCCESS)
+	{
+		if (err != NULL)
+			*err = ldap_err2string(lderr);
+		ldap_unbind_ext(*ld, NULL, NULL);
+		*ld = NULL;
+		return lderr;
+	}
+
+	/* enable auto-restarts */
+	lderr = ldap_set_option(*ld, LDAP_OPT_RESTART, LDAP_OPT_ON);
+	if (lderr != LDAP_OPT_SUCCESS)
+	{
+		if (err != NULL)
+			*err = ldap_err2string(lderr);
+		ldap_unbind_ext(*ld, NULL, NULL);
+		*ld = NULL;
+		return lderr;
+	}
+
+	/* request timeouts */
+	q = dkimf_db_ldap_param[DKIMF_LDAP_PARAM_TIMEOUT];
+	timeout.tv_sec = DKIMF_LDAP_DEFTIMEOUT;
+	timeout.tv_usec = 0;
+	if (q != NULL)
+	{
+		errno = 0;
+		timeout.tv_sec = strtoul(q, &r, 10);
+		if (errno == ERANGE)
+			timeout.tv_sec = DKIMF_LDAP_DEFTIMEOUT;
+	}
+
+	lderr = ldap_set_option(*ld, LDAP_OPT_TIMEOUT, &timeout);
+	if (lderr != LDAP_OPT_SUCCESS)
+	{
+		if (err != NULL)
+			*err = ldap_err2string(lderr);
+		ldap_unbind_ext(*ld, NULL, NULL);
+		*ld = NULL;
+		return lderr;
+	}
+
+	/* request keepalive */
+	q = dkimf_db_ldap_param[DKIMF_LDAP_PARAM_KA_IDLE];
+	if (q != NULL)
+	{
+		errno = 0;
+		n = strtoul(q, &r, 10);
+		if (errno != ERANGE)
+		{
+			lderr = ldap_set_option(*ld, LDAP_OPT_X_KEEPALIVE_IDLE,
+			                        &n);
+			if (lderr != LDAP_OPT_SUCCESS)
+			{
+				if (err != NULL)
+					*err = ldap_err2string(lderr);
+				ldap_unbind_ext(*ld, NULL, NULL);
+				*ld = NULL;
+				return lderr;
+			}
+		}
+	}
+
+	q = dkimf_db_ldap_param[DKIMF_LDAP_PARAM_KA_PROBES];
+	if (q != NULL)
+	{
+		errno = 0;
+		n = strtoul(q, &r, 10);
+		if (errno != ERANGE)
+		{
+			lderr = ldap_set_option(*ld,
+			                        LDAP_OPT_X_KEEPALIVE_PROBES,
+			                        &n);
+			if (lderr != LDAP_OPT_SUCCESS)
+			{
+				if (err != NULL)
+					*err = ldap_err2string(lderr);
+				ldap_unbind_ext(*ld, NULL, NULL);
+				*ld = NULL;
+				return lderr;
+			}
+		}
+	}
+
+	q = dkimf_db_ldap_param[DKIMF_LDAP_PARAM_KA_INTERVAL];
+	if (q != NULL)
+	{
+		errno = 0;
+		n = strtoul(q, &r, 10);
+		if (errno != ERANGE)
+		{
+			lderr = ldap_set_option(*ld,
+			                        LDAP_OPT_X_KEEPALIVE_INTERVAL,
+			                        &n);
+			if (lderr != LDAP_OPT_SUCCESS)
+			{
+				if (err != NULL)
+					*err = ldap_err2string(lderr);
+				ldap_unbind_ext(*ld, NULL, NULL);
+				*ld = NULL;
+				return lderr;
+			}
+		}
+	}
+
+	/* attempt TLS if requested, except for ldaps */
+	q = dkimf_db_ldap_param[DKIMF_LDAP_PARAM_USETLS];
+	if (q != NULL && (*q == 'y' || *q == 'Y') &&
+	    strcasecmp(ldap->ldap_descr->lud_scheme, "ldaps") != 0)
+	{
+		lderr = ldap_start_tls_s(*ld, NULL, NULL);
+		if (lderr != LDAP_SUCCESS)
+		{
+			if (err != NULL)
+				*err = ldap_err2string(lderr);
+			ldap_unbind_ext(*ld, NULL, NULL);
+			*ld = NULL;
+			return lderr;
+		}
+	}
+
+	/* attempt binding */
+	q = dkimf_db_ldap_param[DKIMF_LDAP_PARAM_AUTHMECH];
+	u = dkimf_db_ldap_param[DKIMF_LDAP_PARAM_BINDUSER];
+	if (q == NULL || strcasecmp(q, "none") == 0 ||
+	    strcasecmp(q, "simple") == 0)
+	{
+		struct berval passwd;
+
+		r = dkimf_db_ldap_param[DKIMF_LDAP_PARAM_BINDPW];
+		if (r != NULL)
+		{
+			passwd.bv_val = r;
+			passwd.bv_len = strlen(r);
+		}
+		else
+		{
+			passwd.bv_val = NULL;
+			passwd.bv_len = 0;
+		}
+
+		lderr = ldap_sasl_bind_s(*ld, u, q, &passwd,
+		                         NULL, NULL, NULL);
+		if (lderr != LDAP_SUCCESS)
+		{
+			if (err != NULL)
+				*err = ldap_err2string(lderr);
+			ldap_unbind_ext(*ld, NULL, NULL);
+			*ld = NULL;
+			return lderr;
+		}
+	}
+	else
+	{
+# ifdef USE_SASL
+		lderr = ldap_sasl_interactive_bind_s(*ld,
+		                                     u,	/* bind user */
+		                                     q,	/* SASL mech */
+		                                     NULL, /* controls */
+		                                     NULL, /* controls */
+		                                     LDAP_SASL_QUIET, /* flags */
+		                                     dkimf_db_saslinteract, /* callback */
+		                                     NULL);
+		if (lderr != LDAP_SUCCESS)
+		{
+			if (err != NULL)
+				*err = ldap_err2string(lderr);
+			ldap_unbind_ext(*ld, NULL, NULL);
+			*ld = NULL;
+			return lderr;
+		}
+
+# else /* USE_SASL */
+
+		/* unknown auth mechanism */
+		if (err != NULL)
+			*err = "Unknown auth mechanism";
+		ldap_unbind_ext(*ld, NULL, NULL);
+		*ld = NULL;
+		return LDAP_AUTH_METHOD_NOT_SUPPORTED;
+
+# endif /* USE_SASL */
+	}
+
+	return LDAP_SUCCESS;
+}
+
+# ifdef _FFR_LDAP_ASYNC
+/*
+**  DKIMF_DB_LDAP_NEWPOOL -- create an LDAP connection pool
+**
+**  Parameters:
+**  	ld -- an open connection to put in it, or NULL
+**
+**  Return value:
+**  	A new pool, or NULL on error (with errno set).
+*/
+
+static struct dkimf_db_ldappool *
+dkimf_db_ldap_newpool(LDAP *ld)
+{
+	u_long conns;
+	char *p;
+	char *q;
+	struct dkimf_db_ldappool *pool;
+
+	pool = (struct dkimf_db_ldappool *) malloc(sizeof *pool);
+	if (pool == NULL)
+		return NULL;
+
+	memset(pool, '\0', sizeof *pool);
+
+	pool->lp_nconns = DKIMF_LDAP_DEFCONNS;
+	p = dkimf_db_ldap_param[DKIMF_LDAP_PARAM_CONNECTIONS];
+	if (p != NULL)
+	{
+		conns = strtoul(p, &q, 10);
+		if (*q == '\0' && conns > 0)
+			pool->lp_nconns = (u_int) conns;
+	}
+
+	pool->lp_conns = calloc(pool->lp_nconns,
+	                        sizeof(struct dkimf_db_ldapconn));
+	if (pool->lp_conns == NULL)
+	{
+		free(pool);
+		return NULL;
+	}
+
+#  ifdef _FFR_DB_SHARED_POOLS
+	pool->lp_idle = dkimf_db_pool_getparam(DKIMF_POOL_PARAM_IDLETIME, 0);
+	pool->lp_conns[0].lc_used = time(NULL);
+#  endif /* _FFR_DB_SHARED_POOLS */
+
+	pthread_mutex_init(&pool->lp_lock, NULL);
+
+	pool->lp_conns[0].lc_ld = ld;
+
+	return pool;
+}
+
+/*
+**  DKIMF_DB_LDAP_FREEPOOL -- destroy an LDAP connection pool
+**
+**  Parameters:
+**  	pool -- pool to destroy
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_db_ldap_freepool(struct dkimf_db_ldappool *pool)
+{
+	u_int c;
+
+	assert(pool != NULL);
+
+	for (c = 0; c < pool->lp_nconns; c++)
+	{
+		if (pool->lp_conns[c].lc_ld != NULL)
+			ldap_unbind_ext(pool->lp_conns[c].lc_ld, NULL, NULL);
+	}
+
+	free(pool->lp_conns);
+	pthread_mutex_destroy(&pool->lp_lock);
+	free(pool);
+}
+
+/*
+**  DKIMF_DB_LDAP_RELEASE -- finish with a pooled LDAP connection
+**
+**  Parameters:
+**  	lc -- connection
+**
+**  Return value:
+**  	A handle the caller must unbind once it has dropped the pool lock,
+**  	or NULL.
+**
+**  Notes:
+**  	Caller must hold the pool lock.  A connection that has failed is
+**  	taken out of its slot once nobody is using it any more, freeing
+**  	the slot.
+*/
+
+static LDAP *
+dkimf_db_ldap_release(struct dkimf_db_ldapconn *lc)
+{
+	LDAP *ld = NULL;
+
+	assert(lc->lc_users > 0);
+
+	lc->lc_users--;
+
+#  ifdef _FFR_DB_SHARED_POOLS
+	if (lc->lc_users == 0)
+		lc->lc_used = time(NULL);
+#  endif /* _FFR_DB_SHARED_POOLS */
+
+	if (lc->lc_dead && lc->lc_users == 0 && !lc->lc_reading)
+	{
+		ld = lc->lc_ld;
+		lc->lc_ld = NULL;
+		lc->lc_dead = FALSE;
+	}
+
+	return ld;
+}
+
+/*
+**  DKIMF_DB_LDAP_UNLINK -- remove a search from a connection's pending list
+**
+**  Parameters:
+**  	lc -- connection
+**  	lr -- search
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Caller must hold the pool lock.
+*/
+
+static void
+dkimf_db_ldap_unlink(struct dkimf_db_ldapconn *lc, struct dkimf_db_ldapreq *lr)
+{
+	struct dkimf_db_ldapreq **prev;
+
+	for (prev = &lc->lc_pending; *prev != NULL; prev = &(*prev)->lr_next)
+	{
+		if (*prev == lr)
+		{
+			*prev = lr->lr_next;
+			break;
+		}
 	}
+}
 
-	/* request keepalive */
-	q = dkimf_db_ldap_param[DKIMF_LDAP_PARAM_KA_IDLE];
-	if (q != NULL)
+/*
+**  DKIMF_DB_LDAP_FAIL -- abandon a pooled LDAP connection
+**
+**  Parameters:
+**  	lc -- connection
+**  	status -- LDAP_* code to give to the searches waiting on it
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Caller must hold the pool lock.  No new searches are sent on the
+**  	connection; it's unbound when its last user releases it.
+*/
+
+static void
+dkimf_db_ldap_fail(struct dkimf_db_ldapconn *lc, int status)
+{
+	struct dkimf_db_ldapreq *lr;
+
+	lc->lc_dead = TRUE;
+
+	while ((lr = lc->lc_pending) != NULL)
 	{
-		errno = 0;
-		n = strtoul(q, &r, 10);
-		if (errno != ERANGE)
+		lc->lc_pending = lr->lr_next;
+		lr->lr_done = TRUE;
+		lr->lr_status = status;
+		pthread_cond_signal(&lr->lr_cond);
+	}
+}
+
+/*
+**  DKIMF_DB_LDAP_DISPATCH -- hand a search result to the search awaiting it
+**
+**  Parameters:
+**  	lc -- connection on which the result arrived
+**  	res -- result chain
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Caller must hold the pool lock and be the connection's reader.
+**  	Results nobody is waiting for, such as those of searches that
+**  	timed out, are discarded.
+*/
+
+static void
+dkimf_db_ldap_dispatch(struct dkimf_db_ldapconn *lc, LDAPMessage *res)
+{
+	int msgid;
+	int lderr;
+	struct dkimf_db_ldapreq *lr;
+
+	msgid = ldap_msgid(res);
+
+	for (lr = lc->lc_pending; lr != NULL; lr = lr->lr_next)
+	{
+		if (lr->lr_msgid == msgid)
+			break;
+	}
+
+	if (lr == NULL)
+	{
+		ldap_msgfree(res);
+		return;
+	}
+
+	dkimf_db_ldap_unlink(lc, lr);
+
+	if (ldap_parse_result(lc->lc_ld, res, &lderr, NULL, NULL, NULL,
+	                      NULL, 0) != LDAP_SUCCESS)
+		lderr = LDAP_DECODING_ERROR;
+
+	lr->lr_result = res;
+	lr->lr_status = lderr;
+	lr->lr_done = TRUE;
+	pthread_cond_signal(&lr->lr_cond);
+}
+
+/*
+**  DKIMF_DB_LDAP_SEND -- start a search on the least busy pooled connection
+**
+**  Parameters:
+**  	ldap -- local LDAP data
+**  	query -- base DN
+**  	filter -- search filter
+**  	lr -- search (updated)
+**  	lcp -- connection used (returned)
+**
+**  Return value:
+**  	An LDAP_* constant.
+**
+**  Notes:
+**  	Caller must hold the pool lock; it's dropped while a connection
+**  	is opened or unbound, so the caller can't rely on anything it saw
+**  	in the pool before the call.  On success the connection has a
+**  	new user, to be dropped with dkimf_db_ldap_release().  A further
+**  	connection is only opened when every open one is already in use;
+**  	its slot is marked as connecting meanwhile so nobody else takes
+**  	it.  With shared pools, a connection left unused for longer than
+**  	the configured idle time is unbound here, one per call, and no new
+**  	connection is attempted while backing off after a failed one.
+*/
+
+static int
+dkimf_db_ldap_send(struct dkimf_db_ldap *ldap, char *query, char *filter,
+                   struct dkimf_db_ldapreq *lr,
+                   struct dkimf_db_ldapconn **lcp)
+{
+	int lderr;
+	u_int c;
+#  ifdef _FFR_DB_SHARED_POOLS
+	time_t now;
+#  endif /* _FFR_DB_SHARED_POOLS */
+	LDAP *ld;
+	LDAP *idle = NULL;
+	LDAP *dead = NULL;
+	struct dkimf_db_ldappool *pool;
+	struct dkimf_db_ldapconn *lc;
+	struct dkimf_db_ldapconn *best = NULL;
+	struct dkimf_db_ldapconn *empty = NULL;
+	struct timeval timeout;
+
+	pool = ldap->ldap_pool;
+
+#  ifdef _FFR_DB_SHARED_POOLS
+	now = time(NULL);
+#  endif /* _FFR_DB_SHARED_POOLS */
+
+	for (c = 0; c < pool->lp_nconns; c++)
+	{
+		lc = &pool->lp_conns[c];
+
+		if (lc->lc_dead || lc->lc_connecting)
+			continue;
+
+#  ifdef _FFR_DB_SHARED_POOLS
+		if (lc->lc_ld != NULL && pool->lp_idle > 0 &&
+		    lc->lc_users == 0 && !lc->lc_reading &&
+		    now - lc->lc_used >= pool->lp_idle && idle == NULL)
 		{
-			lderr = ldap_set_option(*ld, LDAP_OPT_X_KEEPALIVE_IDLE,
-			                        &n);
-			if (lderr != LDAP_OPT_SUCCESS)
-			{
-				if (err != NULL)
-					*err = ldap_err2string(lderr);
-				ldap_unbind_ext(*ld, NULL, NULL);
-				*ld = NULL;
-				return lderr;
-			}
+			idle = lc->lc_ld;
+			lc->lc_ld = NULL;
+		}
+#  endif /* _FFR_DB_SHARED_POOLS */
+
+		if (lc->lc_ld == NULL)
+		{
+			if (empty == NULL)
+				empty = lc;
+		}
+		else if (best == NULL || lc->lc_users < best->lc_users)
+		{
+			best = lc;
 		}
 	}
 
-	q = dkimf_db_ldap_param[DKIMF_LDAP_PARAM_KA_PROBES];
-	if (q != NULL)
+	if (best != NULL && best->lc_users == 0)
+		empty = NULL;
+
+#  ifdef _FFR_DB_SHARED_POOLS
+	if (empty != NULL && dkimf_db_backoff_check(&pool->lp_backoff))
+		empty = NULL;
+#  endif /* _FFR_DB_SHARED_POOLS */
+
+	if (empty != NULL)
 	{
-		errno = 0;
-		n = strtoul(q, &r, 10);
-		if (errno != ERANGE)
+		empty->lc_connecting = TRUE;
+
+		pthread_mutex_unlock(&pool->lp_lock);
+
+		if (idle != NULL)
 		{
-			lderr = ldap_set_option(*ld,
-			                        LDAP_OPT_X_KEEPALIVE_PROBES,
-			                        &n);
-			if (lderr != LDAP_OPT_SUCCESS)
-			{
-				if (err != NULL)
-					*err = ldap_err2string(lderr);
-				ldap_unbind_ext(*ld, NULL, NULL);
-				*ld = NULL;
+			ldap_unbind_ext(idle, NULL, NULL);
+			idle = NULL;
+		}
+
+		ld = NULL;
+		lderr = dkimf_db_open_ldap(&ld, ldap, NULL);
+
+		pthread_mutex_lock(&pool->lp_lock);
+
+		empty->lc_connecting = FALSE;
+
+		if (lderr == LDAP_SUCCESS)
+		{
+			empty->lc_ld = ld;
+#  ifdef _FFR_DB_SHARED_POOLS
+			dkimf_db_backoff_reset(&pool->lp_backoff);
+#  endif /* _FFR_DB_SHARED_POOLS */
+			best = empty;
+		}
+		else
+		{
+#  ifdef _FFR_DB_SHARED_POOLS
+			dkimf_db_backoff_fail(&pool->lp_backoff);
+#  endif /* _FFR_DB_SHARED_POOLS */
+
+			/* the lock was dropped; the other one may be gone */
+			if (best != NULL &&
+			    (best->lc_dead || best->lc_ld == NULL))
+				best = NULL;
+			if (best == NULL)
 				return lderr;
-			}
 		}
 	}
 
-	q = dkimf_db_ldap_param[DKIMF_LDAP_PARAM_KA_INTERVAL];
-	if (q != NULL)
+	if (best == NULL)
 	{
-		errno = 0;
-		n = strtoul(q, &r, 10);
-		if (errno != ERANGE)
+		lderr = LDAP_SERVER_DOWN;
+		goto done;
+	}
+
+	lc = best;
+
+	timeout.tv_sec = ldap->ldap_timeout;
+	timeout.tv_usec = 0;
+
+	lderr = ldap_search_ext(lc->lc_ld, query,
+	                        ldap->ldap_descr->lud_scope,
+	                        filter,
+	                        ldap->ldap_descr->lud_attrs,
+	                        0, NULL, NULL,
+	                        &timeout, 0, &lr->lr_msgid);
+	if (lderr != LDAP_SUCCESS)
+	{
+		if (lderr == LDAP_SERVER_DOWN)
 		{
-			lderr = ldap_set_option(*ld,
-			                        LDAP_OPT_X_KEEPALIVE_INTERVAL,
-			                        &n);
-			if (lderr != LDAP_OPT_SUCCESS)
+			dkimf_db_ldap_fail(lc, lderr);
+			if (lc->lc_users == 0 && !lc->lc_reading)
 			{
-				if (err != NULL)
-					*err = ldap_err2string(lderr);
-				ldap_unbind_ext(*ld, NULL, NULL);
-				*ld = NULL;
-				return lderr;
+				dead = lc->lc_ld;
+				lc->lc_ld = NULL;
+				lc->lc_dead = FALSE;
 			}
 		}
+
+		goto done;
 	}
 
-	/* attempt TLS if requested, except for ldaps */
-	q = dkimf_db_ldap_param[DKIMF_LDAP_PARAM_USETLS];
-	if (q != NULL && (*q == 'y' || *q == 'Y') &&
-	    strcasecmp(ldap->ldap_descr->lud_scheme, "ldaps") != 0)
+	lc->lc_users++;
+	lr->lr_next = lc->lc_pending;
+	lc->lc_pending = lr;
+
+	*lcp = lc;
+
+  done:
+	if (idle != NULL || dead != NULL)
 	{
-		lderr = ldap_start_tls_s(*ld, NULL, NULL);
-		if (lderr != LDAP_SUCCESS)
-		{
-			if (err != NULL)
-				*err = ldap_err2string(lderr);
-			ldap_unbind_ext(*ld, NULL, NULL);
-			*ld = NULL;
-			return lderr;
-		}
+		pthread_mutex_unlock(&pool->lp_lock);
+
+		if (idle != NULL)
+			ldap_unbind_ext(idle, NULL, NULL);
+		if (dead != NULL)
+			ldap_unbind_ext(dead, NULL, NULL);
+
+		pthread_mutex_lock(&pool->lp_lock);
 	}
 
-	/* attempt binding */
-	q = dkimf_db_ldap_param[DKIMF_LDAP_PARAM_AUTHMECH];
-	u = dkimf_db_ldap_param[DKIMF_LDAP_PARAM_BINDUSER];
-	if (q == NULL || strcasecmp(q, "none") == 0 ||
-	    strcasecmp(q, "simple") == 0)
+	return lderr;
+}
+
+/*
+**  DKIMF_DB_LDAP_SEARCH -- conduct an LDAP search over the connection pool
+**
+**  Parameters:
+**  	ldap -- local LDAP data
+**  	query -- base DN
+**  	filter -- search filter
+**  	req -- list of data requests
+**  	reqnum -- number of data requests
+**  	found -- whether or not a matching entry was found (returned)
+**
+**  Return value:
+**  	An LDAP_* constant.
+**
+**  Notes:
+**  	Searches are started with ldap_search_ext() and identified by
+**  	message ID, so any number can be outstanding on a connection.
+**  	There's no reader thread; whichever waiting caller finds nobody
+**  	collecting results on its connection does so until its own result
+**  	has arrived, handing each result it collects to the caller that's
+**  	waiting for it, and then hands over to another waiter.  A search
+**  	that fails because its connection went away is retried once.
+*/
+
+static int
+dkimf_db_ldap_search(struct dkimf_db_ldap *ldap, char *query, char *filter,
+                     DKIMF_DBDATA req, unsigned int reqnum, _Bool *found)
+{
+	int c;
+	int lderr;
+	int status;
+	int attempt;
+	LDAP *ld;
+	LDAPMessage *e;
+	LDAPMessage *res;
+	struct dkimf_db_ldapconn *lc;
+	struct berval **vals;
+	struct timeval now;
+	struct timeval timeout;
+	struct timeval deadline;
+	struct timespec abstime;
+	struct dkimf_db_ldappool *pool;
+	struct dkimf_db_ldapreq lr;
+
+	assert(ldap != NULL);
+	assert(query != NULL);
+	assert(filter != NULL);
+	assert(found != NULL);
+
+	*found = FALSE;
+
+	pool = ldap->ldap_pool;
+
+	(void) gettimeofday(&deadline, NULL);
+	deadline.tv_sec += ldap->ldap_timeout;
+	abstime.tv_sec = deadline.tv_sec;
+	abstime.tv_nsec = deadline.tv_usec * 1000;
+
+	pthread_cond_init(&lr.lr_cond, NULL);
+
+	pthread_mutex_lock(&pool->lp_lock);
+
+	for (attempt = 0; attempt < 2; attempt++)
 	{
-		struct berval passwd;
+		lr.lr_done = FALSE;
+		lr.lr_msgid = -1;
+		lr.lr_status = LDAP_SUCCESS;
+		lr.lr_result = NULL;
+		lr.lr_next = NULL;
 
-		r = dkimf_db_ldap_param[DKIMF_LDAP_PARAM_BINDPW];
-		if (r != NULL)
+		status = dkimf_db_ldap_send(ldap, query, filter, &lr, &lc);
+		if (status != LDAP_SUCCESS)
 		{
-			passwd.bv_val = r;
-			passwd.bv_len = strlen(r);
+			if (status == LDAP_SERVER_DOWN && attempt == 0)
+				continue;
+
+			pthread_mutex_unlock(&pool->lp_lock);
+			pthread_cond_destroy(&lr.lr_cond);
+			return status;
 		}
-		else
+
+		while (!lr.lr_done)
 		{
-			passwd.bv_val = NULL;
-			passwd.bv_len = 0;
+			if (lc->lc_reading)
+			{
+				if (pthread_cond_timedwait(&lr.lr_cond,
+				                           &pool->lp_lock,
+				                           &abstime) == ETIMEDOUT &&
+				    !lr.lr_done)
+				{
+					dkimf_db_ldap_unlink(lc, &lr);
+					(void) ldap_abandon_ext(lc->lc_ld,
+					                        lr.lr_msgid,
+					                        NULL, NULL);
+					lr.lr_done = TRUE;
+					lr.lr_status = LDAP_TIMEOUT;
+				}
+
+				continue;
+			}
+
+			/* nobody's collecting results; take a turn */
+			lc->lc_reading = TRUE;
+			ld = lc->lc_ld;
+
+			pthread_mutex_unlock(&pool->lp_lock);
+
+			(void) gettimeofday(&now, NULL);
+			timeout.tv_sec = deadline.tv_sec - now.tv_sec;
+			timeout.tv_usec = deadline.tv_usec - now.tv_usec;
+			if (timeout.tv_usec < 0)
+			{
+				timeout.tv_sec--;
+				timeout.tv_usec += 1000000;
+			}
+			if (timeout.tv_sec < 0)
+			{
+				timeout.tv_sec = 0;
+				timeout.tv_usec = 0;
+			}
+
+			res = NULL;
+			status = ldap_result(ld, LDAP_RES_ANY, LDAP_MSG_ALL,
+			                     &timeout, &res);
+			if (status == -1 &&
+			    ldap_get_option(ld, LDAP_OPT_RESULT_CODE,
+			                    &lderr) != LDAP_OPT_SUCCESS)
+				lderr = LDAP_SERVER_DOWN;
+
+			pthread_mutex_lock(&pool->lp_lock);
+
+			lc->lc_reading = FALSE;
+
+			if (status == 0)
+			{
+				if (!lr.lr_done)
+				{
+					dkimf_db_ldap_unlink(lc, &lr);
+					(void) ldap_abandon_ext(ld, lr.lr_msgid,
+					                        NULL, NULL);
+					lr.lr_done = TRUE;
+					lr.lr_status = LDAP_TIMEOUT;
+				}
+			}
+			else if (status == -1)
+			{
+				dkimf_db_ldap_fail(lc, lderr);
+			}
+			else
+			{
+				dkimf_db_ldap_dispatch(lc, res);
+			}
+
+			/* let someone else collect if there's more to come */
+			if (lc->lc_pending != NULL)
+				pthread_cond_signal(&lc->lc_pending->lr_cond);
 		}
 
-		lderr = ldap_sasl_bind_s(*ld, u, q, &passwd,
-		                         NULL, NULL, NULL);
-		if (lderr != LDAP_SUCCESS)
+		if (lr.lr_status == LDAP_SERVER_DOWN && attempt == 0)
 		{
-			if (err != NULL)
-				*err = ldap_err2string(lderr);
-			ldap_unbind_ext(*ld, NULL, NULL);
-			*ld = NULL;
-			return lderr;
+			ld = dkimf_db_ldap_release(lc);
+			if (ld != NULL)
+			{
+				pthread_mutex_unlock(&pool->lp_lock);
+				ldap_unbind_ext(ld, NULL, NULL);
+				pthread_mutex_lock(&pool->lp_lock);
+			}
+			continue;
 		}
+
+		break;
+	}
+
+	status = lr.lr_status;
+
+	/*
+	**  Extract the values without the pool lock; the connection can't
+	**  be unbound while we're still one of its users.
+	*/
+
+	pthread_mutex_unlock(&pool->lp_lock);
+
+	if (LDAP_NAME_ERROR(status))
+	{
+		status = LDAP_SUCCESS;
 	}
-	else
+	else if (status == LDAP_SUCCESS)
 	{
-# ifdef USE_SASL
-		lderr = ldap_sasl_interactive_bind_s(*ld,
-		                                     u,	/* bind user */
-		                                     q,	/* SASL mech */
-		                                     NULL, /* controls */
-		                                     NULL, /* controls */
-		                                     LDAP_SASL_QUIET, /* flags */
-		                                     dkimf_db_saslinteract, /* callback */
-		                                     NULL);
-		if (lderr != LDAP_SUCCESS)
+		e = ldap_first_entry(lc->lc_ld, lr.lr_result);
+		if (e != NULL)
 		{
-			if (err != NULL)
-				*err = ldap_err2string(lderr);
-			ldap_unbind_ext(*ld, NULL, NULL);
-			*ld = NULL;
-			return lderr;
-		}
+			*found = TRUE;
 
-# else /* USE_SASL */
+			for (c = 0; c < reqnum; c++)
+			{
+				/* bail if we're out of attributes */
+				if (ldap->ldap_descr->lud_attrs[c] == NULL)
+					break;
 
-		/* unknown auth mechanism */
-		if (err != NULL)
-			*err = "Unknown auth mechanism";
-		ldap_unbind_ext(*ld, NULL, NULL);
-		*ld = NULL;
-		return LDAP_AUTH_METHOD_NOT_SUPPORTED;
+				vals = ldap_get_values_len(lc->lc_ld, e,
+				                           ldap->ldap_descr->lud_attrs[c]);
+				if (vals != NULL && vals[0] != NULL)
+				{
+					size_t clen;
+
+					clen = MIN(req[c].dbdata_buflen,
+					           vals[0]->bv_len);
+					memcpy(req[c].dbdata_buffer,
+					       vals[0]->bv_val, clen);
+					clen = MAX(req[c].dbdata_buflen,
+					           vals[0]->bv_len);
+					req[c].dbdata_buflen = clen;
+				}
+				if (vals != NULL)
+					ldap_value_free_len(vals);
+			}
 
-# endif /* USE_SASL */
+			/* tag requests that weren't fulfilled */
+			while (c < reqnum)
+				req[c++].dbdata_buflen = 0;
+		}
 	}
 
-	return LDAP_SUCCESS;
+	if (lr.lr_result != NULL)
+		ldap_msgfree(lr.lr_result);
+
+	pthread_mutex_lock(&pool->lp_lock);
+	ld = dkimf_db_ldap_release(lc);
+	pthread_mutex_unlock(&pool->lp_lock);
+
+	if (ld != NULL)
+		ldap_unbind_ext(ld, NULL, NULL);
+
+	pthread_cond_destroy(&lr.lr_cond);
+
+	return status;
 }
+# endif /* _FFR_LDAP_ASYNC */
 #endif /* USE_LDAP */
 
 #ifdef USE_ODBX
@@ -1305,6 +6305,270 @@ dkimf_db_open_sql(struct dkimf_db_dsn *dsn, odbx_t **odbx, char **err)
 
 	return 0;
 }
+
+# ifdef _FFR_DSN_PREPARE
+/*
+**  DKIMF_DB_SQL_STMTTEXT -- build the lookup statement of an SQL data set
+**
+**  Parameters:
+**  	dsn -- connection description
+**  	buf -- buffer to receive the statement
+**  	buflen -- size of "buf"
+**
+**  Return value:
+**  	Length of the complete statement; if that's not less than "buflen",
+**  	what's in "buf" was truncated and mustn't be used.
+*/
+
+static size_t
+dkimf_db_sql_stmttext(struct dkimf_db_dsn *dsn, char *buf, size_t buflen)
+{
+	int n;
+
+	n = snprintf(buf, buflen, "SELECT %s FROM %s WHERE %s = $1%s%s",
+	             dsn->dsn_datacol,
+	             dsn->dsn_table,
+	             dsn->dsn_keycol,
+	             dsn->dsn_filter == NULL ? "" : " AND ",
+	             dsn->dsn_filter == NULL ? "" : dsn->dsn_filter);
+
+	return (n < 0 ? buflen : (size_t) n);
+}
+
+/*
+**  DKIMF_DB_SQL_STMTNAME -- name the lookup statement of an SQL data set
+**
+**  Parameters:
+**  	dsn -- connection description
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	The name is derived from the statement text, so data sets issuing
+**  	the same query over a shared connection (or across a
+**  	configuration reload) use the same server-side statement.
+**  	Backends that can't prepare statements from plain SQL, and
+**  	statements too long to prepare, get an empty name, which selects
+**  	the text query path.
+*/
+
+static void
+dkimf_db_sql_stmtname(struct dkimf_db_dsn *dsn)
+{
+	unsigned long long h;
+	const char *p;
+	char stmt[BUFRSZ];
+
+	assert(dsn != NULL);
+
+	dsn->dsn_stmt[0] = '\0';
+
+	if (strcasecmp(dsn->dsn_backend, "pgsql") != 0)
+		return;
+
+	if (dkimf_db_sql_stmttext(dsn, stmt, sizeof stmt) >= sizeof stmt)
+		return;
+
+	/* FNV-1a */
+	h = 14695981039346656037ULL;
+	for (p = stmt; *p != '\0'; p++)
+	{
+		h ^= (unsigned char) *p;
+		h *= 1099511628211ULL;
+	}
+
+	snprintf(dsn->dsn_stmt, sizeof dsn->dsn_stmt, "dkimf_%016llx", h);
+}
+
+/*
+**  DKIMF_DB_SQL_FORGET -- discard prepared statement records for a handle
+**
+**  Parameters:
+**  	odbx -- ODBX handle about to be closed
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_db_sql_forget(odbx_t *odbx)
+{
+	struct dkimf_db_sqlstmt *ss;
+	struct dkimf_db_sqlstmt **pp;
+
+	if (odbx == NULL)
+		return;
+
+	pthread_mutex_lock(&sqlstmt_lock);
+
+	pp = &sqlstmts;
+	while (*pp != NULL)
+	{
+		ss = *pp;
+		if (ss->ss_odbx == odbx)
+		{
+			*pp = ss->ss_next;
+			free(ss->ss_text);
+			free(ss);
+		}
+		else
+		{
+			pp = &ss->ss_next;
+		}
+	}
+
+	pthread_mutex_unlock(&sqlstmt_lock);
+}
+
+/*
+**  DKIMF_DB_SQL_PREPARE -- make sure a data set's lookup statement is
+**                          prepared on a connection
+**
+**  Parameters:
+**  	dsn -- connection description
+**  	odbx -- ODBX handle, not in use by any other thread
+**
+**  Return value:
+**  	0 -- statement is ready for EXECUTE
+**  	otherwise -- the statement can't be used on this connection; the
+**  	             caller should issue the plain query instead
+**
+**  Notes:
+**  	A statement of the same name but different text (a hash
+**  	collision) is never reused; the data set just doesn't get a
+**  	prepared statement on that connection.
+*/
+
+static int
+dkimf_db_sql_prepare(struct dkimf_db_dsn *dsn, odbx_t *odbx)
+{
+	int err;
+	odbx_result_t *result;
+	struct dkimf_db_sqlstmt *ss;
+	char stmt[BUFRSZ];
+	char query[BUFRSZ + DKIMF_DB_STMTNAMELEN + 16];
+
+	assert(dsn != NULL);
+	assert(odbx != NULL);
+
+	if (dkimf_db_sql_stmttext(dsn, stmt, sizeof stmt) >= sizeof stmt)
+		return -1;
+
+	pthread_mutex_lock(&sqlstmt_lock);
+	for (ss = sqlstmts; ss != NULL; ss = ss->ss_next)
+	{
+		if (ss->ss_odbx == odbx &&
+		    strcmp(ss->ss_name, dsn->dsn_stmt) == 0)
+			break;
+	}
+	pthread_mutex_unlock(&sqlstmt_lock);
+
+	if (ss != NULL)
+	{
+		if (strcmp(ss->ss_text, stmt) != 0)
+			return -1;
+
+		return (ss->ss_ok ? 0 : -1);
+	}
+
+	snprintf(query, sizeof query, "PREPARE %s AS %s", dsn->dsn_stmt, stmt);
+
+	err = odbx_query(odbx, query, 0);
+	while (err >= 0)
+	{
+		result = NULL;
+		err = odbx_result(odbx, &result, NULL, 0);
+		if (result != NULL)
+			(void) odbx_result_finish(result);
+		if (err == ODBX_RES_DONE)
+		{
+			err = 0;
+			break;
+		}
+	}
+
+	/*
+	**  A broken connection is left for the caller to discover and
+	**  replace.  Any other failure (permissions, syntax the server
+	**  won't accept in a PREPARE, etc.) is remembered so this
+	**  connection doesn't retry on every lookup.
+	*/
+
+	if (err < 0 && odbx_error_type(odbx, err) < 0)
+		return err;
+
+	ss = (struct dkimf_db_sqlstmt *) malloc(sizeof *ss);
+	if (ss == NULL)
+		return err;
+
+	ss->ss_text = strdup(stmt);
+	if (ss->ss_text == NULL)
+	{
+		free(ss);
+		return err;
+	}
+
+	ss->ss_ok = (err == 0);
+	ss->ss_odbx = odbx;
+	strlcpy(ss->ss_name, dsn->dsn_stmt, sizeof ss->ss_name);
+
+	pthread_mutex_lock(&sqlstmt_lock);
+	ss->ss_next = sqlstmts;
+	sqlstmts = ss;
+	pthread_mutex_unlock(&sqlstmt_lock);
+
+	return err;
+}
+
+/*
+**  DKIMF_DB_SQL_STALE -- handle a failed EXECUTE of a prepared statement
+**
+**  Parameters:
+**  	dsn -- connection description
+**  	odbx -- ODBX handle, not in use by any other thread
+**  	err -- error returned by ODBX
+**
+**  Return value:
+**  	TRUE iff the connection is still usable, in which case the record
+**  	of the statement having been prepared on it has been dropped and
+**  	the caller should try once more, which prepares it again.
+**
+**  Notes:
+**  	The server can forget prepared statements without the connection
+**  	failing ("DISCARD ALL", a connection pooler handing the session to
+**  	another backend), after which EXECUTE fails.
+*/
+
+static _Bool
+dkimf_db_sql_stale(struct dkimf_db_dsn *dsn, odbx_t *odbx, int err)
+{
+	struct dkimf_db_sqlstmt *ss;
+	struct dkimf_db_sqlstmt **pp;
+
+	if (odbx_error_type(odbx, err) < 0)
+		return FALSE;
+
+	pthread_mutex_lock(&sqlstmt_lock);
+
+	for (pp = &sqlstmts; *pp != NULL; pp = &(*pp)->ss_next)
+	{
+		ss = *pp;
+		if (ss->ss_odbx == odbx &&
+		    strcmp(ss->ss_name, dsn->dsn_stmt) == 0)
+		{
+			*pp = ss->ss_next;
+			free(ss->ss_text);
+			free(ss);
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&sqlstmt_lock);
+
+	return TRUE;
+}
+# endif /* _FFR_DSN_PREPARE */
 #endif /* USE_ODBX */
 
 /*
@@ -1826,6 +7090,9 @@ dkimf_db_open(DKIMF_DB *db, char *name, u_int flags, pthread_mutex_t *lock,
 	DKIMF_DB new;
 	char *comma;
 	char *p;
+#ifdef _FFR_DB_AUTORELOAD
+	struct stat rs;
+#endif /* _FFR_DB_AUTORELOAD */
 
 	assert(db != NULL);
 	assert(name != NULL);
@@ -1902,7 +7169,7 @@ dkimf_db_open(DKIMF_DB *db, char *name, u_int flags, pthread_mutex_t *lock,
 
 	/* force DB accesses to be mutex-protected */
 	if (new->db_type == DKIMF_DB_TYPE_DSN ||
-	    new->db_type == DKIMF_DB_TYPE_SOCKET)
+	    new->db_type == DKIMF_DB_TYPE_MEMCACHE)
 		new->db_flags |= DKIMF_DB_FLAG_MAKELOCK;
 
 	/* use provided lock, or create a new one if needed */
@@ -2125,6 +7392,12 @@ dkimf_db_open(DKIMF_DB *db, char *name, u_int flags, pthread_mutex_t *lock,
 			return -1;
 		}
 
+#ifdef _FFR_DB_AUTORELOAD
+		/* what was read, for noticing changes later */
+		if (fstat(fileno(f), &rs) != 0)
+			new->db_flags &= ~DKIMF_DB_FLAG_AUTORELOAD;
+#endif /* _FFR_DB_AUTORELOAD */
+
 		memset(line, '\0', sizeof line);
 		while (fgets(line, BUFRSZ, f) != NULL)
 		{
@@ -2324,6 +7597,12 @@ dkimf_db_open(DKIMF_DB *db, char *name, u_int flags, pthread_mutex_t *lock,
 			return -1;
 		}
 
+#ifdef _FFR_DB_AUTORELOAD
+		/* what was read, for noticing changes later */
+		if (fstat(fileno(f), &rs) != 0)
+			new->db_flags &= ~DKIMF_DB_FLAG_AUTORELOAD;
+#endif /* _FFR_DB_AUTORELOAD */
+
 		reflags = REG_EXTENDED;
 		if ((new->db_flags & DKIMF_DB_FLAG_ICASE) != 0)
 			reflags |= REG_ICASE;
@@ -2440,30 +7719,55 @@ dkimf_db_open(DKIMF_DB *db, char *name, u_int flags, pthread_mutex_t *lock,
 		break;
 	  }
 
-#ifdef USE_DB
-	  case DKIMF_DB_TYPE_BDB:
+#ifdef _FFR_CTABLE
+	  case DKIMF_DB_TYPE_CTABLE:
 	  {
-# if DB_VERSION_CHECK(2,0,0)
-		int dbflags = 0;
-# endif /* DB_VERSION_CHECK(2,0,0) */
-		int status = 0;
-		DBTYPE bdbtype;
-		DB *newdb;
+		int status;
+		struct stat sb;
+		struct dkimf_db_ctable *ct = NULL;
 
-# if DB_VERSION_CHECK(2,0,0)
-		if ((new->db_flags & DKIMF_DB_FLAG_READONLY) != 0)
+		if ((new->db_flags & DKIMF_DB_FLAG_READONLY) == 0 ||
+		    (new->db_flags & DKIMF_DB_FLAG_VALLIST) != 0)
 		{
-			dbflags |= DB_RDONLY;
-			bdbtype = DB_UNKNOWN;
+			if (err != NULL)
+				*err = strerror(EINVAL);
+			free(new);
+			errno = EINVAL;
+			return 2;
 		}
-		else
+
+		status = dkimf_db_ctable_open(p, &sb, &ct);
+		if (status == 0 && ct == NULL)
+			status = EINVAL;
+		if (status != 0)
 		{
-			dbflags |= DB_CREATE;
-			bdbtype = DB_HASH;
+			if (ct != NULL)
+				dkimf_db_ctable_free(ct);
+			if (err != NULL && status == EINVAL)
+				*err = "Not a valid compiled table";
+			else if (err != NULL)
+				*err = strerror(status);
+			free(new);
+			errno = status;
+			return -1;
 		}
-# else /* DB_VERSION_CHECK(2,0,0) */
-		bdbtype = DB_HASH;
-# endif /* DB_VERSION_CHECK(2,0,0) */
+
+# ifdef _FFR_DB_AUTORELOAD
+		memcpy(&rs, &sb, sizeof rs);
+# endif /* _FFR_DB_AUTORELOAD */
+
+		new->db_handle = ct;
+		new->db_nrecs = ct->ct_hdr->ch_nrecs;
+
+		break;
+	  }
+#endif /* _FFR_CTABLE */
+
+#ifdef USE_DB
+	  case DKIMF_DB_TYPE_BDB:
+	  {
+		int status = 0;
+		DB *newdb;
 
 		if (*p == '\0')
 		{
@@ -2472,39 +7776,72 @@ dkimf_db_open(DKIMF_DB *db, char *name, u_int flags, pthread_mutex_t *lock,
 			p = NULL;
 		}
 
-# if DB_VERSION_CHECK(3,0,0)
-		status = db_create(&newdb, NULL, 0);
-		if (status == 0)
+		status = dkimf_db_open_bdb(p, ((new->db_flags &
+		                               DKIMF_DB_FLAG_READONLY) != 0),
+		                           &newdb);
+		if (status != 0)
 		{
-#  if DB_VERSION_CHECK(4,1,25)
- 			status = newdb->open(newdb, NULL, p, NULL,
-			                       bdbtype, dbflags, 0);
-#  else /* DB_VERSION_CHECK(4,1,25) */
-			status = newdb->open(newdb, p, NULL, bdbtype,
-			                     dbflags, 0);
-#  endif /* DB_VERSION_CHECK(4,1,25) */
+			if (err != NULL)
+				*err = DB_STRERROR(status);
+			free(new);
+			return 3;
 		}
-# elif DB_VERSION_CHECK(2,0,0)
-		status = db_open(p, bdbtype, dbflags, DKIMF_DB_MODE,
-		                 NULL, NULL, &newdb);
-# else /* DB_VERSION_CHECK(2,0,0) */
-		newdb = dbopen(p,
-		               (new->db_flags & DKIMF_DB_FLAG_READONLY ? O_RDONLY
-		                                                       : (O_CREAT|O_RDWR)),
-		               DKIMF_DB_MODE, bdbtype, NULL);
-		if (newdb == NULL)
-			status = errno;
-# endif /* DB_VERSION_CHECK */
 
-		if (status != 0)
-		{
-			if (err != NULL)
-				*err = DB_STRERROR(status);
-			free(new);
-			return 3;
-		}
+		new->db_handle = newdb;
+
+# ifdef _FFR_BDB_SNAPSHOT
+		if (p != NULL &&
+		    (new->db_flags & DKIMF_DB_FLAG_READONLY) != 0 &&
+		    (new->db_flags & DKIMF_DB_FLAG_SNAPSHOT) != 0)
+		{
+			struct dkimf_db_bdbsnap *bs;
+
+			bs = (struct dkimf_db_bdbsnap *) malloc(sizeof *bs);
+			if (bs == NULL)
+			{
+				if (err != NULL)
+					*err = strerror(errno);
+				(void) DKIMF_DBCLOSE(newdb);
+				free(new);
+				return -1;
+			}
+
+			memset(bs, '\0', sizeof *bs);
+
+			bs->bs_path = strdup(p);
+			if (bs->bs_path == NULL)
+			{
+				if (err != NULL)
+					*err = strerror(errno);
+				free(bs);
+				(void) DKIMF_DBCLOSE(newdb);
+				free(new);
+				return -1;
+			}
+
+			status = dkimf_db_snap_load(bs->bs_path, &bs->bs_stat,
+			                            &bs->bs_snap);
+			if (status != 0)
+			{
+				if (err != NULL)
+					*err = DB_STRERROR(status);
+				free(bs->bs_path);
+				free(bs);
+				(void) DKIMF_DBCLOSE(newdb);
+				free(new);
+				return 3;
+			}
+
+			pthread_rwlock_init(&bs->bs_lock, NULL);
 
-		new->db_handle = newdb;
+			new->db_data = bs;
+
+			pthread_mutex_lock(&snap_lock);
+			bs->bs_next = snaps;
+			snaps = bs;
+			pthread_mutex_unlock(&snap_lock);
+		}
+# endif /* _FFR_BDB_SNAPSHOT */
 
 		break;
 	  }
@@ -2521,6 +7858,10 @@ dkimf_db_open(DKIMF_DB *db, char *name, u_int flags, pthread_mutex_t *lock,
 		char *eq;
 		char *tmp;
 		odbx_t *odbx;
+# ifdef _FFR_DB_SHARED_POOLS
+		u_int poolmax;
+		const char *shparts[6];
+# endif /* _FFR_DB_SHARED_POOLS */
 
 		dsn = (struct dkimf_db_dsn *) malloc(sizeof(struct dkimf_db_dsn));
 		if (dsn == NULL)
@@ -2740,10 +8081,53 @@ dkimf_db_open(DKIMF_DB *db, char *name, u_int flags, pthread_mutex_t *lock,
 			return -1;
 		}
 
+# ifdef _FFR_DSN_PREPARE
+		dkimf_db_sql_stmtname(dsn);
+# endif /* _FFR_DSN_PREPARE */
+
 # ifdef _FFR_DB_HANDLE_POOLS
+#  ifdef _FFR_DB_SHARED_POOLS
+		/*
+		**  Data sets using the same server, database and credentials
+		**  share one pool.  It keeps its own copy of the connection
+		**  parameters since it can outlive the data set creating it.
+		*/
+
+		shparts[0] = dsn->dsn_backend;
+		shparts[1] = dsn->dsn_host;
+		shparts[2] = dsn->dsn_port;
+		shparts[3] = dsn->dsn_dbase;
+		shparts[4] = dsn->dsn_user;
+		shparts[5] = dsn->dsn_password;
+
+		new->db_handle = dkimf_db_shpool_get(new->db_type, shparts, 6);
+		if (new->db_handle == NULL)
+		{
+			struct dkimf_db_dsn *hdata;
+
+			hdata = (struct dkimf_db_dsn *) malloc(sizeof *hdata);
+			if (hdata != NULL)
+			{
+				memcpy(hdata, dsn, sizeof *hdata);
+				hdata->dsn_filter = NULL;
+
+				poolmax = dkimf_db_pool_getparam(DKIMF_POOL_PARAM_SIZE,
+				                                 DEFPOOLMAX);
+				new->db_handle = dkimf_db_hp_new(new->db_type,
+				                                 poolmax, hdata);
+				if (new->db_handle == NULL)
+					free(hdata);
+				else
+					dkimf_db_shpool_add(new->db_type,
+					                    shparts, 6,
+					                    new->db_handle);
+			}
+		}
+#  else /* _FFR_DB_SHARED_POOLS */
 		new->db_handle = dkimf_db_hp_new(new->db_type,
 		                                 DEFPOOLMAX, dsn);
-		if (new == NULL)
+#  endif /* _FFR_DB_SHARED_POOLS */
+		if (new->db_handle == NULL)
 		{
 			if (err != NULL)
 				*err = strerror(errno);
@@ -2799,6 +8183,9 @@ dkimf_db_open(DKIMF_DB *db, char *name, u_int flags, pthread_mutex_t *lock,
 # endif /* USE_DB */
 #endif /* _FFR_LDAP_CACHING */
 		char *uris[DKIMF_LDAP_MAXURIS];
+#if defined(_FFR_LDAP_ASYNC) && defined(_FFR_DB_SHARED_POOLS)
+		const char *shparts[DKIMF_LDAP_PARAM_MAX + 2];
+#endif /* _FFR_LDAP_ASYNC && _FFR_DB_SHARED_POOLS */
 
 		memset(uris, '\0', sizeof uris);
 
@@ -2915,6 +8302,27 @@ dkimf_db_open(DKIMF_DB *db, char *name, u_int flags, pthread_mutex_t *lock,
 			ldap_free_urldesc(descr);
 		}
 
+		ld = NULL;
+
+# if defined(_FFR_LDAP_ASYNC) && defined(_FFR_DB_SHARED_POOLS)
+		/*
+		**  Data sets naming the same servers share one pool as long
+		**  as they also connect and bind the same way.  The binding
+		**  parameters can change on reload, so they're part of the
+		**  key too.
+		*/
+
+		shparts[0] = ldap->ldap_urilist;
+		for (c = 0; c <= DKIMF_LDAP_PARAM_MAX; c++)
+			shparts[c + 1] = dkimf_db_ldap_param[c];
+
+		ldap->ldap_pool = dkimf_db_shpool_get(DKIMF_DB_TYPE_LDAP,
+		                                      shparts,
+		                                      DKIMF_LDAP_PARAM_MAX + 2);
+		if (ldap->ldap_pool != NULL)
+			lderr = LDAP_SUCCESS;
+		else
+# endif /* _FFR_LDAP_ASYNC && _FFR_DB_SHARED_POOLS */
 		lderr = dkimf_db_open_ldap(&ld, ldap, err);
 		if (lderr != LDAP_SUCCESS)
 		{
@@ -2935,6 +8343,38 @@ dkimf_db_open(DKIMF_DB *db, char *name, u_int flags, pthread_mutex_t *lock,
 
 		pthread_mutex_init(&ldap->ldap_lock, NULL);
 
+# ifdef _FFR_LDAP_ASYNC
+		/*
+		**  Lookups go through the pool, which takes over the handle
+		**  we just opened.  Walks open one of their own if needed.
+		*/
+
+		if (ldap->ldap_pool == NULL)
+		{
+			ldap->ldap_pool = dkimf_db_ldap_newpool(ld);
+			if (ldap->ldap_pool == NULL)
+			{
+				if (err != NULL)
+					*err = strerror(errno);
+				if (ld != NULL)
+					ldap_unbind_ext(ld, NULL, NULL);
+				pthread_mutex_destroy(&ldap->ldap_lock);
+				free(ldap);
+				free(p);
+				free(new);
+				return -1;
+			}
+
+#  ifdef _FFR_DB_SHARED_POOLS
+			dkimf_db_shpool_add(DKIMF_DB_TYPE_LDAP,
+			                    shparts, DKIMF_LDAP_PARAM_MAX + 2,
+			                    ldap->ldap_pool);
+#  endif /* _FFR_DB_SHARED_POOLS */
+
+			ld = NULL;
+		}
+# endif /* _FFR_LDAP_ASYNC */
+
 # ifdef _FFR_LDAP_CACHING
 #  ifdef USE_DB
 		if ((new->db_flags & DKIMF_DB_FLAG_NOCACHE) == 0)
@@ -3075,6 +8515,34 @@ dkimf_db_open(DKIMF_DB *db, char *name, u_int flags, pthread_mutex_t *lock,
 		}
 
 		free(tmp);
+
+# ifdef _FFR_LUA_STATE_POOLS
+		/* run queries in pooled states holding the compiled chunk */
+		{
+			u_int max;
+			u_int recycle;
+
+			max = dkimf_db_lua_param[DKIMF_LUA_PARAM_STATES];
+			recycle = dkimf_db_lua_param[DKIMF_LUA_PARAM_RECYCLE];
+
+			if (max > 0)
+			{
+				lua->lua_pool = dkimf_lua_pool_new(lua->lua_script,
+				                                   lua->lua_scriptlen,
+				                                   p, max,
+				                                   recycle);
+				if (lua->lua_pool == NULL)
+				{
+					if (err != NULL)
+						*err = strerror(errno);
+					free(lua->lua_script);
+					free(new->db_data);
+					return -1;
+				}
+			}
+		}
+# endif /* _FFR_LUA_STATE_POOLS */
+
 		break;
 	  }
 #endif /* USE_LUA */
@@ -3190,6 +8658,7 @@ dkimf_db_open(DKIMF_DB *db, char *name, u_int flags, pthread_mutex_t *lock,
 	  {
 		int fd;
 		int status;
+		u_int c;
 		struct dkimf_db_socket *sdb;
 
 		sdb = (struct dkimf_db_socket *) malloc(sizeof *sdb);
@@ -3529,8 +8998,65 @@ dkimf_db_open(DKIMF_DB *db, char *name, u_int flags, pthread_mutex_t *lock,
 			}
 		}
 
-		sdb->sockdb_fd = fd;
-		sdb->sockdb_buf = dkimf_dstring_new(BUFRSZ, 0);
+		/*
+		**  Remember where we ended up so that the pool can open
+		**  further connections to the same place later.
+		*/
+
+		sdb->sockdb_addrlen = sizeof sdb->sockdb_addr;
+		if (getpeername(fd, (struct sockaddr *) &sdb->sockdb_addr,
+		                &sdb->sockdb_addrlen) != 0)
+			sdb->sockdb_addrlen = 0;
+
+		sdb->sockdb_nconns = DKIMF_SOCKET_CONNECTIONS;
+		c = dkimf_db_socket_param[DKIMF_SOCKET_PARAM_CONNECTIONS];
+		if (c != 0 && sdb->sockdb_addrlen != 0)
+			sdb->sockdb_nconns = c;
+
+		c = dkimf_db_socket_param[DKIMF_SOCKET_PARAM_PIPELINE];
+		sdb->sockdb_pipeline = (c != 0);
+
+		sdb->sockdb_next = 0;
+		sdb->sockdb_conns = calloc(sdb->sockdb_nconns,
+		                           sizeof(struct dkimf_db_sockconn));
+		if (sdb->sockdb_conns == NULL)
+		{
+			if (err != NULL)
+				*err = strerror(errno);
+			close(fd);
+			free(sdb);
+			free(new);
+			return 2;
+		}
+
+		for (c = 0; c < sdb->sockdb_nconns; c++)
+		{
+			sdb->sockdb_conns[c].sc_fd = -1;
+			sdb->sockdb_conns[c].sc_buf = dkimf_dstring_new(BUFRSZ,
+			                                                0);
+			if (sdb->sockdb_conns[c].sc_buf == NULL)
+			{
+				if (err != NULL)
+					*err = strerror(errno);
+				while (c-- > 0)
+				{
+					dkimf_dstring_free(sdb->sockdb_conns[c].sc_buf);
+					pthread_mutex_destroy(&sdb->sockdb_conns[c].sc_wlock);
+				}
+				free(sdb->sockdb_conns);
+				close(fd);
+				free(sdb);
+				free(new);
+				return 2;
+			}
+
+			pthread_mutex_init(&sdb->sockdb_conns[c].sc_wlock, NULL);
+		}
+
+		sdb->sockdb_conns[0].sc_fd = fd;
+
+		pthread_mutex_init(&sdb->sockdb_lock, NULL);
+		pthread_cond_init(&sdb->sockdb_cond, NULL);
 
 		new->db_handle = sdb;
 
@@ -3557,7 +9083,16 @@ dkimf_db_open(DKIMF_DB *db, char *name, u_int flags, pthread_mutex_t *lock,
 			return -1;
 		}
 
-		status = mdb_env_open(mdb->mdb_env, p, 0, 0);
+		/*
+		**  Read transactions are kept per thread rather than per
+		**  reader slot, so each thread needs a slot of its own.
+		**  This only takes effect if the lock file is being created.
+		*/
+
+		(void) mdb_env_set_maxreaders(mdb->mdb_env,
+		                              DKIMF_DB_MDB_MAXREADERS);
+
+		status = mdb_env_open(mdb->mdb_env, p, MDB_NOTLS, 0);
 		if (status != 0)
 		{
 			if (err != NULL)
@@ -3567,7 +9102,8 @@ dkimf_db_open(DKIMF_DB *db, char *name, u_int flags, pthread_mutex_t *lock,
 			return -1;
 		}
 
-		status = mdb_txn_begin(mdb->mdb_env, NULL, 0, &mdb->mdb_txn);
+		status = mdb_txn_begin(mdb->mdb_env, NULL, MDB_RDONLY,
+		                       &mdb->mdb_txn);
 		if (status != 0)
 		{
 			if (err != NULL)
@@ -3578,16 +9114,34 @@ dkimf_db_open(DKIMF_DB *db, char *name, u_int flags, pthread_mutex_t *lock,
 		}
 
 		status = mdb_dbi_open(mdb->mdb_txn, NULL, 0, &mdb->mdb_dbi);
+		if (status == 0)
+			status = mdb_txn_commit(mdb->mdb_txn);
+		else
+			mdb_txn_abort(mdb->mdb_txn);
+		mdb->mdb_txn = NULL;
 		if (status != 0)
 		{
 			if (err != NULL)
 				*err = mdb_strerror(status);
-			mdb_txn_abort(mdb->mdb_txn);
 			mdb_env_close(mdb->mdb_env);
 			free(mdb);
 			return -1;
 		}
 
+		status = pthread_key_create(&mdb->mdb_key,
+		                            dkimf_db_mdb_txnfree);
+		if (status != 0)
+		{
+			if (err != NULL)
+				*err = strerror(status);
+			mdb_env_close(mdb->mdb_env);
+			free(mdb);
+			return -1;
+		}
+
+		pthread_mutex_init(&mdb->mdb_lock, NULL);
+		mdb->mdb_txns = NULL;
+
 		new->db_data = (void *) mdb;
 
 		break;
@@ -3675,12 +9229,26 @@ dkimf_db_open(DKIMF_DB *db, char *name, u_int flags, pthread_mutex_t *lock,
 #endif /* USE_ERLANG */
 	}
 
+#ifdef _FFR_DB_AUTORELOAD
+	if ((new->db_flags & DKIMF_DB_FLAG_AUTORELOAD) != 0 &&
+	    (new->db_type == DKIMF_DB_TYPE_FILE ||
+	     new->db_type == DKIMF_DB_TYPE_REFILE ||
+	     new->db_type == DKIMF_DB_TYPE_CTABLE) &&
+	    dkimf_db_reload_add(new, name, &rs) != 0)
+	{
+		if (err != NULL)
+			*err = strerror(errno);
+		(void) dkimf_db_close(new);
+		return -1;
+	}
+#endif /* _FFR_DB_AUTORELOAD */
+
 	*db = new;
 	return 0;
 }
 
 /*
-**  DKIMF_DB_DELETE -- delete a key/data pair from an open database
+**  DKIMF_DB_REMOVE -- delete a key/data pair from an open database's backend
 **
 **  Parameters:
 **  	db -- DB handle to use for searching
@@ -3692,8 +9260,8 @@ dkimf_db_open(DKIMF_DB *db, char *name, u_int flags, pthread_mutex_t *lock,
 **	!0 -- error occurred; error code returned
 */
 
-int
-dkimf_db_delete(DKIMF_DB db, void *buf, size_t buflen)
+static int
+dkimf_db_remove(DKIMF_DB db, void *buf, size_t buflen)
 {
 	int ret = EINVAL;
 #ifdef USE_DB
@@ -3706,6 +9274,14 @@ dkimf_db_delete(DKIMF_DB db, void *buf, size_t buflen)
 	assert(db != NULL);
 	assert(buf != NULL);
 
+#ifdef _FFR_DB_CACHE
+	if (db->db_cache != NULL)
+	{
+		dkimf_db_cache_drop(db->db_cache, buf,
+		                    buflen == 0 ? strlen(buf) : buflen);
+	}
+#endif /* _FFR_DB_CACHE */
+
 	if (db->db_type == DKIMF_DB_TYPE_FILE ||
 	    db->db_type == DKIMF_DB_TYPE_CSL || 
 	    db->db_type == DKIMF_DB_TYPE_DSN || 
@@ -3714,7 +9290,8 @@ dkimf_db_delete(DKIMF_DB db, void *buf, size_t buflen)
 	    db->db_type == DKIMF_DB_TYPE_MEMCACHE || 
 	    db->db_type == DKIMF_DB_TYPE_REPUTE || 
 	    db->db_type == DKIMF_DB_TYPE_REFILE ||
-	    db->db_type == DKIMF_DB_TYPE_ERLANG)
+	    db->db_type == DKIMF_DB_TYPE_ERLANG ||
+	    db->db_type == DKIMF_DB_TYPE_CTABLE)
 		return EINVAL;
 
 #ifdef USE_DB
@@ -3826,7 +9403,42 @@ dkimf_db_delete(DKIMF_DB db, void *buf, size_t buflen)
 }
 
 /*
-**  DKIMF_DB_PUT -- store a key/data pair in an open database
+**  DKIMF_DB_DELETE -- delete a key/data pair from an open database
+**
+**  Parameters:
+**  	db -- DB handle to use for searching
+**  	buf -- pointer to record to be deleted
+**  	buflen -- size of record at "buf"; if 0, use strlen()
+**
+**  Return value:
+**  	0 -- operation successful
+**	!0 -- error occurred; error code returned
+**
+**  Notes:
+**  	If a write-behind buffer has been attached with dkimf_db_wb_enable(),
+**  	the delete is queued there and reaches the backend later.
+*/
+
+int
+dkimf_db_delete(DKIMF_DB db, void *buf, size_t buflen)
+{
+	assert(db != NULL);
+	assert(buf != NULL);
+
+#ifdef _FFR_DB_WRITEBEHIND
+	if (db->db_wb != NULL)
+	{
+		return dkimf_db_wb_put(db, buf,
+		                       buflen == 0 ? strlen(buf) : buflen,
+		                       NULL, 0);
+	}
+#endif /* _FFR_DB_WRITEBEHIND */
+
+	return dkimf_db_remove(db, buf, buflen);
+}
+
+/*
+**  DKIMF_DB_STORE -- store a key/data pair in an open database's backend
 **
 **  Parameters:
 **  	db -- DB handle to use for searching
@@ -3840,9 +9452,9 @@ dkimf_db_delete(DKIMF_DB db, void *buf, size_t buflen)
 **	!0 -- error occurred; error code returned
 */
 
-int
-dkimf_db_put(DKIMF_DB db, void *buf, size_t buflen,
-             void *outbuf, size_t outbuflen)
+static int
+dkimf_db_store(DKIMF_DB db, void *buf, size_t buflen,
+               void *outbuf, size_t outbuflen)
 {
 	int ret = EINVAL;
 #ifdef USE_DB
@@ -3864,13 +9476,22 @@ dkimf_db_put(DKIMF_DB db, void *buf, size_t buflen,
 	assert(buf != NULL);
 	assert(outbuf != NULL);
 
+#ifdef _FFR_DB_CACHE
+	if (db->db_cache != NULL)
+	{
+		dkimf_db_cache_drop(db->db_cache, buf,
+		                    buflen == 0 ? strlen(buf) : buflen);
+	}
+#endif /* _FFR_DB_CACHE */
+
 	if (db->db_type == DKIMF_DB_TYPE_FILE ||
 	    db->db_type == DKIMF_DB_TYPE_CSL || 
 	    db->db_type == DKIMF_DB_TYPE_DSN || 
 	    db->db_type == DKIMF_DB_TYPE_LDAP || 
 	    db->db_type == DKIMF_DB_TYPE_LUA || 
 	    db->db_type == DKIMF_DB_TYPE_REPUTE || 
-	    db->db_type == DKIMF_DB_TYPE_REFILE)
+	    db->db_type == DKIMF_DB_TYPE_REFILE ||
+	    db->db_type == DKIMF_DB_TYPE_CTABLE)
 		return EINVAL;
 
 #ifdef USE_DB
@@ -4041,6 +9662,45 @@ dkimf_db_put(DKIMF_DB db, void *buf, size_t buflen,
 	return ret;
 }
 
+/*
+**  DKIMF_DB_PUT -- store a key/data pair in an open database
+**
+**  Parameters:
+**  	db -- DB handle to use for searching
+**  	buf -- pointer to key record
+**  	buflen -- size of key (use strlen() if 0)
+**  	outbuf -- data buffer
+**  	outbuflen -- number of bytes at outbuf to use as data
+**
+**  Return value:
+**  	0 -- operation successful
+**	!0 -- error occurred; error code returned
+**
+**  Notes:
+**  	If a write-behind buffer has been attached with dkimf_db_wb_enable(),
+**  	the write is queued there and reaches the backend later.
+*/
+
+int
+dkimf_db_put(DKIMF_DB db, void *buf, size_t buflen,
+             void *outbuf, size_t outbuflen)
+{
+	assert(db != NULL);
+	assert(buf != NULL);
+	assert(outbuf != NULL);
+
+#ifdef _FFR_DB_WRITEBEHIND
+	if (db->db_wb != NULL)
+	{
+		return dkimf_db_wb_put(db, buf,
+		                       buflen == 0 ? strlen(buf) : buflen,
+		                       outbuf, outbuflen);
+	}
+#endif /* _FFR_DB_WRITEBEHIND */
+
+	return dkimf_db_store(db, buf, buflen, outbuf, outbuflen);
+}
+
 /*
 **  DKIMF_DB_GET -- retrieve data from an open database
 **
@@ -4080,11 +9740,121 @@ dkimf_db_put(DKIMF_DB db, void *buf, size_t buflen,
 **  	values will be filled in in order (so for "aaa:bbb", "aaa" will be
 **  	copied into the first attribute, "bbb" will be copied to the second,
 **  	and all others will receive no data.
+**
+**  	If a result cache has been attached with dkimf_db_cache_enable(),
+**  	it is consulted first, and is updated from the backend on a miss.
+**  	While a circuit breaker (see dkimf_db_breaker_enable()) is open,
+**  	expired answers are used from the cache and a miss fails at once.
+**  	A write still waiting in a write-behind buffer (see
+**  	dkimf_db_wb_enable()) takes precedence over both.
 */
 
 int
 dkimf_db_get(DKIMF_DB db, void *buf, size_t buflen,
              DKIMF_DBDATA req, unsigned int reqnum, _Bool *exists)
+{
+#ifdef _FFR_METRICS
+	int status;
+	struct timeval start;
+
+	dkimf_metrics_count(DKIMF_METRIC_DBLOOKUPS, db->db_type, 1);
+
+	dkimf_metrics_start(&start);
+	status = dkimf_db_fetch(db, buf, buflen, req, reqnum, exists);
+	dkimf_metrics_time(DKIMF_METRIC_DBTIME, db->db_type, &start);
+
+	return status;
+#else /* _FFR_METRICS */
+	return dkimf_db_fetch(db, buf, buflen, req, reqnum, exists);
+#endif /* _FFR_METRICS */
+}
+
+/*
+**  DKIMF_DB_FETCH -- retrieve data, consulting any cache
+**
+**  Parameters:
+**  	As for dkimf_db_get().
+**
+**  Return value:
+**  	As for dkimf_db_get().
+*/
+
+static int
+dkimf_db_fetch(DKIMF_DB db, void *buf, size_t buflen,
+               DKIMF_DBDATA req, unsigned int reqnum, _Bool *exists)
+{
+#ifdef _FFR_DB_WRITEBEHIND
+	if (db->db_wb != NULL)
+	{
+		int status;
+
+		if (dkimf_db_wb_get(db->db_wb, buf,
+		                    buflen == 0 ? strlen(buf) : buflen,
+		                    req, reqnum, exists, &status))
+			return status;
+	}
+#endif /* _FFR_DB_WRITEBEHIND */
+
+#ifdef _FFR_DB_CACHE
+	assert(db != NULL);
+	assert(buf != NULL);
+	assert(req != NULL || reqnum == 0);
+
+	if (db->db_cache != NULL && reqnum <= DKIMF_DB_CACHE_MAXREQ &&
+	    (db->db_flags & DKIMF_DB_FLAG_MATCHBOTH) == 0)
+	{
+		_Bool found = FALSE;
+		int status;
+		unsigned int c;
+		u_int gen;
+		size_t keylen;
+		size_t reqsz[DKIMF_DB_CACHE_MAXREQ];
+
+		keylen = (buflen == 0 ? strlen(buf) : buflen);
+
+		if (dkimf_db_cache_get(db->db_cache, buf, keylen, req, reqnum,
+		                       DKIMF_DB_BREAKER_OPEN(db), &found))
+		{
+			if (exists != NULL)
+				*exists = found;
+			return 0;
+		}
+
+		for (c = 0; c < reqnum; c++)
+			reqsz[c] = req[c].dbdata_buflen;
+
+		gen = dkimf_db_cache_gen(db->db_cache);
+
+		status = DKIMF_DB_LOOKUP(db, buf, buflen, req, reqnum, &found);
+		if (status == 0)
+		{
+			dkimf_db_cache_put(db->db_cache, gen, buf, keylen,
+			                   req, reqsz, reqnum, found);
+		}
+
+		if (exists != NULL)
+			*exists = found;
+
+		return status;
+	}
+#endif /* _FFR_DB_CACHE */
+
+	return DKIMF_DB_LOOKUP(db, buf, buflen, req, reqnum, exists);
+}
+
+/*
+**  DKIMF_DB_LOOKUP -- retrieve data from an open database's backend
+**
+**  Parameters:
+**  	As for dkimf_db_get().
+**
+**  Return value:
+**  	As for dkimf_db_get().
+*/
+
+static int
+dkimf_db_lookup(DKIMF_DB db, void *buf, size_t buflen,
+                DKIMF_DBDATA req, unsigned int reqnum, _Bool *exists)
 {
 	_Bool matched;
 
@@ -4123,7 +9893,7 @@ dkimf_db_get(DKIMF_DB db, void *buf, size_t buflen,
 	  {
 		struct dkimf_db_list *list;
 
-		for (list = (struct dkimf_db_list *) db->db_handle;
+		for (list = (struct dkimf_db_list *) DKIMF_DB_HANDLE(db);
 		     list != NULL;
 		     list = list->db_list_next)
 		{
@@ -4190,11 +9960,17 @@ dkimf_db_get(DKIMF_DB db, void *buf, size_t buflen,
 		return 0;
 	  }
 
+#ifdef _FFR_CTABLE
+	  case DKIMF_DB_TYPE_CTABLE:
+		return dkimf_db_ctable_get(db, buf, buflen, req, reqnum,
+		                           exists);
+#endif /* _FFR_CTABLE */
+
 	  case DKIMF_DB_TYPE_REFILE:
 	  {
 		struct dkimf_db_relist *list;
 
-		list = (struct dkimf_db_relist *) db->db_handle;
+		list = (struct dkimf_db_relist *) DKIMF_DB_HANDLE(db);
 
 		while (list != NULL)
 		{
@@ -4236,6 +10012,14 @@ dkimf_db_get(DKIMF_DB db, void *buf, size_t buflen,
 		DBT q;
 		char databuf[BUFRSZ + 1];
 
+# ifdef _FFR_BDB_SNAPSHOT
+		if (db->db_data != NULL)
+		{
+			return dkimf_db_snap_get(db, buf, buflen, req, reqnum,
+			                         exists);
+		}
+# endif /* _FFR_BDB_SNAPSHOT */
+
 		bdb = (DB *) db->db_handle;
 
 		memset(&d, 0, sizeof d);
@@ -4401,12 +10185,16 @@ dkimf_db_get(DKIMF_DB db, void *buf, size_t buflen,
 	  case DKIMF_DB_TYPE_DSN:
 	  {
 		_Bool reconnected = FALSE;
+# ifdef _FFR_DSN_PREPARE
+		_Bool executed = FALSE;
+		_Bool retried = FALSE;
+# endif /* _FFR_DSN_PREPARE */
 		int err;
 		int fields;
 		int rescnt = 0;
 		int rowcnt = 0;
 		u_long elen;
-		odbx_result_t *result;
+		odbx_result_t *result = NULL;
 		odbx_t *odbx = NULL;
 		struct dkimf_db_dsn *dsn;
 		char query[BUFRSZ];
@@ -4464,13 +10252,31 @@ dkimf_db_get(DKIMF_DB db, void *buf, size_t buflen,
 			return err;
 		}
 
-		snprintf(query, sizeof query,
-		         "SELECT %s FROM %s WHERE %s = '%s'%s%s",
-		         dsn->dsn_datacol,
-		         dsn->dsn_table,
-		         dsn->dsn_keycol, escaped,
-		         dsn->dsn_filter == NULL ? "" : " AND ",
-		         dsn->dsn_filter == NULL ? "" : dsn->dsn_filter);
+		query[0] = '\0';
+
+# ifdef _FFR_DSN_PREPARE
+		/* reuse the statement prepared on this connection if we can */
+  prepare:
+		executed = FALSE;
+		if (dsn->dsn_stmt[0] != '\0' &&
+		    dkimf_db_sql_prepare(dsn, odbx) == 0)
+		{
+			snprintf(query, sizeof query, "EXECUTE %s('%s')",
+			         dsn->dsn_stmt, escaped);
+			executed = TRUE;
+		}
+# endif /* _FFR_DSN_PREPARE */
+
+		if (query[0] == '\0')
+		{
+			snprintf(query, sizeof query,
+			         "SELECT %s FROM %s WHERE %s = '%s'%s%s",
+			         dsn->dsn_datacol,
+			         dsn->dsn_table,
+			         dsn->dsn_keycol, escaped,
+			         dsn->dsn_filter == NULL ? "" : " AND ",
+			         dsn->dsn_filter == NULL ? "" : dsn->dsn_filter);
+		}
 
 		err = odbx_query(odbx, query, 0);
 		if (err < 0)
@@ -4479,6 +10285,16 @@ dkimf_db_get(DKIMF_DB db, void *buf, size_t buflen,
 
 			db->db_status = err;
 
+# ifdef _FFR_DSN_PREPARE
+			if (executed && !retried &&
+			    dkimf_db_sql_stale(dsn, odbx, err))
+			{
+				retried = TRUE;
+				query[0] = '\0';
+				goto prepare;
+			}
+# endif /* _FFR_DSN_PREPARE */
+
 			if (reconnected)
 			{
 				if (db->db_lock != NULL)
@@ -4508,6 +10324,9 @@ dkimf_db_get(DKIMF_DB db, void *buf, size_t buflen,
 
 			if (status < 0)
 			{
+# ifdef _FFR_DSN_PREPARE
+				dkimf_db_sql_forget(odbx);
+# endif /* _FFR_DSN_PREPARE */
 				(void) odbx_unbind(odbx);
 				(void) odbx_finish(odbx);
 
@@ -4520,8 +10339,8 @@ dkimf_db_get(DKIMF_DB db, void *buf, size_t buflen,
 				if (db->db_lock != NULL)
 					(void) pthread_mutex_unlock(db->db_lock);
 
-				return dkimf_db_get(db, buf, buflen, req,
-				                    reqnum, exists);
+				return dkimf_db_lookup(db, buf, buflen, req,
+				                       reqnum, exists);
 			}
 			else
 			{
@@ -4533,12 +10352,36 @@ dkimf_db_get(DKIMF_DB db, void *buf, size_t buflen,
 
 		for (rescnt = 0; ; rescnt++)
 		{
+			result = NULL;
 			err = odbx_result(odbx, &result, NULL, 0);
 			if (err < 0)
 			{
 				int status;
 				db->db_status = err;
 
+# ifdef _FFR_DSN_PREPARE
+				if (executed && !retried && rescnt == 0 &&
+				    dkimf_db_sql_stale(dsn, odbx, err))
+				{
+					if (result != NULL)
+						(void) odbx_result_finish(result);
+
+					/* collect the rest of the reply */
+					do
+					{
+						result = NULL;
+						err = odbx_result(odbx, &result,
+						                  NULL, 0);
+						if (result != NULL)
+							(void) odbx_result_finish(result);
+					} while (err > 0);
+
+					retried = TRUE;
+					query[0] = '\0';
+					goto prepare;
+				}
+# endif /* _FFR_DSN_PREPARE */
+
 				if (reconnected)
 				{
 					if (db->db_lock != NULL)
@@ -4570,6 +10413,9 @@ dkimf_db_get(DKIMF_DB db, void *buf, size_t buflen,
 
 				if (status < 0)
 				{
+# ifdef _FFR_DSN_PREPARE
+					dkimf_db_sql_forget(odbx);
+# endif /* _FFR_DSN_PREPARE */
 					(void) odbx_unbind(odbx);
 					(void) odbx_finish(odbx);
 
@@ -4582,9 +10428,9 @@ dkimf_db_get(DKIMF_DB db, void *buf, size_t buflen,
 					if (db->db_lock != NULL)
 						(void) pthread_mutex_unlock(db->db_lock);
 
-					return dkimf_db_get(db, buf, buflen,
-					                    req, reqnum,
-					                    exists);
+					return dkimf_db_lookup(db, buf, buflen,
+					                       req, reqnum,
+					                       exists);
 				}
 
 				if (db->db_lock != NULL)
@@ -4695,27 +10541,35 @@ dkimf_db_get(DKIMF_DB db, void *buf, size_t buflen,
 #ifdef USE_LDAP
 	  case DKIMF_DB_TYPE_LDAP:
 	  {
+#if !defined(_FFR_LDAP_ASYNC) || \
+    (defined(_FFR_LDAP_CACHING) && defined(USE_DB))
 		int c;
+#endif /* !_FFR_LDAP_ASYNC || (_FFR_LDAP_CACHING && USE_DB) */
 		int status;
+#ifdef _FFR_LDAP_ASYNC
+		_Bool found;
+#else /* _FFR_LDAP_ASYNC */
 		LDAP *ld;
 		LDAPMessage *result;
 		LDAPMessage *e;
+		struct berval **vals;
+		struct timeval timeout;
+#endif /* _FFR_LDAP_ASYNC */
 		struct dkimf_db_ldap *ldap;
 #ifdef _FFR_LDAP_CACHING
 # ifdef USE_DB
 		struct dkimf_db_ldap_cache *ldc = NULL;
 # endif /* USE_DB */
 #endif /* _FFR_LDAP_CACHING */
-		struct berval **vals;
 		char query[BUFRSZ];
 		char filter[BUFRSZ];
-		struct timeval timeout;
 
-		ld = (LDAP *) db->db_handle;
 		ldap = (struct dkimf_db_ldap *) db->db_data;
 
 		pthread_mutex_lock(&ldap->ldap_lock);
 
+#ifndef _FFR_LDAP_ASYNC
+		ld = (LDAP *) db->db_handle;
 		if (ld == NULL)
 		{
 			int lderr;
@@ -4732,6 +10586,7 @@ dkimf_db_get(DKIMF_DB db, void *buf, size_t buflen,
 				return lderr;
 			}
 		}
+#endif /* ! _FFR_LDAP_ASYNC */
 
 #ifdef _FFR_LDAP_CACHING
 # ifdef USE_DB
@@ -4897,6 +10752,60 @@ dkimf_db_get(DKIMF_DB db, void *buf, size_t buflen,
 			                     FALSE, filter, sizeof filter);
 		}
 
+#ifdef _FFR_LDAP_ASYNC
+		/*
+		**  The pool does its own locking, so the data set lock isn't
+		**  held while waiting for the server.
+		*/
+
+# if defined(_FFR_LDAP_CACHING) && defined(USE_DB)
+		if (ldap->ldap_cache == NULL)
+# endif /* _FFR_LDAP_CACHING && USE_DB */
+			pthread_mutex_unlock(&ldap->ldap_lock);
+
+		status = dkimf_db_ldap_search(ldap, query, filter,
+		                              req, reqnum, &found);
+
+		pthread_mutex_lock(&ldap->ldap_lock);
+
+		if (status != LDAP_SUCCESS)
+		{
+			db->db_status = status;
+# if defined(_FFR_LDAP_CACHING) && defined(USE_DB)
+			if (ldc != NULL)
+			{
+				ldc->ldc_error = status;
+				ldc->ldc_expire = time(NULL) + DKIMF_LDAP_TTL;
+				ldc->ldc_state = DKIMF_DB_CACHE_DATA;
+				pthread_cond_broadcast(&ldc->ldc_cond);
+			}
+# endif /* _FFR_LDAP_CACHING && USE_DB */
+			pthread_mutex_unlock(&ldap->ldap_lock);
+			return status;
+		}
+
+		if (exists != NULL)
+			*exists = found;
+
+		if (!found)
+		{
+# if defined(_FFR_LDAP_CACHING) && defined(USE_DB)
+			if (ldc != NULL)
+			{
+				ldc->ldc_absent = TRUE;
+				ldc->ldc_state = DKIMF_DB_CACHE_DATA;
+				pthread_cond_broadcast(&ldc->ldc_cond);
+			}
+# endif /* _FFR_LDAP_CACHING && USE_DB */
+			pthread_mutex_unlock(&ldap->ldap_lock);
+			return 0;
+		}
+
+# if defined(_FFR_LDAP_CACHING) && defined(USE_DB)
+		/* the caching code below takes the lock itself */
+		pthread_mutex_unlock(&ldap->ldap_lock);
+# endif /* _FFR_LDAP_CACHING && USE_DB */
+#else /* _FFR_LDAP_ASYNC */
 		timeout.tv_sec = ldap->ldap_timeout;
 		timeout.tv_usec = 0;
 
@@ -4936,8 +10845,8 @@ dkimf_db_get(DKIMF_DB db, void *buf, size_t buflen,
 
 			pthread_mutex_unlock(&ldap->ldap_lock);
 
-			status = dkimf_db_get(db, buf, buflen, req, reqnum,
-			                      exists);
+			status = dkimf_db_lookup(db, buf, buflen, req, reqnum,
+			                         exists);
 
 			db->db_iflags &= ~DKIMF_DB_IFLAG_RECONNECT;
 
@@ -5008,6 +10917,7 @@ dkimf_db_get(DKIMF_DB db, void *buf, size_t buflen,
 			req[c++].dbdata_buflen = 0;
 
 		ldap_msgfree(result);
+#endif /* _FFR_LDAP_ASYNC */
 # ifdef _FFR_LDAP_CACHING
 #  ifdef USE_DB
 		pthread_mutex_lock(&ldap->ldap_lock);
@@ -5030,449 +10940,1043 @@ dkimf_db_get(DKIMF_DB db, void *buf, size_t buflen,
 			pthread_mutex_unlock(&ldap->ldap_lock);
 			return errno;
 		}
-		ldc->ldc_nresults = reqnum;
+		ldc->ldc_nresults = reqnum;
+
+		for (c = 0; c < reqnum; c++)
+		{
+			ldc->ldc_results[c] = strdup(req[c].dbdata_buffer);
+			if (ldc->ldc_results[c] == NULL)
+			{
+				ldc->ldc_error = errno;
+				pthread_mutex_unlock(&ldap->ldap_lock);
+				return errno;
+			}
+		}
+
+		ldc->ldc_state = DKIMF_DB_CACHE_DATA;
+		ldc->ldc_expire = time(NULL) + DKIMF_LDAP_TTL;
+
+		/* notify waiters */
+		pthread_cond_broadcast(&ldc->ldc_cond);
+#  endif /* USE_DB */
+# endif /* _FFR_LDAP_CACHING */
+		pthread_mutex_unlock(&ldap->ldap_lock);
+		return 0;
+	  }
+#endif /* USE_LDAP */
+
+#ifdef USE_LUA
+	  case DKIMF_DB_TYPE_LUA:
+	  {
+		int c;
+		int status;
+		struct dkimf_db_lua *lua;
+		struct dkimf_lua_script_result lres;
+
+		memset(&lres, '\0', sizeof lres);
+
+		lua = (struct dkimf_db_lua *) db->db_data;
+
+# ifdef _FFR_LUA_STATE_POOLS
+		if (lua->lua_pool != NULL)
+		{
+			status = dkimf_lua_db_pool_hook(lua->lua_pool,
+			                                (const char *) buf,
+			                                &lres);
+		}
+		else
+# endif /* _FFR_LUA_STATE_POOLS */
+		status = dkimf_lua_db_hook((const char *) lua->lua_script,
+		                           lua->lua_scriptlen,
+		                           (const char *) buf, &lres,
+		                           NULL, NULL);
+		if (status != 0)
+			return -1;
+
+		if (exists != NULL)
+			*exists = (lres.lrs_rcount != 0);
+
+		/* copy results */
+		for (c = 0; c < reqnum && c < lres.lrs_rcount; c++)
+		{
+			req[c].dbdata_buflen = strlcpy(req[c].dbdata_buffer,
+			                               lres.lrs_results[c],
+			                               req[c].dbdata_buflen);
+		}
+
+		/* tag requests that weren't fulfilled */
+		while (c < reqnum)
+			req[c++].dbdata_buflen = 0;
+
+		/* clean up */
+		for (c = 0; c < lres.lrs_rcount; c++)
+			free(lres.lrs_results[c]);
+		if (lres.lrs_results != NULL)
+			free(lres.lrs_results);
+
+		return 0;
+	  }
+#endif /* USE_LUA */
+
+#ifdef USE_LIBMEMCACHED
+	  case DKIMF_DB_TYPE_MEMCACHE:
+	  {
+		memcached_st *mcs;
+		memcached_return_t ret;
+		char *out;
+		char *key;
+		size_t vlen;
+		uint32_t flags;
+		char query[BUFRSZ + 1];
+
+		mcs = (memcached_st *) db->db_handle;
+		key = (char *) db->db_data;
+
+		snprintf(query, sizeof query, "%s:%s", key, (char *) buf);
+		
+		if (db->db_lock != NULL)
+			(void) pthread_mutex_lock(db->db_lock);
+
+		out = memcached_get(mcs, query, strlen(query), &vlen,
+		                    &flags, &ret);
+
+		if (db->db_lock != NULL)
+			(void) pthread_mutex_unlock(db->db_lock);
+
+		if (out != NULL)
+		{
+			if (exists != NULL)
+				*exists = TRUE;
+
+			if (dkimf_db_datasplit(out, vlen, req, reqnum) != 0)
+			{
+				free(out);
+				return -1;
+			}
+
+			free(out);
+			return 0;
+		}
+		else if (ret == MEMCACHED_NOTFOUND)
+		{
+			if (exists != NULL)
+				*exists = FALSE;
+
+			return 0;
+		}
+		else
+		{
+			db->db_status = (int) ret;
+			return -1;
+		}
+	  }
+#endif /* USE_LIBMEMCACHED */
+
+#ifdef _FFR_REPUTATION
+	  case DKIMF_DB_TYPE_REPUTE:
+	  {
+		_Bool found = FALSE;
+		int c;
+		float rep;
+		float conf;
+		unsigned long samp;
+		unsigned long limit;
+		time_t when;
+		REPUTE_STAT rstat;
+		REPUTE r;
+
+		r = (REPUTE) db->db_data;
+
+		if (!found)
+		{
+			rstat = repute_query(r, (char *) buf, &rep, &conf,
+			                     &samp, &limit, &when);
+
+			if (rstat == REPUTE_STAT_PARSE)
+				return 0;
+			else if (rstat != REPUTE_STAT_OK)
+				return -1;
+
+			if (exists != NULL)
+				*exists = TRUE;
+		}
+
+		if (reqnum >= 1 && req[0].dbdata_buffer != NULL &&
+		    req[0].dbdata_buflen != 0)
+		{
+			if ((req[0].dbdata_flags & DKIMF_DB_DATA_BINARY) != 0)
+			{
+				if (req[0].dbdata_buflen != sizeof rep)
+					return -1;
+				memcpy(req[0].dbdata_buffer, &rep, sizeof rep);
+			}
+			else
+			{
+				req[0].dbdata_buflen = snprintf(req[0].dbdata_buffer,
+				                                req[0].dbdata_buflen,
+				                                "%f", rep);
+			}
+		}
+
+		if (reqnum >= 2 && req[1].dbdata_buffer != NULL &&
+		    req[1].dbdata_buflen != 0)
+		{
+			if ((req[1].dbdata_flags & DKIMF_DB_DATA_BINARY) != 0)
+			{
+				if (req[1].dbdata_buflen != sizeof conf)
+					return -1;
+				memcpy(req[1].dbdata_buffer, &conf,
+				       sizeof conf);
+			}
+			else
+			{
+				req[1].dbdata_buflen = snprintf(req[1].dbdata_buffer,
+				                                req[1].dbdata_buflen,
+				                                "%f", conf);
+			}
+		}
+
+		if (reqnum >= 3 && req[2].dbdata_buffer != NULL &&
+		    req[2].dbdata_buflen != 0)
+		{
+			if ((req[2].dbdata_flags & DKIMF_DB_DATA_BINARY) != 0)
+			{
+				if (req[2].dbdata_buflen != sizeof samp)
+					return -1;
+				memcpy(req[2].dbdata_buffer, &samp,
+				       sizeof samp);
+			}
+			else
+			{
+				req[2].dbdata_buflen = snprintf(req[2].dbdata_buffer,
+				                                req[2].dbdata_buflen,
+				                                "%lu", samp);
+			}
+		}
+
+		if (reqnum >= 4 && req[3].dbdata_buffer != NULL &&
+		    req[3].dbdata_buflen != 0)
+		{
+			if ((req[3].dbdata_flags & DKIMF_DB_DATA_BINARY) != 0)
+			{
+				if (req[3].dbdata_buflen != sizeof when)
+					return -1;
+				memcpy(req[3].dbdata_buffer, &when,
+				       sizeof when);
+			}
+			else
+			{
+				req[3].dbdata_buflen = snprintf(req[3].dbdata_buffer,
+				                                req[3].dbdata_buflen,
+				                                "%lu", when);
+			}
+		}
 
-		for (c = 0; c < reqnum; c++)
+		if (reqnum >= 5 && req[4].dbdata_buffer != NULL &&
+		    req[4].dbdata_buflen != 0)
 		{
-			ldc->ldc_results[c] = strdup(req[c].dbdata_buffer);
-			if (ldc->ldc_results[c] == NULL)
+			if ((req[4].dbdata_flags & DKIMF_DB_DATA_BINARY) != 0)
 			{
-				ldc->ldc_error = errno;
-				pthread_mutex_unlock(&ldap->ldap_lock);
-				return errno;
+				if (req[4].dbdata_buflen != sizeof limit)
+					return -1;
+				memcpy(req[4].dbdata_buffer, &limit,
+				       sizeof limit);
+			}
+			else
+			{
+				req[4].dbdata_buflen = snprintf(req[4].dbdata_buffer,
+				                                req[4].dbdata_buflen,
+				                                "%lu", limit);
 			}
 		}
 
-		ldc->ldc_state = DKIMF_DB_CACHE_DATA;
-		ldc->ldc_expire = time(NULL) + DKIMF_LDAP_TTL;
+		/* tag requests that weren't fulfilled */
+		for (c = 5; c < reqnum; c++)
+			req[c].dbdata_buflen = 0;
 
-		/* notify waiters */
-		pthread_cond_broadcast(&ldc->ldc_cond);
-#  endif /* USE_DB */
-# endif /* _FFR_LDAP_CACHING */
-		pthread_mutex_unlock(&ldap->ldap_lock);
 		return 0;
 	  }
-#endif /* USE_LDAP */
+#endif /* _FFR_REPUTATION */
 
-#ifdef USE_LUA
-	  case DKIMF_DB_TYPE_LUA:
+#ifdef _FFR_SOCKETDB
+	  case DKIMF_DB_TYPE_SOCKET:
 	  {
-		int c;
 		int status;
-		struct dkimf_db_lua *lua;
-		struct dkimf_lua_script_result lres;
-
-		memset(&lres, '\0', sizeof lres);
+		struct dkimf_db_socket *sdb;
+		struct dkimf_dstring *reply;
 
-		lua = (struct dkimf_db_lua *) db->db_data;
+		sdb = (struct dkimf_db_socket *) db->db_handle;
 
-		status = dkimf_lua_db_hook((const char *) lua->lua_script,
-		                           lua->lua_scriptlen,
-		                           (const char *) buf, &lres,
-		                           NULL, NULL);
-		if (status != 0)
+		reply = dkimf_dstring_new(BUFRSZ, 0);
+		if (reply == NULL)
+		{
+			db->db_status = errno;
 			return -1;
+		}
 
-		if (exists != NULL)
-			*exists = (lres.lrs_rcount != 0);
+		if (buflen == 0)
+			buflen = strlen(buf);
 
-		/* copy results */
-		for (c = 0; c < reqnum && c < lres.lrs_rcount; c++)
+		if (sdb->sockdb_pipeline)
+			status = dkimf_db_sock_pquery(sdb, buf, buflen, reply);
+		else
+			status = dkimf_db_sock_query(sdb, buf, buflen, reply);
+
+		if (status != 0)
 		{
-			req[c].dbdata_buflen = strlcpy(req[c].dbdata_buffer,
-			                               lres.lrs_results[c],
-			                               req[c].dbdata_buflen);
+			db->db_status = status;
+			dkimf_dstring_free(reply);
+			return -1;
 		}
 
-		/* tag requests that weren't fulfilled */
-		while (c < reqnum)
-			req[c++].dbdata_buflen = 0;
+		/* an empty reply line means the key wasn't found */
+		if (exists != NULL)
+			*exists = (dkimf_dstring_len(reply) > 0);
 
-		/* clean up */
-		for (c = 0; c < lres.lrs_rcount; c++)
-			free(lres.lrs_results[c]);
-		if (lres.lrs_results != NULL)
-			free(lres.lrs_results);
+		status = dkimf_db_datasplit((char *) dkimf_dstring_get(reply),
+		                            dkimf_dstring_len(reply),
+		                            req, reqnum);
 
-		return 0;
+		dkimf_dstring_free(reply);
+
+		return (status == 0 ? 0 : -1);
 	  }
-#endif /* USE_LUA */
+#endif /* _FFR_SOCKETDB */
 
-#ifdef USE_LIBMEMCACHED
-	  case DKIMF_DB_TYPE_MEMCACHE:
+#ifdef USE_MDB
+	  case DKIMF_DB_TYPE_MDB:
 	  {
-		memcached_st *mcs;
-		memcached_return_t ret;
-		char *out;
-		char *key;
-		size_t vlen;
-		uint32_t flags;
-		char query[BUFRSZ + 1];
+		int ret = 0;
+		int status;
+		struct dkimf_db_mdb *mdb;
+		MDB_txn *txn;
+		MDB_val key;
+		MDB_val data;
 
-		mcs = (memcached_st *) db->db_handle;
-		key = (char *) db->db_data;
+		mdb = (struct dkimf_db_mdb *) db->db_data;
 
-		snprintf(query, sizeof query, "%s:%s", key, (char *) buf);
-		
-		out = memcached_get(mcs, query, strlen(query), &vlen,
-		                    &flags, &ret);
+		key.mv_size = (buflen == 0 ? strlen(buf) : buflen);
+		key.mv_data = buf;
 
-		if (out != NULL)
+		status = dkimf_db_mdb_begin(mdb, &txn);
+		if (status != 0)
 		{
-			if (exists != NULL)
-				*exists = TRUE;
+			db->db_status = status;
+			return -1;
+		}
 
-			if (dkimf_db_datasplit(out, vlen, req, reqnum) != 0)
-			{
-				free(out);
-				return -1;
-			}
+		/*
+		**  "data" points into the map itself and is only valid until
+		**  the transaction is reset, so it's split straight into the
+		**  caller's buffers without an intermediate copy.
+		*/
 
-			free(out);
-			return 0;
-		}
-		else if (ret == MEMCACHED_NOTFOUND)
+		status = mdb_get(txn, mdb->mdb_dbi, &key, &data);
+		if (status == MDB_NOTFOUND)
 		{
 			if (exists != NULL)
 				*exists = FALSE;
+		}
+		else if (status == 0)
+		{
+			if (exists != NULL)
+				*exists = TRUE;
 
-			return 0;
+			if (dkimf_db_datasplit(data.mv_data, data.mv_size,
+			                       req, reqnum) != 0)
+				ret = -1;
 		}
 		else
 		{
-			db->db_status = (int) ret;
-			return -1;
+			db->db_status = status;
+			ret = -1;
 		}
+
+		mdb_txn_reset(txn);
+
+		return ret;
 	  }
-#endif /* USE_LIBMEMCACHED */
+#endif /* USE_MDB */
 
-#ifdef _FFR_REPUTATION
-	  case DKIMF_DB_TYPE_REPUTE:
+#ifdef USE_ERLANG
+	  case DKIMF_DB_TYPE_ERLANG:
 	  {
-		_Bool found = FALSE;
-		int c;
-		float rep;
-		float conf;
-		unsigned long samp;
-		unsigned long limit;
-		time_t when;
-		REPUTE_STAT rstat;
-		REPUTE r;
+		int fd;
+		int ret;
+		int res_size;
+		int res_index;
+		int res_type;
+		struct dkimf_db_erlang *e;
+		ei_cnode ec;
+		ei_x_buff args;
+		ei_x_buff resp;
+
+		e = (struct dkimf_db_erlang *) db->db_data;
+
+		ei_x_new(&args);
+		ei_x_new(&resp);
+
+		ei_x_encode_list_header(&args, 1);
+		ei_x_encode_binary(&args, buf, strlen(buf));
+		ei_x_encode_empty_list(&args);
+
+		fd = dkimf_db_erl_connect(db, &ec);
+		if (fd < 0)
+		{
+			db->db_status = erl_errno;
+			ei_x_free(&args);
+			ei_x_free(&resp);
+			return -1;
+		}
+
+		ret = ei_rpc(&ec, fd, e->erlang_module, e->erlang_function,
+			     args.buff, args.index, &resp);
+		close(fd);
+		if (ret == -1)
+		{
+			db->db_status = erl_errno;
+			ei_x_free(&args);
+			ei_x_free(&resp);
+			return ret;
+		}
+
+		ret = dkimf_db_erl_decode_response(&resp, "not_found", req,
+	 	                                   reqnum, NULL, NULL);
+
+		if (exists != NULL)
+		{
+			if (ret == 1)
+				*exists = FALSE;
+			else if (ret == 0)
+				*exists = TRUE;
+		}
+
+		ei_x_free(&args);
+		ei_x_free(&resp);
+
+		if (ret == -1)
+			db->db_status = erl_errno;
+
+		return 0;
+	  }
+#endif /* USE_ERLANG */
+
+	  default:
+		assert(0);
+		return 0;		/* to silence the compiler */
+	}
+
+	/* NOTREACHED */
+}
+
+#if defined(USE_LIBMEMCACHED) || defined(USE_ODBX)
+/*
+**  DKIMF_DB_ASCIIOK -- see if a key may be looked up in a data set
+**
+**  Parameters:
+**  	db -- DKIMF_DB handle
+**  	key -- key (NULL-terminated)
+**
+**  Return value:
+**  	FALSE iff the data set only accepts ASCII keys and "key" isn't one.
+*/
+
+static _Bool
+dkimf_db_asciiok(DKIMF_DB db, const char *key)
+{
+	const char *p;
+
+	if ((db->db_flags & DKIMF_DB_FLAG_ASCIIONLY) == 0)
+		return TRUE;
+
+	for (p = key; *p != '\0'; p++)
+	{
+		if (!isascii(*p))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+#endif /* USE_LIBMEMCACHED || USE_ODBX */
+
+#ifdef USE_LIBMEMCACHED
+/*
+**  DKIMF_DB_MGET_MEMCACHE -- look up several keys in a memcache data set
+**
+**  Parameters:
+**  	As for dkimf_db_mget().
+**
+**  Return value:
+**  	0 -- success
+**  	-1 -- error
+**
+**  Notes:
+**  	"exists" must already be cleared.  All keys are requested with one
+**  	memcached_mget() and the replies then collected in whatever order
+**  	the servers send them.
+*/
+
+static int
+dkimf_db_mget_memcache(DKIMF_DB db, char **keys, unsigned int nkeys,
+                       DKIMF_DBDATA req, unsigned int reqnum, _Bool *exists)
+{
+	int status = 0;
+	unsigned int c;
+	unsigned int n = 0;
+	size_t len;
+	size_t *mlens;
+	unsigned int *idx;
+	char *prefix;
+	char **mkeys;
+	memcached_st *mcs;
+	memcached_return_t ret;
+	memcached_result_st res;
+
+	mcs = (memcached_st *) db->db_handle;
+	prefix = (char *) db->db_data;
+
+	mkeys = (char **) calloc(nkeys, sizeof(char *));
+	mlens = (size_t *) calloc(nkeys, sizeof(size_t));
+	idx = (unsigned int *) calloc(nkeys, sizeof(unsigned int));
+	if (mkeys == NULL || mlens == NULL || idx == NULL)
+	{
+		db->db_status = (int) MEMCACHED_MEMORY_ALLOCATION_FAILURE;
+		free(mkeys);
+		free(mlens);
+		free(idx);
+		return -1;
+	}
 
-		r = (REPUTE) db->db_data;
+	for (c = 0; c < nkeys; c++)
+	{
+		if (!dkimf_db_asciiok(db, keys[c]))
+			continue;
 
-		if (!found)
+		len = strlen(prefix) + strlen(keys[c]) + 2;
+		mkeys[n] = (char *) malloc(len);
+		if (mkeys[n] == NULL)
 		{
-			rstat = repute_query(r, (char *) buf, &rep, &conf,
-			                     &samp, &limit, &when);
+			db->db_status = (int) MEMCACHED_MEMORY_ALLOCATION_FAILURE;
+			status = -1;
+			break;
+		}
 
-			if (rstat == REPUTE_STAT_PARSE)
-				return 0;
-			else if (rstat != REPUTE_STAT_OK)
-				return -1;
+		mlens[n] = snprintf(mkeys[n], len, "%s:%s", prefix, keys[c]);
+		idx[n] = c;
+		n++;
+	}
 
-			if (exists != NULL)
-				*exists = TRUE;
-		}
+	if (status == 0 && n > 0)
+	{
+		if (db->db_lock != NULL)
+			(void) pthread_mutex_lock(db->db_lock);
 
-		if (reqnum >= 1 && req[0].dbdata_buffer != NULL &&
-		    req[0].dbdata_buflen != 0)
+		ret = memcached_mget(mcs, (const char * const *) mkeys,
+		                     mlens, n);
+		if (ret != MEMCACHED_SUCCESS)
 		{
-			if ((req[0].dbdata_flags & DKIMF_DB_DATA_BINARY) != 0)
-			{
-				if (req[0].dbdata_buflen != sizeof rep)
-					return -1;
-				memcpy(req[0].dbdata_buffer, &rep, sizeof rep);
-			}
-			else
-			{
-				req[0].dbdata_buflen = snprintf(req[0].dbdata_buffer,
-				                                req[0].dbdata_buflen,
-				                                "%f", rep);
-			}
+			db->db_status = (int) ret;
+			status = -1;
 		}
-
-		if (reqnum >= 2 && req[1].dbdata_buffer != NULL &&
-		    req[1].dbdata_buflen != 0)
+		else
 		{
-			if ((req[1].dbdata_flags & DKIMF_DB_DATA_BINARY) != 0)
-			{
-				if (req[1].dbdata_buflen != sizeof conf)
-					return -1;
-				memcpy(req[1].dbdata_buffer, &conf,
-				       sizeof conf);
-			}
-			else
-			{
-				req[1].dbdata_buflen = snprintf(req[1].dbdata_buffer,
-				                                req[1].dbdata_buflen,
-				                                "%f", conf);
-			}
-		}
+			(void) memcached_result_create(mcs, &res);
 
-		if (reqnum >= 3 && req[2].dbdata_buffer != NULL &&
-		    req[2].dbdata_buflen != 0)
-		{
-			if ((req[2].dbdata_flags & DKIMF_DB_DATA_BINARY) != 0)
+			while (memcached_fetch_result(mcs, &res, &ret) != NULL)
 			{
-				if (req[2].dbdata_buflen != sizeof samp)
-					return -1;
-				memcpy(req[2].dbdata_buffer, &samp,
-				       sizeof samp);
+				const char *kv;
+
+				kv = memcached_result_key_value(&res);
+				len = memcached_result_key_length(&res);
+
+				for (c = 0; c < n; c++)
+				{
+					if (exists[idx[c]] || mlens[c] != len ||
+					    memcmp(mkeys[c], kv, len) != 0)
+						continue;
+
+					exists[idx[c]] = TRUE;
+
+					if (status == 0 &&
+					    dkimf_db_datasplit((char *) memcached_result_value(&res),
+					                       memcached_result_length(&res),
+					                       reqnum == 0 ? NULL : &req[idx[c] * reqnum],
+					                       reqnum) != 0)
+						status = -1;
+				}
 			}
-			else
+
+			if (ret != MEMCACHED_END && ret != MEMCACHED_SUCCESS &&
+			    ret != MEMCACHED_NOTFOUND)
 			{
-				req[2].dbdata_buflen = snprintf(req[2].dbdata_buffer,
-				                                req[2].dbdata_buflen,
-				                                "%lu", samp);
+				db->db_status = (int) ret;
+				status = -1;
 			}
+
+			memcached_result_free(&res);
 		}
 
-		if (reqnum >= 4 && req[3].dbdata_buffer != NULL &&
-		    req[3].dbdata_buflen != 0)
+		if (db->db_lock != NULL)
+			(void) pthread_mutex_unlock(db->db_lock);
+	}
+
+	for (c = 0; c < n; c++)
+		free(mkeys[c]);
+	free(mkeys);
+	free(mlens);
+	free(idx);
+
+	return status;
+}
+#endif /* USE_LIBMEMCACHED */
+
+#ifdef USE_ODBX
+/*
+**  DKIMF_DB_MGET_SQL -- look up several keys in an SQL data set
+**
+**  Parameters:
+**  	As for dkimf_db_mget().
+**
+**  Return value:
+**  	0 -- success
+**  	1 -- the batch couldn't be completed; ask for each key separately
+**
+**  Notes:
+**  	"exists" must already be cleared.  The keys are requested with a
+**  	single query made of the single-key query for each of them joined
+**  	by "UNION ALL", each returning the key's position in "keys" ahead
+**  	of the data, so rows are matched to keys by the server's own
+**  	comparison rather than by comparing strings here.  Any failure
+**  	is left for the single-key code to retry and report; it already
+**  	knows how to reconnect.
+*/
+
+static int
+dkimf_db_mget_sql(DKIMF_DB db, char **keys, unsigned int nkeys,
+                  DKIMF_DBDATA req, unsigned int reqnum, _Bool *exists)
+{
+	_Bool any = FALSE;
+	int err = 0;
+	int fields;
+	unsigned int c;
+	unsigned int d;
+	unsigned int k;
+	size_t qlen;
+	size_t sqlen;
+	u_long elen;
+	char *p;
+	char *q;
+	char *query;
+	char *val;
+	odbx_result_t *result = NULL;
+	odbx_t *odbx;
+	struct dkimf_db_dsn *dsn;
+
+	dsn = (struct dkimf_db_dsn *) db->db_data;
+
+	/* room for one single-key query, less the key itself */
+	sqlen = strlen(dsn->dsn_keycol) + strlen(dsn->dsn_datacol) +
+	        strlen(dsn->dsn_table) + BUFRSZ;
+	if (dsn->dsn_filter != NULL)
+		sqlen += strlen(dsn->dsn_filter);
+
+	qlen = 1;
+	for (c = 0; c < nkeys; c++)
+		qlen += strlen(keys[c]) * 2 + sqlen;
+
+	query = (char *) malloc(qlen);
+	if (query == NULL)
+		return 1;
+
+# ifdef _FFR_DB_HANDLE_POOLS
+	odbx = dkimf_db_hp_get((struct handle_pool *) db->db_handle, &err);
+	if (odbx == NULL)
+	{
+		free(query);
+		return 1;
+	}
+# else /* _FFR_DB_HANDLE_POOLS */
+	if (db->db_lock != NULL)
+		(void) pthread_mutex_lock(db->db_lock);
+
+	if ((db->db_iflags & DKIMF_DB_IFLAG_RECONNECT) != 0)
+	{
+		if (db->db_lock != NULL)
+			(void) pthread_mutex_unlock(db->db_lock);
+		free(query);
+		return 1;
+	}
+
+	odbx = (odbx_t *) db->db_handle;
+# endif /* _FFR_DB_HANDLE_POOLS */
+
+	q = query;
+
+	for (c = 0; c < nkeys; c++)
+	{
+		if (!dkimf_db_asciiok(db, keys[c]))
+			continue;
+
+		q += snprintf(q, qlen - (q - query),
+		              "%sSELECT %u, %s FROM %s WHERE %s = '",
+		              any ? " UNION ALL " : "", c,
+		              dsn->dsn_datacol, dsn->dsn_table,
+		              dsn->dsn_keycol);
+
+		elen = qlen - (q - query) - 1;
+		err = odbx_escape(odbx, keys[c], strlen(keys[c]), q, &elen);
+		if (err < 0)
+			break;
+
+		q += elen;
+		q += snprintf(q, qlen - (q - query), "'%s%s",
+		              dsn->dsn_filter == NULL ? "" : " AND ",
+		              dsn->dsn_filter == NULL ? "" : dsn->dsn_filter);
+		any = TRUE;
+	}
+
+	if (err >= 0 && any)
+		err = odbx_query(odbx, query, 0);
+
+	free(query);
+
+	while (any && err >= 0)
+	{
+		result = NULL;
+		err = odbx_result(odbx, &result, NULL, 0);
+		if (err < 0 || err == ODBX_RES_DONE)
 		{
-			if ((req[3].dbdata_flags & DKIMF_DB_DATA_BINARY) != 0)
-			{
-				if (req[3].dbdata_buflen != sizeof when)
-					return -1;
-				memcpy(req[3].dbdata_buffer, &when,
-				       sizeof when);
-			}
-			else
-			{
-				req[3].dbdata_buflen = snprintf(req[3].dbdata_buffer,
-				                                req[3].dbdata_buflen,
-				                                "%lu", when);
-			}
+			if (result != NULL)
+				(void) odbx_result_finish(result);
+			break;
 		}
 
-		if (reqnum >= 5 && req[4].dbdata_buffer != NULL &&
-		    req[4].dbdata_buflen != 0)
+		while ((err = odbx_row_fetch(result)) > 0)
 		{
-			if ((req[4].dbdata_flags & DKIMF_DB_DATA_BINARY) != 0)
-			{
-				if (req[4].dbdata_buflen != sizeof limit)
-					return -1;
-				memcpy(req[4].dbdata_buffer, &limit,
-				       sizeof limit);
-			}
-			else
+			fields = odbx_column_count(result);
+			val = (char *) odbx_field_value(result, 0);
+			if (fields == 0 || val == NULL)
+				continue;
+
+			/* the first row for each key wins, as for one key */
+			k = (unsigned int) strtoul(val, &p, 10);
+			if (p == val || *p != '\0' || k >= nkeys || exists[k])
+				continue;
+
+			exists[k] = TRUE;
+
+			for (d = 0; d < reqnum; d++)
 			{
-				req[4].dbdata_buflen = snprintf(req[4].dbdata_buffer,
-				                                req[4].dbdata_buflen,
-				                                "%lu", limit);
+				DKIMF_DBDATA r;
+				char *v;
+
+				r = &req[k * reqnum + d];
+
+				if (d + 1 >= fields)
+					v = NULL;
+				else
+					v = (char *) odbx_field_value(result, d + 1);
+
+				if (v == NULL)
+				{
+					r->dbdata_buflen = 0;
+				}
+				else
+				{
+					r->dbdata_buflen = strlcpy(r->dbdata_buffer,
+					                           v,
+					                           r->dbdata_buflen);
+				}
 			}
 		}
 
-		/* tag requests that weren't fulfilled */
-		for (c = 5; c < reqnum; c++)
-			req[c].dbdata_buflen = 0;
+		(void) odbx_result_finish(result);
+	}
 
-		return 0;
-	  }
-#endif /* _FFR_REPUTATION */
+	if (err < 0 && odbx_error_type(odbx, err) < 0)
+	{
+		/* connection's broken; the retry will replace it */
+# ifdef _FFR_DSN_PREPARE
+		dkimf_db_sql_forget(odbx);
+# endif /* _FFR_DSN_PREPARE */
+		(void) odbx_unbind(odbx);
+		(void) odbx_finish(odbx);
 
-#ifdef _FFR_SOCKETDB
-	  case DKIMF_DB_TYPE_SOCKET:
-	  {
-		int status;
-		size_t len;
-		size_t wlen;
-		fd_set rfds;
-		struct timeval timeout;
-		struct iovec iov[2];
-		struct dkimf_db_socket *sdb;
-		char *tmp;
-		char inbuf[BUFRSZ];
+# ifdef _FFR_DB_HANDLE_POOLS
+		dkimf_db_hp_dead((struct handle_pool *) db->db_handle);
+# else /* _FFR_DB_HANDLE_POOLS */
+		db->db_iflags |= DKIMF_DB_IFLAG_RECONNECT;
+# endif /* _FFR_DB_HANDLE_POOLS */
+	}
+	else
+	{
+# ifdef _FFR_DB_HANDLE_POOLS
+		dkimf_db_hp_put((struct handle_pool *) db->db_handle,
+		                (void *) odbx);
+# endif /* _FFR_DB_HANDLE_POOLS */
+	}
 
-		sdb = (struct dkimf_db_socket *) db->db_handle;
+	if (db->db_lock != NULL)
+		(void) pthread_mutex_unlock(db->db_lock);
 
-		timeout.tv_sec = DKIMF_SOCKET_TIMEOUT;
-		timeout.tv_usec = 0;
+	if (err < 0)
+	{
+		for (c = 0; c < nkeys; c++)
+			exists[c] = FALSE;
 
-		iov[0].iov_base = buf;
-		iov[0].iov_len = buflen;
+		return 1;
+	}
 
-		iov[1].iov_base = "\n";
-		iov[1].iov_len = 1;
+	return 0;
+}
+#endif /* USE_ODBX */
 
-		/* single-thread readers */
-		if (db->db_lock != NULL)
-			(void) pthread_mutex_lock(db->db_lock);
+/*
+**  DKIMF_DB_MGET_BATCH -- look up several keys in one round trip
+**
+**  Parameters:
+**  	As for dkimf_db_mget().
+**
+**  Return value:
+**  	As for dkimf_db_mget().
+*/
+
+static int
+dkimf_db_mget_batch(DKIMF_DB db, char **keys, unsigned int nkeys,
+                    DKIMF_DBDATA req, unsigned int reqnum, _Bool *exists)
+{
+	int status = 1;
+	unsigned int c;
+	unsigned int n;
 
-		wlen = writev(sdb->sockdb_fd, iov, 2);
-		if (wlen < buflen + 1)
+	for (c = 0; c < nkeys; c += n)
+	{
+		n = MIN(nkeys - c, DKIMF_DB_MGETMAX);
+
+		switch (db->db_type)
 		{
-			db->db_status = errno;
-			if (db->db_lock != NULL)
-				(void) pthread_mutex_unlock(db->db_lock);
-			return -1;
-		}
+#ifdef USE_LIBMEMCACHED
+		  case DKIMF_DB_TYPE_MEMCACHE:
+			status = dkimf_db_mget_memcache(db, &keys[c], n,
+			                                reqnum == 0 ? NULL : &req[c * reqnum],
+			                                reqnum, &exists[c]);
+			break;
+#endif /* USE_LIBMEMCACHED */
 
-		FD_ZERO(&rfds);
-		FD_SET(sdb->sockdb_fd, &rfds);
+#ifdef USE_ODBX
+		  case DKIMF_DB_TYPE_DSN:
+			status = dkimf_db_mget_sql(db, &keys[c], n,
+			                           reqnum == 0 ? NULL : &req[c * reqnum],
+			                           reqnum, &exists[c]);
+			break;
+#endif /* USE_ODBX */
 
-		dkimf_dstring_blank(sdb->sockdb_buf);
+		  default:
+			assert(0);
+			break;
+		}
 
-		for (;;)
-		{
-			status = select(sdb->sockdb_fd + 1, &rfds, NULL, NULL,
-			                &timeout);
-			if (status != 1)
-			{
-				db->db_status = errno;
-				if (db->db_lock != NULL)
-					(void) pthread_mutex_unlock(db->db_lock);
-				return -1;
-			}
+		if (status == -1)
+			return -1;
+
+		if (status == 1)
+		{
+			unsigned int d;
 
-			wlen = read(sdb->sockdb_fd, inbuf, sizeof inbuf);
-			if (wlen == (size_t) -1)
+			for (d = c; d < c + n; d++)
 			{
-				db->db_status = errno;
-				if (db->db_lock != NULL)
-					(void) pthread_mutex_unlock(db->db_lock);
-				return -1;
+				if (dkimf_db_lookup(db, keys[d], 0,
+				                    reqnum == 0 ? NULL : &req[d * reqnum],
+				                    reqnum, &exists[d]) != 0)
+					return -1;
 			}
+		}
+	}
 
-			if (wlen == 0)
-				break;
+	return 0;
+}
 
-			dkimf_dstring_catn(sdb->sockdb_buf, inbuf, wlen);
+/*
+**  DKIMF_DB_CANBATCH -- determine whether a data set answers dkimf_db_mget()
+**                       requests in one round trip
+**
+**  Parameters:
+**  	db -- DKIMF_DB handle
+**
+**  Return value:
+**  	TRUE iff dkimf_db_mget() sends the keys it's given as one batch.
+**
+**  Notes:
+**  	Callers that would stop at the first key found can use this to
+**  	decide whether asking for all of them up front is cheaper.
+*/
 
-			tmp = dkimf_dstring_get(sdb->sockdb_buf);
-			len = dkimf_dstring_len(sdb->sockdb_buf);
+_Bool
+dkimf_db_canbatch(DKIMF_DB db)
+{
+	assert(db != NULL);
 
-			if (tmp[len - 1] == '\n')
-				break;
-		}
+	if ((db->db_flags & DKIMF_DB_FLAG_MATCHBOTH) != 0)
+		return FALSE;
 
-		if (len > 0 && exists != NULL)
-			*exists = TRUE;
+	switch (db->db_type)
+	{
+#ifdef USE_LIBMEMCACHED
+	  case DKIMF_DB_TYPE_MEMCACHE:
+		return TRUE;
+#endif /* USE_LIBMEMCACHED */
 
-		if (dkimf_db_datasplit(tmp, len - 1, req, reqnum) != 0)
-		{
-			if (db->db_lock != NULL)
-				(void) pthread_mutex_unlock(db->db_lock);
-			return -1;
-		}
-		else
-		{
-			if (db->db_lock != NULL)
-				(void) pthread_mutex_unlock(db->db_lock);
-			return 0;
-		}
-	  }
-#endif /* _FFR_SOCKETDB */
+#ifdef USE_ODBX
+	  case DKIMF_DB_TYPE_DSN:
+		return TRUE;
+#endif /* USE_ODBX */
 
-#ifdef USE_MDB
-	  case DKIMF_DB_TYPE_MDB:
-	  {
-		int status;
-		struct dkimf_db_mdb *mdb;
-		MDB_val key;
-		MDB_val data;
+	  default:
+		return FALSE;
+	}
+}
+
+/*
+**  DKIMF_DB_MGET -- retrieve data for several keys from an open database
+**
+**  Parameters:
+**  	db -- DKIMF_DB handle
+**  	keys -- keys to retrieve (NULL-terminated strings)
+**  	nkeys -- number of keys
+**  	req -- list of data requests; "reqnum" for each key, in key order
+**  	reqnum -- number of data requests per key
+**  	exists -- array of "nkeys" flags, set iff each key was found
+**  	          (returned)
+**
+**  Return value:
+**  	0 on successful completion, -1 on error.
+**
+**  Notes:
+**  	The results are as if dkimf_db_get() had been called for each key
+**  	in turn.  Memcache and SQL data sets get the whole set in one round
+**  	trip (see dkimf_db_canbatch()); others are asked one key at a time.
+*/
 
-		mdb = (struct dkimf_db_mdb *) db->db_handle;
+int
+dkimf_db_mget(DKIMF_DB db, char **keys, unsigned int nkeys,
+              DKIMF_DBDATA req, unsigned int reqnum, _Bool *exists)
+{
+	unsigned int c;
 
-		key.mv_size = buflen;
-		key.mv_data = buf;
+	assert(db != NULL);
+	assert(keys != NULL);
+	assert(req != NULL || reqnum == 0);
+	assert(exists != NULL);
 
-		status = mdb_get(mdb->mdb_txn, mdb->mdb_dbi, &key, &data);
-		if (status == MDB_NOTFOUND)
-		{
-			if (exists != NULL)
-				*exists = FALSE;
-		}
-		else if (status == 0)
-		{
-			if (exists != NULL)
-				*exists = TRUE;
+	for (c = 0; c < nkeys; c++)
+		exists[c] = FALSE;
 
-			if (dkimf_db_datasplit(data.mv_data, data.mv_size,
-			                       req, reqnum) != 0)
-				return -1;
-		}
-		else
+	if (nkeys < 2 || !dkimf_db_canbatch(db) || DKIMF_DB_BREAKER_OPEN(db))
+	{
+		for (c = 0; c < nkeys; c++)
 		{
-			db->db_status = status;
-			return -1;
+			if (dkimf_db_get(db, keys[c], 0,
+			                 reqnum == 0 ? NULL : &req[c * reqnum],
+			                 reqnum, &exists[c]) != 0)
+				return -1;
 		}
 
 		return 0;
-	  }
-#endif /* USE_MDB */
-
-#ifdef USE_ERLANG
-	  case DKIMF_DB_TYPE_ERLANG:
-	  {
-		int fd;
-		int ret;
-		int res_size;
-		int res_index;
-		int res_type;
-		struct dkimf_db_erlang *e;
-		ei_cnode ec;
-		ei_x_buff args;
-		ei_x_buff resp;
-
-		e = (struct dkimf_db_erlang *) db->db_data;
+	}
 
-		ei_x_new(&args);
-		ei_x_new(&resp);
+#ifdef _FFR_METRICS
+	dkimf_metrics_count(DKIMF_METRIC_DBLOOKUPS, db->db_type, nkeys);
+#endif /* _FFR_METRICS */
 
-		ei_x_encode_list_header(&args, 1);
-		ei_x_encode_binary(&args, buf, strlen(buf));
-		ei_x_encode_empty_list(&args);
+#ifdef _FFR_DB_CACHE
+	if (db->db_cache != NULL && reqnum <= DKIMF_DB_CACHE_MAXREQ)
+	{
+		int status = 0;
+		unsigned int d;
+		unsigned int n = 0;
+		unsigned int *idx;
+		u_int gen;
+		char **mkeys;
+		size_t *reqsz = NULL;
+		_Bool *mexists;
+		DKIMF_DBDATA mreq = NULL;
+
+		/* answer what we can from the cache, and batch the rest */
+		idx = (unsigned int *) malloc(nkeys * sizeof(unsigned int));
+		mkeys = (char **) malloc(nkeys * sizeof(char *));
+		mexists = (_Bool *) malloc(nkeys * sizeof(_Bool));
+		if (reqnum != 0)
+		{
+			mreq = (DKIMF_DBDATA) malloc(nkeys * reqnum *
+			                             sizeof(struct dkimf_db_data));
+			reqsz = (size_t *) malloc(nkeys * reqnum *
+			                          sizeof(size_t));
+		}
 
-		fd = dkimf_db_erl_connect(db, &ec);
-		if (fd < 0)
+		if (idx == NULL || mkeys == NULL || mexists == NULL ||
+		    (reqnum != 0 && (mreq == NULL || reqsz == NULL)))
 		{
-			db->db_status = erl_errno;
-			ei_x_free(&args);
-			ei_x_free(&resp);
+			free(idx);
+			free(mkeys);
+			free(mexists);
+			free(mreq);
+			free(reqsz);
 			return -1;
 		}
 
-		ret = ei_rpc(&ec, fd, e->erlang_module, e->erlang_function,
-			     args.buff, args.index, &resp);
-		close(fd);
-		if (ret == -1)
+		for (c = 0; c < nkeys; c++)
 		{
-			db->db_status = erl_errno;
-			ei_x_free(&args);
-			ei_x_free(&resp);
-			return ret;
+			if (dkimf_db_cache_get(db->db_cache, keys[c],
+			                       strlen(keys[c]),
+			                       reqnum == 0 ? NULL : &req[c * reqnum],
+			                       reqnum, FALSE, &exists[c]))
+				continue;
+
+			idx[n] = c;
+			mkeys[n] = keys[c];
+			for (d = 0; d < reqnum; d++)
+			{
+				mreq[n * reqnum + d] = req[c * reqnum + d];
+				reqsz[n * reqnum + d] = req[c * reqnum + d].dbdata_buflen;
+			}
+			n++;
 		}
 
-		ret = dkimf_db_erl_decode_response(&resp, "not_found", req,
-	 	                                   reqnum, NULL, NULL);
+		gen = dkimf_db_cache_gen(db->db_cache);
 
-		if (exists != NULL)
+		if (n > 0)
 		{
-			if (ret == 1)
-				*exists = FALSE;
-			else if (ret == 0)
-				*exists = TRUE;
+			for (c = 0; c < n; c++)
+				mexists[c] = FALSE;
+
+			status = DKIMF_DB_MGET_BATCH(db, mkeys, n, mreq,
+			                             reqnum, mexists);
 		}
 
-		ei_x_free(&args);
-		ei_x_free(&resp);
+		for (c = 0; status == 0 && c < n; c++)
+		{
+			for (d = 0; d < reqnum; d++)
+				req[idx[c] * reqnum + d] = mreq[c * reqnum + d];
+			exists[idx[c]] = mexists[c];
 
-		if (ret == -1)
-			db->db_status = erl_errno;
+			dkimf_db_cache_put(db->db_cache, gen, mkeys[c],
+			                   strlen(mkeys[c]),
+			                   reqnum == 0 ? NULL : &req[idx[c] * reqnum],
+			                   reqnum == 0 ? NULL : &reqsz[c * reqnum],
+			                   reqnum, mexists[c]);
+		}
 
-		return 0;
-	  }
-#endif /* USE_ERLANG */
+		free(idx);
+		free(mkeys);
+		free(mexists);
+		free(mreq);
+		free(reqsz);
 
-	  default:
-		assert(0);
-		return 0;		/* to silence the compiler */
+		return status;
 	}
+#endif /* _FFR_DB_CACHE */
 
-	/* NOTREACHED */
+	return DKIMF_DB_MGET_BATCH(db, keys, nkeys, req, reqnum, exists);
 }
 
 /*
@@ -5496,6 +12000,29 @@ dkimf_db_close(DKIMF_DB db)
 {
 	assert(db != NULL);
 
+#ifdef _FFR_DB_BREAKER
+	if (db->db_breaker != NULL && dkimf_db_breaker_free(db))
+		return 0;
+#endif /* _FFR_DB_BREAKER */
+
+#ifdef _FFR_DB_WRITEBEHIND
+	if (db->db_wb != NULL)
+		dkimf_db_wb_free(db);
+#endif /* _FFR_DB_WRITEBEHIND */
+
+#ifdef _FFR_DB_AUTORELOAD
+	if (db->db_reload != NULL)
+		dkimf_db_reload_remove(db, FALSE);
+#endif /* _FFR_DB_AUTORELOAD */
+
+#ifdef _FFR_DB_CACHE
+	if (db->db_cache != NULL)
+	{
+		dkimf_db_cache_free(db->db_cache);
+		db->db_cache = NULL;
+	}
+#endif /* _FFR_DB_CACHE */
+
 	if (db->db_array != NULL)
 	{
 		int c;
@@ -5531,6 +12058,14 @@ dkimf_db_close(DKIMF_DB db)
 		free(db);
 		return 0;
 
+#ifdef _FFR_CTABLE
+	  case DKIMF_DB_TYPE_CTABLE:
+		if (db->db_handle != NULL)
+			dkimf_db_ctable_free(db->db_handle);
+		free(db);
+		return 0;
+#endif /* _FFR_CTABLE */
+
 #ifdef USE_DB
 	  case DKIMF_DB_TYPE_BDB:
 	  {
@@ -5542,9 +12077,26 @@ dkimf_db_close(DKIMF_DB db)
 # endif /* DB_VERSION_CHECK(2,0,0) */
 		status = DKIMF_DBCLOSE((DB *) (db->db_handle));
 		if (status != 0)
+		{
 			db->db_status = status;
+		}
 		else
+		{
+# ifdef _FFR_BDB_SNAPSHOT
+			if (db->db_data != NULL)
+			{
+				struct dkimf_db_bdbsnap *bs;
+
+				bs = (struct dkimf_db_bdbsnap *) db->db_data;
+				dkimf_db_snap_remove(bs);
+				dkimf_db_snap_free(bs->bs_snap);
+				pthread_rwlock_destroy(&bs->bs_lock);
+				free(bs->bs_path);
+				free(bs);
+			}
+# endif /* _FFR_BDB_SNAPSHOT */
 			free(db);
+		}
 
 		return status;
 	  }
@@ -5553,8 +12105,22 @@ dkimf_db_close(DKIMF_DB db)
 #ifdef USE_ODBX
 	  case DKIMF_DB_TYPE_DSN:
 # ifdef _FFR_DB_HANDLE_POOLS
+#  ifdef _FFR_DB_SHARED_POOLS
+		if (dkimf_db_shpool_put(db->db_handle))
+		{
+			struct handle_pool *pool;
+
+			pool = (struct handle_pool *) db->db_handle;
+			free(pool->hp_hdata);
+			dkimf_db_hp_free(pool);
+		}
+#  else /* _FFR_DB_SHARED_POOLS */
 		dkimf_db_hp_free((struct handle_pool *) db->db_handle);
+#  endif /* _FFR_DB_SHARED_POOLS */
 # else /* _FFR_DB_HANDLE_POOLS */
+#  ifdef _FFR_DSN_PREPARE
+		dkimf_db_sql_forget((odbx_t *) db->db_handle);
+#  endif /* _FFR_DSN_PREPARE */
 		(void) odbx_finish((odbx_t *) db->db_handle);
 # endif /* _FFR_DB_HANDLE_POOLS */
 		free(db->db_data);
@@ -5569,7 +12135,17 @@ dkimf_db_close(DKIMF_DB db)
 
 		ldap = (struct dkimf_db_ldap *) db->db_data;
 
+# ifdef _FFR_LDAP_ASYNC
+		if (db->db_handle != NULL)
+			ldap_unbind_ext((LDAP *) db->db_handle, NULL, NULL);
+
+#  ifdef _FFR_DB_SHARED_POOLS
+		if (dkimf_db_shpool_put(ldap->ldap_pool))
+#  endif /* _FFR_DB_SHARED_POOLS */
+			dkimf_db_ldap_freepool(ldap->ldap_pool);
+# else /* _FFR_LDAP_ASYNC */
 		ldap_unbind_ext((LDAP *) db->db_handle, NULL, NULL);
+# endif /* _FFR_LDAP_ASYNC */
 		pthread_mutex_destroy(&ldap->ldap_lock);
 # ifdef _FFR_LDAP_CACHING
 #  ifdef USE_DB
@@ -5619,6 +12195,10 @@ dkimf_db_close(DKIMF_DB db)
 
 		lua = (struct dkimf_db_lua *) db->db_data;
 
+# ifdef _FFR_LUA_STATE_POOLS
+		if (lua->lua_pool != NULL)
+			dkimf_lua_pool_free(lua->lua_pool);
+# endif /* _FFR_LUA_STATE_POOLS */
 		free(lua->lua_script);
 		free(db->db_data);
 		free(db);
@@ -5652,10 +12232,23 @@ dkimf_db_close(DKIMF_DB db)
 	  case DKIMF_DB_TYPE_SOCKET:
 		if (db->db_handle != NULL)
 		{
+			u_int c;
 			struct dkimf_db_socket *sdb;
 
 			sdb = (struct dkimf_db_socket *) db->db_handle;
-			close(sdb->sockdb_fd);
+
+			for (c = 0; c < sdb->sockdb_nconns; c++)
+			{
+				if (sdb->sockdb_conns[c].sc_fd != -1)
+					close(sdb->sockdb_conns[c].sc_fd);
+				dkimf_dstring_free(sdb->sockdb_conns[c].sc_buf);
+				pthread_mutex_destroy(&sdb->sockdb_conns[c].sc_wlock);
+			}
+
+			pthread_mutex_destroy(&sdb->sockdb_lock);
+			pthread_cond_destroy(&sdb->sockdb_cond);
+			free(sdb->sockdb_conns);
+			free(sdb);
 		}
 		free(db);
 		return 0;
@@ -5666,12 +12259,34 @@ dkimf_db_close(DKIMF_DB db)
 	  {
 		struct dkimf_db_mdb *mdb;
 
+		struct dkimf_db_mdbtxn *mt;
+		struct dkimf_db_mdbtxn *next;
+
 		mdb = db->db_data;
 
+		/*
+		**  Once the key is gone no thread will run the destructor,
+		**  so the remaining per-thread transactions are ours to end.
+		*/
+
+		(void) pthread_key_delete(mdb->mdb_key);
+
+		pthread_mutex_lock(&mdb->mdb_lock);
+		for (mt = mdb->mdb_txns; mt != NULL; mt = next)
+		{
+			next = mt->mt_next;
+			mdb_txn_abort(mt->mt_txn);
+			free(mt);
+		}
+		mdb->mdb_txns = NULL;
+		pthread_mutex_unlock(&mdb->mdb_lock);
+		pthread_mutex_destroy(&mdb->mdb_lock);
+
 		if (db->db_cursor != NULL)
 			mdb_cursor_close(db->db_cursor);
 
-		mdb_txn_abort(mdb->mdb_txn);
+		if (mdb->mdb_txn != NULL)
+			mdb_txn_abort(mdb->mdb_txn);
 		mdb_env_close(mdb->mdb_env);
 		free(db->db_data);
 		free(db);
@@ -5714,11 +12329,20 @@ dkimf_db_strerror(DKIMF_DB db, char *err, size_t errlen)
 	assert(db != NULL);
 	assert(err != NULL);
 
+#ifdef _FFR_DB_BREAKER
+	if (DKIMF_DB_BREAKER_OPEN(db))
+	{
+		return strlcpy(err, "queries suspended after repeated failures",
+		               errlen);
+	}
+#endif /* _FFR_DB_BREAKER */
+
 	switch (db->db_type)
 	{
 	  case DKIMF_DB_TYPE_FILE:
 	  case DKIMF_DB_TYPE_CSL:
 	  case DKIMF_DB_TYPE_SOCKET:
+	  case DKIMF_DB_TYPE_CTABLE:
 		return strlcpy(err, strerror(db->db_status), errlen);
 
 	  case DKIMF_DB_TYPE_REFILE:
@@ -5833,6 +12457,12 @@ dkimf_db_walk(DKIMF_DB db, _Bool first, void *key, size_t *keylen,
 	    db->db_type == DKIMF_DB_TYPE_LUA)
 		return -1;
 
+#ifdef _FFR_DB_WRITEBEHIND
+	/* a walk only sees the backend, so bring it up to date first */
+	if (first && db->db_wb != NULL)
+		dkimf_db_wb_flush(db);
+#endif /* _FFR_DB_WRITEBEHIND */
+
 	switch (db->db_type)
 	{
 	  case DKIMF_DB_TYPE_CSL:
@@ -5841,7 +12471,7 @@ dkimf_db_walk(DKIMF_DB db, _Bool first, void *key, size_t *keylen,
 		struct dkimf_db_list *list;
 
 		if (first)
-			list = (struct dkimf_db_list *) db->db_handle;
+			list = (struct dkimf_db_list *) DKIMF_DB_HANDLE(db);
 		else
 			list = (struct dkimf_db_list *) db->db_cursor;
 
@@ -5868,6 +12498,51 @@ dkimf_db_walk(DKIMF_DB db, _Bool first, void *key, size_t *keylen,
 		return 0;
 	  }
 
+#ifdef _FFR_CTABLE
+	  case DKIMF_DB_TYPE_CTABLE:
+	  {
+		struct dkimf_db_ctable *ct;
+		struct dkimf_ctable_rec *cr;
+
+		if (first)
+		{
+			ct = (struct dkimf_db_ctable *) DKIMF_DB_HANDLE(db);
+			ct->ct_cursor = 0;
+			db->db_cursor = ct;
+		}
+		else
+		{
+			ct = (struct dkimf_db_ctable *) db->db_cursor;
+		}
+
+		if (ct == NULL || ct->ct_cursor >= ct->ct_hdr->ch_nrecs)
+			return 1;
+
+		/* records are grouped by key; walk them in source order */
+		if (ct->ct_order[ct->ct_cursor] >= ct->ct_hdr->ch_nrecs)
+			return -1;
+		cr = &ct->ct_recs[ct->ct_order[ct->ct_cursor]];
+		if (!dkimf_db_ctable_recok(ct, cr))
+			return -1;
+
+		if (key != NULL)
+		{
+			*keylen = strlcpy(key, ct->ct_map + cr->cr_key,
+			                  *keylen);
+		}
+
+		if (reqnum != 0 && cr->cr_value != 0)
+		{
+			if (dkimf_db_ctable_split(ct, cr, req, reqnum) != 0)
+				return -1;
+		}
+
+		ct->ct_cursor++;
+
+		return 0;
+	  }
+#endif /* _FFR_CTABLE */
+
 #ifdef USE_DB
 	  case DKIMF_DB_TYPE_BDB:
 	  {
@@ -6279,11 +12954,22 @@ dkimf_db_walk(DKIMF_DB db, _Bool first, void *key, size_t *keylen,
 		struct dkimf_db_mdb *mdb;
 		char databuf[BUFRSZ + 1];
 
-		mdb = (struct dkimf_db_mdb *) db->db_handle;
+		mdb = (struct dkimf_db_mdb *) db->db_data;
 
 		dbc = db->db_cursor;
 		if (dbc == NULL)
 		{
+			if (mdb->mdb_txn == NULL)
+			{
+				status = mdb_txn_begin(mdb->mdb_env, NULL,
+				                       MDB_RDONLY, &mdb->mdb_txn);
+				if (status != 0)
+				{
+					db->db_status = status;
+					return -1;
+				}
+			}
+
 			status = mdb_cursor_open(mdb->mdb_txn, mdb->mdb_dbi,
 			                         &dbc);
 			if (status != 0)
@@ -6607,13 +13293,25 @@ dkimf_db_mkarray(DKIMF_DB db, char ***a, const char **base)
 	    db->db_type == DKIMF_DB_TYPE_LUA)
 		return -1;
 
+#ifdef _FFR_DB_AUTORELOAD
+	/*
+	**  The array points into the list and is kept for the life of the
+	**  data set, so the list can't be replaced after this.  Lists it
+	**  already replaced may still be in use by other threads.
+	*/
+
+	if (db->db_reload != NULL)
+		dkimf_db_reload_remove(db, TRUE);
+#endif /* _FFR_DB_AUTORELOAD */
+
 #ifdef USE_DB
 	if (db->db_type != DKIMF_DB_TYPE_BDB && db->db_nrecs == 0)
 		return 0;
 #endif /* USE_DB */
 
 	if ((db->db_type == DKIMF_DB_TYPE_FILE ||
-	     db->db_type == DKIMF_DB_TYPE_CSL) &&
+	     db->db_type == DKIMF_DB_TYPE_CSL ||
+	     db->db_type == DKIMF_DB_TYPE_CTABLE) &&
 	    db->db_array != NULL)
 	{
 		*a = db->db_array;
@@ -6636,24 +13334,66 @@ dkimf_db_mkarray(DKIMF_DB db, char ***a, const char **base)
 		struct dkimf_db_list *cur;
 
 		out = (char **) malloc(sizeof(char *) * (db->db_nrecs + 1));
-		if (out != NULL)
+		if (out != NULL)
+		{
+			cur = db->db_handle;
+			for (c = 0; c < db->db_nrecs; c++)
+			{
+				out[c] = cur->db_list_key;
+				cur = cur->db_list_next;
+			}
+
+			out[c] = NULL;
+		}
+
+		db->db_array = out;
+
+		*a = out;
+
+		return c;
+	  }
+
+#ifdef _FFR_CTABLE
+	  case DKIMF_DB_TYPE_CTABLE:
+	  {
+		int c = 0;
+		struct dkimf_db_ctable *ct;
+		struct dkimf_ctable_rec *cr;
+
+		ct = (struct dkimf_db_ctable *) db->db_handle;
+
+		out = (char **) malloc(sizeof(char *) * (db->db_nrecs + 1));
+		if (out == NULL)
+			return -1;
+
+		/* in source order, e.g. for SenderHeaders */
+		for (c = 0; c < db->db_nrecs; c++)
 		{
-			cur = db->db_handle;
-			for (c = 0; c < db->db_nrecs; c++)
+			if (ct->ct_order[c] >= ct->ct_hdr->ch_nrecs)
 			{
-				out[c] = cur->db_list_key;
-				cur = cur->db_list_next;
+				free(out);
+				return -1;
 			}
 
-			out[c] = NULL;
+			cr = &ct->ct_recs[ct->ct_order[c]];
+			if (!dkimf_db_ctable_recok(ct, cr))
+			{
+				free(out);
+				return -1;
+			}
+
+			out[c] = ct->ct_map + cr->cr_key;
 		}
 
+		out[c] = NULL;
+
 		db->db_array = out;
 
 		*a = out;
 
 		return c;
 	  }
+#endif /* _FFR_CTABLE */
 
 #ifdef USE_DB
 	  case DKIMF_DB_TYPE_BDB:
@@ -6798,7 +13538,7 @@ dkimf_db_rewalk(DKIMF_DB db, char *str, DKIMF_DBDATA req, unsigned int reqnum,
 	}
 	else
 	{
-		re = (struct dkimf_db_relist *) db->db_handle;
+		re = (struct dkimf_db_relist *) DKIMF_DB_HANDLE(db);
 	}
 
 	while (re != NULL)
@@ -6851,6 +13591,63 @@ dkimf_db_set_ldap_param(int param, char *str)
 	dkimf_db_ldap_param[param] = str;
 }
 
+/*
+**  DKIMF_DB_SET_SOCKET_PARAM -- set a socket data set parameter
+**
+**  Parameters:
+**  	param -- parameter code to set
+**  	value -- new value (0 for the default)
+**
+**  Return value:
+**  	None.
+*/
+
+void
+dkimf_db_set_socket_param(int param, u_int value)
+{
+	assert(param >= 0 && param <= DKIMF_SOCKET_PARAM_MAX);
+
+	dkimf_db_socket_param[param] = value;
+}
+
+/*
+**  DKIMF_DB_SET_LUA_PARAM -- set a Lua data set parameter
+**
+**  Parameters:
+**  	param -- parameter code to set
+**  	value -- new value
+**
+**  Return value:
+**  	None.
+*/
+
+void
+dkimf_db_set_lua_param(int param, u_int value)
+{
+	assert(param >= 0 && param <= DKIMF_LUA_PARAM_MAX);
+
+	dkimf_db_lua_param[param] = value;
+}
+
+/*
+**  DKIMF_DB_SET_POOL_PARAM -- set a connection pool parameter
+**
+**  Parameters:
+**  	param -- parameter code to set
+**  	str -- new string pointer value
+**
+**  Return value:
+**  	None.
+*/
+
+void
+dkimf_db_set_pool_param(int param, char *str)
+{
+	assert(param >= 0 && param <= DKIMF_POOL_PARAM_MAX);
+
+	dkimf_db_pool_param[param] = str;
+}
+
 /*
 **  DKIMF_DB_CHOWN -- set ownership and permissions on a DB
 **
@@ -6904,3 +13701,384 @@ dkimf_db_chown(DKIMF_DB db, uid_t uid)
 
 #endif /* USE_DB */
 }
+
+#ifdef _FFR_DB_BREAKER
+/*
+**  DKIMF_DB_BREAKER_ENABLE -- attach a circuit breaker to a DB handle
+**
+**  Parameters:
+**  	db -- DKIMF_DB handle
+**  	name -- name of the data set, for logging
+**  	threshold -- consecutive slow or failed queries that trip it
+**  	slow -- milliseconds after which a query counts as slow
+**  	        (0 = only failures count)
+**  	retry -- seconds between probes while tripped
+**
+**  Return value:
+**  	0 -- success
+**  	-1 -- error; errno will be set
+**
+**  Notes:
+**  	Once tripped, queries are refused without being sent to the backend
+**  	and dkimf_db_get() answers from the result cache, if there is one,
+**  	even after its answers have expired; otherwise it fails at once,
+**  	leaving the caller to apply its internal error handling.  A
+**  	background thread probes the backend and closes the breaker when it
+**  	answers promptly again.  Only data sets served by remote servers
+**  	need one; for others this does nothing.
+*/
+
+int
+dkimf_db_breaker_enable(DKIMF_DB db, const char *name, u_int threshold,
+                        u_int slow, u_int retry)
+{
+	struct dkimf_db_breaker *br;
+
+	assert(db != NULL);
+
+	if (threshold == 0 || retry == 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (db->db_breaker != NULL)
+		return 0;
+
+	switch (db->db_type)
+	{
+	  case DKIMF_DB_TYPE_DSN:
+	  case DKIMF_DB_TYPE_ERLANG:
+	  case DKIMF_DB_TYPE_LDAP:
+	  case DKIMF_DB_TYPE_MEMCACHE:
+	  case DKIMF_DB_TYPE_REPUTE:
+	  case DKIMF_DB_TYPE_SOCKET:
+		break;
+
+	  default:
+		return 0;
+	}
+
+	br = (struct dkimf_db_breaker *) malloc(sizeof *br);
+	if (br == NULL)
+		return -1;
+
+	memset(br, '\0', sizeof *br);
+
+	br->br_name = strdup(name == NULL ? "data set" : name);
+	if (br->br_name == NULL)
+	{
+		free(br);
+		return -1;
+	}
+
+	br->br_threshold = threshold;
+	br->br_slow = slow;
+	br->br_retry = retry;
+
+	pthread_mutex_init(&br->br_lock, NULL);
+	pthread_cond_init(&br->br_wakeup, NULL);
+
+	db->db_breaker = br;
+
+	return 0;
+}
+
+/*
+**  DKIMF_DB_BREAKER_STATS -- report query latency and failures for a
+**                            DB handle
+**
+**  Parameters:
+**  	db -- DKIMF_DB handle
+**  	stats -- statistics (returned)
+**
+**  Return value:
+**  	TRUE iff "db" has a circuit breaker.
+*/
+
+_Bool
+dkimf_db_breaker_stats(DKIMF_DB db, struct dkimf_db_brstats *stats)
+{
+	struct dkimf_db_breaker *br;
+
+	assert(db != NULL);
+	assert(stats != NULL);
+
+	memset(stats, '\0', sizeof *stats);
+
+	br = db->db_breaker;
+	if (br == NULL)
+		return FALSE;
+
+	pthread_mutex_lock(&br->br_lock);
+	stats->brs_queries = br->br_queries;
+	stats->brs_errors = br->br_errors;
+	stats->brs_slow = br->br_slowq;
+	stats->brs_trips = br->br_trips;
+	stats->brs_refused = br->br_refused;
+	stats->brs_maxlatency = br->br_maxusec / 1000;
+	if (br->br_queries != 0)
+	{
+		stats->brs_avglatency = (unsigned long) (br->br_usec /
+		                                         br->br_queries / 1000);
+	}
+	stats->brs_open = br->br_open;
+	pthread_mutex_unlock(&br->br_lock);
+
+	return TRUE;
+}
+#endif /* _FFR_DB_BREAKER */
+
+#ifdef _FFR_DB_CACHE
+/*
+**  DKIMF_DB_CACHE_ENABLE -- attach a result cache to a DB handle
+**
+**  Parameters:
+**  	db -- DKIMF_DB handle
+**  	ttl -- lifetime of cached positive answers, in seconds
+**  	negttl -- lifetime of cached negative answers (0 = don't cache them)
+**  	max -- maximum number of cached answers
+**
+**  Return value:
+**  	0 -- success
+**  	-1 -- error; errno will be set
+**
+**  Notes:
+**  	The cache is split into independently locked shards so that
+**  	concurrent lookups of different keys don't contend; "max" is
+**  	divided evenly among them.  Least recently used answers are
+**  	discarded first when a shard is full.  Writes through dkimf_db_put()
+**  	and dkimf_db_delete() discard any cached answer for the same key.
+*/
+
+int
+dkimf_db_cache_enable(DKIMF_DB db, u_int ttl, u_int negttl, u_int max)
+{
+	int c;
+	struct dkimf_db_cache *cache;
+
+	assert(db != NULL);
+
+	if (ttl == 0 || max == 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (db->db_cache != NULL)
+		return 0;
+
+	cache = (struct dkimf_db_cache *) malloc(sizeof *cache);
+	if (cache == NULL)
+		return -1;
+
+	memset(cache, '\0', sizeof *cache);
+
+	cache->cache_icase = ((db->db_flags & DKIMF_DB_FLAG_ICASE) != 0);
+	cache->cache_ttl = ttl;
+	cache->cache_negttl = negttl;
+	cache->cache_shardmax = MAX(max / DKIMF_DB_CACHE_SHARDS, 1);
+
+	for (c = 0; c < DKIMF_DB_CACHE_SHARDS; c++)
+		pthread_mutex_init(&cache->cache_shards[c].cs_lock, NULL);
+
+	db->db_cache = cache;
+
+	return 0;
+}
+
+/*
+**  DKIMF_DB_CACHE_STATS -- report result cache activity for a DB handle
+**
+**  Parameters:
+**  	db -- DKIMF_DB handle
+**  	hits -- lookups answered from the cache (returned)
+**  	misses -- lookups passed to the backend (returned)
+**
+**  Return value:
+**  	TRUE iff "db" has a result cache.
+*/
+
+_Bool
+dkimf_db_cache_stats(DKIMF_DB db, unsigned long *hits, unsigned long *misses)
+{
+	int c;
+	struct dkimf_db_cshard *cs;
+
+	assert(db != NULL);
+	assert(hits != NULL);
+	assert(misses != NULL);
+
+	*hits = 0;
+	*misses = 0;
+
+	if (db->db_cache == NULL)
+		return FALSE;
+
+	for (c = 0; c < DKIMF_DB_CACHE_SHARDS; c++)
+	{
+		cs = &db->db_cache->cache_shards[c];
+
+		pthread_mutex_lock(&cs->cs_lock);
+		*hits += cs->cs_hits;
+		*misses += cs->cs_misses;
+		pthread_mutex_unlock(&cs->cs_lock);
+	}
+
+	return TRUE;
+}
+#endif /* _FFR_DB_CACHE */
+
+#ifdef _FFR_DB_WRITEBEHIND
+/*
+**  DKIMF_DB_WB_ENABLE -- attach a write-behind buffer to a DB handle
+**
+**  Parameters:
+**  	db -- DKIMF_DB handle
+**  	interval -- seconds between flushes
+**  	max -- flush early once this many keys have writes pending
+**
+**  Return value:
+**  	0 -- success
+**  	-1 -- error; errno will be set
+**
+**  Notes:
+**  	After this, dkimf_db_put() and dkimf_db_delete() only record the
+**  	change in memory, replacing any earlier change to the same key that
+**  	hasn't been written yet, and a background thread applies them to the
+**  	backend.  dkimf_db_get() sees pending changes immediately; a walk
+**  	flushes them first.  Changes still pending when the handle is
+**  	closed are written out then.  Only Berkeley DB and LMDB data sets
+**  	can be buffered.
+*/
+
+int
+dkimf_db_wb_enable(DKIMF_DB db, u_int interval, u_int max)
+{
+	struct dkimf_db_wb *wb;
+
+	assert(db != NULL);
+
+	if (interval == 0 || max == 0 ||
+	    (db->db_flags & DKIMF_DB_FLAG_READONLY) != 0 ||
+	    (db->db_type != DKIMF_DB_TYPE_BDB &&
+	     db->db_type != DKIMF_DB_TYPE_MDB))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (db->db_wb != NULL)
+		return 0;
+
+	/* the flusher needs to be kept off the handle while others use it */
+	if (db->db_lock == NULL)
+	{
+		db->db_lock = (pthread_mutex_t *) malloc(sizeof *db->db_lock);
+		if (db->db_lock == NULL)
+			return -1;
+
+		if (pthread_mutex_init(db->db_lock, NULL) != 0)
+		{
+			free(db->db_lock);
+			db->db_lock = NULL;
+			errno = ENOMEM;
+			return -1;
+		}
+
+		db->db_flags |= DKIMF_DB_FLAG_MAKELOCK;
+	}
+
+	wb = (struct dkimf_db_wb *) malloc(sizeof *wb);
+	if (wb == NULL)
+		return -1;
+
+	memset(wb, '\0', sizeof *wb);
+
+	wb->wb_interval = interval;
+	wb->wb_max = max;
+
+	pthread_mutex_init(&wb->wb_lock, NULL);
+	pthread_cond_init(&wb->wb_wakeup, NULL);
+	pthread_cond_init(&wb->wb_done, NULL);
+
+	db->db_wb = wb;
+
+	return 0;
+}
+
+/*
+**  DKIMF_DB_WB_DISABLE -- stop buffering writes to a DB handle
+**
+**  Parameters:
+**  	db -- DKIMF_DB handle
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Writes still pending are flushed before this returns, and later
+**  	ones go straight to the backend.  Used when another handle is
+**  	about to take over the same database, e.g. on a configuration
+**  	reload, so that it sees everything written through this one.
+*/
+
+void
+dkimf_db_wb_disable(DKIMF_DB db)
+{
+	struct dkimf_db_wb *wb;
+
+	assert(db != NULL);
+
+	wb = db->db_wb;
+	if (wb == NULL)
+		return;
+
+	pthread_mutex_lock(&wb->wb_lock);
+	wb->wb_direct = TRUE;
+	pthread_mutex_unlock(&wb->wb_lock);
+
+	dkimf_db_wb_flush(db);
+}
+
+/*
+**  DKIMF_DB_WB_STATS -- report write-behind activity for a DB handle
+**
+**  Parameters:
+**  	db -- DKIMF_DB handle
+**  	writes -- writes accepted (returned)
+**  	flushed -- writes sent to the backend after coalescing (returned)
+**  	errors -- writes the backend refused (returned)
+**
+**  Return value:
+**  	TRUE iff "db" has a write-behind buffer.
+*/
+
+_Bool
+dkimf_db_wb_stats(DKIMF_DB db, unsigned long *writes, unsigned long *flushed,
+                  unsigned long *errors)
+{
+	struct dkimf_db_wb *wb;
+
+	assert(db != NULL);
+	assert(writes != NULL);
+	assert(flushed != NULL);
+	assert(errors != NULL);
+
+	*writes = 0;
+	*flushed = 0;
+	*errors = 0;
+
+	wb = db->db_wb;
+	if (wb == NULL)
+		return FALSE;
+
+	pthread_mutex_lock(&wb->wb_lock);
+	*writes = wb->wb_writes;
+	*flushed = wb->wb_flushed;
+	*errors = wb->wb_errors;
+	pthread_mutex_unlock(&wb->wb_lock);
+
+	return TRUE;
+}
+#endif /* _FFR_DB_WRITEBEHIND */
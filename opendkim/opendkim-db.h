@@ -24,6 +24,8 @@
 #define	DKIMF_DB_FLAG_NOFDLOCK	0x0080
 #define	DKIMF_DB_FLAG_SOFTSTART	0x0100
 #define	DKIMF_DB_FLAG_NOCACHE	0x0200
+#define	DKIMF_DB_FLAG_SNAPSHOT	0x0400
+#define	DKIMF_DB_FLAG_AUTORELOAD 0x0800
 
 #define	DKIMF_DB_TYPE_UNKNOWN	(-1)
 #define	DKIMF_DB_TYPE_FILE	0
@@ -38,6 +40,7 @@
 #define DKIMF_DB_TYPE_SOCKET	9
 #define DKIMF_DB_TYPE_MDB	10
 #define DKIMF_DB_TYPE_ERLANG	11
+#define DKIMF_DB_TYPE_CTABLE	12
 
 #define	DKIMF_LDAP_PARAM_BINDUSER	0
 #define	DKIMF_LDAP_PARAM_BINDPW		1
@@ -50,8 +53,25 @@
 #define	DKIMF_LDAP_PARAM_KA_IDLE	8
 #define	DKIMF_LDAP_PARAM_KA_PROBES	9
 #define	DKIMF_LDAP_PARAM_KA_INTERVAL	10
+#define	DKIMF_LDAP_PARAM_CONNECTIONS	11
 
-#define DKIMF_LDAP_PARAM_MAX		10
+#define DKIMF_LDAP_PARAM_MAX		11
+
+#define	DKIMF_SOCKET_PARAM_CONNECTIONS	0
+#define	DKIMF_SOCKET_PARAM_PIPELINE	1
+
+#define DKIMF_SOCKET_PARAM_MAX		1
+
+#define	DKIMF_POOL_PARAM_SIZE		0
+#define	DKIMF_POOL_PARAM_IDLETIME	1
+#define	DKIMF_POOL_PARAM_BACKOFF	2
+
+#define DKIMF_POOL_PARAM_MAX		2
+
+#define	DKIMF_LUA_PARAM_STATES		0
+#define	DKIMF_LUA_PARAM_RECYCLE		1
+
+#define DKIMF_LUA_PARAM_MAX		1
 
 #ifdef __STDC__
 # ifndef __P
@@ -78,23 +98,65 @@ typedef struct dkimf_db_data * DKIMF_DBDATA;
 #define	DKIMF_DB_DATA_BINARY	0x01		/* data is binary */
 #define	DKIMF_DB_DATA_OPTIONAL	0x02		/* data is optional */
 
+#ifdef _FFR_DB_BREAKER
+struct dkimf_db_brstats
+{
+	_Bool		brs_open;		/* currently tripped */
+	unsigned long	brs_queries;		/* queries sent */
+	unsigned long	brs_errors;		/* queries that failed */
+	unsigned long	brs_slow;		/* queries that were slow */
+	unsigned long	brs_trips;		/* times tripped */
+	unsigned long	brs_refused;		/* queries refused */
+	unsigned long	brs_avglatency;		/* mean query time (ms) */
+	unsigned long	brs_maxlatency;		/* longest query time (ms) */
+};
+#endif /* _FFR_DB_BREAKER */
+
 /* prototypes */
+#ifdef _FFR_DB_BREAKER
+extern int dkimf_db_breaker_enable __P((DKIMF_DB, const char *, u_int, u_int,
+                                        u_int));
+extern _Bool dkimf_db_breaker_stats __P((DKIMF_DB, struct dkimf_db_brstats *));
+#endif /* _FFR_DB_BREAKER */
+#ifdef _FFR_DB_CACHE
+extern int dkimf_db_cache_enable __P((DKIMF_DB, u_int, u_int, u_int));
+extern _Bool dkimf_db_cache_stats __P((DKIMF_DB, unsigned long *,
+                                       unsigned long *));
+#endif /* _FFR_DB_CACHE */
+extern _Bool dkimf_db_canbatch __P((DKIMF_DB));
 extern int dkimf_db_chown __P((DKIMF_DB, uid_t uid));
 extern int dkimf_db_close __P((DKIMF_DB));
 extern int dkimf_db_delete __P((DKIMF_DB, void *, size_t));
 extern void dkimf_db_flags __P((unsigned int));
 extern int dkimf_db_get __P((DKIMF_DB, void *, size_t,
                              DKIMF_DBDATA, unsigned int, _Bool *));
+extern int dkimf_db_mget __P((DKIMF_DB, char **, unsigned int,
+                              DKIMF_DBDATA, unsigned int, _Bool *));
 extern int dkimf_db_mkarray __P((DKIMF_DB, char ***, const char **));
 extern int dkimf_db_open __P((DKIMF_DB *, char *, u_int flags,
                               pthread_mutex_t *, char **));
 extern int dkimf_db_put __P((DKIMF_DB, void *, size_t, void *, size_t));
+#ifdef _FFR_DB_AUTORELOAD
+extern int dkimf_db_reload_start __P((_Bool));
+#endif /* _FFR_DB_AUTORELOAD */
 extern int dkimf_db_rewalk __P((DKIMF_DB, char *, DKIMF_DBDATA, unsigned int,
                                 void **));
 extern void dkimf_db_set_ldap_param __P((int, char *));
+extern void dkimf_db_set_lua_param __P((int, u_int));
+extern void dkimf_db_set_pool_param __P((int, char *));
+extern void dkimf_db_set_socket_param __P((int, u_int));
+#if defined(USE_DB) && defined(_FFR_BDB_SNAPSHOT)
+extern int dkimf_db_snap_start __P((void));
+#endif /* USE_DB && _FFR_BDB_SNAPSHOT */
 extern int dkimf_db_strerror __P((DKIMF_DB, char *, size_t));
 extern int dkimf_db_type __P((DKIMF_DB));
 extern int dkimf_db_walk __P((DKIMF_DB, _Bool, void *, size_t *,
                               DKIMF_DBDATA, unsigned int));
+#ifdef _FFR_DB_WRITEBEHIND
+extern void dkimf_db_wb_disable __P((DKIMF_DB));
+extern int dkimf_db_wb_enable __P((DKIMF_DB, u_int, u_int));
+extern _Bool dkimf_db_wb_stats __P((DKIMF_DB, unsigned long *,
+                                    unsigned long *, unsigned long *));
+#endif /* _FFR_DB_WRITEBEHIND */
 
 #endif /* _OPENDKIM_DB_H_ */
@@ -12,6 +12,9 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#ifdef _FFR_LUA_STATE_POOLS
+# include <pthread.h>
+#endif /* _FFR_LUA_STATE_POOLS */
 
 /* Lua includes */
 #include <lua.h>
@@ -37,6 +40,29 @@ struct dkimf_lua_io
 	size_t		lua_io_alloc;
 };
 
+#ifdef _FFR_LUA_STATE_POOLS
+struct dkimf_lua_state
+{
+	int			ls_func;	/* registry ref of compiled chunk */
+	u_int			ls_calls;	/* calls made so far */
+	lua_State *		ls_state;	/* the interpreter */
+	struct dkimf_lua_state * ls_next;	/* next idle state */
+};
+
+struct dkimf_lua_pool
+{
+	u_int			lp_max;		/* max. idle states kept */
+	u_int			lp_recycle;	/* calls before replacing */
+	u_int			lp_idle;	/* idle states */
+	size_t			lp_scriptlen;	/* length of lp_script */
+	const char *		lp_script;	/* compiled script */
+	char *			lp_name;	/* script name */
+	void			(*lp_init) __P((lua_State *)); /* state setup */
+	struct dkimf_lua_state * lp_free;	/* idle states */
+	pthread_mutex_t		lp_lock;	/* lock */
+};
+#endif /* _FFR_LUA_STATE_POOLS */
+
 #ifdef DKIMF_LUA_CONTEXT_HOOKS
 /* libraries */
 static const luaL_Reg dkimf_lua_lib_setup[] =
@@ -422,117 +448,105 @@ dkimf_lua_gc_cleanup(struct dkimf_lua_gc *gc)
 	}
 }
 
-#ifdef DKIMF_LUA_CONTEXT_HOOKS
 /*
-**  DKIMF_LUA_SETUP_HOOK -- hook to Lua for handling a message during setup
+**  DKIMF_LUA_RESULTS -- collect the values returned by a script
 **
 **  Parameters:
-**  	ctx -- session context, for making calls back to opendkim.c
-**  	script -- script to run
-**  	scriptlen -- length of script; if 0, use strlen()
-**  	name -- name of the script (for logging)
-**  	lres -- Lua result structure
-**  	keep -- where to save the script (or NULL)
-**  	funclen -- size of the saved object
+**  	l -- Lua state
+**  	status -- return value from lua_pcall()
+**  	lres -- Lua result structure (updated)
 **
 **  Return value:
-**  	2 -- processing error
-**  	1 -- script contains a syntax error
-**  	0 -- success
-**  	-1 -- memory allocation failure
-**
-**  Side effects:
-**  	lres may be modified to relay the script's signing requests, i.e.
-**  	which key/selector(s) to use, whether to use "l=", etc.
-** 
-**  Notes:
-**  	Called by mlfi_eoh() so it can decide what signature(s) to apply.
+**  	None.
 */
 
-int
-dkimf_lua_setup_hook(void *ctx, const char *script, size_t scriptlen,
-                     const char *name, struct dkimf_lua_script_result *lres,
-                     void **keep, size_t *funclen)
+static void
+dkimf_lua_results(lua_State *l, int status,
+                  struct dkimf_lua_script_result *lres)
 {
-	int status;
-	lua_State *l = NULL;
-	struct dkimf_lua_io io;
-	struct dkimf_lua_gc gc;
-
-	assert(script != NULL);
+	assert(l != NULL);
 	assert(lres != NULL);
 
-	io.lua_io_done = FALSE;
-	io.lua_io_script = script;
-	if (scriptlen == 0)
-		io.lua_io_len = strlen(script);
-	else
-		io.lua_io_len = scriptlen;
+	if (status != 0 && lua_isstring(l, 1))
+	{
+		lres->lrs_error = strdup(lua_tostring(l, 1));
+		lres->lrs_rcount = 0;
+	}
+	else if (status == 0)
+	{
+		size_t asz;
 
-	gc.gc_head = NULL;
-	gc.gc_tail = NULL;
+		lres->lrs_rcount = lua_gettop(l);
 
-	l = lua_newstate(dkimf_lua_alloc, NULL);
-	if (l == NULL)
-		return -1;
+		asz = sizeof(char *) * lres->lrs_rcount;
+		lres->lrs_results = (char **) malloc(asz);
+		if (lres->lrs_results != NULL)
+		{
+			int c;
 
-	luaL_openlibs(l);
+			for (c = 0; c < lres->lrs_rcount; c++)
+			{
+				lres->lrs_results[c] = strdup(lua_tostring(l,
+				                                           c + 1));
+			}
+		}
+	}
+}
 
-	/*
-	**  Register functions.
-	*/
+#ifdef _FFR_LUA_STATE_POOLS
+/*
+**  DKIMF_LUA_STATE_NEW -- create a Lua state with a script loaded
+**
+**  Parameters:
+**  	pool -- pool the state will belong to
+**  	lres -- Lua result structure (for reporting load errors)
+**  	status -- status code (returned); as for dkimf_lua_db_hook()
+**
+**  Return value:
+**  	A new state holding the script's compiled chunk, or NULL on error.
+*/
 
-# if LUA_VERSION_NUM == 502
-	luaL_newlib(l, dkimf_lua_lib_setup);
-	lua_setglobal(l, "odkim");
-# else /* LUA_VERSION_NUM == 502 */
-	luaL_register(l, "odkim", dkimf_lua_lib_setup);
-# endif /* LUA_VERSION_NUM == 502 */
-	lua_pop(l, 1);
+static struct dkimf_lua_state *
+dkimf_lua_state_new(struct dkimf_lua_pool *pool,
+                    struct dkimf_lua_script_result *lres, int *status)
+{
+	struct dkimf_lua_state *ls;
+	lua_State *l;
+	struct dkimf_lua_io io;
 
-	/*
-	**  Register constants.
-	*/
+	assert(pool != NULL);
+	assert(lres != NULL);
+	assert(status != NULL);
 
-	/* garbage collection handle */
-	lua_pushlightuserdata(l, &gc);
-	lua_setglobal(l, DKIMF_GC);
+	ls = (struct dkimf_lua_state *) malloc(sizeof *ls);
+	if (ls == NULL)
+	{
+		*status = -1;
+		return NULL;
+	}
 
-	/* DB handle constants */
-	lua_pushnumber(l, DB_DOMAINS);
-	lua_setglobal(l, "DB_DOMAINS");
-	lua_pushnumber(l, DB_THIRDPARTY);
-	lua_setglobal(l, "DB_THIRDPARTY");
-	lua_pushnumber(l, DB_DONTSIGNTO);
-	lua_setglobal(l, "DB_DONTSIGNTO");
-	lua_pushnumber(l, DB_MTAS);
-	lua_setglobal(l, "DB_MTAS");
-	lua_pushnumber(l, DB_MACROS);
-	lua_setglobal(l, "DB_MACROS");
-	lua_pushnumber(l, DB_SIGNINGTABLE);
-	lua_setglobal(l, "DB_SIGNINGTABLE");
+	l = lua_newstate(dkimf_lua_alloc, NULL);
+	if (l == NULL)
+	{
+		free(ls);
+		*status = -1;
+		return NULL;
+	}
 
-	/* set result code */
-	lua_pushnumber(l, SMFIS_TEMPFAIL);
-	lua_setglobal(l, "SMFIS_TEMPFAIL");
-	lua_pushnumber(l, SMFIS_ACCEPT);
-	lua_setglobal(l, "SMFIS_ACCEPT");
-	lua_pushnumber(l, SMFIS_DISCARD);
-	lua_setglobal(l, "SMFIS_DISCARD");
-	lua_pushnumber(l, SMFIS_REJECT);
-	lua_setglobal(l, "SMFIS_REJECT");
+	luaL_openlibs(l);
 
-	/* filter context */
-	lua_pushlightuserdata(l, ctx);
-	lua_setglobal(l, "ctx");
+	if (pool->lp_init != NULL)
+		pool->lp_init(l);
 
-	/* import other globals */
-	dkimf_import_globals(ctx, l);
+	io.lua_io_done = FALSE;
+	io.lua_io_script = pool->lp_script;
+	io.lua_io_len = pool->lp_scriptlen;
 
 # if LUA_VERSION_NUM == 502
-	switch (lua_load(l, dkimf_lua_reader, (void *) &io, name, NULL))
+	switch (lua_load(l, dkimf_lua_reader, (void *) &io, pool->lp_name,
+	                 NULL))
 # else /* LUA_VERSION_NUM == 502 */
-	switch (lua_load(l, dkimf_lua_reader, (void *) &io, name))
+	switch (lua_load(l, dkimf_lua_reader, (void *) &io, pool->lp_name))
 # endif /* LUA_VERSION_NUM == 502 */
 	{
 	  case 0:
@@ -542,133 +556,345 @@ dkimf_lua_setup_hook(void *ctx, const char *script, size_t scriptlen,
 		if (lua_isstring(l, 1))
 			lres->lrs_error = strdup(lua_tostring(l, 1));
 		lua_close(l);
-		return 1;
+		free(ls);
+		*status = 1;
+		return NULL;
 
 	  case LUA_ERRMEM:
 		if (lua_isstring(l, 1))
 			lres->lrs_error = strdup(lua_tostring(l, 1));
 		lua_close(l);
-		return -1;
+		free(ls);
+		*status = -1;
+		return NULL;
 
 	  default:
 		assert(0);
 	}
 
-	if (keep != NULL && funclen != NULL)
-	{
-		io.lua_io_done = FALSE;
-		io.lua_io_script = NULL;
-		io.lua_io_len = 0;
-		io.lua_io_alloc = 0;
-
-		if (lua_dump(l, dkimf_lua_writer, &io) == 0)
-		{
-			*keep = (void *) io.lua_io_script;
-			*funclen = io.lua_io_len;
-		}
-	}
+	/* keep the chunk where each call can find it */
+	ls->ls_func = luaL_ref(l, LUA_REGISTRYINDEX);
+	ls->ls_calls = 0;
+	ls->ls_state = l;
+	ls->ls_next = NULL;
 
-	status = lua_pcall(l, 0, LUA_MULTRET, 0);
-	if (lua_isstring(l, 1))
-		lres->lrs_error = strdup(lua_tostring(l, 1));
+	*status = 0;
+	return ls;
+}
 
-	dkimf_lua_gc_cleanup(&gc);
+/*
+**  DKIMF_LUA_STATE_FREE -- destroy a pooled Lua state
+**
+**  Parameters:
+**  	ls -- state to destroy
+**
+**  Return value:
+**  	None.
+*/
 
-	lua_close(l);
+static void
+dkimf_lua_state_free(struct dkimf_lua_state *ls)
+{
+	assert(ls != NULL);
 
-	return (status == 0 ? 0 : 2);
+	lua_close(ls->ls_state);
+	free(ls);
 }
 
 /*
-**  DKIMF_LUA_SCREEN_HOOK -- hook to Lua for handling a message after the
-**                           verifying handle is established and all headers
-**                           have been fed to it
+**  DKIMF_LUA_POOL_NEW -- create a pool of Lua states for a script
 **
 **  Parameters:
-**  	ctx -- session context, for making calls back to opendkim.c
-**  	script -- script to run
-**  	scriptlen -- length of script; if 0, use strlen()
-**  	name -- name of the script (for logging)
-**  	lres -- Lua result structure
-**  	keep -- where to save the script (or NULL)
-**  	funclen -- size of the saved object
+**  	script -- compiled script (as saved by one of the hooks); the
+**  	          caller must keep it around until the pool is freed
+**  	scriptlen -- length of the script
+**  	name -- name of the script (for error reporting)
+**  	max -- most idle states to keep
+**  	recycle -- number of calls after which a state is replaced
+**  	           (0 == never)
 **
 **  Return value:
-**  	2 -- processing error
-**  	1 -- script contains a syntax error
-**  	0 -- success
-**  	-1 -- memory allocation failure
-**
-**  Notes:
-**  	Called by mlfi_eom() so it can decide whether or not the message
-**  	is acceptable.
+**  	A new pool, or NULL on error.  States are created on demand.
 */
 
-int
-dkimf_lua_screen_hook(void *ctx, const char *script, size_t scriptlen,
-                      const char *name, struct dkimf_lua_script_result *lres,
-                      void **keep, size_t *funclen)
+struct dkimf_lua_pool *
+dkimf_lua_pool_new(const char *script, size_t scriptlen, const char *name,
+                   u_int max, u_int recycle)
 {
-	int status;
-	lua_State *l = NULL;
-	struct dkimf_lua_io io;
-	struct dkimf_lua_gc gc;
+	struct dkimf_lua_pool *pool;
 
 	assert(script != NULL);
-	assert(lres != NULL);
 
-	io.lua_io_done = FALSE;
-	io.lua_io_script = script;
-	if (scriptlen == 0)
-		io.lua_io_len = strlen(script);
-	else
-		io.lua_io_len = scriptlen;
+	pool = (struct dkimf_lua_pool *) malloc(sizeof *pool);
+	if (pool == NULL)
+		return NULL;
 
-	gc.gc_head = NULL;
-	gc.gc_tail = NULL;
+	pool->lp_max = max;
+	pool->lp_recycle = recycle;
+	pool->lp_idle = 0;
+	pool->lp_script = script;
+	pool->lp_scriptlen = scriptlen;
+	pool->lp_name = NULL;
+	pool->lp_init = NULL;
+	pool->lp_free = NULL;
 
-	l = lua_newstate(dkimf_lua_alloc, NULL);
-	if (l == NULL)
-		return -1;
+	if (name != NULL)
+	{
+		pool->lp_name = strdup(name);
+		if (pool->lp_name == NULL)
+		{
+			free(pool);
+			return NULL;
+		}
+	}
 
-	luaL_openlibs(l);
+	pthread_mutex_init(&pool->lp_lock, NULL);
 
-	/*
-	**  Register functions.
-	*/
+	return pool;
+}
 
-# if LUA_VERSION_NUM == 502
-	luaL_newlib(l, dkimf_lua_lib_screen);
-	lua_setglobal(l, "odkim");
-# else /* LUA_VERSION_NUM == 502 */
-	luaL_register(l, "odkim", dkimf_lua_lib_screen);
-# endif /* LUA_VERSION_NUM == 502 */
-	lua_pop(l, 1);
+/*
+**  DKIMF_LUA_POOL_FREE -- destroy a pool of Lua states
+**
+**  Parameters:
+**  	pool -- pool to destroy; none of its states may be in use
+**
+**  Return value:
+**  	None.
+*/
 
-	/*
-	**  Register constants.
-	*/
+void
+dkimf_lua_pool_free(struct dkimf_lua_pool *pool)
+{
+	struct dkimf_lua_state *ls;
+	struct dkimf_lua_state *next;
 
-	/* garbage collection handle */
-	lua_pushlightuserdata(l, &gc);
-	lua_setglobal(l, DKIMF_GC);
+	assert(pool != NULL);
 
-	/* DB handles */
-	lua_pushnumber(l, DB_DOMAINS);
-	lua_setglobal(l, "DB_DOMAINS");
-	lua_pushnumber(l, DB_THIRDPARTY);
-	lua_setglobal(l, "DB_THIRDPARTY");
-	lua_pushnumber(l, DB_DONTSIGNTO);
-	lua_setglobal(l, "DB_DONTSIGNTO");
-	lua_pushnumber(l, DB_MTAS);
-	lua_setglobal(l, "DB_MTAS");
-	lua_pushnumber(l, DB_MACROS);
-	lua_setglobal(l, "DB_MACROS");
-	lua_pushnumber(l, DB_SIGNINGTABLE);
-	lua_setglobal(l, "DB_SIGNINGTABLE");
+	for (ls = pool->lp_free; ls != NULL; ls = next)
+	{
+		next = ls->ls_next;
+		dkimf_lua_state_free(ls);
+	}
 
-	/* milter context */
-	lua_pushlightuserdata(l, ctx);
+	pthread_mutex_destroy(&pool->lp_lock);
+	if (pool->lp_name != NULL)
+		free(pool->lp_name);
+	free(pool);
+}
+
+/*
+**  DKIMF_LUA_POOL_GET -- get a Lua state from a pool
+**
+**  Parameters:
+**  	pool -- pool to query
+**  	lres -- Lua result structure (for reporting load errors)
+**  	status -- status code (returned); as for dkimf_lua_db_hook()
+**
+**  Return value:
+**  	An idle or newly-created state, or NULL on error.
+*/
+
+static struct dkimf_lua_state *
+dkimf_lua_pool_get(struct dkimf_lua_pool *pool,
+                   struct dkimf_lua_script_result *lres, int *status)
+{
+	struct dkimf_lua_state *ls;
+
+	assert(pool != NULL);
+
+	pthread_mutex_lock(&pool->lp_lock);
+
+	ls = pool->lp_free;
+	if (ls != NULL)
+	{
+		pool->lp_free = ls->ls_next;
+		pool->lp_idle--;
+	}
+
+	pthread_mutex_unlock(&pool->lp_lock);
+
+	if (ls != NULL)
+	{
+		*status = 0;
+		return ls;
+	}
+
+	return dkimf_lua_state_new(pool, lres, status);
+}
+
+/*
+**  DKIMF_LUA_POOL_PUT -- return a Lua state to a pool
+**
+**  Parameters:
+**  	pool -- pool the state came from
+**  	ls -- state being returned
+**  	discard -- if TRUE, the state is no longer usable
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	States that have reached the recycle limit are destroyed rather
+**  	than kept, so memory a script accumulates in its globals or
+**  	through fragmentation is given back periodically.
+*/
+
+static void
+dkimf_lua_pool_put(struct dkimf_lua_pool *pool, struct dkimf_lua_state *ls,
+                   _Bool discard)
+{
+	assert(pool != NULL);
+	assert(ls != NULL);
+
+	ls->ls_calls++;
+	lua_settop(ls->ls_state, 0);
+
+	if (!discard &&
+	    (pool->lp_recycle == 0 || ls->ls_calls < pool->lp_recycle))
+	{
+		pthread_mutex_lock(&pool->lp_lock);
+
+		if (pool->lp_idle < pool->lp_max)
+		{
+			ls->ls_next = pool->lp_free;
+			pool->lp_free = ls;
+			pool->lp_idle++;
+			ls = NULL;
+		}
+
+		pthread_mutex_unlock(&pool->lp_lock);
+	}
+
+	if (ls != NULL)
+		dkimf_lua_state_free(ls);
+}
+#endif /* _FFR_LUA_STATE_POOLS */
+
+#ifdef DKIMF_LUA_CONTEXT_HOOKS
+/*
+**  DKIMF_LUA_SETUP_INIT -- prepare a Lua state for the setup script
+**
+**  Parameters:
+**  	l -- Lua state
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Registers the library and constants available to the script;
+**  	nothing done here depends on the message being processed.
+*/
+
+static void
+dkimf_lua_setup_init(lua_State *l)
+{
+	assert(l != NULL);
+
+	/*
+	**  Register functions.
+	*/
+
+# if LUA_VERSION_NUM == 502
+	luaL_newlib(l, dkimf_lua_lib_setup);
+	lua_setglobal(l, "odkim");
+# else /* LUA_VERSION_NUM == 502 */
+	luaL_register(l, "odkim", dkimf_lua_lib_setup);
+# endif /* LUA_VERSION_NUM == 502 */
+	lua_pop(l, 1);
+
+	/*
+	**  Register constants.
+	*/
+
+	/* DB handle constants */
+	lua_pushnumber(l, DB_DOMAINS);
+	lua_setglobal(l, "DB_DOMAINS");
+	lua_pushnumber(l, DB_THIRDPARTY);
+	lua_setglobal(l, "DB_THIRDPARTY");
+	lua_pushnumber(l, DB_DONTSIGNTO);
+	lua_setglobal(l, "DB_DONTSIGNTO");
+	lua_pushnumber(l, DB_MTAS);
+	lua_setglobal(l, "DB_MTAS");
+	lua_pushnumber(l, DB_MACROS);
+	lua_setglobal(l, "DB_MACROS");
+	lua_pushnumber(l, DB_SIGNINGTABLE);
+	lua_setglobal(l, "DB_SIGNINGTABLE");
+
+	/* set result code */
+	lua_pushnumber(l, SMFIS_TEMPFAIL);
+	lua_setglobal(l, "SMFIS_TEMPFAIL");
+	lua_pushnumber(l, SMFIS_ACCEPT);
+	lua_setglobal(l, "SMFIS_ACCEPT");
+	lua_pushnumber(l, SMFIS_DISCARD);
+	lua_setglobal(l, "SMFIS_DISCARD");
+	lua_pushnumber(l, SMFIS_REJECT);
+	lua_setglobal(l, "SMFIS_REJECT");
+}
+
+/*
+**  DKIMF_LUA_SETUP_HOOK -- hook to Lua for handling a message during setup
+**
+**  Parameters:
+**  	ctx -- session context, for making calls back to opendkim.c
+**  	script -- script to run
+**  	scriptlen -- length of script; if 0, use strlen()
+**  	name -- name of the script (for logging)
+**  	lres -- Lua result structure
+**  	keep -- where to save the script (or NULL)
+**  	funclen -- size of the saved object
+**
+**  Return value:
+**  	2 -- processing error
+**  	1 -- script contains a syntax error
+**  	0 -- success
+**  	-1 -- memory allocation failure
+**
+**  Side effects:
+**  	lres may be modified to relay the script's signing requests, i.e.
+**  	which key/selector(s) to use, whether to use "l=", etc.
+** 
+**  Notes:
+**  	Called by mlfi_eoh() so it can decide what signature(s) to apply.
+*/
+
+int
+dkimf_lua_setup_hook(void *ctx, const char *script, size_t scriptlen,
+                     const char *name, struct dkimf_lua_script_result *lres,
+                     void **keep, size_t *funclen)
+{
+	int status;
+	lua_State *l = NULL;
+	struct dkimf_lua_io io;
+	struct dkimf_lua_gc gc;
+
+	assert(script != NULL);
+	assert(lres != NULL);
+
+	io.lua_io_done = FALSE;
+	io.lua_io_script = script;
+	if (scriptlen == 0)
+		io.lua_io_len = strlen(script);
+	else
+		io.lua_io_len = scriptlen;
+
+	gc.gc_head = NULL;
+	gc.gc_tail = NULL;
+
+	l = lua_newstate(dkimf_lua_alloc, NULL);
+	if (l == NULL)
+		return -1;
+
+	luaL_openlibs(l);
+
+	dkimf_lua_setup_init(l);
+
+	/* garbage collection handle */
+	lua_pushlightuserdata(l, &gc);
+	lua_setglobal(l, DKIMF_GC);
+
+	/* filter context */
+	lua_pushlightuserdata(l, ctx);
 	lua_setglobal(l, "ctx");
 
 	/* import other globals */
@@ -724,10 +950,60 @@ dkimf_lua_screen_hook(void *ctx, const char *script, size_t scriptlen,
 	return (status == 0 ? 0 : 2);
 }
 
-# ifdef _FFR_STATSEXT
 /*
-**  DKIMF_LUA_STATS_HOOK -- hook to Lua for recording statistics after
-**                          verifying has been done
+**  DKIMF_LUA_SCREEN_INIT -- prepare a Lua state for the screening script
+**
+**  Parameters:
+**  	l -- Lua state
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Registers the library and constants available to the script;
+**  	nothing done here depends on the message being processed.
+*/
+
+static void
+dkimf_lua_screen_init(lua_State *l)
+{
+	assert(l != NULL);
+
+	/*
+	**  Register functions.
+	*/
+
+# if LUA_VERSION_NUM == 502
+	luaL_newlib(l, dkimf_lua_lib_screen);
+	lua_setglobal(l, "odkim");
+# else /* LUA_VERSION_NUM == 502 */
+	luaL_register(l, "odkim", dkimf_lua_lib_screen);
+# endif /* LUA_VERSION_NUM == 502 */
+	lua_pop(l, 1);
+
+	/*
+	**  Register constants.
+	*/
+
+	/* DB handles */
+	lua_pushnumber(l, DB_DOMAINS);
+	lua_setglobal(l, "DB_DOMAINS");
+	lua_pushnumber(l, DB_THIRDPARTY);
+	lua_setglobal(l, "DB_THIRDPARTY");
+	lua_pushnumber(l, DB_DONTSIGNTO);
+	lua_setglobal(l, "DB_DONTSIGNTO");
+	lua_pushnumber(l, DB_MTAS);
+	lua_setglobal(l, "DB_MTAS");
+	lua_pushnumber(l, DB_MACROS);
+	lua_setglobal(l, "DB_MACROS");
+	lua_pushnumber(l, DB_SIGNINGTABLE);
+	lua_setglobal(l, "DB_SIGNINGTABLE");
+}
+
+/*
+**  DKIMF_LUA_SCREEN_HOOK -- hook to Lua for handling a message after the
+**                           verifying handle is established and all headers
+**                           have been fed to it
 **
 **  Parameters:
 **  	ctx -- session context, for making calls back to opendkim.c
@@ -745,14 +1021,14 @@ dkimf_lua_screen_hook(void *ctx, const char *script, size_t scriptlen,
 **  	-1 -- memory allocation failure
 **
 **  Notes:
-**  	Called by mlfi_eom() so it can pass extra statistical parameters
-**  	to the stats recording module.
+**  	Called by mlfi_eom() so it can decide whether or not the message
+**  	is acceptable.
 */
 
 int
-dkimf_lua_stats_hook(void *ctx, const char *script, size_t scriptlen,
-                     const char *name, struct dkimf_lua_script_result *lres,
-                     void **keep, size_t *funclen)
+dkimf_lua_screen_hook(void *ctx, const char *script, size_t scriptlen,
+                      const char *name, struct dkimf_lua_script_result *lres,
+                      void **keep, size_t *funclen)
 {
 	int status;
 	lua_State *l = NULL;
@@ -778,6 +1054,89 @@ dkimf_lua_stats_hook(void *ctx, const char *script, size_t scriptlen,
 
 	luaL_openlibs(l);
 
+	dkimf_lua_screen_init(l);
+
+	/* garbage collection handle */
+	lua_pushlightuserdata(l, &gc);
+	lua_setglobal(l, DKIMF_GC);
+
+	/* milter context */
+	lua_pushlightuserdata(l, ctx);
+	lua_setglobal(l, "ctx");
+
+	/* import other globals */
+	dkimf_import_globals(ctx, l);
+
+# if LUA_VERSION_NUM == 502
+	switch (lua_load(l, dkimf_lua_reader, (void *) &io, name, NULL))
+# else /* LUA_VERSION_NUM == 502 */
+	switch (lua_load(l, dkimf_lua_reader, (void *) &io, name))
+# endif /* LUA_VERSION_NUM == 502 */
+	{
+	  case 0:
+		break;
+
+	  case LUA_ERRSYNTAX:
+		if (lua_isstring(l, 1))
+			lres->lrs_error = strdup(lua_tostring(l, 1));
+		lua_close(l);
+		return 1;
+
+	  case LUA_ERRMEM:
+		if (lua_isstring(l, 1))
+			lres->lrs_error = strdup(lua_tostring(l, 1));
+		lua_close(l);
+		return -1;
+
+	  default:
+		assert(0);
+	}
+
+	if (keep != NULL && funclen != NULL)
+	{
+		io.lua_io_done = FALSE;
+		io.lua_io_script = NULL;
+		io.lua_io_len = 0;
+		io.lua_io_alloc = 0;
+
+		if (lua_dump(l, dkimf_lua_writer, &io) == 0)
+		{
+			*keep = (void *) io.lua_io_script;
+			*funclen = io.lua_io_len;
+		}
+	}
+
+	status = lua_pcall(l, 0, LUA_MULTRET, 0);
+	if (lua_isstring(l, 1))
+		lres->lrs_error = strdup(lua_tostring(l, 1));
+
+	dkimf_lua_gc_cleanup(&gc);
+
+	lua_close(l);
+
+	return (status == 0 ? 0 : 2);
+}
+
+# ifdef _FFR_STATSEXT
+/*
+**  DKIMF_LUA_STATS_INIT -- prepare a Lua state for the statistics script
+**
+**  Parameters:
+**  	l -- Lua state
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Registers the library and constants available to the script;
+**  	nothing done here depends on the message being processed.
+*/
+
+static void
+dkimf_lua_stats_init(lua_State *l)
+{
+	assert(l != NULL);
+
 	/*
 	**  Register functions.
 	*/
@@ -794,10 +1153,6 @@ dkimf_lua_stats_hook(void *ctx, const char *script, size_t scriptlen,
 	**  Register constants.
 	*/
 
-	/* garbage collection handle */
-	lua_pushlightuserdata(l, &gc);
-	lua_setglobal(l, DKIMF_GC);
-
 	/* milter result codes */
 	lua_pushnumber(l, SMFIS_TEMPFAIL);
 	lua_setglobal(l, "SMFIS_TEMPFAIL");
@@ -903,6 +1258,66 @@ dkimf_lua_stats_hook(void *ctx, const char *script, size_t scriptlen,
 	lua_setglobal(l, "DKIM_SIGERROR_KEYREVOKED");
 	lua_pushnumber(l, DKIM_SIGERROR_KEYDECODE);
 	lua_setglobal(l, "DKIM_SIGERROR_KEYDECODE");
+}
+
+/*
+**  DKIMF_LUA_STATS_HOOK -- hook to Lua for recording statistics after
+**                          verifying has been done
+**
+**  Parameters:
+**  	ctx -- session context, for making calls back to opendkim.c
+**  	script -- script to run
+**  	scriptlen -- length of script; if 0, use strlen()
+**  	name -- name of the script (for logging)
+**  	lres -- Lua result structure
+**  	keep -- where to save the script (or NULL)
+**  	funclen -- size of the saved object
+**
+**  Return value:
+**  	2 -- processing error
+**  	1 -- script contains a syntax error
+**  	0 -- success
+**  	-1 -- memory allocation failure
+**
+**  Notes:
+**  	Called by mlfi_eom() so it can pass extra statistical parameters
+**  	to the stats recording module.
+*/
+
+int
+dkimf_lua_stats_hook(void *ctx, const char *script, size_t scriptlen,
+                     const char *name, struct dkimf_lua_script_result *lres,
+                     void **keep, size_t *funclen)
+{
+	int status;
+	lua_State *l = NULL;
+	struct dkimf_lua_io io;
+	struct dkimf_lua_gc gc;
+
+	assert(script != NULL);
+	assert(lres != NULL);
+
+	io.lua_io_done = FALSE;
+	io.lua_io_script = script;
+	if (scriptlen == 0)
+		io.lua_io_len = strlen(script);
+	else
+		io.lua_io_len = scriptlen;
+
+	gc.gc_head = NULL;
+	gc.gc_tail = NULL;
+
+	l = lua_newstate(dkimf_lua_alloc, NULL);
+	if (l == NULL)
+		return -1;
+
+	luaL_openlibs(l);
+
+	dkimf_lua_stats_init(l);
+
+	/* garbage collection handle */
+	lua_pushlightuserdata(l, &gc);
+	lua_setglobal(l, DKIMF_GC);
 
 	/* milter context */
 	lua_pushlightuserdata(l, ctx);
@@ -963,57 +1378,23 @@ dkimf_lua_stats_hook(void *ctx, const char *script, size_t scriptlen,
 # endif /* _FFR_STATSEXT */
 
 /*
-**  DKIMF_LUA_FINAL_HOOK -- hook to Lua for handling a message after all
-**                          signing and verifying has been done
+**  DKIMF_LUA_FINAL_INIT -- prepare a Lua state for the final script
 **
 **  Parameters:
-**  	ctx -- session context, for making calls back to opendkim.c
-**  	script -- script to run
-**  	scriptlen -- length of script; if 0, use strlen()
-**  	name -- name of the script (for logging)
-**  	lres -- Lua result structure
-**  	keep -- where to save the script (or NULL)
-**  	funclen -- size of the saved object
+**  	l -- Lua state
 **
 **  Return value:
-**  	2 -- processing error
-**  	1 -- script contains a syntax error
-**  	0 -- success
-**  	-1 -- memory allocation failure
+**  	None.
 **
 **  Notes:
-**  	Called by mlfi_eom() so it can decide whether or not the message
-**  	is acceptable.
+**  	Registers the library and constants available to the script;
+**  	nothing done here depends on the message being processed.
 */
 
-int
-dkimf_lua_final_hook(void *ctx, const char *script, size_t scriptlen,
-                     const char *name, struct dkimf_lua_script_result *lres,
-                     void **keep, size_t *funclen)
+static void
+dkimf_lua_final_init(lua_State *l)
 {
-	int status;
-	lua_State *l = NULL;
-	struct dkimf_lua_io io;
-	struct dkimf_lua_gc gc;
-
-	assert(script != NULL);
-	assert(lres != NULL);
-
-	io.lua_io_done = FALSE;
-	io.lua_io_script = script;
-	if (scriptlen == 0)
-		io.lua_io_len = strlen(script);
-	else
-		io.lua_io_len = scriptlen;
-
-	gc.gc_head = NULL;
-	gc.gc_tail = NULL;
-
-	l = lua_newstate(dkimf_lua_alloc, NULL);
-	if (l == NULL)
-		return -1;
-
-	luaL_openlibs(l);
+	assert(l != NULL);
 
 	/*
 	**  Register functions.
@@ -1031,10 +1412,6 @@ dkimf_lua_final_hook(void *ctx, const char *script, size_t scriptlen,
 	**  Register constants.
 	*/
 
-	/* garbage collection handle */
-	lua_pushlightuserdata(l, &gc);
-	lua_setglobal(l, DKIMF_GC);
-
 	/* milter result codes */
 	lua_pushnumber(l, SMFIS_TEMPFAIL);
 	lua_setglobal(l, "SMFIS_TEMPFAIL");
@@ -1140,6 +1517,66 @@ dkimf_lua_final_hook(void *ctx, const char *script, size_t scriptlen,
 	lua_setglobal(l, "DKIM_SIGERROR_KEYREVOKED");
 	lua_pushnumber(l, DKIM_SIGERROR_KEYDECODE);
 	lua_setglobal(l, "DKIM_SIGERROR_KEYDECODE");
+}
+
+/*
+**  DKIMF_LUA_FINAL_HOOK -- hook to Lua for handling a message after all
+**                          signing and verifying has been done
+**
+**  Parameters:
+**  	ctx -- session context, for making calls back to opendkim.c
+**  	script -- script to run
+**  	scriptlen -- length of script; if 0, use strlen()
+**  	name -- name of the script (for logging)
+**  	lres -- Lua result structure
+**  	keep -- where to save the script (or NULL)
+**  	funclen -- size of the saved object
+**
+**  Return value:
+**  	2 -- processing error
+**  	1 -- script contains a syntax error
+**  	0 -- success
+**  	-1 -- memory allocation failure
+**
+**  Notes:
+**  	Called by mlfi_eom() so it can decide whether or not the message
+**  	is acceptable.
+*/
+
+int
+dkimf_lua_final_hook(void *ctx, const char *script, size_t scriptlen,
+                     const char *name, struct dkimf_lua_script_result *lres,
+                     void **keep, size_t *funclen)
+{
+	int status;
+	lua_State *l = NULL;
+	struct dkimf_lua_io io;
+	struct dkimf_lua_gc gc;
+
+	assert(script != NULL);
+	assert(lres != NULL);
+
+	io.lua_io_done = FALSE;
+	io.lua_io_script = script;
+	if (scriptlen == 0)
+		io.lua_io_len = strlen(script);
+	else
+		io.lua_io_len = scriptlen;
+
+	gc.gc_head = NULL;
+	gc.gc_tail = NULL;
+
+	l = lua_newstate(dkimf_lua_alloc, NULL);
+	if (l == NULL)
+		return -1;
+
+	luaL_openlibs(l);
+
+	dkimf_lua_final_init(l);
+
+	/* garbage collection handle */
+	lua_pushlightuserdata(l, &gc);
+	lua_setglobal(l, DKIMF_GC);
 
 	/* milter context */
 	lua_pushlightuserdata(l, ctx);
@@ -1197,6 +1634,174 @@ dkimf_lua_final_hook(void *ctx, const char *script, size_t scriptlen,
 
 	return (status == 0 ? 0 : 2);
 }
+
+# ifdef _FFR_LUA_STATE_POOLS
+/*
+**  DKIMF_LUA_HOOK_POOL_NEW -- create a pool of Lua states for a policy
+**                             script
+**
+**  Parameters:
+**  	hook -- DKIMF_LUA_HOOK_* constant naming the script's hook
+**  	script -- compiled script (as saved by the hook); the caller must
+**  	          keep it around until the pool is freed
+**  	scriptlen -- length of the script
+**  	name -- name of the script (for error reporting)
+**  	max -- most idle states to keep
+**  	recycle -- number of calls after which a state is replaced
+**  	           (0 == never)
+**
+**  Return value:
+**  	A new pool, or NULL on error.
+*/
+
+struct dkimf_lua_pool *
+dkimf_lua_hook_pool_new(int hook, const char *script, size_t scriptlen,
+                        const char *name, u_int max, u_int recycle)
+{
+	struct dkimf_lua_pool *pool;
+
+	pool = dkimf_lua_pool_new(script, scriptlen, name, max, recycle);
+	if (pool == NULL)
+		return NULL;
+
+	switch (hook)
+	{
+	  case DKIMF_LUA_HOOK_SETUP:
+		pool->lp_init = dkimf_lua_setup_init;
+		break;
+
+	  case DKIMF_LUA_HOOK_SCREEN:
+		pool->lp_init = dkimf_lua_screen_init;
+		break;
+
+#  ifdef _FFR_STATSEXT
+	  case DKIMF_LUA_HOOK_STATS:
+		pool->lp_init = dkimf_lua_stats_init;
+		break;
+#  endif /* _FFR_STATSEXT */
+
+	  case DKIMF_LUA_HOOK_FINAL:
+		pool->lp_init = dkimf_lua_final_init;
+		break;
+
+	  default:
+		assert(0);
+	}
+
+	return pool;
+}
+
+/*
+**  DKIMF_LUA_NEWENV -- give a compiled chunk a fresh global environment
+**
+**  Parameters:
+**  	l -- Lua state, with the chunk on top of the stack
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	The new environment is an empty table that falls back to the
+**  	state's real globals for reading, so the script sees the libraries,
+**  	"ctx" and exported globals as usual, but anything it assigns to a
+**  	global lands in the new table and is gone by the next call.
+*/
+
+static void
+dkimf_lua_newenv(lua_State *l)
+{
+	lua_newtable(l);
+	lua_newtable(l);
+#  if LUA_VERSION_NUM == 502
+	lua_rawgeti(l, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+#  else /* LUA_VERSION_NUM == 502 */
+	lua_pushvalue(l, LUA_GLOBALSINDEX);
+#  endif /* LUA_VERSION_NUM == 502 */
+	lua_setfield(l, -2, "__index");
+	lua_setmetatable(l, -2);
+
+	/* the main chunk's only upvalue is _ENV */
+#  if LUA_VERSION_NUM == 502
+	(void) lua_setupvalue(l, -2, 1);
+#  else /* LUA_VERSION_NUM == 502 */
+	(void) lua_setfenv(l, -2);
+#  endif /* LUA_VERSION_NUM == 502 */
+}
+
+/*
+**  DKIMF_LUA_HOOK_POOL -- run a policy script in a pooled Lua state
+**
+**  Parameters:
+**  	pool -- pool of states for the script
+**  	ctx -- session context, for making calls back to opendkim.c
+**  	lres -- Lua result structure
+**
+**  Return value:
+**  	As for the hook that compiled the script.
+**
+**  Notes:
+**  	The state already has the hook's library, constants and compiled
+**  	script.  Only the context, the garbage collection handle and the
+**  	globals exported for this message are set before the call, and
+**  	they are cleared again afterward.  The script runs with a fresh
+**  	environment each time, so globals it sets (which may refer to
+**  	objects freed at the end of the message) don't survive into the
+**  	next message handled by the same state.
+*/
+
+int
+dkimf_lua_hook_pool(struct dkimf_lua_pool *pool, void *ctx,
+                    struct dkimf_lua_script_result *lres)
+{
+	int status;
+	lua_State *l;
+	struct dkimf_lua_state *ls;
+	struct dkimf_lua_gc gc;
+
+	assert(pool != NULL);
+	assert(lres != NULL);
+
+	ls = dkimf_lua_pool_get(pool, lres, &status);
+	if (ls == NULL)
+		return status;
+
+	l = ls->ls_state;
+
+	gc.gc_head = NULL;
+	gc.gc_tail = NULL;
+
+	/* garbage collection handle */
+	lua_pushlightuserdata(l, &gc);
+	lua_setglobal(l, DKIMF_GC);
+
+	/* milter context */
+	lua_pushlightuserdata(l, ctx);
+	lua_setglobal(l, "ctx");
+
+	/* import other globals */
+	dkimf_import_globals(ctx, l);
+
+	lua_rawgeti(l, LUA_REGISTRYINDEX, ls->ls_func);
+	dkimf_lua_newenv(l);
+
+	status = lua_pcall(l, 0, LUA_MULTRET, 0);
+	if (lua_isstring(l, 1))
+		lres->lrs_error = strdup(lua_tostring(l, 1));
+
+	dkimf_lua_gc_cleanup(&gc);
+
+	/* nothing from this message may leak into the next one */
+	lua_pushnil(l);
+	lua_setglobal(l, DKIMF_GC);
+	lua_pushnil(l);
+	lua_setglobal(l, "ctx");
+	dkimf_clear_globals(ctx, l);
+
+	dkimf_lua_pool_put(pool, ls, status == LUA_ERRMEM);
+
+	return (status == 0 ? 0 : 2);
+}
+# endif /* _FFR_LUA_STATE_POOLS */
 #endif /* DKIMF_LUA_CONTEXT_HOOKS */
 
 /*
@@ -1289,33 +1894,64 @@ dkimf_lua_db_hook(const char *script, size_t scriptlen, const char *query,
 	}
 
 	status = lua_pcall(l, 0, LUA_MULTRET, 0);
-	if (status != 0 && lua_isstring(l, 1))
-	{
-		lres->lrs_error = strdup(lua_tostring(l, 1));
-		lres->lrs_rcount = 0;
-	}
-	else if (status == 0)
-	{
-		size_t asz;
+	dkimf_lua_results(l, status, lres);
 
-		lres->lrs_rcount = lua_gettop(l);
+	lua_close(l);
 
-		asz = sizeof(char *) * lres->lrs_rcount;
-		lres->lrs_results = (char **) malloc(asz);
-		if (lres->lrs_results != NULL)
-		{
-			int c;
+	return (status == 0 ? 0 : 2);
+}
 
-			for (c = 0; c < lres->lrs_rcount; c++)
-			{
-				lres->lrs_results[c] = strdup(lua_tostring(l,
-				                                           c + 1));
-			}
-		}
-	}
+#ifdef _FFR_LUA_STATE_POOLS
+/*
+**  DKIMF_LUA_DB_POOL_HOOK -- hook to Lua for handling a DB query, using a
+**                            pooled state
+**
+**  Parameters:
+**  	pool -- pool of states for the script
+**  	query -- query string
+**  	lres -- Lua result structure
+**
+**  Return value:
+**  	As for dkimf_lua_db_hook().
+**
+**  Notes:
+**  	Each state loads the script once; a query only sets "query" and
+**  	calls the compiled chunk.  Other globals the script sets persist
+**  	between queries handled by the same state.
+*/
 
-	lua_close(l);
+int
+dkimf_lua_db_pool_hook(struct dkimf_lua_pool *pool, const char *query,
+                       struct dkimf_lua_script_result *lres)
+{
+	int status;
+	lua_State *l;
+	struct dkimf_lua_state *ls;
+
+	assert(pool != NULL);
+	assert(lres != NULL);
+
+	ls = dkimf_lua_pool_get(pool, lres, &status);
+	if (ls == NULL)
+		return status;
+
+	l = ls->ls_state;
+
+	/* query string */
+	if (query == NULL)
+		lua_pushnil(l);
+	else
+		lua_pushstring(l, query);
+	lua_setglobal(l, "query");
+
+	lua_rawgeti(l, LUA_REGISTRYINDEX, ls->ls_func);
+
+	status = lua_pcall(l, 0, LUA_MULTRET, 0);
+	dkimf_lua_results(l, status, lres);
+
+	dkimf_lua_pool_put(pool, ls, status == LUA_ERRMEM);
 
 	return (status == 0 ? 0 : 2);
 }
+#endif /* _FFR_LUA_STATE_POOLS */
 #endif /* USE_LUA */
@@ -30,14 +30,33 @@ struct dkimf_lua_gc
 	struct dkimf_lua_gc_item *	gc_tail;
 };
 
+#ifdef _FFR_LUA_STATE_POOLS
+struct dkimf_lua_pool;
+#endif /* _FFR_LUA_STATE_POOLS */
+
 /* macros */
 #define	DKIMF_GC		"_DKIMF_GC"
 #define	DKIMF_LUA_GC_DB		1
 
+#ifdef _FFR_LUA_STATE_POOLS
+# define DKIMF_LUA_DEFSTATES	8
+# define DKIMF_LUA_DEFRECYCLE	1000
+
+# define DKIMF_LUA_HOOK_SETUP	1
+# define DKIMF_LUA_HOOK_SCREEN	2
+# define DKIMF_LUA_HOOK_STATS	3
+# define DKIMF_LUA_HOOK_FINAL	4
+#endif /* _FFR_LUA_STATE_POOLS */
+
 /* prototypes */
 extern int dkimf_lua_db_hook __P((const char *, size_t, const char *,
                                   struct dkimf_lua_script_result *,
                                   void **, size_t *));
+#ifdef _FFR_LUA_STATE_POOLS
+extern int dkimf_lua_db_pool_hook __P((struct dkimf_lua_pool *,
+                                       const char *,
+                                       struct dkimf_lua_script_result *));
+#endif /* _FFR_LUA_STATE_POOLS */
 extern int dkimf_lua_final_hook __P((void *, const char *, size_t,
                                      const char *,
                                      struct dkimf_lua_script_result *,
@@ -45,6 +64,20 @@ extern int dkimf_lua_final_hook __P((void *, const char *, size_t,
 extern void dkimf_lua_gc_add __P((struct dkimf_lua_gc *g, void *, int));
 extern void dkimf_lua_gc_cleanup __P((struct dkimf_lua_gc *));
 extern void dkimf_lua_gc_remove __P((struct dkimf_lua_gc *, void *));
+#ifdef _FFR_LUA_STATE_POOLS
+extern int dkimf_lua_hook_pool __P((struct dkimf_lua_pool *, void *,
+                                    struct dkimf_lua_script_result *));
+extern struct dkimf_lua_pool *dkimf_lua_hook_pool_new __P((int, const char *,
+                                                           size_t,
+                                                           const char *,
+                                                           u_int, u_int));
+#endif /* _FFR_LUA_STATE_POOLS */
+#ifdef _FFR_LUA_STATE_POOLS
+extern void dkimf_lua_pool_free __P((struct dkimf_lua_pool *));
+extern struct dkimf_lua_pool *dkimf_lua_pool_new __P((const char *, size_t,
+                                                      const char *,
+                                                      u_int, u_int));
+#endif /* _FFR_LUA_STATE_POOLS */
 extern int dkimf_lua_screen_hook __P((void *, const char *, size_t,
                                       const char *,
                                       struct dkimf_lua_script_result *,
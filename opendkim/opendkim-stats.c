@@ -6,6 +6,8 @@
 /* system includes */
 #include <sys/param.h>
 #include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <sysexits.h>
 #include <assert.h>
 #include <unistd.h>
@@ -14,6 +16,7 @@
 #include <stdlib.h>
 #include <time.h>
 #include <errno.h>
+#include <stdint.h>
 
 /* OpenDKIM includes */
 #include "build-config.h"
@@ -50,6 +53,120 @@ usage(void)
 	return EX_USAGE;
 }
 
+/*
+**  READBIN -- read a record from a binary statistics file
+**
+**  Parameters:
+**  	in -- input stream
+**  	buf -- buffer to receive the record in text form
+**  	buflen -- bytes available at "buf"
+**
+**  Return value:
+**  	1 -- record read
+**  	0 -- end of input
+**  	-1 -- corrupt or truncated input
+*/
+
+int
+readbin(FILE *in, char *buf, size_t buflen)
+{
+	int n;
+	size_t used;
+	size_t pos;
+	uint16_t slen;
+	uint32_t len;
+	uint32_t v;
+	char *p;
+	char *cols;
+	u_char rec[MAXLINE];
+
+	if (fread(&len, sizeof len, 1, in) != 1)
+		return (feof(in) && !ferror(in)) ? 0 : -1;
+
+	len = ntohl(len);
+	if (len == 0 || len > sizeof rec ||
+	    fread(rec, 1, len, in) != len)
+		return -1;
+
+	switch (rec[0])
+	{
+	  case 'M':
+		cols = DKIMS_BIN_MCOLS;
+		break;
+
+	  case 'S':
+		cols = DKIMS_BIN_SCOLS;
+		break;
+
+	  case 'X':
+		cols = DKIMS_BIN_XCOLS;
+		break;
+
+	  case 'A':
+		cols = DKIMS_BIN_ACOLS;
+		break;
+
+	  default:
+		cols = "";
+		break;
+	}
+
+	buf[0] = rec[0];
+	used = 1;
+	pos = 1;
+
+	for (p = cols; *p != '\0'; p++)
+	{
+		if (p != cols)
+		{
+			if (used + 1 >= buflen)
+				return -1;
+			buf[used++] = '\t';
+		}
+
+		if (*p == 's')
+		{
+			if (pos + sizeof slen > len)
+				return -1;
+			memcpy(&slen, &rec[pos], sizeof slen);
+			slen = ntohs(slen);
+			pos += sizeof slen;
+
+			if (pos + slen > len || used + slen >= buflen)
+				return -1;
+			memcpy(&buf[used], &rec[pos], slen);
+			pos += slen;
+			used += slen;
+			continue;
+		}
+
+		if (pos + sizeof v > len)
+			return -1;
+		memcpy(&v, &rec[pos], sizeof v);
+		v = ntohl(v);
+		pos += sizeof v;
+
+		if (*p == 'i')
+		{
+			n = snprintf(&buf[used], buflen - used, "%ld",
+			             (long) (int32_t) v);
+		}
+		else
+		{
+			n = snprintf(&buf[used], buflen - used, "%lu",
+			             (unsigned long) v);
+		}
+
+		if (n < 0 || used + n >= buflen)
+			return -1;
+		used += n;
+	}
+
+	buf[used] = '\0';
+
+	return 1;
+}
+
 /*
 **  MAIN -- program mainline
 **
@@ -63,10 +180,12 @@ usage(void)
 int
 main(int argc, char **argv)
 {
+	_Bool binary = FALSE;
 	int c;
 	int n;
 	int m = 0;
 	int s = 0;
+	int a = 0;
 	int ms = 0;
 	int nfields = 0;
 	int line;
@@ -103,9 +222,59 @@ main(int argc, char **argv)
 	memset(buf, '\0', sizeof buf);
 	line = 0;
 
-	/* read lines from stdin */
-	while (fgets(buf, sizeof buf - 1, in) != NULL)
+	/* a binary file starts with its magic string; no text record does */
+	c = getc(in);
+	if (c == DKIMS_BIN_MAGIC[0])
 	{
+		uint32_t inversion;
+
+		buf[0] = c;
+		if (fread(buf + 1, 1, DKIMS_BIN_MAGICLEN - 1,
+		          in) != DKIMS_BIN_MAGICLEN - 1 ||
+		    memcmp(buf, DKIMS_BIN_MAGIC, DKIMS_BIN_MAGICLEN) != 0 ||
+		    fread(&inversion, sizeof inversion, 1, in) != 1)
+		{
+			fprintf(stderr, "%s: unrecognized input format\n",
+			        progname);
+			return EX_DATAERR;
+		}
+
+		if (ntohl(inversion) != DKIMS_BIN_VERSION)
+		{
+			fprintf(stderr, "%s: unknown binary version (%u)\n",
+			        progname, ntohl(inversion));
+			return EX_DATAERR;
+		}
+
+		binary = TRUE;
+	}
+	else if (c != EOF)
+	{
+		ungetc(c, in);
+	}
+
+	/* read lines (or binary records) from the input */
+	for (;;)
+	{
+		if (binary)
+		{
+			n = readbin(in, buf, sizeof buf - 1);
+			if (n == 0)
+				break;
+
+			if (n == -1)
+			{
+				fprintf(stderr,
+				        "%s: corrupt or truncated record after input record %d\n",
+				        progname, line);
+				break;
+			}
+		}
+		else if (fgets(buf, sizeof buf - 1, in) == NULL)
+		{
+			break;
+		}
+
 		line++;
 
 		/* eat the newline */
@@ -353,6 +522,41 @@ main(int argc, char **argv)
 			s++;
 		}
 
+		/* processing section for window summaries */
+		else if (c == 'A')
+		{
+			time_t start;
+
+			if (n != DKIMS_AI_MAX + 1)
+			{
+				fprintf(stderr,
+				        "%s: unexpected summary field count (%d) at input line %d\n",
+				        progname, n, line);
+				continue;
+			}
+
+			if (ms > 0)
+			{
+				fprintf(stdout, "\n");
+				ms = 0;
+			}
+
+			start = (time_t) strtoul(fields[DKIMS_AI_START], NULL, 10);
+
+			fprintf(stdout, "Summary for %s seconds from %s\tat %s\tfrom domain = '%s'\n\t\tmessages: %s\n\t\tsignatures: %s\n\t\tpassed: %s\n\t\tfailed (body changed): %s\n\t\terrors: %s\n",
+			        fields[DKIMS_AI_WINDOW],
+			        ctime(&start),
+			        fields[DKIMS_AI_REPORTER],
+			        fields[DKIMS_AI_FROMDOMAIN],
+			        fields[DKIMS_AI_MESSAGES],
+			        fields[DKIMS_AI_SIGNATURES],
+			        fields[DKIMS_AI_PASS],
+			        fields[DKIMS_AI_FAIL_BODY],
+			        fields[DKIMS_AI_SIGERROR]);
+
+			a++;
+		}
+
 #ifdef _FFR_STATSEXT
 		/* processing section for extension data */
 		else if (c == 'X')
@@ -373,8 +577,8 @@ main(int argc, char **argv)
 
 	if (ferror(in))
 	{
-		fprintf(stderr, "%s: fgets(): %s at input line %d\n", progname,
-		        strerror(errno), line);
+		fprintf(stderr, "%s: %s(): %s at input line %d\n", progname,
+		        binary ? "fread" : "fgets", strerror(errno), line);
 	}
 
 	if (infile != NULL)
@@ -382,6 +586,11 @@ main(int argc, char **argv)
 
 	fprintf(stdout, "%s: %d message%s, %d signature%s processed\n",
 	        progname, m, m == 0 ? "" : "s", s, s == 0 ? "" : "s");
+	if (a > 0)
+	{
+		fprintf(stdout, "%s: %d window summar%s processed\n",
+		        progname, a, a == 1 ? "y" : "ies");
+	}
 
 	return EX_OK;
 }
@@ -17,6 +17,9 @@
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
+#ifdef _FFR_DB_CACHE
+# include <stddef.h>
+#endif /* _FFR_DB_CACHE */
 #ifdef HAVE_ISO_LIMITS_ISO_H
 # include <iso/limits_iso.h>
 #endif /* HAVE_ISO_LIMITS_ISO_H */
@@ -131,6 +134,15 @@
 #ifdef _FFR_STATS
 # include "stats.h"
 #endif /* _FFR_STATS */
+#ifdef _FFR_KEYSTORE
+# include "keystore.h"
+#endif /* _FFR_KEYSTORE */
+#ifdef _FFR_LOG_QUEUE
+# include "logqueue.h"
+#endif /* _FFR_LOG_QUEUE */
+#ifdef _FFR_METRICS
+# include "metrics.h"
+#endif /* _FFR_METRICS */
 #ifdef _FFR_REPUTATION
 # include "reputation.h"
 #endif /* _FFR_REPUTATION */
@@ -202,6 +214,20 @@ struct lua_global
 	struct lua_global * lg_next;
 };
 
+#ifdef _FFR_HANDLE_POOL
+/*
+**  DKIMF_HPOOL -- idle verifying handles, reset and ready for reuse
+*/
+
+struct dkimf_hpool
+{
+	u_int		hp_max;			/* most handles kept */
+	u_int		hp_count;		/* handles kept */
+	pthread_mutex_t	hp_lock;		/* pool lock */
+	DKIM **		hp_handles;		/* handles (a stack) */
+};
+#endif /* _FFR_HANDLE_POOL */
+
 /*
 **  CONFIG -- configuration data
 */
@@ -212,6 +238,15 @@ struct dkimf_config
 #if defined(USE_LDAP) || defined(USE_ODBX)
 	_Bool		conf_softstart;		/* do LDAP/SQL soft starts */
 #endif /* defined(USE_LDAP) || defined(USE_ODBX) */
+#if defined(USE_DB) && defined(_FFR_BDB_SNAPSHOT)
+	_Bool		conf_bdbsnapshot;	/* snapshot read-only BDB sets */
+#endif /* defined(USE_DB) && defined(_FFR_BDB_SNAPSHOT) */
+#ifdef _FFR_DB_AUTORELOAD
+	_Bool		conf_dbautoreload;	/* reload changed file sets */
+#endif /* _FFR_DB_AUTORELOAD */
+#ifdef _FFR_SOCKETDB
+	_Bool		conf_sockdb_pipeline;	/* pipeline socket data sets */
+#endif /* _FFR_SOCKETDB */
 #ifdef _FFR_LUA_ONLY_SIGNING
 	_Bool		conf_luasigning;	/* signing via Lua only */
 #endif /* _FFR_LUA_ONLY_SIGNING */
@@ -247,6 +282,9 @@ struct dkimf_config
 	_Bool		conf_noheaderb;		/* suppress "header.b" */
 	_Bool		conf_singleauthres;	/* single Auth-Results */
 	_Bool		conf_safekeys;		/* check key permissions */
+#ifdef _FFR_KEYSTORE
+	_Bool		conf_keystore;		/* cache key files in memory */
+#endif /* _FFR_KEYSTORE */
 #ifdef _FFR_RESIGN
 	_Bool		conf_resignall;		/* resign unverified mail */
 #endif /* _FFR_RESIGN */
@@ -267,6 +305,14 @@ struct dkimf_config
 	unsigned int	conf_maxhdrsz;		/* max header bytes */
 	unsigned int	conf_maxverify;		/* max sigs to verify */
 	unsigned int	conf_minkeybits;	/* min key size (bits) */
+	unsigned int	conf_arenasz;		/* library arena chunk size */
+#ifdef _FFR_HANDLE_POOL
+	unsigned int	conf_handlepool;	/* idle handles kept */
+	struct dkimf_hpool * conf_hpool;	/* idle verifying handles */
+#endif /* _FFR_HANDLE_POOL */
+#ifdef _FFR_LOG_QUEUE
+	unsigned int	conf_logqueue;		/* log queue size */
+#endif /* _FFR_LOG_QUEUE */
 #ifdef _FFR_REPUTATION
 	unsigned int	conf_repfactor;		/* reputation factor */
 	unsigned int	conf_repminimum;	/* reputation minimum */
@@ -281,6 +327,27 @@ struct dkimf_config
 	unsigned int	conf_flowdatattl;	/* flow data TTL */
 	unsigned int	conf_flowfactor;	/* flow factor */
 #endif /* _FFR_RATE_LIMIT */
+#ifdef _FFR_DB_BREAKER
+	unsigned int	conf_dbbrretry;		/* dataset breaker retry */
+	unsigned int	conf_dbbrslow;		/* dataset breaker slow query */
+	unsigned int	conf_dbbrthreshold;	/* dataset breaker threshold */
+#endif /* _FFR_DB_BREAKER */
+#ifdef _FFR_DB_CACHE
+	unsigned int	conf_dbcachettl;	/* dataset cache TTL */
+	unsigned int	conf_dbcachenegttl;	/* dataset cache neg. TTL */
+	unsigned int	conf_dbcachesize;	/* dataset cache size */
+#endif /* _FFR_DB_CACHE */
+#ifdef _FFR_DB_WRITEBEHIND
+	unsigned int	conf_dbwbinterval;	/* write-behind interval */
+	unsigned int	conf_dbwbsize;		/* write-behind flush size */
+#endif /* _FFR_DB_WRITEBEHIND */
+#ifdef _FFR_SOCKETDB
+	unsigned int	conf_sockdb_conns;	/* socket data set connections */
+#endif /* _FFR_SOCKETDB */
+#if defined(USE_LUA) && defined(_FFR_LUA_STATE_POOLS)
+	unsigned int	conf_lua_states;	/* idle Lua states kept */
+	unsigned int	conf_lua_recycle;	/* calls before Lua state reset */
+#endif /* USE_LUA && _FFR_LUA_STATE_POOLS */
 	int		conf_clockdrift;	/* tolerable clock drift */
 	int		conf_sigmintype;	/* signature minimum type */
 	size_t		conf_sigmin;		/* signature minimum */
@@ -335,20 +402,36 @@ struct dkimf_config
 	_Bool		conf_rmidentityhdr;	/* remove identity header */
 #endif /* _FFR_IDENTITY_HEADER */
 	char *		conf_diagdir;		/* diagnostics directory */
+#ifdef _FFR_LOG_QUEUE
+	char *		conf_logqueuefile;	/* log queue file */
+#endif /* _FFR_LOG_QUEUE */
+#ifdef _FFR_METRICS
+	char *		conf_metricssock;	/* metrics socket */
+#endif /* _FFR_METRICS */
 #ifdef _FFR_STATS
 	char *		conf_statspath;		/* path for stats file */
 	char *		conf_reporthost;	/* reporter name */
 	char *		conf_reportprefix;	/* stats data prefix */
+	int		conf_statsformat;	/* stats file format */
+	u_int		conf_statswindow;	/* stats aggregation window */
 #endif /* _FFR_STATS */
 	char *		conf_reportaddr;	/* report sender address */
 	char *		conf_reportaddrbcc;	/* report repcipient address as bcc */
 	char *		conf_mtacommand;	/* MTA command (reports) */
 	char *		conf_redirect;		/* redirect failures to */
+#ifdef _FFR_DB_SHARED_POOLS
+	char *		conf_pool_size;		/* max. connections per pool */
+	char *		conf_pool_idle;		/* pool connection idle time */
+	char *		conf_pool_backoff;	/* max. reconnect backoff */
+#endif /* _FFR_DB_SHARED_POOLS */
 #ifdef USE_LDAP
 	char *		conf_ldap_timeout;	/* LDAP timeout */
 	char *		conf_ldap_kaidle;	/* LDAP keepalive idle */
 	char *		conf_ldap_kaprobes;	/* LDAP keepalive probes */
 	char *		conf_ldap_kainterval;	/* LDAP keepalive interval */
+# ifdef _FFR_LDAP_ASYNC
+	char *		conf_ldap_connections;	/* LDAP connections per pool */
+# endif /* _FFR_LDAP_ASYNC */
 	char *		conf_ldap_binduser;	/* LDAP bind user */
 	char *          conf_ldap_bindpw;	/* LDAP bind password */
 	char *          conf_ldap_authmech;	/* LDAP auth mechanism */
@@ -369,6 +452,14 @@ struct dkimf_config
 # endif /* _FFR_STATSEXT */
 	char *		conf_finalscript;	/* Lua script: final */
 	void *		conf_finalfunc;		/* Lua function: final */
+# ifdef _FFR_LUA_STATE_POOLS
+	struct dkimf_lua_pool * conf_setuppool;	/* Lua states: setup */
+	struct dkimf_lua_pool * conf_screenpool; /* Lua states: screening */
+#  ifdef _FFR_STATSEXT
+	struct dkimf_lua_pool * conf_statspool;	/* Lua states: stats */
+#  endif /* _FFR_STATSEXT */
+	struct dkimf_lua_pool * conf_finalpool;	/* Lua states: final */
+# endif /* _FFR_LUA_STATE_POOLS */
 #endif /* USE_LUA */
 #ifdef _FFR_REPLACE_RULES
 	char *		conf_rephdrs;		/* replacement headers */
@@ -449,6 +540,36 @@ struct dkimf_config
 	struct handling	conf_handling;		/* message handling */
 };
 
+#if defined(_FFR_DB_CACHE) || defined(_FFR_DB_BREAKER)
+/*
+**  DKIMF_CACHEDB -- data sets to which "DatasetCache" and "DatasetBreaker"
+**                   can apply
+*/
+
+struct dkimf_cachedb
+{
+	const char *	cdb_name;		/* configuration setting */
+	size_t		cdb_offset;		/* DKIMF_DB in dkimf_config */
+};
+
+static struct dkimf_cachedb dkimf_cachedbs[] =
+{
+	{ "BodyLengthDB",	offsetof(struct dkimf_config, conf_bldb) },
+	{ "DontSignMailTo",	offsetof(struct dkimf_config, conf_dontsigntodb) },
+	{ "ExemptDomains",	offsetof(struct dkimf_config, conf_exemptdb) },
+	{ "ExternalIgnoreList",	offsetof(struct dkimf_config, conf_exignore) },
+	{ "InternalHosts",	offsetof(struct dkimf_config, conf_internal) },
+	{ "KeyTable",		offsetof(struct dkimf_config, conf_keytabledb) },
+	{ "MTA",		offsetof(struct dkimf_config, conf_mtasdb) },
+	{ "PeerList",		offsetof(struct dkimf_config, conf_peerdb) },
+	{ "SigningTable",	offsetof(struct dkimf_config, conf_signtabledb) },
+	{ NULL,			0 }
+};
+
+# define DKIMF_CACHEDB(c,x)	(*(DKIMF_DB *) ((char *) (c) + \
+				                dkimf_cachedbs[(x)].cdb_offset))
+#endif /* _FFR_DB_CACHE || _FFR_DB_BREAKER */
+
 /*
 **  MSGCTX -- message context, containing transaction-specific data
 */
@@ -506,6 +627,9 @@ struct msgctx
 #endif /* _FFR_STATSEXT */
 	struct lua_global * mctx_luaglobalh;	/* Lua global list */
 	struct lua_global * mctx_luaglobalt;	/* Lua global list */
+#ifdef _FFR_MSG_ARENA
+	struct dkimf_arena * mctx_arena;	/* per-message allocations */
+#endif /* _FFR_MSG_ARENA */
 #ifdef _FFR_REPUTATION
 # ifdef USE_GNUTLS
 	gnutls_hash_hd_t mctx_hash;			/* hash, for dup detection */
@@ -535,6 +659,9 @@ struct connctx
 	struct sockaddr_storage	cctx_ip;	/* IP info */
 	struct dkimf_config * cctx_config;	/* configuration in use */
 	struct msgctx *	cctx_msg;		/* message context */
+#ifdef _FFR_MSG_ARENA
+	struct dkimf_arena * cctx_arena;	/* reused by each message */
+#endif /* _FFR_MSG_ARENA */
 };
 
 /*
@@ -718,13 +845,16 @@ sfsistat mlfi_negotiate __P((SMFICTX *, unsigned long, unsigned long,
                                         unsigned long *, unsigned long *,
                                         unsigned long *, unsigned long *));
 
-static int dkimf_add_signrequest __P((struct msgctx *, DKIMF_DB,
+static int dkimf_add_signrequest __P((struct msgctx *,
+                                      struct dkimf_config *, DKIMF_DB,
                                       char *, char *, ssize_t));
 sfsistat dkimf_addheader __P((SMFICTX *, char *, char *));
 sfsistat dkimf_addrcpt __P((SMFICTX *, char *));
-static int dkimf_apply_signtable __P((struct msgctx *, DKIMF_DB, DKIMF_DB,
-                                      unsigned char *, unsigned char *, char *,
-                                      size_t, _Bool));
+static int dkimf_apply_signtable __P((struct msgctx *,
+                                      struct dkimf_config *, DKIMF_DB,
+                                      DKIMF_DB, unsigned char *,
+                                      unsigned char *, char *, size_t,
+                                      _Bool));
 sfsistat dkimf_chgheader __P((SMFICTX *, char *, int, char *));
 static void dkimf_cleanup __P((SMFICTX *));
 static void dkimf_config_reload __P((void));
@@ -732,7 +862,10 @@ sfsistat dkimf_delrcpt __P((SMFICTX *, char *));
 static Header dkimf_findheader __P((msgctx, char *, int));
 void *dkimf_getpriv __P((SMFICTX *));
 char *dkimf_getsymval __P((SMFICTX *, char *));
+static DKIM *dkimf_getverify __P((struct dkimf_config *, u_char *,
+                                  DKIM_STAT *));
 sfsistat dkimf_insheader __P((SMFICTX *, int, char *, char *));
+static void dkimf_putverify __P((struct dkimf_config *, DKIM *));
 sfsistat dkimf_quarantine __P((SMFICTX *, char *));
 void dkimf_sendprogress __P((const void *));
 sfsistat dkimf_setpriv __P((SMFICTX *, void *));
@@ -742,6 +875,10 @@ static void dkimf_sigreport __P((connctx, struct dkimf_config *, char *));
 /* GLOBALS */
 _Bool dolog;					/* logging? (exported) */
 _Bool reload;					/* reload requested */
+_Bool reloading;				/* reload in progress */
+#ifdef _FFR_METRICS
+_Bool dumpmetrics;				/* metrics dump requested */
+#endif /* _FFR_METRICS */
 _Bool no_i_whine;				/* noted ${i} is undefined */
 _Bool testmode;					/* test mode */
 _Bool allowdeprecated;				/* allow deprecated config values */
@@ -781,6 +918,23 @@ pthread_mutex_t pwdb_lock;			/* passwd/group lock */
 			} while (0)
 #define	DKIMF_EOHMACROS	"i {daemon_name} {auth_type}"
 
+/*
+**  Things that live exactly as long as a message (header fields,
+**  recipients, signing requests and the like) are allocated with these;
+**  with _FFR_MSG_ARENA they come from the connection's arena, and are all
+**  released at once by dkimf_cleanup() rather than one at a time.
+*/
+
+#ifdef _FFR_MSG_ARENA
+# define MSGALLOC(m,x)	dkimf_arena_alloc((m)->mctx_arena, (x))
+# define MSGSTRDUP(m,x)	dkimf_arena_strdup((m)->mctx_arena, (x))
+# define MSGFREE(m,x)	do { } while (0)
+#else /* _FFR_MSG_ARENA */
+# define MSGALLOC(m,x)	malloc(x)
+# define MSGSTRDUP(m,x)	strdup(x)
+# define MSGFREE(m,x)	TRYFREE(x)
+#endif /* _FFR_MSG_ARENA */
+
 
 
 /*
@@ -1151,6 +1305,45 @@ dkimf_import_globals(void *p, lua_State *l)
 	}
 }
 
+# ifdef _FFR_LUA_STATE_POOLS
+/*
+**  DKIMF_CLEAR_GLOBALS -- remove a message's globals from a Lua state
+**
+**  Parameters:
+**  	ctx -- filter context
+**  	l -- Lua state
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Undoes dkimf_import_globals() (and any odkim.export() calls made
+**  	since) so a pooled state can be used for another message.
+*/
+
+void
+dkimf_clear_globals(void *p, lua_State *l)
+{
+	SMFICTX *ctx;
+	struct connctx *cc;
+	struct msgctx *mctx;
+	struct lua_global *lg;
+
+	if (p == NULL)
+		return;
+
+	ctx = (SMFICTX *) p;
+	cc = (struct connctx *) dkimf_getpriv(ctx);
+	mctx = cc->cctx_msg;
+
+	for (lg = mctx->mctx_luaglobalh; lg != NULL; lg = lg->lg_next)
+	{
+		lua_pushnil(l);
+		lua_setglobal(l, lg->lg_name);
+	}
+}
+# endif /* _FFR_LUA_STATE_POOLS */
+
 /*
 **  DKIMF_XS_SIGNFOR -- sign as if the mail came from a specified user
 **
@@ -1224,7 +1417,7 @@ dkimf_xs_signfor(lua_State *l)
 		lua_error(l);
 	}
 
-	status = dkimf_apply_signtable(msg, conf->conf_keytabledb,
+	status = dkimf_apply_signtable(msg, conf, conf->conf_keytabledb,
 	                               conf->conf_signtabledb,
 	                               user, domain, errkey, sizeof errkey,
 	                               multi);
@@ -1309,13 +1502,13 @@ dkimf_xs_export(lua_State *l)
 		    type != LUA_TSTRING)
 			continue;
 
-		lg = (struct lua_global *) malloc(sizeof *lg);
+		lg = (struct lua_global *) MSGALLOC(msg, sizeof *lg);
 		if (lg != NULL)
 		{
-			lg->lg_name = strdup(lua_tostring(l, c));
+			lg->lg_name = MSGSTRDUP(msg, lua_tostring(l, c));
 			if (lg->lg_name == NULL)
 			{
-				free(lg);
+				MSGFREE(msg, lg);
 				continue;
 			}
 
@@ -1337,7 +1530,7 @@ dkimf_xs_export(lua_State *l)
 				break;
 
 			  case LUA_TNUMBER:
-				lg->lg_value = malloc(sizeof(lua_Number));
+				lg->lg_value = MSGALLOC(msg, sizeof(lua_Number));
 				if (lg->lg_value != NULL)
 				{
 					lua_Number x;
@@ -1355,7 +1548,8 @@ dkimf_xs_export(lua_State *l)
 				break;
 
 			  case LUA_TSTRING:
-				lg->lg_value = strdup(lua_tostring(l, c + 1));
+				lg->lg_value = MSGSTRDUP(msg,
+				                         lua_tostring(l, c + 1));
 				break;
 			}
 		}
@@ -2030,7 +2224,7 @@ dkimf_xs_requestsig(lua_State *l)
 	/* try to get the key */
 	if (keyname != NULL)
 	{
-		switch (dkimf_add_signrequest(dfc, conf->conf_keytabledb,
+		switch (dkimf_add_signrequest(dfc, conf, conf->conf_keytabledb,
 		                              (char *) keyname,
 		                              (char *) ident,
 		                              signlen))
@@ -2070,7 +2264,7 @@ dkimf_xs_requestsig(lua_State *l)
 			return 1;
 		}
 	}
-	else if (dkimf_add_signrequest(dfc, NULL, NULL, (char *) ident,
+	else if (dkimf_add_signrequest(dfc, conf, NULL, NULL, (char *) ident,
 	                               (ssize_t) -1) != 0)
 	{
 		if (conf->conf_dolog)
@@ -2166,7 +2360,7 @@ dkimf_xs_replaceheader(lua_State *l)
 			size_t len;
 
 			len = strlen(newval);
-			tmp = malloc(len + 2);
+			tmp = MSGALLOC(dfc, len + 2);
 			if (tmp == NULL)
 			{
 				lua_pushnil(l);
@@ -2178,7 +2372,7 @@ dkimf_xs_replaceheader(lua_State *l)
 		}
 		else
 		{
-			tmp = strdup(newval);
+			tmp = MSGSTRDUP(dfc, newval);
 			if (tmp == NULL)
 			{
 				lua_pushnil(l);
@@ -2186,7 +2380,7 @@ dkimf_xs_replaceheader(lua_State *l)
 			}
 		}
 
-		free(hdr->hdr_val);
+		MSGFREE(dfc, hdr->hdr_val);
 		hdr->hdr_val = tmp;
 
 		return 0;
@@ -2998,9 +3192,9 @@ dkimf_xs_verify(lua_State *l)
 		{
 			DKIM_STAT status;
 
-			dfc->mctx_dkimv = dkim_verify(conf->conf_libopendkim,
-			                              dfc->mctx_jobid, NULL,
-			                              &status);
+			dfc->mctx_dkimv = dkimf_getverify(conf,
+			                                  dfc->mctx_jobid,
+			                                  &status);
 
 			if (dfc->mctx_dkimv == NULL)
 			{
@@ -4131,7 +4325,7 @@ dkimf_xs_statsext(lua_State *l)
 		cc = (struct connctx *) dkimf_getpriv(ctx);
 		dfc = cc->cctx_msg;
 
-		se = (struct statsext *) malloc(sizeof(struct statsext));
+		se = (struct statsext *) MSGALLOC(dfc, sizeof(struct statsext));
 		if (se == NULL)
 		{
 			lua_pushfstring(l, "odkim.stats(): malloc(): %s",
@@ -4829,6 +5023,7 @@ dkimf_securefile(const char *path, ino_t *ino, uid_t myuid, char *err,
 **  DKIMF_LOADKEY -- resolve a key
 **
 **  Parameters:
+**  	conf -- configuration in use by the message
 **  	buf -- key buffer
 **  	buflen -- pointer to key buffer's length (updated)
 **  	insecure -- key is insecure (returned)
@@ -4841,14 +5036,20 @@ dkimf_securefile(const char *path, ino_t *ino, uid_t myuid, char *err,
 **  Notes:
 **  	The caller might pass a key or a filename in "buf".  If we think it's a
 **  	filename, replace the contents of "buf" with what we find in that file.
+**
+**  	If KeyStore is enabled, file contents and the dkimf_securefile()
+**  	verdict are taken from the in-memory key store when it holds a
+**  	current copy, and added to it after a successful read.
+**  	With LogWhy set, each time a key file is actually read is logged.
 */
 
 static _Bool
-dkimf_loadkey(char *buf, size_t *buflen, _Bool *insecure, char *error,
-              size_t errlen)
+dkimf_loadkey(struct dkimf_config *conf, char *buf, size_t *buflen,
+              _Bool *insecure, char *error, size_t errlen)
 {
 	ino_t ino;
 
+	assert(conf != NULL);
 	assert(buf != NULL);
 	assert(buflen != NULL);
 
@@ -4859,6 +5060,22 @@ dkimf_loadkey(char *buf, size_t *buflen, _Bool *insecure, char *error,
 		int status;
 		ssize_t rlen;
 		struct stat s;
+#ifdef _FFR_KEYSTORE
+		_Bool cache;
+		time_t checked;
+		char path[MAXPATHLEN + 1];
+
+		cache = conf->conf_keystore;
+		if (cache)
+		{
+			if (dkimf_keystore_get(buf, buf, buflen, insecure,
+			                       error, errlen))
+				return TRUE;
+
+			strlcpy(path, buf, sizeof path);
+			checked = time(NULL);
+		}
+#endif /* _FFR_KEYSTORE */
 
 		fd = open(buf, O_RDONLY);
 		if (fd < 0)
@@ -4868,6 +5085,9 @@ dkimf_loadkey(char *buf, size_t *buflen, _Bool *insecure, char *error,
 			return FALSE;
 		}
 
+		if (conf->conf_dolog && conf->conf_logwhy)
+			syslog(LOG_DEBUG, "reading key from %s", buf);
+
 		status = fstat(fd, &s);
 		if (status != 0 || !S_ISREG(s.st_mode))
 		{
@@ -4900,6 +5120,14 @@ dkimf_loadkey(char *buf, size_t *buflen, _Bool *insecure, char *error,
 
 		if (rlen < *buflen)
 			return FALSE;
+
+#ifdef _FFR_KEYSTORE
+		if (cache && rlen == s.st_size)
+		{
+			dkimf_keystore_put(path, &s, buf, rlen, *insecure,
+			                   *insecure ? error : NULL, checked);
+		}
+#endif /* _FFR_KEYSTORE */
 	}
 
 	return TRUE;
@@ -4910,6 +5138,7 @@ dkimf_loadkey(char *buf, size_t *buflen, _Bool *insecure, char *error,
 **
 **  Parameters:
 **  	dfc -- message context
+**  	conf -- configuration in use by the message
 **  	keytable -- table from which to get key
 **  	keyname -- name of private key to use
 **  	signer -- signer identity to use
@@ -4924,8 +5153,9 @@ dkimf_loadkey(char *buf, size_t *buflen, _Bool *insecure, char *error,
 */
 
 static int
-dkimf_add_signrequest(struct msgctx *dfc, DKIMF_DB keytable, char *keyname,
-                      char *signer, ssize_t signlen)
+dkimf_add_signrequest(struct msgctx *dfc, struct dkimf_config *conf,
+                      DKIMF_DB keytable, char *keyname, char *signer,
+                      ssize_t signlen)
 {
 	_Bool found = FALSE;
 	size_t keydatasz = 0;
@@ -4937,6 +5167,7 @@ dkimf_add_signrequest(struct msgctx *dfc, DKIMF_DB keytable, char *keyname,
 	char err[BUFRSZ + 1];
 
 	assert(dfc != NULL);
+	assert(conf != NULL);
 
 	/*
 	**  Error out if we want the default key but the key or selector were
@@ -4945,8 +5176,8 @@ dkimf_add_signrequest(struct msgctx *dfc, DKIMF_DB keytable, char *keyname,
 
 	if (keyname == NULL)
 	{
-		if (curconf->conf_seckey == NULL ||
-		    curconf->conf_selector == NULL)
+		if (conf->conf_seckey == NULL ||
+		    conf->conf_selector == NULL)
 			return 1;
 	}
 
@@ -5047,7 +5278,7 @@ dkimf_add_signrequest(struct msgctx *dfc, DKIMF_DB keytable, char *keyname,
 
 		keydatasz = sizeof keydata - 1;
 		insecure = FALSE;
-		if (!dkimf_loadkey(dbd[2].dbdata_buffer, &keydatasz,
+		if (!dkimf_loadkey(conf, dbd[2].dbdata_buffer, &keydatasz,
 		                   &insecure, err, sizeof err))
 		{
 			if (dolog)
@@ -5065,19 +5296,19 @@ dkimf_add_signrequest(struct msgctx *dfc, DKIMF_DB keytable, char *keyname,
 			{
 				int sev;
 
-				sev = (curconf->conf_safekeys ? LOG_ERR
+				sev = (conf->conf_safekeys ? LOG_ERR
 				                              : LOG_WARNING);
 
 				syslog(sev, "%s: key data is not secure: %s",
 				       keyname, err);
 			}
 
- 			if (curconf->conf_safekeys)
+ 			if (conf->conf_safekeys)
 				return 2;
 		}
 	}
 
-	new = malloc(sizeof *new);
+	new = MSGALLOC(dfc, sizeof *new);
 	if (new == NULL)
 		return -1;
 
@@ -5088,22 +5319,22 @@ dkimf_add_signrequest(struct msgctx *dfc, DKIMF_DB keytable, char *keyname,
 	new->srq_keydata = NULL;
 	new->srq_signlen = signlen;
 	if (signer != NULL && signer[0] != '\0')
-		new->srq_signer = (u_char *) strdup(signer);
+		new->srq_signer = (u_char *) MSGSTRDUP(dfc, signer);
 	else
 		new->srq_signer = NULL;
 
 	if (keytable != NULL)
 	{
 		if (domain[0] == '%' && domain[1] == '\0')
-			new->srq_domain = (u_char *) strdup((char *) dfc->mctx_domain);
+			new->srq_domain = (u_char *) MSGSTRDUP(dfc, (char *) dfc->mctx_domain);
 		else
-			new->srq_domain = (u_char *) strdup((char *) domain);
+			new->srq_domain = (u_char *) MSGSTRDUP(dfc, (char *) domain);
 
-		new->srq_selector = (u_char *) strdup((char *) selector);
+		new->srq_selector = (u_char *) MSGSTRDUP(dfc, (char *) selector);
 		new->srq_keydata = (void *) malloc(keydatasz + 1);
 		if (new->srq_keydata == NULL)
 		{
-			free(new);
+			MSGFREE(dfc, new);
 			return -1;
 		}
 		memset(new->srq_keydata, '\0', keydatasz + 1);
@@ -5129,6 +5360,8 @@ dkimf_add_signrequest(struct msgctx *dfc, DKIMF_DB keytable, char *keyname,
 **  	last -- last handle processed (returned on error)
 **  	header -- header field name and value
 **  	headerlen -- number of bytes at "header"
+**  	ref -- if TRUE, "header" outlives the handles and can be shared
+**  	       with them rather than copied
 **
 **  Return value:
 **  	A DKIM_STAT_* constant, either DKIM_STAT_OK if all of them passed
@@ -5137,7 +5370,7 @@ dkimf_add_signrequest(struct msgctx *dfc, DKIMF_DB keytable, char *keyname,
 
 static DKIM_STAT
 dkimf_msr_header(struct signreq *sr, DKIM **last, u_char *header,
-                 size_t headerlen)
+                 size_t headerlen, _Bool ref)
 {
 	DKIM_STAT status;
 
@@ -5146,7 +5379,10 @@ dkimf_msr_header(struct signreq *sr, DKIM **last, u_char *header,
 
 	while (sr != NULL)
 	{
-		status = dkim_header(sr->srq_dkim, header, headerlen);
+		if (ref)
+			status = dkim_header_ref(sr->srq_dkim, header, headerlen);
+		else
+			status = dkim_header(sr->srq_dkim, header, headerlen);
 		if (status != DKIM_STAT_OK)
 		{
 			if (last != NULL)
@@ -5712,6 +5948,12 @@ dkimf_sighandler(int sig)
 		if (conffile != NULL)
 			reload = TRUE;
 	}
+#ifdef _FFR_METRICS
+	else if (sig == SIGUSR2 && !die)
+	{
+		dumpmetrics = TRUE;
+	}
+#endif /* _FFR_METRICS */
 }
 
 /*
@@ -5734,13 +5976,34 @@ dkimf_reloader(/* UNUSED */ void *vp)
 
 	sigemptyset(&mask);
 	sigaddset(&mask, SIGUSR1);
+#ifdef _FFR_METRICS
+	sigaddset(&mask, SIGUSR2);
+#endif /* _FFR_METRICS */
 
 	while (!die)
 	{
 		(void) sigwait(&mask, &sig);
 
+#ifdef _FFR_METRICS
+		if (sig == SIGUSR2)
+		{
+			dkimf_metrics_dump();
+			continue;
+		}
+#endif /* _FFR_METRICS */
+
 		if (conffile != NULL)
 			reload = TRUE;
+
+#ifdef _FFR_STATS
+		/* let the statistics file be rotated */
+		dkimf_stats_reopen();
+#endif /* _FFR_STATS */
+
+#ifdef _FFR_LOG_QUEUE
+		/* and the log file */
+		dkimf_logq_reopen();
+#endif /* _FFR_LOG_QUEUE */
 	}
 
 	return NULL;
@@ -5873,6 +6136,26 @@ dkimf_config_new(void)
 	new->conf_flowdatattl = DEFFLOWDATATTL;
 	new->conf_flowfactor = 1;
 #endif /* _FFR_RATE_LIMIT */
+#ifdef _FFR_DB_BREAKER
+	new->conf_dbbrretry = DEFDBBRRETRY;
+	new->conf_dbbrslow = DEFDBBRSLOW;
+	new->conf_dbbrthreshold = DEFDBBRTHRESHOLD;
+#endif /* _FFR_DB_BREAKER */
+#ifdef _FFR_DB_CACHE
+	new->conf_dbcachettl = DEFDBCACHETTL;
+	new->conf_dbcachenegttl = DEFDBCACHENEGTTL;
+	new->conf_dbcachesize = DEFDBCACHESIZE;
+#endif /* _FFR_DB_CACHE */
+#ifdef _FFR_DB_WRITEBEHIND
+	new->conf_dbwbsize = DEFDBWBSIZE;
+#endif /* _FFR_DB_WRITEBEHIND */
+#ifdef _FFR_HANDLE_POOL
+	new->conf_handlepool = DEFHANDLEPOOL;
+#endif /* _FFR_HANDLE_POOL */
+#if defined(USE_LUA) && defined(_FFR_LUA_STATE_POOLS)
+	new->conf_lua_states = DKIMF_LUA_DEFSTATES;
+	new->conf_lua_recycle = DKIMF_LUA_DEFRECYCLE;
+#endif /* USE_LUA && _FFR_LUA_STATE_POOLS */
 	new->conf_mtacommand = SENDMAIL_PATH;
 #ifdef _FFR_ATPS
 	new->conf_atpshash = dkimf_atpshash[0].str;
@@ -5902,6 +6185,88 @@ dkimf_config_free(struct dkimf_config *conf)
 
 	dkimf_zapkey(conf);
 
+#ifdef _FFR_DB_CACHE
+	if (conf->conf_dolog)
+	{
+		int c;
+		unsigned long hits;
+		unsigned long misses;
+
+		for (c = 0; dkimf_cachedbs[c].cdb_name != NULL; c++)
+		{
+			if (DKIMF_CACHEDB(conf, c) != NULL &&
+			    dkimf_db_cache_stats(DKIMF_CACHEDB(conf, c),
+			                         &hits, &misses))
+			{
+				syslog(LOG_INFO,
+				       "%s: dataset cache: %lu hit(s), "
+				       "%lu miss(es)",
+				       dkimf_cachedbs[c].cdb_name,
+				       hits, misses);
+			}
+		}
+	}
+#endif /* _FFR_DB_CACHE */
+
+#ifdef _FFR_DB_BREAKER
+	if (conf->conf_dolog)
+	{
+		int c;
+		struct dkimf_db_brstats brs;
+
+		for (c = 0; dkimf_cachedbs[c].cdb_name != NULL; c++)
+		{
+			if (DKIMF_CACHEDB(conf, c) != NULL &&
+			    dkimf_db_breaker_stats(DKIMF_CACHEDB(conf, c), &brs))
+			{
+				syslog(LOG_INFO,
+				       "%s: %lu lookup(s), %lu failed, "
+				       "%lu slow, average %lums, "
+				       "maximum %lums, %lu trip(s), "
+				       "%lu refused",
+				       dkimf_cachedbs[c].cdb_name,
+				       brs.brs_queries, brs.brs_errors,
+				       brs.brs_slow, brs.brs_avglatency,
+				       brs.brs_maxlatency, brs.brs_trips,
+				       brs.brs_refused);
+			}
+		}
+	}
+#endif /* _FFR_DB_BREAKER */
+
+#if defined(_FFR_DB_WRITEBEHIND) && defined(_FFR_RATE_LIMIT)
+	if (conf->conf_dolog && conf->conf_flowdatadb != NULL)
+	{
+		unsigned long writes;
+		unsigned long flushed;
+		unsigned long errors;
+
+		if (dkimf_db_wb_stats(conf->conf_flowdatadb, &writes,
+		                      &flushed, &errors))
+		{
+			syslog(LOG_INFO,
+			       "FlowData: %lu write(s), %lu flushed, "
+			       "%lu error(s)",
+			       writes, flushed, errors);
+		}
+	}
+#endif /* _FFR_DB_WRITEBEHIND && _FFR_RATE_LIMIT */
+
+#ifdef _FFR_HANDLE_POOL
+	/* pooled handles belong to the library, so they go first */
+	if (conf->conf_hpool != NULL)
+	{
+		u_int c;
+
+		for (c = 0; c < conf->conf_hpool->hp_count; c++)
+			dkim_free(conf->conf_hpool->hp_handles[c]);
+
+		pthread_mutex_destroy(&conf->conf_hpool->hp_lock);
+		free(conf->conf_hpool->hp_handles);
+		free(conf->conf_hpool);
+	}
+#endif /* _FFR_HANDLE_POOL */
+
 	if (conf->conf_libopendkim != NULL)
 		dkim_close(conf->conf_libopendkim);
 
@@ -6035,6 +6400,18 @@ dkimf_config_free(struct dkimf_config *conf)
 		free(conf->conf_finalscript);
 	if (conf->conf_finalfunc != NULL)
 		free(conf->conf_finalfunc);
+# ifdef _FFR_LUA_STATE_POOLS
+	if (conf->conf_setuppool != NULL)
+		dkimf_lua_pool_free(conf->conf_setuppool);
+	if (conf->conf_screenpool != NULL)
+		dkimf_lua_pool_free(conf->conf_screenpool);
+#  ifdef _FFR_STATSEXT
+	if (conf->conf_statspool != NULL)
+		dkimf_lua_pool_free(conf->conf_statspool);
+#  endif /* _FFR_STATSEXT */
+	if (conf->conf_finalpool != NULL)
+		dkimf_lua_pool_free(conf->conf_finalpool);
+# endif /* _FFR_LUA_STATE_POOLS */
 #endif /* USE_LUA */
 
 	if (conf->conf_keytabledb != NULL)
@@ -6143,6 +6520,55 @@ dkimf_parsehandler(struct config *cfg, char *name, struct handling *hndl,
 	}
 }
 
+#if defined(USE_LUA) && defined(_FFR_LUA_STATE_POOLS)
+/*
+**  DKIMF_CONFIG_LUAPOOL -- create a pool of Lua states for a policy script
+**
+**  Parameters:
+**  	conf -- configuration handle
+**  	hook -- DKIMF_LUA_HOOK_* constant
+**  	func -- compiled script
+**  	funcsz -- size of the compiled script
+**  	name -- name of the script
+**  	pool -- pool (returned); left NULL if pooling is disabled
+**  	err -- where to write errors
+**  	errlen -- bytes available at "err"
+**
+**  Return value:
+**  	0 -- success
+**  	-1 -- error
+*/
+
+static int
+dkimf_config_luapool(struct dkimf_config *conf, int hook, void *func,
+                     size_t funcsz, char *name, struct dkimf_lua_pool **pool,
+                     char *err, size_t errlen)
+{
+	u_int max;
+	u_int recycle;
+
+	assert(conf != NULL);
+	assert(pool != NULL);
+
+	max = conf->conf_lua_states;
+	recycle = conf->conf_lua_recycle;
+
+	if (func == NULL || max == 0)
+		return 0;
+
+	*pool = dkimf_lua_hook_pool_new(hook, func, funcsz, name, max,
+	                                recycle);
+	if (*pool == NULL)
+	{
+		snprintf(err, errlen, "%s: can't create Lua state pool: %s",
+		         name, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+#endif /* USE_LUA && _FFR_LUA_STATE_POOLS */
+
 /*
 **  DKIMF_CONFIG_LOAD -- load a configuration handle based on file content
 **
@@ -6190,6 +6616,18 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 		                  sizeof conf->conf_softstart);
 #endif /* USE_LDAP */
 
+#if defined(USE_DB) && defined(_FFR_BDB_SNAPSHOT)
+		(void) config_get(data, "BerkeleyDBSnapshots",
+		                  &conf->conf_bdbsnapshot,
+		                  sizeof conf->conf_bdbsnapshot);
+#endif /* defined(USE_DB) && defined(_FFR_BDB_SNAPSHOT) */
+
+#ifdef _FFR_DB_AUTORELOAD
+		(void) config_get(data, "DatasetAutoReload",
+		                  &conf->conf_dbautoreload,
+		                  sizeof conf->conf_dbautoreload);
+#endif /* _FFR_DB_AUTORELOAD */
+
 		(void) config_get(data, "DNSConnect",
 		                  &conf->conf_dnsconnect,
 		                  sizeof conf->conf_dnsconnect);
@@ -6276,6 +6714,16 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 		                  &conf->conf_minkeybits,
 		                  sizeof conf->conf_minkeybits);
 
+		(void) config_get(data, "LibraryArenaSize",
+		                  &conf->conf_arenasz,
+		                  sizeof conf->conf_arenasz);
+
+#ifdef _FFR_HANDLE_POOL
+		(void) config_get(data, "HandlePoolSize",
+		                  &conf->conf_handlepool,
+		                  sizeof conf->conf_handlepool);
+#endif /* _FFR_HANDLE_POOL */
+
 		(void) config_get(data, "RequestReports",
 		                  &conf->conf_reqreports,
 		                  sizeof conf->conf_reqreports);
@@ -6325,6 +6773,22 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 		                  sizeof conf->conf_rmidentityhdr);
 #endif /* _FFR_IDENTITY_HEADER */
 
+#ifdef _FFR_LOG_QUEUE
+		(void) config_get(data, "LogQueue",
+		                  &conf->conf_logqueue,
+		                  sizeof conf->conf_logqueue);
+
+		(void) config_get(data, "LogQueueFile",
+		                  &conf->conf_logqueuefile,
+		                  sizeof conf->conf_logqueuefile);
+#endif /* _FFR_LOG_QUEUE */
+
+#ifdef _FFR_METRICS
+		(void) config_get(data, "MetricsSocket",
+		                  &conf->conf_metricssock,
+		                  sizeof conf->conf_metricssock);
+#endif /* _FFR_METRICS */
+
 		if (conf->conf_siglimit == NULL)
 		{
 			(void) config_get(data, "Minimum",
@@ -6438,6 +6902,32 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 		(void) config_get(data, "StatisticsName", &str, sizeof str);
 		if (str != NULL)
 			conf->conf_reporthost = str;
+
+		str = NULL;
+		(void) config_get(data, "StatisticsFormat", &str, sizeof str);
+		if (str != NULL)
+		{
+			if (strcasecmp(str, "text") == 0)
+			{
+				conf->conf_statsformat = DKIMS_FORMAT_TEXT;
+			}
+			else if (strcasecmp(str, "binary") == 0)
+			{
+				conf->conf_statsformat = DKIMS_FORMAT_BINARY;
+			}
+			else
+			{
+				snprintf(err, errlen,
+				         "invalid value for StatisticsFormat");
+				return -1;
+			}
+		}
+
+		tmpint = 0;
+		(void) config_get(data, "StatisticsAggregate", &tmpint,
+		                  sizeof tmpint);
+		if (tmpint > 0)
+			conf->conf_statswindow = (u_int) tmpint;
 #endif /* _FFR_STATS */
 
 		if (!conf->conf_subdomains)
@@ -6557,6 +7047,15 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 		dkimf_db_set_ldap_param(DKIMF_LDAP_PARAM_TIMEOUT,
 		                        conf->conf_ldap_timeout);
 
+# ifdef _FFR_LDAP_ASYNC
+		(void) config_get(data, "LDAPConnections",
+		                  &conf->conf_ldap_connections,
+		                  sizeof conf->conf_ldap_connections);
+
+		dkimf_db_set_ldap_param(DKIMF_LDAP_PARAM_CONNECTIONS,
+		                        conf->conf_ldap_connections);
+# endif /* _FFR_LDAP_ASYNC */
+
 		(void) config_get(data, "LDAPKeepaliveIdle",
 		                  &conf->conf_ldap_kaidle,
 		                  sizeof conf->conf_ldap_kaidle);
@@ -6623,6 +7122,61 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 		                        conf->conf_ldap_binduser);
 #endif /* USE_LDAP */
 
+#ifdef _FFR_DB_SHARED_POOLS
+		(void) config_get(data, "DatabasePoolSize",
+		                  &conf->conf_pool_size,
+		                  sizeof conf->conf_pool_size);
+
+		dkimf_db_set_pool_param(DKIMF_POOL_PARAM_SIZE,
+		                        conf->conf_pool_size);
+
+		(void) config_get(data, "DatabasePoolIdleTime",
+		                  &conf->conf_pool_idle,
+		                  sizeof conf->conf_pool_idle);
+
+		dkimf_db_set_pool_param(DKIMF_POOL_PARAM_IDLETIME,
+		                        conf->conf_pool_idle);
+
+		(void) config_get(data, "DatabaseReconnectBackoff",
+		                  &conf->conf_pool_backoff,
+		                  sizeof conf->conf_pool_backoff);
+
+		dkimf_db_set_pool_param(DKIMF_POOL_PARAM_BACKOFF,
+		                        conf->conf_pool_backoff);
+#endif /* _FFR_DB_SHARED_POOLS */
+
+#if defined(USE_LUA) && defined(_FFR_LUA_STATE_POOLS)
+		(void) config_get(data, "LuaStatePoolSize",
+		                  &conf->conf_lua_states,
+		                  sizeof conf->conf_lua_states);
+
+		dkimf_db_set_lua_param(DKIMF_LUA_PARAM_STATES,
+		                       conf->conf_lua_states);
+
+		(void) config_get(data, "LuaStateRecycle",
+		                  &conf->conf_lua_recycle,
+		                  sizeof conf->conf_lua_recycle);
+
+		dkimf_db_set_lua_param(DKIMF_LUA_PARAM_RECYCLE,
+		                       conf->conf_lua_recycle);
+#endif /* USE_LUA && _FFR_LUA_STATE_POOLS */
+
+#ifdef _FFR_SOCKETDB
+		(void) config_get(data, "SocketDatasetConnections",
+		                  &conf->conf_sockdb_conns,
+		                  sizeof conf->conf_sockdb_conns);
+
+		dkimf_db_set_socket_param(DKIMF_SOCKET_PARAM_CONNECTIONS,
+		                          conf->conf_sockdb_conns);
+
+		(void) config_get(data, "SocketDatasetPipelining",
+		                  &conf->conf_sockdb_pipeline,
+		                  sizeof conf->conf_sockdb_pipeline);
+
+		dkimf_db_set_socket_param(DKIMF_SOCKET_PARAM_PIPELINE,
+		                          conf->conf_sockdb_pipeline);
+#endif /* _FFR_SOCKETDB */
+
 		(void) config_get(data, "Nameservers",
 		                  &conf->conf_nslist,
 		                  sizeof conf->conf_nslist);
@@ -6751,6 +7305,15 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 				free(lres.lrs_error);
 				return -1;
 			}
+
+# ifdef _FFR_LUA_STATE_POOLS
+			if (dkimf_config_luapool(conf, DKIMF_LUA_HOOK_SETUP,
+			                         conf->conf_setupfunc,
+			                         conf->conf_setupfuncsz, str,
+			                         &conf->conf_setuppool,
+			                         err, errlen) != 0)
+				return -1;
+# endif /* _FFR_LUA_STATE_POOLS */
 		}
 
 		str = NULL;
@@ -6818,6 +7381,15 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 				free(lres.lrs_error);
 				return -1;
 			}
+
+# ifdef _FFR_LUA_STATE_POOLS
+			if (dkimf_config_luapool(conf, DKIMF_LUA_HOOK_SCREEN,
+			                         conf->conf_screenfunc,
+			                         conf->conf_screenfuncsz, str,
+			                         &conf->conf_screenpool,
+			                         err, errlen) != 0)
+				return -1;
+# endif /* _FFR_LUA_STATE_POOLS */
 		}
 
 # ifdef _FFR_STATSEXT
@@ -6885,6 +7457,15 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 				free(lres.lrs_error);
 				return -1;
 			}
+
+#  ifdef _FFR_LUA_STATE_POOLS
+			if (dkimf_config_luapool(conf, DKIMF_LUA_HOOK_STATS,
+			                         conf->conf_statsfunc,
+			                         conf->conf_statsfuncsz, str,
+			                         &conf->conf_statspool,
+			                         err, errlen) != 0)
+				return -1;
+#  endif /* _FFR_LUA_STATE_POOLS */
 		}
 # endif /* _FFR_STATSEXT */
 
@@ -6951,6 +7532,15 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 				free(lres.lrs_error);
 				return -1;
 			}
+
+# ifdef _FFR_LUA_STATE_POOLS
+			if (dkimf_config_luapool(conf, DKIMF_LUA_HOOK_FINAL,
+			                         conf->conf_finalfunc,
+			                         conf->conf_finalfuncsz, str,
+			                         &conf->conf_finalpool,
+			                         err, errlen) != 0)
+				return -1;
+# endif /* _FFR_LUA_STATE_POOLS */
 		}
 #endif /* USE_LUA */
 
@@ -6966,6 +7556,16 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 		dbflags |= DKIMF_DB_FLAG_SOFTSTART;
 #endif /* defined(USE_LDAP) || defined(USE_ODBX) */
 
+#if defined(USE_DB) && defined(_FFR_BDB_SNAPSHOT)
+	if (conf->conf_bdbsnapshot)
+		dbflags |= DKIMF_DB_FLAG_SNAPSHOT;
+#endif /* defined(USE_DB) && defined(_FFR_BDB_SNAPSHOT) */
+
+#ifdef _FFR_DB_AUTORELOAD
+	if (conf->conf_dbautoreload)
+		dbflags |= DKIMF_DB_FLAG_AUTORELOAD;
+#endif /* _FFR_DB_AUTORELOAD */
+
 	if (basedir[0] != '\0')
 	{
 		if (chdir(basedir) != 0)
@@ -7473,6 +8073,12 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 			}
 
 			conf->conf_selector = NULL;
+
+#ifdef _FFR_KEYSTORE
+			(void) config_get(data, "KeyStore",
+			                  &conf->conf_keystore,
+			                  sizeof conf->conf_keystore);
+#endif /* _FFR_KEYSTORE */
 		}
 	}
 
@@ -7533,6 +8139,18 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 	}
 #endif /* _FFR_RESIGN */
 
+#ifdef _FFR_DB_WRITEBEHIND
+	if (data != NULL)
+	{
+		(void) config_get(data, "DatasetWriteBehind",
+		                  &conf->conf_dbwbinterval,
+		                  sizeof conf->conf_dbwbinterval);
+		(void) config_get(data, "DatasetWriteBehindSize",
+		                  &conf->conf_dbwbsize,
+		                  sizeof conf->conf_dbwbsize);
+	}
+#endif /* _FFR_DB_WRITEBEHIND */
+
 #ifdef _FFR_RATE_LIMIT
 	str = NULL;
 	if (data != NULL)
@@ -7593,6 +8211,18 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 			         str);
 			return -1;
 		}
+
+# ifdef _FFR_DB_WRITEBEHIND
+		if (conf->conf_dbwbinterval != 0 &&
+		    dkimf_db_wb_enable(conf->conf_flowdatadb,
+		                       conf->conf_dbwbinterval,
+		                       conf->conf_dbwbsize) != 0)
+		{
+			snprintf(err, errlen, "%s: dkimf_db_wb_enable(): %s",
+			         str, strerror(errno));
+			return -1;
+		}
+# endif /* _FFR_DB_WRITEBEHIND */
 	}
 #endif /* _FFR_RATE_LIMIT */
 
@@ -8031,6 +8661,19 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 			         "can't initialize reputation subsystem");
 			return -1;
 		}
+
+# ifdef _FFR_DB_WRITEBEHIND
+		if (conf->conf_dbwbinterval != 0 &&
+		    dkimf_rep_writebehind(conf->conf_rep,
+		                          conf->conf_dbwbinterval,
+		                          conf->conf_dbwbsize) != 0)
+		{
+			snprintf(err, errlen,
+			         "reputation cache write-behind: %s",
+			         strerror(errno));
+			return -1;
+		}
+# endif /* _FFR_DB_WRITEBEHIND */
 	}
 #endif /* _FFR_REPUTATION */
 
@@ -8347,35 +8990,179 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 		}
 	}
 
-	/* activate logging if requested */
-	if (conf->conf_dolog)
+#ifdef _FFR_DB_CACHE
+	str = NULL;
+	if (data != NULL)
 	{
-		char *log_facility = NULL;
+		(void) config_get(data, "DatasetCache", &str, sizeof str);
+		(void) config_get(data, "DatasetCacheTTL",
+		                  &conf->conf_dbcachettl,
+		                  sizeof conf->conf_dbcachettl);
+		(void) config_get(data, "DatasetCacheNegativeTTL",
+		                  &conf->conf_dbcachenegttl,
+		                  sizeof conf->conf_dbcachenegttl);
+		(void) config_get(data, "DatasetCacheSize",
+		                  &conf->conf_dbcachesize,
+		                  sizeof conf->conf_dbcachesize);
+	}
+	if (str != NULL)
+	{
+		_Bool found;
+		int c;
+		int status;
+		DKIMF_DB cachedb;
+		char *dberr = NULL;
 
-		if (data != NULL)
+		if (conf->conf_dbcachettl == 0 || conf->conf_dbcachesize == 0)
 		{
-			(void) config_get(data, "SyslogFacility", &log_facility,
-			                  sizeof log_facility);
+			snprintf(err, errlen,
+			         "DatasetCacheTTL and DatasetCacheSize must be non-zero");
+			return -1;
 		}
 
-		dkimf_init_syslog(log_facility);
-	}
-
-	return 0;
-}
+		status = dkimf_db_open(&cachedb, str,
+		                       (dbflags |
+		                        DKIMF_DB_FLAG_ICASE |
+		                        DKIMF_DB_FLAG_READONLY),
+		                       NULL, &dberr);
+		if (status != 0)
+		{
+			snprintf(err, errlen, "%s: dkimf_db_open(): %s",
+			         str, dberr);
+			return -1;
+		}
 
-/*
-**  DKIMF_DNS_INIT -- initialize and configure the DNS service in the
-**                    DKIM library
-**
-**  Parameters:
-**  	lib -- DKIM library
-**  	conf -- configuration handle
-**  	err -- error string (returned)
-**
-**  Return value:
-**  	TRUE on success, FALSE otherwise
-*/
+		for (c = 0; dkimf_cachedbs[c].cdb_name != NULL; c++)
+		{
+			if (DKIMF_CACHEDB(conf, c) == NULL)
+				continue;
+
+			found = FALSE;
+			if (dkimf_db_get(cachedb,
+			                 (char *) dkimf_cachedbs[c].cdb_name, 0,
+			                 NULL, 0, &found) != 0 || !found)
+				continue;
+
+			if (dkimf_db_cache_enable(DKIMF_CACHEDB(conf, c),
+			                          conf->conf_dbcachettl,
+			                          conf->conf_dbcachenegttl,
+			                          conf->conf_dbcachesize) != 0)
+			{
+				snprintf(err, errlen,
+				         "%s: dkimf_db_cache_enable(): %s",
+				         dkimf_cachedbs[c].cdb_name,
+				         strerror(errno));
+				(void) dkimf_db_close(cachedb);
+				return -1;
+			}
+		}
+
+		(void) dkimf_db_close(cachedb);
+	}
+#endif /* _FFR_DB_CACHE */
+
+#ifdef _FFR_DB_BREAKER
+	str = NULL;
+	if (data != NULL)
+	{
+		(void) config_get(data, "DatasetBreaker", &str, sizeof str);
+		(void) config_get(data, "DatasetBreakerRetry",
+		                  &conf->conf_dbbrretry,
+		                  sizeof conf->conf_dbbrretry);
+		(void) config_get(data, "DatasetBreakerSlowQuery",
+		                  &conf->conf_dbbrslow,
+		                  sizeof conf->conf_dbbrslow);
+		(void) config_get(data, "DatasetBreakerThreshold",
+		                  &conf->conf_dbbrthreshold,
+		                  sizeof conf->conf_dbbrthreshold);
+	}
+	if (str != NULL)
+	{
+		_Bool found;
+		int c;
+		int status;
+		DKIMF_DB brdb;
+		char *dberr = NULL;
+
+		if (conf->conf_dbbrretry == 0 || conf->conf_dbbrthreshold == 0)
+		{
+			snprintf(err, errlen,
+			         "DatasetBreakerRetry and "
+			         "DatasetBreakerThreshold must be non-zero");
+			return -1;
+		}
+
+		status = dkimf_db_open(&brdb, str,
+		                       (dbflags |
+		                        DKIMF_DB_FLAG_ICASE |
+		                        DKIMF_DB_FLAG_READONLY),
+		                       NULL, &dberr);
+		if (status != 0)
+		{
+			snprintf(err, errlen, "%s: dkimf_db_open(): %s",
+			         str, dberr);
+			return -1;
+		}
+
+		for (c = 0; dkimf_cachedbs[c].cdb_name != NULL; c++)
+		{
+			if (DKIMF_CACHEDB(conf, c) == NULL)
+				continue;
+
+			found = FALSE;
+			if (dkimf_db_get(brdb,
+			                 (char *) dkimf_cachedbs[c].cdb_name, 0,
+			                 NULL, 0, &found) != 0 || !found)
+				continue;
+
+			if (dkimf_db_breaker_enable(DKIMF_CACHEDB(conf, c),
+			                            dkimf_cachedbs[c].cdb_name,
+			                            conf->conf_dbbrthreshold,
+			                            conf->conf_dbbrslow,
+			                            conf->conf_dbbrretry) != 0)
+			{
+				snprintf(err, errlen,
+				         "%s: dkimf_db_breaker_enable(): %s",
+				         dkimf_cachedbs[c].cdb_name,
+				         strerror(errno));
+				(void) dkimf_db_close(brdb);
+				return -1;
+			}
+		}
+
+		(void) dkimf_db_close(brdb);
+	}
+#endif /* _FFR_DB_BREAKER */
+
+	/* activate logging if requested */
+	if (conf->conf_dolog)
+	{
+		char *log_facility = NULL;
+
+		if (data != NULL)
+		{
+			(void) config_get(data, "SyslogFacility", &log_facility,
+			                  sizeof log_facility);
+		}
+
+		dkimf_init_syslog(log_facility);
+	}
+
+	return 0;
+}
+
+/*
+**  DKIMF_DNS_INIT -- initialize and configure the DNS service in the
+**                    DKIM library
+**
+**  Parameters:
+**  	lib -- DKIM library
+**  	conf -- configuration handle
+**  	err -- error string (returned)
+**
+**  Return value:
+**  	TRUE on success, FALSE otherwise
+*/
 
 static _Bool
 dkimf_dns_init(DKIM_LIB *lib, struct dkimf_config *conf, char **err)
@@ -8503,6 +9290,46 @@ dkimf_config_setlib(struct dkimf_config *conf, char **err)
 		                    sizeof conf->conf_minkeybits);
 	}
 
+	if (conf->conf_arenasz != 0)
+	{
+		size_t arenasz;
+
+		arenasz = conf->conf_arenasz;
+		(void) dkim_options(lib, DKIM_OP_SETOPT, DKIM_OPTS_ARENASZ,
+		                    &arenasz, sizeof arenasz);
+	}
+
+#ifdef _FFR_HANDLE_POOL
+	if (conf->conf_hpool == NULL && conf->conf_handlepool != 0)
+	{
+		struct dkimf_hpool *pool;
+
+		pool = (struct dkimf_hpool *) malloc(sizeof *pool);
+		if (pool == NULL)
+		{
+			if (err != NULL)
+				*err = "failed to allocate handle pool";
+			return FALSE;
+		}
+
+		pool->hp_handles = (DKIM **) malloc(sizeof(DKIM *) *
+		                                    conf->conf_handlepool);
+		if (pool->hp_handles == NULL)
+		{
+			free(pool);
+			if (err != NULL)
+				*err = "failed to allocate handle pool";
+			return FALSE;
+		}
+
+		pool->hp_max = conf->conf_handlepool;
+		pool->hp_count = 0;
+		pthread_mutex_init(&pool->hp_lock, NULL);
+
+		conf->conf_hpool = pool;
+	}
+#endif /* _FFR_HANDLE_POOL */
+
 	if (conf->conf_testdnsdb != NULL)
 	{
 		(void) dkimf_filedns_setup(lib, conf->conf_testdnsdb);
@@ -8744,6 +9571,41 @@ dkimf_config_setlib(struct dkimf_config *conf, char **err)
 	return TRUE;
 }
 
+#ifdef _FFR_DB_WRITEBEHIND
+/*
+**  DKIMF_CONFIG_WBDISABLE -- stop buffering a configuration's writes
+**
+**  Parameters:
+**  	conf -- configuration handle
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Called on the outgoing configuration before a new one is published.
+**  	The new one has its own handles on the same databases, so whatever
+**  	the old one still has pending must reach them first, and anything
+**  	its remaining messages write afterwards must not linger in a buffer
+**  	to overwrite newer data when the old configuration is freed.
+*/
+
+static void
+dkimf_config_wbdisable(struct dkimf_config *conf)
+{
+	assert(conf != NULL);
+
+# ifdef _FFR_RATE_LIMIT
+	if (conf->conf_flowdatadb != NULL)
+		dkimf_db_wb_disable(conf->conf_flowdatadb);
+# endif /* _FFR_RATE_LIMIT */
+
+# ifdef _FFR_REPUTATION
+	if (conf->conf_rep != NULL)
+		dkimf_rep_wbdisable(conf->conf_rep);
+# endif /* _FFR_REPUTATION */
+}
+#endif /* _FFR_DB_WRITEBEHIND */
+
 /*
 **  DKIMF_CONFIG_RELOAD -- reload configuration if requested
 **
@@ -8756,6 +9618,12 @@ dkimf_config_setlib(struct dkimf_config *conf, char **err)
 **  Side effects:
 **  	If a reload was requested and is successful, "curconf" now points
 **  	to a new configuration handle.
+**
+**  Notes:
+**  	conf_lock is held only to claim the reload and to publish the
+**  	result, so connections arriving while the new configuration is
+**  	being built take a reference to the old one and carry on.  The
+**  	old one is freed by whoever drops its last reference.
 */
 
 static void
@@ -8766,7 +9634,7 @@ dkimf_config_reload(void)
 
 	pthread_mutex_lock(&conf_lock);
 
-	if (!reload)
+	if (!reload || reloading)
 	{
 		pthread_mutex_unlock(&conf_lock);
 		return;
@@ -8783,6 +9651,17 @@ dkimf_config_reload(void)
 		return;
 	}
 
+	/*
+	**  Claim the reload and build outside the lock.  Only one thread
+	**  reloads at a time, so "curconf" can't be freed underneath us;
+	**  a signal arriving meanwhile sets "reload" again.
+	*/
+
+	reload = FALSE;
+	reloading = TRUE;
+
+	pthread_mutex_unlock(&conf_lock);
+
 	new = dkimf_config_new();
 	if (new == NULL)
 	{
@@ -8878,12 +9757,58 @@ dkimf_config_reload(void)
 
 		if (!err)
 		{
-			if (curconf->conf_refcnt == 0)
-				dkimf_config_free(curconf);
+			struct dkimf_config *old;
+
+			new->conf_data = cfg;
 
+#ifdef _FFR_DB_WRITEBEHIND
+			/* old buffered writes land before the new handles go live */
+			dkimf_config_wbdisable(curconf);
+#endif /* _FFR_DB_WRITEBEHIND */
+
+			/* publish it */
+			pthread_mutex_lock(&conf_lock);
+
+			old = curconf;
 			dolog = new->conf_dolog;
 			curconf = new;
-			new->conf_data = cfg;
+
+			if (old->conf_refcnt != 0)
+				old = NULL;
+
+			pthread_mutex_unlock(&conf_lock);
+
+			if (old != NULL)
+				dkimf_config_free(old);
+
+#ifdef _FFR_KEYSTORE
+			dkimf_keystore_flush();
+			if (new->conf_keystore && dkimf_keystore_init() != 0 &&
+			    new->conf_dolog)
+			{
+				syslog(LOG_ERR, "dkimf_keystore_init(): %s",
+				       strerror(errno));
+			}
+#endif /* _FFR_KEYSTORE */
+
+#if defined(USE_DB) && defined(_FFR_BDB_SNAPSHOT)
+			if (new->conf_bdbsnapshot && dkimf_db_snap_start() != 0 &&
+			    new->conf_dolog)
+			{
+				syslog(LOG_ERR, "dkimf_db_snap_start(): %s",
+				       strerror(errno));
+			}
+#endif /* defined(USE_DB) && defined(_FFR_BDB_SNAPSHOT) */
+
+#ifdef _FFR_DB_AUTORELOAD
+			if (new->conf_dbautoreload &&
+			    dkimf_db_reload_start(new->conf_dolog) != 0 &&
+			    new->conf_dolog)
+			{
+				syslog(LOG_ERR, "dkimf_db_reload_start(): %s",
+				       strerror(errno));
+			}
+#endif /* _FFR_DB_AUTORELOAD */
 
 			if (new->conf_dolog)
 			{
@@ -8894,8 +9819,8 @@ dkimf_config_reload(void)
 		}
 	}
 
-	reload = FALSE;
-
+	pthread_mutex_lock(&conf_lock);
+	reloading = FALSE;
 	pthread_mutex_unlock(&conf_lock);
 
 	return;
@@ -8917,14 +9842,20 @@ dkimf_config_reload(void)
 static _Bool
 dkimf_checkbldb(DKIMF_DB db, char *to, char *jobid)
 {
-	int c;
-	_Bool exists = FALSE;
+	_Bool ret = FALSE;
+	unsigned int c;
+	unsigned int n;
+	unsigned int start;
+	unsigned int nkeys;
+	unsigned int batch;
 	DKIM_STAT status;
 	char *domain;
 	char *user;
 	char *p;
+	char *keybuf;
+	char **keys;
+	_Bool *exists;
 	char addr[MAXADDRESS + 1];
-	char dbaddr[MAXADDRESS + 1];
 
 	strlcpy(addr, to, sizeof addr);
 	status = dkim_mail_parse(addr, (u_char **) &user, (u_char **) &domain);
@@ -8939,18 +9870,44 @@ dkimf_checkbldb(DKIMF_DB db, char *to, char *jobid)
 		return FALSE;
 	}
 
+	/*
+	**  The keys to try, in order: "user@host" and "*@host", the same
+	**  for each parent domain, then "user@*" and "*".  Data sets that
+	**  can answer several keys in one round trip get them all at once.
+	*/
+
+	nkeys = 4;
+	for (p = strchr(domain, '.'); p != NULL; p = strchr(p + 1, '.'))
+		nkeys += 2;
+
+	batch = dkimf_db_canbatch(db) ? nkeys : 1;
+
+	keys = (char **) malloc(nkeys * sizeof(char *));
+	keybuf = (char *) malloc(nkeys * (MAXADDRESS + 1));
+	exists = (_Bool *) malloc(batch * sizeof(_Bool));
+	if (keys == NULL || keybuf == NULL || exists == NULL)
+	{
+		free(keys);
+		free(keybuf);
+		free(exists);
+		return FALSE;
+	}
+
+	n = 0;
 	for (p = domain; ; p = strchr(p + 1, '.'))
 	{
 		for (c = 0; c < 2; c++)
 		{
+			keys[n] = &keybuf[n * (MAXADDRESS + 1)];
+
 			if (c == 1 && p == NULL)
 			{
-				dbaddr[0] = '*';
-				dbaddr[1] = '\0';
+				keys[n][0] = '*';
+				keys[n][1] = '\0';
 			}
-			else if (snprintf(dbaddr, sizeof dbaddr, "%s@%s",
+			else if (snprintf(keys[n], MAXADDRESS + 1, "%s@%s",
 			                  c == 0 ? user : "*",
-			                  p == NULL ? "*" : p) >= (int) sizeof dbaddr)
+			                  p == NULL ? "*" : p) >= MAXADDRESS + 1)
 			{
 				if (dolog)
 				{
@@ -8959,26 +9916,45 @@ dkimf_checkbldb(DKIMF_DB db, char *to, char *jobid)
 					       jobid, to);
 				}
 
+				free(keys);
+				free(keybuf);
+				free(exists);
 				return FALSE;
 			}
 
-			status = dkimf_db_get(db, dbaddr, 0, NULL, 0, &exists);
-			if (status == 0)
-			{
-				if (exists)
-					return TRUE;
-			}
-			else if (dolog)
-			{
-				dkimf_db_error(db, dbaddr);
-			}
+			n++;
 		}
 
 		if (p == NULL)
 			break;
 	}
 
-	return FALSE;
+	for (start = 0; !ret && start < nkeys; start += n)
+	{
+		n = MIN(batch, nkeys - start);
+
+		if (dkimf_db_mget(db, &keys[start], n, NULL, 0, exists) != 0)
+		{
+			if (dolog)
+				dkimf_db_error(db, keys[start]);
+			continue;
+		}
+
+		for (c = 0; c < n; c++)
+		{
+			if (exists[c])
+			{
+				ret = TRUE;
+				break;
+			}
+		}
+	}
+
+	free(keys);
+	free(keybuf);
+	free(exists);
+
+	return ret;
 }
 
 /*
@@ -9141,6 +10117,104 @@ dkimf_log_ssl_errors(DKIM *dkim, DKIM_SIGINFO *sig, char *jobid)
 	}
 }
 
+/*
+**  DKIMF_GETVERIFY -- get a handle for verifying a message
+**
+**  Parameters:
+**  	conf -- configuration in use
+**  	jobid -- job ID of the message
+**  	status -- status (returned)
+**
+**  Return value:
+**  	A DKIM handle, or NULL on failure.
+**
+**  Notes:
+**  	Takes an idle handle from the configuration's pool if there is one,
+**  	or creates a new one otherwise.  It should be returned with
+**  	dkimf_putverify() rather than dkim_free().
+*/
+
+static DKIM *
+dkimf_getverify(struct dkimf_config *conf, u_char *jobid, DKIM_STAT *status)
+{
+#ifdef _FFR_HANDLE_POOL
+	DKIM *dkim = NULL;
+	struct dkimf_hpool *pool;
+
+	assert(conf != NULL);
+	assert(status != NULL);
+
+	pool = conf->conf_hpool;
+	if (pool != NULL)
+	{
+		pthread_mutex_lock(&pool->hp_lock);
+		if (pool->hp_count > 0)
+		{
+			pool->hp_count--;
+			dkim = pool->hp_handles[pool->hp_count];
+		}
+		pthread_mutex_unlock(&pool->hp_lock);
+	}
+
+	if (dkim != NULL)
+	{
+		/* already emptied; this just sets the job ID */
+		*status = dkim_reset(dkim, jobid);
+		if (*status == DKIM_STAT_OK)
+			return dkim;
+
+		dkim_free(dkim);
+	}
+#endif /* _FFR_HANDLE_POOL */
+
+	return dkim_verify(conf->conf_libopendkim, jobid, NULL, status);
+}
+
+/*
+**  DKIMF_PUTVERIFY -- finish with a handle from dkimf_getverify()
+**
+**  Parameters:
+**  	conf -- configuration the handle was taken from
+**  	dkim -- DKIM handle
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	The handle is emptied here rather than when it's next used, so
+**  	an idle handle doesn't pin the memory of the last message; with
+**  	an arena, it keeps a single chunk of it.
+*/
+
+static void
+dkimf_putverify(struct dkimf_config *conf, DKIM *dkim)
+{
+#ifdef _FFR_HANDLE_POOL
+	struct dkimf_hpool *pool;
+
+	assert(conf != NULL);
+	assert(dkim != NULL);
+
+	pool = conf->conf_hpool;
+	if (pool != NULL && dkim_reset(dkim, NULL) == DKIM_STAT_OK)
+	{
+		pthread_mutex_lock(&pool->hp_lock);
+		if (pool->hp_count < pool->hp_max)
+		{
+			pool->hp_handles[pool->hp_count] = dkim;
+			pool->hp_count++;
+			dkim = NULL;
+		}
+		pthread_mutex_unlock(&pool->hp_lock);
+	}
+
+	if (dkim != NULL)
+		dkim_free(dkim);
+#else /* _FFR_HANDLE_POOL */
+	dkim_free(dkim);
+#endif /* _FFR_HANDLE_POOL */
+}
+
 /*
 **  DKIMF_CLEANUP -- release local resources related to a message
 **
@@ -9169,22 +10243,7 @@ dkimf_cleanup(SMFICTX *ctx)
 	/* release memory, reset state */
 	if (dfc != NULL)
 	{
-		if (dfc->mctx_hqhead != NULL)
-		{
-			Header hdr;
-			Header prev;
-
-			hdr = dfc->mctx_hqhead;
-			while (hdr != NULL)
-			{
-				TRYFREE(hdr->hdr_hdr);
-				TRYFREE(hdr->hdr_val);
-				prev = hdr;
-				hdr = hdr->hdr_next;
-				TRYFREE(prev);
-			}
-		}
-
+#ifndef _FFR_MSG_ARENA
 		if (dfc->mctx_rcptlist != NULL)
 		{
 			struct addrlist *addr;
@@ -9201,6 +10260,7 @@ dkimf_cleanup(SMFICTX *ctx)
 				addr = next;
 			}
 		}
+#endif /* ! _FFR_MSG_ARENA */
 
 		if (dfc->mctx_srhead != NULL)
 		{
@@ -9215,17 +10275,37 @@ dkimf_cleanup(SMFICTX *ctx)
 				if (sr->srq_dkim != NULL)
 					dkim_free(sr->srq_dkim);
 				TRYFREE(sr->srq_keydata);
-				TRYFREE(sr->srq_domain);
-				TRYFREE(sr->srq_selector);
-				TRYFREE(sr->srq_signer);
-				TRYFREE(sr);
+				MSGFREE(dfc, sr->srq_domain);
+				MSGFREE(dfc, sr->srq_selector);
+				MSGFREE(dfc, sr->srq_signer);
+				MSGFREE(dfc, sr);
 
 				sr = next;
 			}
 		}
 
 		if (dfc->mctx_dkimv != NULL)
-			dkim_free(dfc->mctx_dkimv);
+			dkimf_putverify(cc->cctx_config, dfc->mctx_dkimv);
+
+#ifndef _FFR_MSG_ARENA
+		/* the handles borrowed hdr_text, so these go after them */
+		if (dfc->mctx_hqhead != NULL)
+		{
+			Header hdr;
+			Header prev;
+
+			hdr = dfc->mctx_hqhead;
+			while (hdr != NULL)
+			{
+				TRYFREE(hdr->hdr_hdr);
+				TRYFREE(hdr->hdr_val);
+				TRYFREE(hdr->hdr_text);
+				prev = hdr;
+				hdr = hdr->hdr_next;
+				TRYFREE(prev);
+			}
+		}
+#endif /* ! _FFR_MSG_ARENA */
 
 #ifdef _FFR_VBR
 		if (dfc->mctx_vbr != NULL)
@@ -9237,7 +10317,7 @@ dkimf_cleanup(SMFICTX *ctx)
 		if (dfc->mctx_tmpstr != NULL)
 			dkimf_dstring_free(dfc->mctx_tmpstr);
 
-#ifdef _FFR_STATSEXT
+#if defined(_FFR_STATSEXT) && !defined(_FFR_MSG_ARENA)
 		if (dfc->mctx_statsext != NULL)
 		{
 			struct statsext *cur;
@@ -9253,9 +10333,9 @@ dkimf_cleanup(SMFICTX *ctx)
 				cur = next;
 			}
 		}
-#endif /* _FFR_STATSEXT */
+#endif /* _FFR_STATSEXT && ! _FFR_MSG_ARENA */
 
-#ifdef USE_LUA
+#if defined(USE_LUA) && !defined(_FFR_MSG_ARENA)
 		if (dfc->mctx_luaglobalh != NULL)
 		{
 			struct lua_global *cur;
@@ -9275,11 +10355,16 @@ dkimf_cleanup(SMFICTX *ctx)
 				cur = next;
 			}
 		}
-#endif /* USE_LUA */
+#endif /* USE_LUA && ! _FFR_MSG_ARENA */
 
 		free(dfc);
 		cc->cctx_msg = NULL;
 	}
+
+#ifdef _FFR_MSG_ARENA
+	if (cc->cctx_arena != NULL)
+		dkimf_arena_reset(cc->cctx_arena);
+#endif /* _FFR_MSG_ARENA */
 }
 
 /*
@@ -9679,11 +10764,56 @@ dkimf_findheader(msgctx dfc, char *hname, int instance)
 	return NULL;
 }
 
+/*
+**  DKIMF_SIGNTABLE_ADD -- add a signature request found in the signing table
+**
+**  Parameters:
+**  	dfc -- message context
+**  	conf -- configuration in use by the message
+**  	keydb -- database handle for key table
+**  	keyname -- key name found ("%" means "domain")
+**  	signer -- signer found, or an empty string
+**  	domain -- domain
+**  	errkey -- where to write the name of a key that failed
+**  	errlen -- bytes available at "errkey"
+**
+**  Return value:
+**  	0 -- signature request added
+**  	-2 -- unknown key
+**  	-3 -- key load error
+*/
+
+static int
+dkimf_signtable_add(struct msgctx *dfc, struct dkimf_config *conf,
+                    DKIMF_DB keydb, char *keyname, u_char *signer,
+                    unsigned char *domain, char *errkey, size_t errlen)
+{
+	int status;
+	u_char tmp[BUFRSZ + 1];
+
+	if (keyname[0] == '%' && keyname[1] == '\0')
+		strlcpy(keyname, (char *) domain, BUFRSZ + 1);
+
+	dkimf_reptoken(tmp, sizeof tmp, signer, domain);
+
+	status = dkimf_add_signrequest(dfc, conf, keydb, keyname,
+	                               (char *) tmp, (ssize_t) -1);
+	if (status != 0 && errkey != NULL)
+		strlcpy(errkey, keyname, errlen);
+	if (status == 1)
+		return -2;
+	else if (status == 2 || status == 3 || status == -1)
+		return -3;
+
+	return 0;
+}
+
 /*
 **  DKIMF_APPLY_SIGNTABLE -- apply the signing table to a message
 **
 **  Parameters:
 **  	dfc -- message context
+**  	conf -- configuration in use by the message
 **  	keydb -- database handle for key table
 **  	signdb -- database handle for signing table
 **  	user -- userid (local-part)
@@ -9700,16 +10830,16 @@ dkimf_findheader(msgctx dfc, char *hname, int instance)
 */
 
 static int
-dkimf_apply_signtable(struct msgctx *dfc, DKIMF_DB keydb, DKIMF_DB signdb,
-                      unsigned char *user, unsigned char *domain, char *errkey,
-                      size_t errlen, _Bool multisig)
+dkimf_apply_signtable(struct msgctx *dfc, struct dkimf_config *conf,
+                      DKIMF_DB keydb, DKIMF_DB signdb, unsigned char *user,
+                      unsigned char *domain, char *errkey, size_t errlen,
+                      _Bool multisig)
 {
-	_Bool found;
 	int nfound = 0;
 	char keyname[BUFRSZ + 1];
-	u_char tmp[BUFRSZ + 1];
 
 	assert(dfc != NULL);
+	assert(conf != NULL);
 	assert(keydb != NULL);
 	assert(signdb != NULL);
 	assert(user != NULL);
@@ -9744,19 +10874,11 @@ dkimf_apply_signtable(struct msgctx *dfc, DKIMF_DB keydb, DKIMF_DB signdb,
 			else if (status == 1)
 				break;
 
-			if (keyname[0] == '%' && keyname[1] == '\0')
-				strlcpy(keyname, domain, sizeof keyname);
-
-			dkimf_reptoken(tmp, sizeof tmp, signer, domain);
-			status = dkimf_add_signrequest(dfc, keydb, keyname,
-			                               (char *) tmp,
-			                               (ssize_t) -1);
-			if (status != 0 && errkey != NULL)
-				strlcpy(errkey, keyname, errlen);
-			if (status == 1)
-				return -2;
-			else if (status == 2 || status == 3 || status == -1)
-				return -3;
+			status = dkimf_signtable_add(dfc, conf, keydb,
+			                             keyname, signer, domain,
+			                             errkey, errlen);
+			if (status != 0)
+				return status;
 
 			nfound++;
 
@@ -9766,273 +10888,143 @@ dkimf_apply_signtable(struct msgctx *dfc, DKIMF_DB keydb, DKIMF_DB signdb,
 	}
 	else
 	{
+		_Bool done = FALSE;
 		int status;
+		unsigned int c;
+		unsigned int n;
+		unsigned int start;
+		unsigned int nkeys;
+		unsigned int batch;
 		char *p;
-		char tmpaddr[MAXADDRESS + 1];
-		u_char signer[MAXADDRESS + 1];
-		struct dkimf_db_data req[2];
-
-		memset(&req, '\0', sizeof req);
-
-		memset(keyname, '\0', sizeof keyname);
-		memset(signer, '\0', sizeof signer);
-		req[0].dbdata_buffer = keyname;
-		req[0].dbdata_buflen = sizeof keyname - 1;
-		req[1].dbdata_buffer = (char *) signer;
-		req[1].dbdata_buflen = sizeof signer - 1;
-		req[1].dbdata_flags = DKIMF_DB_DATA_OPTIONAL;
-
-		/* first try full "user@host" */
-		snprintf(tmpaddr, sizeof tmpaddr, "%s@%s", user, domain);
-
-		found = FALSE;
-		status = dkimf_db_get(signdb, tmpaddr, strlen(tmpaddr),
-		                      req, 2, &found);
-		if (status != 0 ||
-		    (found && (req[0].dbdata_buflen == 0 ||
-		               req[0].dbdata_buflen == (size_t) -1)))
-		{
-			if (status != 0 && dolog)
-				dkimf_db_error(signdb, tmpaddr);
-			return -1;
-		}
-		else if (found)
-		{
-			if (keyname[0] == '%' && keyname[1] == '\0')
-				strlcpy(keyname, domain, sizeof keyname);
-
-			dkimf_reptoken(tmp, sizeof tmp, signer, domain);
-
-			status = dkimf_add_signrequest(dfc, keydb, keyname,
-			                               (char *) tmp,
-			                               (ssize_t) -1);
-			if (status != 0 && errkey != NULL)
-				strlcpy(errkey, keyname, errlen);
-			if (status == 1)
-				return -2;
-			else if (status == 2 || status == 3 || status == -1)
-				return -3;
+		char *keybuf;
+		char *names;
+		u_char *signers;
+		char **keys;
+		_Bool *found;
+		struct dkimf_db_data *req;
 
-			nfound++;
-
-			if (!multisig)
-				return nfound;
-		}
+		/*
+		**  The keys to try, in order: "user@host", "host", then
+		**  "user@.domain" and ".domain" for each parent domain,
+		**  then "user@*" and finally "*".  Data sets that can answer
+		**  several keys in one round trip get them all at once;
+		**  others are asked one at a time so the search can stop at
+		**  the first match.
+		*/
 
-		/* now just "host" */
-		found = FALSE;
-		req[0].dbdata_buflen = sizeof keyname - 1;
-		req[1].dbdata_buflen = sizeof signer - 1;
-		memset(keyname, '\0', sizeof keyname);
-		memset(signer, '\0', sizeof signer);
-		status = dkimf_db_get(signdb, domain, strlen((char *) domain),
-		                      req, 2, &found);
-		if (status != 0 ||
-		    (found && (req[0].dbdata_buflen == 0 ||
-		               req[0].dbdata_buflen == (size_t) -1)))
-		{
-			if (status != 0 && dolog)
-				dkimf_db_error(signdb, (char *) domain);
+		nkeys = 4;
+		for (p = strchr((char *) domain, '.');
+		     p != NULL;
+		     p = strchr(p + 1, '.'))
+			nkeys += 2;
+
+		batch = dkimf_db_canbatch(signdb) ? nkeys : 1;
+
+		keys = (char **) malloc(nkeys * sizeof(char *));
+		keybuf = (char *) malloc(nkeys * (MAXADDRESS + 1));
+		found = (_Bool *) malloc(batch * sizeof(_Bool));
+		names = (char *) malloc(batch * (BUFRSZ + 1));
+		signers = (u_char *) malloc(batch * (MAXADDRESS + 1));
+		req = (struct dkimf_db_data *) malloc(batch * 2 * sizeof *req);
+		if (keys == NULL || keybuf == NULL || found == NULL ||
+		    names == NULL || signers == NULL || req == NULL)
+		{
+			free(keys);
+			free(keybuf);
+			free(found);
+			free(names);
+			free(signers);
+			free(req);
 			return -1;
 		}
-		else if (found)
-		{
-			if (keyname[0] == '%' && keyname[1] == '\0')
-				strlcpy(keyname, domain, sizeof keyname);
-
-			dkimf_reptoken(tmp, sizeof tmp, signer, domain);
-
-			status = dkimf_add_signrequest(dfc, keydb, keyname,
-			                               (char *) tmp,
-			                               (ssize_t) -1);
-			if (status != 0 && errkey != NULL)
-				strlcpy(errkey, keyname, errlen);
-			if (status == 1)
-				return -2;
-			else if (status == 2 || status == 3 || status == -1)
-				return -3;
-
-			nfound++;
-
-			if (!multisig)
-				return nfound;
-		}
 
-		/* next "user@.domain" and ".domain", degrading */
+		n = 0;
+		keys[n] = &keybuf[n * (MAXADDRESS + 1)];
+		snprintf(keys[n++], MAXADDRESS + 1, "%s@%s", user, domain);
+		keys[n++] = (char *) domain;
 		for (p = strchr((char *) domain, '.');
 		     p != NULL;
 		     p = strchr(p + 1, '.'))
 		{
-			snprintf(tmpaddr, sizeof tmpaddr, "%s@%s",
-			         user, p);
-
-			found = FALSE;
-			req[0].dbdata_buflen = sizeof keyname - 1;
-			req[1].dbdata_buflen = sizeof signer - 1;
-			memset(keyname, '\0', sizeof keyname);
-			memset(signer, '\0', sizeof signer);
-			status = dkimf_db_get(signdb, tmpaddr, strlen(tmpaddr),
-			                      req, 2, &found);
-			if (status != 0 ||
-			    (found && (req[0].dbdata_buflen == 0 ||
-			               req[0].dbdata_buflen == (size_t) -1)))
-			{
-				if (status != 0 && dolog)
-					dkimf_db_error(signdb, tmpaddr);
-				return -1;
-			}
-			else if (found)
-			{
-				if (keyname[0] == '%' && keyname[1] == '\0')
-				{
-					strlcpy(keyname, domain,
-					        sizeof keyname);
-				}
-
-				dkimf_reptoken(tmp, sizeof tmp, signer,
-				               domain);
+			keys[n] = &keybuf[n * (MAXADDRESS + 1)];
+			snprintf(keys[n++], MAXADDRESS + 1, "%s@%s", user, p);
+			keys[n++] = p;
+		}
+		keys[n] = &keybuf[n * (MAXADDRESS + 1)];
+		snprintf(keys[n++], MAXADDRESS + 1, "%s@*", user);
+		keys[n++] = "*";
 
-				status = dkimf_add_signrequest(dfc, keydb,
-				                               keyname,
-				                               (char *) tmp,
-				                               (ssize_t) -1);
-				if (status != 0 && errkey != NULL)
-					strlcpy(errkey, keyname, errlen);
-				if (status == 1)
-					return -2;
-				else if (status == 2 || status == 3 ||
-				         status == -1)
-					return -3;
+		for (start = 0; !done && start < nkeys; start += n)
+		{
+			n = MIN(batch, nkeys - start);
 
-				nfound++;
+			memset(names, '\0', n * (BUFRSZ + 1));
+			memset(signers, '\0', n * (MAXADDRESS + 1));
+			memset(req, '\0', n * 2 * sizeof *req);
 
-				if (!multisig)
-					return nfound;
+			for (c = 0; c < n; c++)
+			{
+				req[c * 2].dbdata_buffer = &names[c * (BUFRSZ + 1)];
+				req[c * 2].dbdata_buflen = BUFRSZ;
+				req[c * 2 + 1].dbdata_buffer = (char *) &signers[c * (MAXADDRESS + 1)];
+				req[c * 2 + 1].dbdata_buflen = MAXADDRESS;
+				req[c * 2 + 1].dbdata_flags = DKIMF_DB_DATA_OPTIONAL;
 			}
 
-			found = FALSE;
-			req[0].dbdata_buflen = sizeof keyname - 1;
-			req[1].dbdata_buflen = sizeof signer - 1;
-			memset(keyname, '\0', sizeof keyname);
-			memset(signer, '\0', sizeof signer);
-			status = dkimf_db_get(signdb, p, strlen(p),
-			                      req, 2, &found);
-			if (status != 0 ||
-			    (found && (req[0].dbdata_buflen == 0 ||
-			               req[0].dbdata_buflen == (size_t) -1)))
-			{
-				if (status != 0 && dolog)
-					dkimf_db_error(signdb, p);
-				return -1;
-			}
-			else if (found)
+			status = dkimf_db_mget(signdb, &keys[start], n,
+			                       req, 2, found);
+			if (status != 0)
 			{
-				if (keyname[0] == '%' && keyname[1] == '\0')
-				{
-					strlcpy(keyname, domain,
-					        sizeof keyname);
-				}
-
-				dkimf_reptoken(tmp, sizeof tmp, signer,
-				               domain);
-
-				status = dkimf_add_signrequest(dfc, keydb,
-				                               keyname,
-				                               (char *) tmp,
-				                               (ssize_t) -1);
-				if (status != 0 && errkey != NULL)
-					strlcpy(errkey, keyname, errlen);
-				if (status == 1)
-					return -2;
-				else if (status == 2 || status == 3 ||
-				         status == -1)
-					return -3;
-
-				nfound++;
-
-				if (!multisig)
-					return nfound;
+				if (dolog)
+					dkimf_db_error(signdb, keys[start]);
+				nfound = -1;
+				break;
 			}
-		}
-
-		/* now "user@*" */
-		snprintf(tmpaddr, sizeof tmpaddr, "%s@*", user);
-
-		found = FALSE;
-		req[0].dbdata_buflen = sizeof keyname - 1;
-		req[1].dbdata_buflen = sizeof signer - 1;
-		memset(keyname, '\0', sizeof keyname);
-		memset(signer, '\0', sizeof signer);
-		status = dkimf_db_get(signdb, tmpaddr, strlen(tmpaddr),
-		                      req, 2, &found);
-		if (status != 0 ||
-		    (found && (req[0].dbdata_buflen == 0 ||
-		               req[0].dbdata_buflen == (size_t) -1)))
-		{
-			if (status != 0 && dolog)
-				dkimf_db_error(signdb, tmpaddr);
-			return -1;
-		}
-		else if (found)
-		{
-			if (keyname[0] == '%' && keyname[1] == '\0')
-				strlcpy(keyname, domain, sizeof keyname);
-
-			dkimf_reptoken(tmp, sizeof tmp, signer, domain);
-
-			status = dkimf_add_signrequest(dfc, keydb, keyname,
-			                               (char *) tmp,
-			                               (ssize_t) -1);
-			if (status != 0 && errkey != NULL)
-				strlcpy(errkey, keyname, errlen);
-			if (status == 1)
-				return -2;
-			else if (status == 2 || status == 3 || status == -1)
-				return -3;
-
-			nfound++;
-
-			if (!multisig)
-				return nfound;
-		}
 
-		/* finally just "*" */
-		found = FALSE;
-		req[0].dbdata_buflen = sizeof keyname - 1;
-		req[1].dbdata_buflen = sizeof signer - 1;
-		memset(keyname, '\0', sizeof keyname);
-		memset(signer, '\0', sizeof signer);
-		status = dkimf_db_get(signdb, "*", 1, req, 2, &found);
-		if (status != 0 ||
-		    (found && (req[0].dbdata_buflen == 0 ||
-		               req[0].dbdata_buflen == (size_t) -1)))
-		{
-			if (status != 0 && dolog)
-				dkimf_db_error(signdb, "*");
-			return -1;
-		}
-		else if (found)
-		{
-			if (keyname[0] == '%' && keyname[1] == '\0')
-				strlcpy(keyname, domain, sizeof keyname);
+			for (c = 0; c < n; c++)
+			{
+				if (!found[c])
+					continue;
 
-			dkimf_reptoken(tmp, sizeof tmp, signer, domain);
+				if (req[c * 2].dbdata_buflen == 0 ||
+				    req[c * 2].dbdata_buflen == (size_t) -1)
+				{
+					nfound = -1;
+					done = TRUE;
+					break;
+				}
 
-			status = dkimf_add_signrequest(dfc, keydb, keyname,
-			                               (char *) tmp,
-			                               (ssize_t) -1);
-			if (status != 0 && errkey != NULL)
-				strlcpy(errkey, keyname, errlen);
-			if (status == 1)
-				return -2;
-			else if (status == 2 || status == 3 || status == -1)
-				return -3;
+				strlcpy(keyname, &names[c * (BUFRSZ + 1)],
+				        sizeof keyname);
 
-			nfound++;
+				status = dkimf_signtable_add(dfc, conf, keydb,
+				                             keyname,
+				                             &signers[c * (MAXADDRESS + 1)],
+				                             domain, errkey,
+				                             errlen);
+				if (status != 0)
+				{
+					nfound = status;
+					done = TRUE;
+					break;
+				}
 
-			if (!multisig)
-				return nfound;
+				nfound++;
+
+				if (!multisig)
+				{
+					done = TRUE;
+					break;
+				}
+			}
 		}
+
+		free(keys);
+		free(keybuf);
+		free(found);
+		free(names);
+		free(signers);
+		free(req);
 	}
 
 	return nfound;
@@ -11085,6 +12077,17 @@ mlfi_envfrom(SMFICTX *ctx, char **envfrom)
 
 	dkimf_cleanup(ctx);
 	dfc = dkimf_initcontext(conf);
+#ifdef _FFR_MSG_ARENA
+	if (dfc != NULL && cc->cctx_arena == NULL)
+		cc->cctx_arena = dkimf_arena_new(MSGARENASZ);
+	if (dfc != NULL && cc->cctx_arena == NULL)
+	{
+		free(dfc);
+		dfc = NULL;
+	}
+	if (dfc != NULL)
+		dfc->mctx_arena = cc->cctx_arena;
+#endif /* _FFR_MSG_ARENA */
 	if (dfc == NULL)
 	{
 		if (conf->conf_dolog)
@@ -11204,7 +12207,7 @@ mlfi_envrcpt(SMFICTX *ctx, char **envrcpt)
 	{
 		struct addrlist *a;
 
-		copy = strdup(addr);
+		copy = MSGSTRDUP(dfc, addr);
 		if (copy == NULL)
 		{
 			if (conf->conf_dolog)
@@ -11213,12 +12216,12 @@ mlfi_envrcpt(SMFICTX *ctx, char **envrcpt)
 				       "message requeueing (internal error)");
 			}
 
-			free(copy);
+			MSGFREE(dfc, copy);
 			dkimf_cleanup(ctx);
 			return SMFIS_TEMPFAIL;
 		}
 
-		a = (struct addrlist *) malloc(sizeof(struct addrlist));
+		a = (struct addrlist *) MSGALLOC(dfc, sizeof(struct addrlist));
 		if (a == NULL)
 		{
 			if (conf->conf_dolog)
@@ -11227,7 +12230,7 @@ mlfi_envrcpt(SMFICTX *ctx, char **envrcpt)
 				       "message requeueing (internal error)");
 			}
 
-			free(copy);
+			MSGFREE(dfc, copy);
 			dkimf_cleanup(ctx);
 			return SMFIS_TEMPFAIL;
 		}
@@ -11304,7 +12307,7 @@ mlfi_header(SMFICTX *ctx, char *headerf, char *headerv)
 		return SMFIS_CONTINUE;
 	}
 
-	newhdr = (Header) malloc(sizeof(struct Header));
+	newhdr = (Header) MSGALLOC(dfc, sizeof(struct Header));
 	if (newhdr == NULL)
 	{
 		if (conf->conf_dolog)
@@ -11326,7 +12329,7 @@ mlfi_header(SMFICTX *ctx, char *headerf, char *headerv)
 
 	(void) memset(newhdr, '\0', sizeof(struct Header));
 
-	newhdr->hdr_hdr = strdup(headerf);
+	newhdr->hdr_hdr = MSGSTRDUP(dfc, headerf);
 
 	if (dfc->mctx_tmpstr == NULL)
 	{
@@ -11336,8 +12339,8 @@ mlfi_header(SMFICTX *ctx, char *headerf, char *headerv)
 			if (conf->conf_dolog)
 				syslog(LOG_ERR, "dkimf_dstring_new() failed");
 
-			TRYFREE(newhdr->hdr_hdr);
-			free(newhdr);
+			MSGFREE(dfc, newhdr->hdr_hdr);
+			MSGFREE(dfc, newhdr);
 
 			dkimf_cleanup(ctx);
 
@@ -11426,8 +12429,8 @@ mlfi_header(SMFICTX *ctx, char *headerf, char *headerv)
 			if (conf->conf_dolog)
 				syslog(LOG_ERR, "dkimf_dstring_new() failed");
 
-			TRYFREE(newhdr->hdr_hdr);
-			free(newhdr);
+			MSGFREE(dfc, newhdr->hdr_hdr);
+			MSGFREE(dfc, newhdr);
 
 			dkimf_cleanup(ctx);
 
@@ -11457,8 +12460,8 @@ mlfi_header(SMFICTX *ctx, char *headerf, char *headerv)
 						       "regexec() failed");
 					}
 
-					TRYFREE(newhdr->hdr_hdr);
-					free(newhdr);
+					MSGFREE(dfc, newhdr->hdr_hdr);
+					MSGFREE(dfc, newhdr);
 					dkimf_dstring_free(tmphdr);
 					dkimf_cleanup(ctx);
 
@@ -11482,7 +12485,8 @@ mlfi_header(SMFICTX *ctx, char *headerf, char *headerv)
 	}
 #endif /* _FFR_REPLACE_RULES */
 
-	newhdr->hdr_val = strdup((char *) dkimf_dstring_get(dfc->mctx_tmpstr));
+	newhdr->hdr_val = MSGSTRDUP(dfc,
+	                            (char *) dkimf_dstring_get(dfc->mctx_tmpstr));
 
 	newhdr->hdr_next = NULL;
 	newhdr->hdr_prev = dfc->mctx_hqtail;
@@ -11492,9 +12496,9 @@ mlfi_header(SMFICTX *ctx, char *headerf, char *headerv)
 		if (conf->conf_dolog)
 			syslog(LOG_ERR, "malloc(): %s", strerror(errno));
 
-		TRYFREE(newhdr->hdr_hdr);
-		TRYFREE(newhdr->hdr_val);
-		TRYFREE(newhdr);
+		MSGFREE(dfc, newhdr->hdr_hdr);
+		MSGFREE(dfc, newhdr->hdr_val);
+		MSGFREE(dfc, newhdr);
 		dkimf_cleanup(ctx);
 		return SMFIS_TEMPFAIL;
 	}
@@ -11583,6 +12587,9 @@ mlfi_eoh(SMFICTX *ctx)
 	struct dkimf_dstring *addr;
 	Header from = NULL;
 	Header hdr;
+#if defined(_FFR_METRICS) && defined(USE_LUA)
+	struct timeval mstart;
+#endif /* _FFR_METRICS && USE_LUA */
 
 	assert(ctx != NULL);
 
@@ -11873,8 +12880,8 @@ mlfi_eoh(SMFICTX *ctx)
 			if (conf->conf_keytabledb == NULL ||
 			    resignkey[0] == '\0')
 			{
-				status = dkimf_add_signrequest(dfc, NULL, NULL,
-				                               NULL,
+				status = dkimf_add_signrequest(dfc, conf, NULL,
+				                               NULL, NULL,
 				                               (ssize_t) -1);
 
 				if (status != 0)
@@ -11892,7 +12899,7 @@ mlfi_eoh(SMFICTX *ctx)
 			}
 			else
 			{
-				status = dkimf_add_signrequest(dfc,
+				status = dkimf_add_signrequest(dfc, conf,
 				                               conf->conf_keytabledb,
 				                               resignkey,
 				                               NULL,
@@ -12150,7 +13157,8 @@ mlfi_eoh(SMFICTX *ctx)
 		char errkey[BUFRSZ + 1];
 
 		memset(errkey, '\0', sizeof errkey);
-		found = dkimf_apply_signtable(dfc, conf->conf_keytabledb,
+		found = dkimf_apply_signtable(dfc, conf,
+		                              conf->conf_keytabledb,
 		                              conf->conf_signtabledb,
 		                              user, dfc->mctx_domain,
 		                              errkey, sizeof errkey,
@@ -12225,10 +13233,25 @@ mlfi_eoh(SMFICTX *ctx)
 
 		dfc->mctx_mresult = SMFIS_CONTINUE;
 
+# ifdef _FFR_METRICS
+		dkimf_metrics_start(&mstart);
+# endif /* _FFR_METRICS */
+# ifdef _FFR_LUA_STATE_POOLS
+		if (conf->conf_setuppool != NULL)
+		{
+			status = dkimf_lua_hook_pool(conf->conf_setuppool,
+			                             ctx, &lres);
+		}
+		else
+# endif /* _FFR_LUA_STATE_POOLS */
 		status = dkimf_lua_setup_hook(ctx, conf->conf_setupfunc,
 		                              conf->conf_setupfuncsz,
 		                              "setup script", &lres,
 		                              NULL, NULL);
+# ifdef _FFR_METRICS
+		dkimf_metrics_time(DKIMF_METRIC_OPTIME, DKIMF_METRIC_OP_LUASETUP,
+		                   &mstart);
+# endif /* _FFR_METRICS */
 
 		if (status != 0)
 		{
@@ -12277,7 +13300,7 @@ mlfi_eoh(SMFICTX *ctx)
 	/* create a default signing request if there was a domain match */
 	if (domainok && originok && dfc->mctx_srhead == NULL)
 	{
-		status = dkimf_add_signrequest(dfc, NULL, NULL, NULL,
+		status = dkimf_add_signrequest(dfc, conf, NULL, NULL, NULL,
 		                               (ssize_t) -1);
 
 		if (status != 0)
@@ -12315,44 +13338,81 @@ mlfi_eoh(SMFICTX *ctx)
 	/* check for "DontSignMailTo" */
 	if (dfc->mctx_srhead != NULL && conf->conf_dontsigntodb != NULL)
 	{
-		_Bool found;
-		int status;
+		_Bool *found;
+		unsigned int c;
+		unsigned int n;
+		unsigned int start;
+		unsigned int batch;
+		unsigned int nrcpts = 0;
+		char **rcpts;
 		struct addrlist *a;
 
-		a = dfc->mctx_rcptlist;
+		/* ask about all recipients at once if the data set can */
+		for (a = dfc->mctx_rcptlist; a != NULL; a = a->a_next)
+			nrcpts++;
+
+		batch = dkimf_db_canbatch(conf->conf_dontsigntodb) ? nrcpts : 1;
 
-		while (a != NULL)
+		rcpts = (char **) malloc(nrcpts * sizeof(char *));
+		found = (_Bool *) malloc(nrcpts * sizeof(_Bool));
+		if (nrcpts > 0 && (rcpts == NULL || found == NULL))
 		{
-			found = FALSE;
-			status = dkimf_db_get(conf->conf_dontsigntodb,
-			                      a->a_addr, 0, NULL, 0,
-			                      &found);
-			if (found)
+			if (conf->conf_dolog)
 			{
-				if (conf->conf_dolog)
-				{
-					syslog(LOG_INFO,
-					       "%s: skipping signing of mail to '%s'",
-					       dfc->mctx_jobid,
-					       a->a_addr);
-				}
-
-				return SMFIS_ACCEPT;
+				syslog(LOG_ERR, "%s: malloc(): %s",
+				       dfc->mctx_jobid, strerror(errno));
 			}
-			else if (status != 0)
+
+			free(rcpts);
+			free(found);
+			return SMFIS_TEMPFAIL;
+		}
+
+		for (a = dfc->mctx_rcptlist, c = 0;
+		     a != NULL;
+		     a = a->a_next, c++)
+			rcpts[c] = a->a_addr;
+
+		for (start = 0; start < nrcpts; start += n)
+		{
+			n = MIN(batch, nrcpts - start);
+
+			if (dkimf_db_mget(conf->conf_dontsigntodb,
+			                  &rcpts[start], n, NULL, 0,
+			                  &found[start]) != 0)
 			{
 				if (conf->conf_dolog)
 				{
 					syslog(LOG_ERR,
-					       "%s: dkimf_db_get() failed",
+					       "%s: dkimf_db_mget() failed",
 					       dfc->mctx_jobid);
 				}
 
+				free(rcpts);
+				free(found);
 				return SMFIS_TEMPFAIL;
 			}
 
-			a = a->a_next;
+			for (c = start; c < start + n; c++)
+			{
+				if (!found[c])
+					continue;
+
+				if (conf->conf_dolog)
+				{
+					syslog(LOG_INFO,
+					       "%s: skipping signing of mail to '%s'",
+					       dfc->mctx_jobid, rcpts[c]);
+				}
+
+				free(rcpts);
+				free(found);
+				return SMFIS_ACCEPT;
+			}
 		}
+
+		free(rcpts);
+		free(found);
 	}
 
 #ifdef _FFR_RESIGN
@@ -12363,9 +13423,8 @@ mlfi_eoh(SMFICTX *ctx)
 	if (dfc->mctx_srhead == NULL)
 #endif /* _FFR_RESIGN */
 	{
-		dfc->mctx_dkimv = dkim_verify(conf->conf_libopendkim,
-		                              dfc->mctx_jobid, NULL,
-		                              &status);
+		dfc->mctx_dkimv = dkimf_getverify(conf, dfc->mctx_jobid,
+		                                  &status);
 
 		if (dfc->mctx_dkimv == NULL && status != DKIM_STAT_OK)
 		{
@@ -12835,7 +13894,8 @@ mlfi_eoh(SMFICTX *ctx)
 				}
 
 				/* add it to header set so it gets signed */
-				newhdr = (Header) malloc(sizeof(struct Header));
+				newhdr = (Header) MSGALLOC(dfc,
+				                           sizeof(struct Header));
 				if (newhdr == NULL)
 				{
 					if (conf->conf_dolog)
@@ -12851,8 +13911,8 @@ mlfi_eoh(SMFICTX *ctx)
 				(void) memset(newhdr, '\0',
 				              sizeof(struct Header));
 
-				newhdr->hdr_hdr = strdup(VBR_INFOHEADER);
-				newhdr->hdr_val = strdup(header);
+				newhdr->hdr_hdr = MSGSTRDUP(dfc, VBR_INFOHEADER);
+				newhdr->hdr_val = MSGSTRDUP(dfc, header);
 
 				if (newhdr->hdr_hdr == NULL ||
 				    newhdr->hdr_val == NULL)
@@ -12860,7 +13920,7 @@ mlfi_eoh(SMFICTX *ctx)
 					syslog(LOG_ERR, "%s: strdup(): %s",
 					       dfc->mctx_jobid,
 					       strerror(errno));
-					TRYFREE(newhdr->hdr_hdr);
+					MSGFREE(dfc, newhdr->hdr_hdr);
 					dkimf_cleanup(ctx);
 					return SMFIS_TEMPFAIL;
 				}
@@ -12948,13 +14008,34 @@ mlfi_eoh(SMFICTX *ctx)
 			dfc->mctx_spam = TRUE;
 #endif /* _FFR_REPUTATION */
 
+		/*
+		**  Keep one copy of the converted header field with the
+		**  header itself; every handle borrows that copy, since
+		**  the header list is released only after the handles.
+		*/
+
+		hdr->hdr_textlen = dkimf_dstring_len(dfc->mctx_tmpstr);
+		hdr->hdr_text = MSGALLOC(dfc, hdr->hdr_textlen + 1);
+		if (hdr->hdr_text == NULL)
+		{
+			if (conf->conf_dolog)
+			{
+				syslog(LOG_ERR, "%s: malloc(): %s",
+				       dfc->mctx_jobid, strerror(errno));
+			}
+
+			return SMFIS_TEMPFAIL;
+		}
+		memcpy(hdr->hdr_text, dkimf_dstring_get(dfc->mctx_tmpstr),
+		       hdr->hdr_textlen + 1);
+
 		if (dfc->mctx_srhead != NULL)
 		{
 			DKIM *dkim;
 
 			status = dkimf_msr_header(dfc->mctx_srhead, &dkim,
-				                  dkimf_dstring_get(dfc->mctx_tmpstr),
-				                  dkimf_dstring_len(dfc->mctx_tmpstr));
+				                  hdr->hdr_text,
+				                  hdr->hdr_textlen, TRUE);
 			if (status != DKIM_STAT_OK)
 			{
 				ms = dkimf_libstatus(ctx, dkim,
@@ -12965,9 +14046,9 @@ mlfi_eoh(SMFICTX *ctx)
 
 		if (dfc->mctx_dkimv != NULL)
 		{
-			status = dkim_header(dfc->mctx_dkimv,
-			                     (u_char *) dkimf_dstring_get(dfc->mctx_tmpstr),
-			                     dkimf_dstring_len(dfc->mctx_tmpstr));
+			status = dkim_header_ref(dfc->mctx_dkimv,
+			                         hdr->hdr_text,
+			                         hdr->hdr_textlen);
 
 			if (status != DKIM_STAT_OK)
 			{
@@ -13005,10 +14086,25 @@ mlfi_eoh(SMFICTX *ctx)
 
 		memset(&lres, '\0', sizeof lres);
 
+# ifdef _FFR_METRICS
+		dkimf_metrics_start(&mstart);
+# endif /* _FFR_METRICS */
+# ifdef _FFR_LUA_STATE_POOLS
+		if (conf->conf_screenpool != NULL)
+		{
+			status = dkimf_lua_hook_pool(conf->conf_screenpool,
+			                             ctx, &lres);
+		}
+		else
+# endif /* _FFR_LUA_STATE_POOLS */
 		status = dkimf_lua_screen_hook(ctx, conf->conf_screenfunc,
 		                               conf->conf_screenfuncsz,
 		                               "screen script", &lres,
 		                               NULL, NULL);
+# ifdef _FFR_METRICS
+		dkimf_metrics_time(DKIMF_METRIC_OPTIME, DKIMF_METRIC_OP_LUASCREEN,
+		                   &mstart);
+# endif /* _FFR_METRICS */
 
 		if (status != 0)
 		{
@@ -13215,6 +14311,9 @@ mlfi_eom(SMFICTX *ctx)
 	struct dkimf_config *conf;
 	DKIM_SIGINFO *sig = NULL;
 	Header hdr;
+#ifdef _FFR_METRICS
+	struct timeval mstart;
+#endif /* _FFR_METRICS */
 	unsigned char header[DKIM_MAXHEADER + 1];
 
 	assert(ctx != NULL);
@@ -13530,9 +14629,16 @@ mlfi_eom(SMFICTX *ctx)
 		**  Signal end-of-message to DKIM
 		*/
 
+#ifdef _FFR_METRICS
+		dkimf_metrics_start(&mstart);
+#endif /* _FFR_METRICS */
 		status = dkim_eom(dfc->mctx_dkimv, &testkey);
 		lastdkim = dfc->mctx_dkimv;
 
+#ifdef _FFR_METRICS
+		dkimf_metrics_verified(dfc->mctx_dkimv, status, &mstart);
+#endif /* _FFR_METRICS */
+
 		if (conf->conf_logresults && conf->conf_dolog)
 		{
 			int c;
@@ -13883,12 +14989,27 @@ mlfi_eom(SMFICTX *ctx)
 
 				memset(&lres, '\0', sizeof lres);
 
+#   ifdef _FFR_METRICS
+				dkimf_metrics_start(&mstart);
+#   endif /* _FFR_METRICS */
+#   ifdef _FFR_LUA_STATE_POOLS
+				if (conf->conf_statspool != NULL)
+				{
+					status = dkimf_lua_hook_pool(conf->conf_statspool,
+					                             ctx, &lres);
+				}
+				else
+#   endif /* _FFR_LUA_STATE_POOLS */
 				status = dkimf_lua_stats_hook(ctx,
 				                              conf->conf_statsfunc,
 				                              conf->conf_statsfuncsz,
 				                              "stats script",
 				                              &lres,
 				                              NULL, NULL);
+#   ifdef _FFR_METRICS
+				dkimf_metrics_time(DKIMF_METRIC_OPTIME,
+				                   DKIMF_METRIC_OP_LUASTATS, &mstart);
+#   endif /* _FFR_METRICS */
 
 				if (status != 0)
 				{
@@ -13933,7 +15054,12 @@ mlfi_eom(SMFICTX *ctx)
 #  endif /* _FFR_STATSEXT */
 # endif /* USE_LUA */
 
+# ifdef _FFR_METRICS
+			dkimf_metrics_start(&mstart);
+# endif /* _FFR_METRICS */
 			if (dkimf_stats_record(conf->conf_statspath,
+			                       conf->conf_statsformat,
+			                       conf->conf_statswindow,
 			                       dfc->mctx_jobid,
 			                       conf->conf_reporthost,
 			                       conf->conf_reportprefix,
@@ -13960,6 +15086,10 @@ mlfi_eom(SMFICTX *ctx)
 					       "statistics recording failed");
 				}
 			}
+# ifdef _FFR_METRICS
+			dkimf_metrics_time(DKIMF_METRIC_OPTIME,
+			                   DKIMF_METRIC_OP_STATSRECORD, &mstart);
+# endif /* _FFR_METRICS */
 		}
 #endif /* _FFR_STATS */
 
@@ -14443,7 +15573,8 @@ mlfi_eom(SMFICTX *ctx)
 					status = dkimf_msr_header(dfc->mctx_srhead,
 					                          &lastdkim,
 					                          header,
-					                          strlen(header));
+					                          strlen(header),
+					                          FALSE);
 					if (status != DKIM_STAT_OK)
 					{
 						return dkimf_libstatus(ctx,
@@ -14824,10 +15955,25 @@ mlfi_eom(SMFICTX *ctx)
 
 		dfc->mctx_mresult = SMFIS_CONTINUE;
 
+# ifdef _FFR_METRICS
+		dkimf_metrics_start(&mstart);
+# endif /* _FFR_METRICS */
+# ifdef _FFR_LUA_STATE_POOLS
+		if (conf->conf_finalpool != NULL)
+		{
+			status = dkimf_lua_hook_pool(conf->conf_finalpool,
+			                             ctx, &lres);
+		}
+		else
+# endif /* _FFR_LUA_STATE_POOLS */
 		status = dkimf_lua_final_hook(ctx, conf->conf_finalfunc,
 		                              conf->conf_finalfuncsz,
 		                              "final script", &lres,
 		                              NULL, NULL);
+# ifdef _FFR_METRICS
+		dkimf_metrics_time(DKIMF_METRIC_OPTIME, DKIMF_METRIC_OP_LUAFINAL,
+		                   &mstart);
+# endif /* _FFR_METRICS */
 
 		if (status != 0)
 		{
@@ -14887,7 +16033,14 @@ mlfi_eom(SMFICTX *ctx)
 		u_char *start;
 		struct signreq *sr;
 
+#ifdef _FFR_METRICS
+		dkimf_metrics_start(&mstart);
+#endif /* _FFR_METRICS */
 		status = dkimf_msr_eom(dfc->mctx_srhead, &lastdkim);
+#ifdef _FFR_METRICS
+		dkimf_metrics_time(DKIMF_METRIC_OPTIME, DKIMF_METRIC_OP_SIGN,
+		                   &mstart);
+#endif /* _FFR_METRICS */
 		if (status != DKIM_STAT_OK)
 		{
 			dkimf_log_ssl_errors(lastdkim, NULL,
@@ -14896,6 +16049,13 @@ mlfi_eom(SMFICTX *ctx)
 			                       status);
 		}
 
+#ifdef _FFR_METRICS
+		dkimf_metrics_count(DKIMF_METRIC_MESSAGES, DKIMF_METRIC_SIGN,
+		                    1);
+		for (sr = dfc->mctx_srhead; sr != NULL; sr = sr->srq_next)
+			dkimf_metrics_signed(sr->srq_dkim);
+#endif /* _FFR_METRICS */
+
 		if (dfc->mctx_tmpstr == NULL)
 		{
 			dfc->mctx_tmpstr = dkimf_dstring_new(BUFRSZ, 0);
@@ -15138,16 +16298,26 @@ mlfi_close(SMFICTX *ctx)
 	cc = (connctx) dkimf_getpriv(ctx);
 	if (cc != NULL)
 	{
+		_Bool retired;
+
 		pthread_mutex_lock(&conf_lock);
 
 		cc->cctx_config->conf_refcnt--;
 
-		if (cc->cctx_config->conf_refcnt == 0 &&
-		    cc->cctx_config != curconf)
-			dkimf_config_free(cc->cctx_config);
+		retired = (cc->cctx_config->conf_refcnt == 0 &&
+		           cc->cctx_config != curconf);
 
 		pthread_mutex_unlock(&conf_lock);
 
+		/* last user of a replaced configuration; free it unlocked */
+		if (retired)
+			dkimf_config_free(cc->cctx_config);
+
+#ifdef _FFR_MSG_ARENA
+		if (cc->cctx_arena != NULL)
+			dkimf_arena_free(cc->cctx_arena);
+#endif /* _FFR_MSG_ARENA */
+
 		free(cc);
 		dkimf_setpriv(ctx, NULL);
 	}
@@ -15190,6 +16360,149 @@ mlfi_close(SMFICTX *ctx)
 	return SMFIS_CONTINUE;
 }
 
+#ifdef _FFR_METRICS
+/*
+**  MLFI_*_TIMED -- time the milter callbacks
+**
+**  Parameters:
+**  	As for the callbacks they wrap.
+**
+**  Return value:
+**  	As for the callbacks they wrap.
+**
+**  Notes:
+**  	These are what libmilter calls when metrics are compiled in, so
+**  	every return path of every callback is timed.  The test mode
+**  	calls the callbacks directly and isn't timed.
+*/
+
+static sfsistat
+mlfi_connect_timed(SMFICTX *ctx, char *host, _SOCK_ADDR *ip)
+{
+	sfsistat ret;
+	struct timeval start;
+
+	dkimf_metrics_start(&start);
+	ret = mlfi_connect(ctx, host, ip);
+	dkimf_metrics_time(DKIMF_METRIC_PHASETIME, DKIMF_METRIC_PHASE_CONNECT,
+	                   &start);
+
+	return ret;
+}
+
+static sfsistat
+mlfi_envfrom_timed(SMFICTX *ctx, char **envfrom)
+{
+	sfsistat ret;
+	struct timeval start;
+
+	dkimf_metrics_start(&start);
+	ret = mlfi_envfrom(ctx, envfrom);
+	dkimf_metrics_time(DKIMF_METRIC_PHASETIME, DKIMF_METRIC_PHASE_ENVFROM,
+	                   &start);
+
+	return ret;
+}
+
+static sfsistat
+mlfi_envrcpt_timed(SMFICTX *ctx, char **envrcpt)
+{
+	sfsistat ret;
+	struct timeval start;
+
+	dkimf_metrics_start(&start);
+	ret = mlfi_envrcpt(ctx, envrcpt);
+	dkimf_metrics_time(DKIMF_METRIC_PHASETIME, DKIMF_METRIC_PHASE_ENVRCPT,
+	                   &start);
+
+	return ret;
+}
+
+static sfsistat
+mlfi_header_timed(SMFICTX *ctx, char *headerf, char *headerv)
+{
+	sfsistat ret;
+	struct timeval start;
+
+	dkimf_metrics_start(&start);
+	ret = mlfi_header(ctx, headerf, headerv);
+	dkimf_metrics_time(DKIMF_METRIC_PHASETIME, DKIMF_METRIC_PHASE_HEADER,
+	                   &start);
+
+	return ret;
+}
+
+static sfsistat
+mlfi_eoh_timed(SMFICTX *ctx)
+{
+	sfsistat ret;
+	struct timeval start;
+
+	dkimf_metrics_start(&start);
+	ret = mlfi_eoh(ctx);
+	dkimf_metrics_time(DKIMF_METRIC_PHASETIME, DKIMF_METRIC_PHASE_EOH,
+	                   &start);
+
+	return ret;
+}
+
+static sfsistat
+mlfi_body_timed(SMFICTX *ctx, u_char *bodyp, size_t bodylen)
+{
+	sfsistat ret;
+	struct timeval start;
+
+	dkimf_metrics_start(&start);
+	ret = mlfi_body(ctx, bodyp, bodylen);
+	dkimf_metrics_time(DKIMF_METRIC_PHASETIME, DKIMF_METRIC_PHASE_BODY,
+	                   &start);
+
+	return ret;
+}
+
+static sfsistat
+mlfi_eom_timed(SMFICTX *ctx)
+{
+	sfsistat ret;
+	struct timeval start;
+
+	dkimf_metrics_start(&start);
+	ret = mlfi_eom(ctx);
+	dkimf_metrics_time(DKIMF_METRIC_PHASETIME, DKIMF_METRIC_PHASE_EOM,
+	                   &start);
+
+	return ret;
+}
+
+static sfsistat
+mlfi_abort_timed(SMFICTX *ctx)
+{
+	sfsistat ret;
+	struct timeval start;
+
+	dkimf_metrics_start(&start);
+	ret = mlfi_abort(ctx);
+	dkimf_metrics_time(DKIMF_METRIC_PHASETIME, DKIMF_METRIC_PHASE_ABORT,
+	                   &start);
+
+	return ret;
+}
+
+static sfsistat
+mlfi_close_timed(SMFICTX *ctx)
+{
+	sfsistat ret;
+	struct timeval start;
+
+	dkimf_metrics_start(&start);
+	ret = mlfi_close(ctx);
+	dkimf_metrics_time(DKIMF_METRIC_PHASETIME, DKIMF_METRIC_PHASE_CLOSE,
+	                   &start);
+
+	return ret;
+}
+#endif /* _FFR_METRICS */
+
 /*
 **  smfilter -- the milter module description
 */
@@ -15199,12 +16512,26 @@ struct smfiDesc smfilter =
 	DKIMF_PRODUCT,	/* filter name */
 	SMFI_VERSION,	/* version code -- do not change */
 	0,		/* flags; updated in main() */
+#ifdef _FFR_METRICS
+	mlfi_connect_timed, /* connection info filter */
+#else /* _FFR_METRICS */
 	mlfi_connect,	/* connection info filter */
+#endif /* _FFR_METRICS */
 #if SMFI_VERSION == 2
 	mlfi_helo,	/* SMTP HELO command filter */
 #else /* SMFI_VERSION == 2 */
 	NULL,		/* SMTP HELO command filter */
 #endif /* SMFI_VERSION == 2 */
+#ifdef _FFR_METRICS
+	mlfi_envfrom_timed, /* envelope sender filter */
+	mlfi_envrcpt_timed, /* envelope recipient filter */
+	mlfi_header_timed, /* header filter */
+	mlfi_eoh_timed,	/* end of header */
+	mlfi_body_timed, /* body block filter */
+	mlfi_eom_timed,	/* end of message */
+	mlfi_abort_timed, /* message aborted */
+	mlfi_close_timed, /* shutdown */
+#else /* _FFR_METRICS */
 	mlfi_envfrom,	/* envelope sender filter */
 	mlfi_envrcpt,	/* envelope recipient filter */
 	mlfi_header,	/* header filter */
@@ -15213,6 +16540,7 @@ struct smfiDesc smfilter =
 	mlfi_eom,	/* end of message */
 	mlfi_abort,	/* message aborted */
 	mlfi_close,	/* shutdown */
+#endif /* _FFR_METRICS */
 #if SMFI_VERSION > 2
 	NULL,		/* unrecognised command */
 #endif
@@ -16333,11 +17661,17 @@ main(int argc, char **argv)
 		sigaddset(&sa.sa_mask, SIGINT);
 		sigaddset(&sa.sa_mask, SIGTERM);
 		sigaddset(&sa.sa_mask, SIGUSR1);
+#ifdef _FFR_METRICS
+		sigaddset(&sa.sa_mask, SIGUSR2);
+#endif /* _FFR_METRICS */
 		sa.sa_flags = 0;
 
 		if (sigaction(SIGHUP, &sa, NULL) != 0 ||
 		    sigaction(SIGINT, &sa, NULL) != 0 ||
 		    sigaction(SIGTERM, &sa, NULL) != 0 ||
+#ifdef _FFR_METRICS
+		    sigaction(SIGUSR2, &sa, NULL) != 0 ||
+#endif /* _FFR_METRICS */
 		    sigaction(SIGUSR1, &sa, NULL) != 0)
 		{
 			if (curconf->conf_dolog)
@@ -16457,6 +17791,18 @@ main(int argc, char **argv)
 
 							continue;
 						}
+#ifdef _FFR_METRICS
+						else if (dumpmetrics)
+						{
+							dkimf_killchild(pid,
+							                SIGUSR2,
+							                curconf->conf_dolog);
+
+							dumpmetrics = FALSE;
+
+							continue;
+						}
+#endif /* _FFR_METRICS */
 					}
 
 					if (pid != wpid)
@@ -16581,12 +17927,16 @@ main(int argc, char **argv)
 	}
 
 	/*
-	**  Block SIGUSR1 for use of our reload thread, and SIGHUP, SIGINT
-	**  and SIGTERM for use of libmilter's signal handling thread.
+	**  Block SIGUSR1 (and SIGUSR2) for use of our reload thread, and
+	**  SIGHUP, SIGINT and SIGTERM for use of libmilter's signal handling
+	**  thread.
 	*/
 
 	sigemptyset(&sigset);
 	sigaddset(&sigset, SIGUSR1);
+#ifdef _FFR_METRICS
+	sigaddset(&sigset, SIGUSR2);
+#endif /* _FFR_METRICS */
 	sigaddset(&sigset, SIGHUP);
 	sigaddset(&sigset, SIGTERM);
 	sigaddset(&sigset, SIGINT);
@@ -16863,10 +18213,108 @@ main(int argc, char **argv)
 	}
 #endif /* POPAUTH */
 
+#ifdef _FFR_LOG_QUEUE
+	if (curconf->conf_logqueue > 0 || curconf->conf_logqueuefile != NULL)
+	{
+		u_int qsize;
+
+		qsize = curconf->conf_logqueue;
+		if (qsize == 0)
+			qsize = DEFLOGQUEUE;
+
+		if (dkimf_logq_init(qsize, curconf->conf_logqueuefile,
+		                    &p) != 0)
+		{
+			if (curconf->conf_dolog)
+			{
+				syslog(LOG_ERR, "can't start log queue: %s",
+				       p);
+			}
+
+			fprintf(stderr, "%s: can't start log queue: %s\n",
+			        progname, p);
+
+			if (!autorestart && pidfile != NULL)
+				(void) unlink(pidfile);
+
+			return EX_UNAVAILABLE;
+		}
+	}
+#endif /* _FFR_LOG_QUEUE */
+
 #ifdef _FFR_STATS
 	dkimf_stats_init();
 #endif /* _FFR_STATS */
 
+#ifdef _FFR_METRICS
+	if (curconf->conf_metricssock != NULL &&
+	    dkimf_metrics_init(curconf->conf_metricssock, &p) != 0)
+	{
+		if (curconf->conf_dolog)
+		{
+			syslog(LOG_ERR, "%s: can't start metrics listener: %s",
+			       curconf->conf_metricssock, p);
+		}
+
+		fprintf(stderr, "%s: %s: can't start metrics listener: %s\n",
+		        progname, curconf->conf_metricssock, p);
+
+		if (!autorestart && pidfile != NULL)
+			(void) unlink(pidfile);
+
+		return EX_UNAVAILABLE;
+	}
+#endif /* _FFR_METRICS */
+
+#ifdef _FFR_KEYSTORE
+	if (curconf->conf_keystore && dkimf_keystore_init() != 0)
+	{
+		if (curconf->conf_dolog)
+		{
+			syslog(LOG_ERR, "dkimf_keystore_init(): %s",
+			       strerror(errno));
+		}
+
+		if (!autorestart && pidfile != NULL)
+			(void) unlink(pidfile);
+
+		return EX_OSERR;
+	}
+#endif /* _FFR_KEYSTORE */
+
+#if defined(USE_DB) && defined(_FFR_BDB_SNAPSHOT)
+	if (curconf->conf_bdbsnapshot && dkimf_db_snap_start() != 0)
+	{
+		if (curconf->conf_dolog)
+		{
+			syslog(LOG_ERR, "dkimf_db_snap_start(): %s",
+			       strerror(errno));
+		}
+
+		if (!autorestart && pidfile != NULL)
+			(void) unlink(pidfile);
+
+		return EX_OSERR;
+	}
+#endif /* defined(USE_DB) && defined(_FFR_BDB_SNAPSHOT) */
+
+#ifdef _FFR_DB_AUTORELOAD
+	if (curconf->conf_dbautoreload &&
+	    dkimf_db_reload_start(curconf->conf_dolog) != 0)
+	{
+		if (curconf->conf_dolog)
+		{
+			syslog(LOG_ERR, "dkimf_db_reload_start(): %s",
+			       strerror(errno));
+		}
+
+		if (!autorestart && pidfile != NULL)
+			(void) unlink(pidfile);
+
+		return EX_OSERR;
+	}
+#endif /* _FFR_DB_AUTORELOAD */
+
 	if (curconf->conf_dolog)
 	{
 		syslog(LOG_INFO, "%s v%s starting (%s)", DKIMF_PRODUCT,
@@ -16907,10 +18355,28 @@ main(int argc, char **argv)
 
 	dkimf_zapkey(curconf);
 
+#ifdef _FFR_KEYSTORE
+	dkimf_keystore_close();
+#endif /* _FFR_KEYSTORE */
+
 	/* tell the reloader thread to die */
 	die = TRUE;
 	(void) raise(SIGUSR1);
 
+#ifdef _FFR_STATS
+	/* write out any statistics still queued */
+	dkimf_stats_shutdown();
+#endif /* _FFR_STATS */
+
+#ifdef _FFR_METRICS
+	dkimf_metrics_shutdown();
+#endif /* _FFR_METRICS */
+
+#ifdef _FFR_LOG_QUEUE
+	/* write out any messages still queued */
+	dkimf_logq_shutdown();
+#endif /* _FFR_LOG_QUEUE */
+
 	if (!autorestart && pidfile != NULL)
 		(void) unlink(pidfile);
 
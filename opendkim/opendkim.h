@@ -34,6 +34,13 @@
 # endif /* DKIMF_LUA_PROTOTYPES */
 #endif /* USE_LUA */
 
+#ifdef _FFR_LOG_QUEUE
+/* hand everything logged to the log queue, once it's running */
+# include <syslog.h>
+# include "logqueue.h"
+# define syslog		dkimf_logq_syslog
+#endif /* _FFR_LOG_QUEUE */
+
 /* make sure we have TRUE and FALSE */
 #ifndef FALSE
 # define FALSE		0
@@ -47,8 +54,17 @@
 #define	CACHESTATSINT	300
 #define	CBINTERVAL	3
 #define	DEFCONFFILE	CONFIG_BASE "/opendkim.conf"
+#define	DEFDBBRRETRY	30
+#define	DEFDBBRSLOW	2000
+#define	DEFDBBRTHRESHOLD 5
+#define	DEFDBCACHENEGTTL 60
+#define	DEFDBCACHESIZE	10000
+#define	DEFDBCACHETTL	300
+#define	DEFDBWBSIZE	1000
 #define	DEFFLOWDATATTL	86400
+#define	DEFHANDLEPOOL	32
 #define	DEFINTERNAL	"csl:127.0.0.1,::1"
+#define	DEFLOGQUEUE	1024
 #define	DEFMAXHDRSZ	65536
 #define	DEFMAXVERIFY	3
 #define	DEFTIMEOUT	5
@@ -61,6 +77,7 @@
 #define	MAXHDRCNT	64
 #define	MAXHDRLEN	78
 #define	MAXSIGNATURE	1024
+#define	MSGARENASZ	16384
 #define	MTAMARGIN	78
 #define	NULLDOMAIN	"(invalid)"
 #define	SUPERUSER	"root"
@@ -104,6 +121,8 @@ struct Header
 {
 	char *		hdr_hdr;
 	char *		hdr_val;
+	u_char *	hdr_text;		/* as given to libopendkim */
+	size_t		hdr_textlen;
 	struct Header *	hdr_next;
 	struct Header *	hdr_prev;
 };
@@ -164,6 +183,7 @@ extern char *dkimf_get_ldap_param __P((int));
 
 #ifdef USE_LUA
 # ifdef DKIMF_LUA_PROTOTYPES
+extern void dkimf_clear_globals __P((void *, lua_State *));
 extern void dkimf_import_globals __P((void *, lua_State *));
 extern int dkimf_xs_addheader __P((lua_State *));
 extern int dkimf_xs_addrcpt __P((lua_State *));
@@ -170,6 +170,55 @@ dkimf_rep_close(DKIMF_REP rephandle)
 	(void) pthread_mutex_destroy(&rephandle->rep_lock);
 }
 
+#ifdef _FFR_DB_WRITEBEHIND
+/*
+**  DKIMF_REP_WRITEBEHIND -- buffer writes to the reputation caches
+**
+**  Parameters:
+**  	rep -- reputation handle
+**  	interval -- seconds between flushes
+**  	max -- flush early once this many writes are pending
+**
+**  Return value:
+**  	0 -- success
+**  	-1 -- failure; errno will be set
+*/
+
+int
+dkimf_rep_writebehind(DKIMF_REP rep, unsigned int interval, unsigned int max)
+{
+	assert(rep != NULL);
+
+	if (dkimf_db_wb_enable(rep->rep_reps, interval, max) != 0 ||
+	    dkimf_db_wb_enable(rep->rep_dups, interval, max) != 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+**  DKIMF_REP_WBDISABLE -- stop buffering writes to the reputation caches
+**
+**  Parameters:
+**  	rep -- reputation handle
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Pending writes are flushed first; see dkimf_db_wb_disable().
+*/
+
+void
+dkimf_rep_wbdisable(DKIMF_REP rep)
+{
+	assert(rep != NULL);
+
+	dkimf_db_wb_disable(rep->rep_reps);
+	dkimf_db_wb_disable(rep->rep_dups);
+}
+#endif /* _FFR_DB_WRITEBEHIND */
+
 /*
 **  DKIMF_REP_CHECK -- check reputation
 **
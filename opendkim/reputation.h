@@ -35,5 +35,9 @@ extern int dkimf_rep_check __P((DKIMF_REP, DKIM_SIGINFO *, _Bool,
                                 char *, size_t));
 extern int dkimf_rep_chown_cache __P((DKIMF_REP, uid_t));
 extern void dkimf_rep_close __P((DKIMF_REP));
+#ifdef _FFR_DB_WRITEBEHIND
+extern void dkimf_rep_wbdisable __P((DKIMF_REP));
+extern int dkimf_rep_writebehind __P((DKIMF_REP, unsigned int, unsigned int));
+#endif /* _FFR_DB_WRITEBEHIND */
 
 #endif /* _REPUTATION_H_ */
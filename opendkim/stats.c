@@ -24,6 +24,13 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #ifdef USE_GNUTLS
 /* GnuTLS includes */
@@ -55,14 +62,790 @@
 #include "util.h"
 #include "opendkim.h"
 #include "opendkim-db.h"
+#ifdef _FFR_METRICS
+# include "metrics.h"
+#endif /* _FFR_METRICS */
 
 /* macros, defaults */
 #define	DEFCT			"text/plain"
 #define	DEFCTE			"7bit"
 #define	DKIMF_STATS_MAXCOST	10
+#define	DKIMF_STATS_BATCH	64	/* records that wake the writer */
+#define	DKIMF_STATS_FLUSH	1	/* seconds between writes */
+#define	DKIMF_STATS_MAXQUEUE	8192	/* records waiting, at most */
+#define	DKIMF_STATS_AGGBUCKETS	1021	/* aggregation hash size */
+#define	DKIMF_STATS_AGGMAX	65536	/* aggregation keys, at most */
+
+#ifndef IOV_MAX
+# define IOV_MAX		16
+#endif /* ! IOV_MAX */
+#if IOV_MAX > DKIMF_STATS_BATCH
+# define DKIMF_STATS_IOV	DKIMF_STATS_BATCH
+#else /* IOV_MAX > DKIMF_STATS_BATCH */
+# define DKIMF_STATS_IOV	IOV_MAX
+#endif /* IOV_MAX > DKIMF_STATS_BATCH */
+
+/* data types */
+struct dkimf_stats_rec
+{
+	struct dkimf_stats_rec * sr_next;	/* next record */
+	char *			sr_path;	/* file to append to */
+	int			sr_format;	/* DKIMS_FORMAT_* */
+	size_t			sr_len;		/* bytes at sr_data */
+	char			sr_data[1];	/* record text, then path */
+};
+
+struct dkimf_stats_agg
+{
+	struct dkimf_stats_agg * sa_next;	/* next in bucket */
+	char *			sa_reporter;	/* reporter name */
+	char *			sa_domain;	/* From: domain */
+	u_long			sa_messages;	/* messages */
+	u_long			sa_signatures;	/* signatures */
+	u_long			sa_pass;	/* passing signatures */
+	u_long			sa_failbody;	/* body hash mismatches */
+	u_long			sa_sigerror;	/* other signature errors */
+	char			sa_data[1];	/* reporter, then domain */
+};
 
 /* globals */
-static pthread_mutex_t stats_lock;
+static _Bool stats_running;			/* writer thread started */
+static _Bool stats_die;				/* writer should exit */
+static _Bool stats_reopen;			/* writer should reopen */
+static _Bool stats_keyok;			/* stats_key created */
+static u_int stats_queued;			/* records in queue */
+static u_long stats_dropped;			/* records discarded */
+static pthread_t stats_writer;			/* writer thread */
+static pthread_key_t stats_key;			/* per-thread buffer */
+static pthread_mutex_t stats_lock;		/* queue lock */
+static pthread_cond_t stats_cond;		/* queue signal */
+static struct dkimf_stats_rec *stats_head;	/* oldest record */
+static struct dkimf_stats_rec *stats_tail;	/* newest record */
+static u_int stats_aggcount;			/* aggregation keys */
+static u_int stats_aggwindow;			/* aggregation window */
+static int stats_aggformat;			/* aggregation format */
+static time_t stats_aggstart;			/* current window start */
+static char *stats_aggpath;			/* aggregation file */
+static struct dkimf_stats_agg *stats_agg[DKIMF_STATS_AGGBUCKETS];
+
+/*
+**  DKIMF_STATS_FREEBUF -- destroy a thread's formatting buffer
+**
+**  Parameters:
+**  	p -- buffer to destroy
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_stats_freebuf(void *p)
+{
+	if (p != NULL)
+		dkimf_dstring_free((struct dkimf_dstring *) p);
+}
+
+/*
+**  DKIMF_STATS_OPEN -- open a statistics file for appending
+**
+**  Parameters:
+**  	path -- path to open
+**  	format -- DKIMS_FORMAT_* expected
+**
+**  Return value:
+**  	A descriptor, or -1 on error.
+**
+**  Side effects:
+**  	Writes the format header to a file that is new.  A file that
+**  	already holds the other format is not opened.
+*/
+
+static int
+dkimf_stats_open(char *path, int format)
+{
+	int fd;
+	ssize_t rlen;
+	struct stat s;
+	char hdr[BUFRSZ];
+
+	fd = open(path, O_RDWR|O_APPEND|O_CREAT, 0666);
+	if (fd == -1)
+	{
+		if (dolog)
+		{
+			syslog(LOG_ERR, "%s: open(): %s", path,
+			       strerror(errno));
+		}
+
+		return -1;
+	}
+
+	if (fstat(fd, &s) == 0 && s.st_size == 0)
+	{
+		/* write version if file is new */
+		if (format == DKIMS_FORMAT_BINARY)
+		{
+			uint32_t version;
+
+			version = htonl(DKIMS_BIN_VERSION);
+			memcpy(hdr, DKIMS_BIN_MAGIC, DKIMS_BIN_MAGICLEN);
+			memcpy(&hdr[DKIMS_BIN_MAGICLEN], &version,
+			       sizeof version);
+			(void) write(fd, hdr,
+			             DKIMS_BIN_MAGICLEN + sizeof version);
+		}
+		else
+		{
+			snprintf(hdr, sizeof hdr, "V%d\n", DKIMS_VERSION);
+			(void) write(fd, hdr, strlen(hdr));
+		}
+	}
+	else
+	{
+		/* don't mix formats in one file */
+		rlen = pread(fd, hdr, DKIMS_BIN_MAGICLEN, 0);
+		if ((rlen == DKIMS_BIN_MAGICLEN &&
+		     memcmp(hdr, DKIMS_BIN_MAGIC, DKIMS_BIN_MAGICLEN) == 0) !=
+		    (format == DKIMS_FORMAT_BINARY))
+		{
+			if (dolog)
+			{
+				syslog(LOG_ERR,
+				       "%s: not a %s statistics file", path,
+				       format == DKIMS_FORMAT_BINARY ? "binary"
+				                                     : "text");
+			}
+
+			(void) close(fd);
+			return -1;
+		}
+	}
+
+	return fd;
+}
+
+/*
+**  DKIMF_STATS_WRITEV -- write a set of buffers in full
+**
+**  Parameters:
+**  	fd -- descriptor
+**  	iov -- buffers (updated)
+**  	niov -- number of buffers
+**
+**  Return value:
+**  	0 on success, -1 on error.
+*/
+
+static int
+dkimf_stats_writev(int fd, struct iovec *iov, int niov)
+{
+	ssize_t wlen;
+
+	while (niov > 0)
+	{
+		wlen = writev(fd, iov, niov);
+		if (wlen == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		/* skip what was written; resume in the middle of a short one */
+		while (niov > 0 && (size_t) wlen >= iov->iov_len)
+		{
+			wlen -= iov->iov_len;
+			iov++;
+			niov--;
+		}
+
+		if (niov > 0)
+		{
+			iov->iov_base = (char *) iov->iov_base + wlen;
+			iov->iov_len -= wlen;
+		}
+	}
+
+	return 0;
+}
+
+/*
+**  DKIMF_STATS_FLUSH -- write out a batch of records
+**
+**  Parameters:
+**  	batch -- records to write, oldest first; freed
+**  	fd -- open descriptor (updated)
+**  	fdpath -- path "fd" refers to (updated)
+**  	fdformat -- format of "fdpath" (updated)
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_stats_flush(struct dkimf_stats_rec *batch, int *fd, char **fdpath,
+                  int *fdformat)
+{
+	int niov;
+	struct dkimf_stats_rec *cur;
+	struct dkimf_stats_rec *next;
+	struct dkimf_stats_rec *run;
+#ifdef _FFR_METRICS
+	struct timeval start;
+#endif /* _FFR_METRICS */
+	struct iovec iov[DKIMF_STATS_IOV];
+
+#ifdef _FFR_METRICS
+	dkimf_metrics_start(&start);
+#endif /* _FFR_METRICS */
+
+	while (batch != NULL)
+	{
+		/* switch files if this run goes somewhere else */
+		if (*fd == -1 || *fdformat != batch->sr_format ||
+		    strcmp(*fdpath, batch->sr_path) != 0)
+		{
+			if (*fd != -1)
+				(void) close(*fd);
+			if (*fdpath != NULL)
+				free(*fdpath);
+
+			*fdformat = batch->sr_format;
+			*fdpath = strdup(batch->sr_path);
+			*fd = *fdpath == NULL ? -1
+			                      : dkimf_stats_open(batch->sr_path,
+			                                         batch->sr_format);
+		}
+
+		/* gather records for the same file */
+		niov = 0;
+		run = batch;
+		for (cur = batch;
+		     cur != NULL && niov < DKIMF_STATS_IOV &&
+		     cur->sr_format == run->sr_format &&
+		     strcmp(cur->sr_path, run->sr_path) == 0;
+		     cur = cur->sr_next)
+		{
+			iov[niov].iov_base = cur->sr_data;
+			iov[niov].iov_len = cur->sr_len;
+			niov++;
+		}
+
+		if (*fd != -1 && dkimf_stats_writev(*fd, iov, niov) != 0)
+		{
+			if (dolog)
+			{
+				syslog(LOG_ERR, "%s: writev(): %s",
+				       *fdpath, strerror(errno));
+			}
+
+			/* try a fresh descriptor next time */
+			(void) close(*fd);
+			*fd = -1;
+		}
+
+		/* release what was just handled */
+		while (batch != cur)
+		{
+			next = batch->sr_next;
+			free(batch);
+			batch = next;
+		}
+	}
+
+#ifdef _FFR_METRICS
+	dkimf_metrics_time(DKIMF_METRIC_OPTIME, DKIMF_METRIC_OP_STATSWRITE,
+	                   &start);
+#endif /* _FFR_METRICS */
+}
+
+/*
+**  DKIMF_STATS_MKREC -- create a queue entry
+**
+**  Parameters:
+**  	path -- file to append to
+**  	format -- DKIMS_FORMAT_* of "data"
+**  	data -- formatted record(s)
+**  	len -- bytes at "data"
+**
+**  Return value:
+**  	A new entry, or NULL on error.
+*/
+
+static struct dkimf_stats_rec *
+dkimf_stats_mkrec(char *path, int format, u_char *data, size_t len)
+{
+	size_t plen;
+	struct dkimf_stats_rec *rec;
+
+	plen = strlen(path);
+
+	rec = (struct dkimf_stats_rec *) malloc(sizeof *rec + len + plen + 1);
+	if (rec == NULL)
+	{
+		if (dolog)
+			syslog(LOG_ERR, "malloc(): %s", strerror(errno));
+		return NULL;
+	}
+
+	memcpy(rec->sr_data, data, len);
+	rec->sr_len = len;
+	rec->sr_format = format;
+	rec->sr_path = &rec->sr_data[len];
+	memcpy(rec->sr_path, path, plen + 1);
+	rec->sr_next = NULL;
+
+	return rec;
+}
+
+/*
+**  DKIMF_STATS_APPEND -- add an entry to the writer's queue
+**
+**  Parameters:
+**  	rec -- entry to add
+**  	force -- add it even if the queue is full
+**
+**  Return value:
+**  	TRUE iff "rec" was queued; if not, it has been freed.
+**
+**  Notes:
+**  	Caller must hold stats_lock.
+*/
+
+static _Bool
+dkimf_stats_append(struct dkimf_stats_rec *rec, _Bool force)
+{
+	if (!force && stats_queued >= DKIMF_STATS_MAXQUEUE)
+	{
+		stats_dropped++;
+		free(rec);
+		return FALSE;
+	}
+
+	if (stats_tail == NULL)
+		stats_head = rec;
+	else
+		stats_tail->sr_next = rec;
+	stats_tail = rec;
+	stats_queued++;
+
+	if (stats_queued == DKIMF_STATS_BATCH)
+		pthread_cond_signal(&stats_cond);
+
+	return TRUE;
+}
+
+/*
+**  DKIMF_STATS_EMIT -- format one record
+**
+**  Parameters:
+**  	out -- dstring to which to append
+**  	format -- DKIMS_FORMAT_* to use
+**  	type -- record type
+**  	cols -- column encodings (see stats.h)
+**  	... -- column values; char * for 's', long for 'i', unsigned
+**  	       long for 'u'
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_stats_emit(struct dkimf_dstring *out, int format, int type,
+                 char *cols, ...)
+{
+	int start;
+	size_t len;
+	uint16_t slen;
+	uint32_t n;
+	char *p;
+	char *str;
+	va_list ap;
+
+	start = dkimf_dstring_len(out);
+
+	/* binary records lead with their length, filled in below */
+	if (format == DKIMS_FORMAT_BINARY)
+	{
+		n = 0;
+		dkimf_dstring_catn(out, (u_char *) &n, sizeof n);
+	}
+
+	dkimf_dstring_cat1(out, type);
+
+	va_start(ap, cols);
+
+	for (p = cols; *p != '\0'; p++)
+	{
+		if (format != DKIMS_FORMAT_BINARY && p != cols)
+			dkimf_dstring_cat1(out, '\t');
+
+		switch (*p)
+		{
+		  case 's':
+			str = va_arg(ap, char *);
+			if (format != DKIMS_FORMAT_BINARY)
+			{
+				dkimf_dstring_cat(out, (u_char *) str);
+				break;
+			}
+
+			len = strlen(str);
+			if (len > UINT16_MAX)
+				len = UINT16_MAX;
+			slen = htons((uint16_t) len);
+			dkimf_dstring_catn(out, (u_char *) &slen, sizeof slen);
+			dkimf_dstring_catn(out, (u_char *) str, len);
+			break;
+
+		  case 'i':
+		  {
+			long v;
+
+			v = va_arg(ap, long);
+			if (format != DKIMS_FORMAT_BINARY)
+			{
+				dkimf_dstring_printf(out, "%ld", v);
+				break;
+			}
+
+			n = htonl((uint32_t) (int32_t) v);
+			dkimf_dstring_catn(out, (u_char *) &n, sizeof n);
+			break;
+		  }
+
+		  case 'u':
+		  {
+			unsigned long v;
+
+			v = va_arg(ap, unsigned long);
+			if (format != DKIMS_FORMAT_BINARY)
+			{
+				dkimf_dstring_printf(out, "%lu", v);
+				break;
+			}
+
+			n = htonl((uint32_t) v);
+			dkimf_dstring_catn(out, (u_char *) &n, sizeof n);
+			break;
+		  }
+
+		  default:
+			assert(0);
+		}
+	}
+
+	va_end(ap);
+
+	if (format == DKIMS_FORMAT_BINARY)
+	{
+		n = htonl((uint32_t) (dkimf_dstring_len(out) - start -
+		                      sizeof n));
+		memcpy(dkimf_dstring_get(out) + start, &n, sizeof n);
+	}
+	else
+	{
+		dkimf_dstring_cat1(out, '\n');
+	}
+}
+
+/*
+**  DKIMF_STATS_AGGHASH -- hash an aggregation key
+**
+**  Parameters:
+**  	reporter -- reporter name
+**  	domain -- From: domain
+**
+**  Return value:
+**  	A bucket number.
+*/
+
+static u_int
+dkimf_stats_agghash(char *reporter, char *domain)
+{
+	u_long hash = 5381;
+	char *p;
+
+	for (p = reporter; *p != '\0'; p++)
+		hash = (hash << 5) + hash + (u_char) *p;
+	for (p = domain; *p != '\0'; p++)
+		hash = (hash << 5) + hash + tolower((u_char) *p);
+
+	return hash % DKIMF_STATS_AGGBUCKETS;
+}
+
+/*
+**  DKIMF_STATS_AGGEMIT -- close the current aggregation window
+**
+**  Parameters:
+**  	now -- current time
+**
+**  Return value:
+**  	None.
+**
+**  Side effects:
+**  	Queues one summary record per key seen during the window, clears
+**  	the counters and starts the window "now" falls in.
+**
+**  Notes:
+**  	Caller must hold stats_lock.
+*/
+
+static void
+dkimf_stats_aggemit(time_t now)
+{
+	u_int c;
+	struct dkimf_dstring *out = NULL;
+	struct dkimf_stats_agg *agg;
+	struct dkimf_stats_agg *next;
+	struct dkimf_stats_rec *rec;
+
+	if (stats_aggcount != 0)
+	{
+		out = dkimf_dstring_new(BUFRSZ, 0);
+		if (out == NULL && dolog)
+		{
+			syslog(LOG_ERR,
+			       "dkimf_dstring_new() failed; %u summary record(s) lost",
+			       stats_aggcount);
+		}
+	}
+
+	for (c = 0; c < DKIMF_STATS_AGGBUCKETS && stats_aggcount != 0; c++)
+	{
+		for (agg = stats_agg[c]; agg != NULL; agg = next)
+		{
+			next = agg->sa_next;
+
+			if (out != NULL)
+			{
+				dkimf_stats_emit(out, stats_aggformat, 'A',
+				                 DKIMS_BIN_ACOLS,
+				                 (unsigned long) stats_aggstart,
+				                 (unsigned long) stats_aggwindow,
+				                 agg->sa_reporter,
+				                 agg->sa_domain,
+				                 agg->sa_messages,
+				                 agg->sa_signatures,
+				                 agg->sa_pass,
+				                 agg->sa_failbody,
+				                 agg->sa_sigerror);
+			}
+
+			free(agg);
+			stats_aggcount--;
+		}
+
+		stats_agg[c] = NULL;
+	}
+
+	if (out != NULL)
+	{
+		rec = dkimf_stats_mkrec(stats_aggpath, stats_aggformat,
+		                        dkimf_dstring_get(out),
+		                        dkimf_dstring_len(out));
+		if (rec != NULL)
+			(void) dkimf_stats_append(rec, TRUE);
+
+		dkimf_dstring_free(out);
+	}
+
+	if (stats_aggwindow != 0)
+		stats_aggstart = now - (now % stats_aggwindow);
+}
+
+/*
+**  DKIMF_STATS_AGGADD -- count a message toward the current window
+**
+**  Parameters:
+**  	path -- file to append summaries to
+**  	format -- DKIMS_FORMAT_* to use
+**  	window -- window length, in seconds
+**  	reporter -- reporter name
+**  	domain -- From: domain
+**  	nsigs -- signatures evaluated
+**  	pass -- signatures that passed
+**  	failbody -- signatures whose body hash didn't match
+**  	sigerror -- signatures that had some other error
+**
+**  Return value:
+**  	0 on success, -1 on failure.
+**
+**  Notes:
+**  	Caller must hold stats_lock.
+*/
+
+static int
+dkimf_stats_aggadd(char *path, int format, u_int window, char *reporter,
+                   char *domain, u_long nsigs, u_long pass, u_long failbody,
+                   u_long sigerror)
+{
+	u_int hash;
+	size_t rlen;
+	size_t dlen;
+	time_t now;
+	struct dkimf_stats_agg *agg;
+
+	now = time(NULL);
+
+	/* reloaded with different settings; finish what we have */
+	if (stats_aggpath == NULL || stats_aggwindow != window ||
+	    stats_aggformat != format || strcmp(stats_aggpath, path) != 0)
+	{
+		char *newpath;
+
+		newpath = strdup(path);
+		if (newpath == NULL)
+		{
+			if (dolog)
+				syslog(LOG_ERR, "strdup(): %s", strerror(errno));
+			return -1;
+		}
+
+		if (stats_aggpath != NULL)
+		{
+			dkimf_stats_aggemit(now);
+			free(stats_aggpath);
+		}
+
+		stats_aggpath = newpath;
+		stats_aggwindow = window;
+		stats_aggformat = format;
+		stats_aggstart = now - (now % window);
+	}
+	else if (now >= stats_aggstart + (time_t) stats_aggwindow ||
+	         stats_aggcount >= DKIMF_STATS_AGGMAX)
+	{
+		dkimf_stats_aggemit(now);
+	}
+
+	hash = dkimf_stats_agghash(reporter, domain);
+
+	for (agg = stats_agg[hash]; agg != NULL; agg = agg->sa_next)
+	{
+		if (strcmp(agg->sa_reporter, reporter) == 0 &&
+		    strcasecmp(agg->sa_domain, domain) == 0)
+			break;
+	}
+
+	if (agg == NULL)
+	{
+		rlen = strlen(reporter);
+		dlen = strlen(domain);
+
+		agg = (struct dkimf_stats_agg *) malloc(sizeof *agg + rlen +
+		                                        dlen + 1);
+		if (agg == NULL)
+		{
+			if (dolog)
+				syslog(LOG_ERR, "malloc(): %s", strerror(errno));
+			return -1;
+		}
+
+		memset(agg, '\0', sizeof *agg);
+		agg->sa_reporter = agg->sa_data;
+		memcpy(agg->sa_reporter, reporter, rlen + 1);
+		agg->sa_domain = &agg->sa_data[rlen + 1];
+		memcpy(agg->sa_domain, domain, dlen + 1);
+
+		agg->sa_next = stats_agg[hash];
+		stats_agg[hash] = agg;
+		stats_aggcount++;
+	}
+
+	agg->sa_messages++;
+	agg->sa_signatures += nsigs;
+	agg->sa_pass += pass;
+	agg->sa_failbody += failbody;
+	agg->sa_sigerror += sigerror;
+
+	return 0;
+}
+
+/*
+**  DKIMF_STATS_WRITER -- statistics writer thread
+**
+**  Parameters:
+**  	vp -- void pointer required by thread API but not used
+**
+**  Return value:
+**  	NULL.
+*/
+
+static void *
+dkimf_stats_writer(/* UNUSED */ void *vp)
+{
+	_Bool die;
+	_Bool reopen;
+	int fd = -1;
+	int fdformat = DKIMS_FORMAT_TEXT;
+	u_long dropped;
+	time_t now;
+	char *fdpath = NULL;
+	struct dkimf_stats_rec *batch;
+	struct timespec timeout;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&stats_lock);
+
+		if (!stats_die && !stats_reopen &&
+		    stats_queued < DKIMF_STATS_BATCH)
+		{
+			timeout.tv_sec = time(NULL) + DKIMF_STATS_FLUSH;
+			timeout.tv_nsec = 0;
+
+			(void) pthread_cond_timedwait(&stats_cond, &stats_lock,
+			                              &timeout);
+		}
+
+		/* close an aggregation window that has ended */
+		now = time(NULL);
+		if (stats_aggpath != NULL &&
+		    (stats_die ||
+		     now >= stats_aggstart + (time_t) stats_aggwindow))
+			dkimf_stats_aggemit(now);
+
+		/* take everything waiting */
+		batch = stats_head;
+		stats_head = NULL;
+		stats_tail = NULL;
+		stats_queued = 0;
+		dropped = stats_dropped;
+		stats_dropped = 0;
+		reopen = stats_reopen;
+		stats_reopen = FALSE;
+		die = stats_die;
+
+		pthread_mutex_unlock(&stats_lock);
+
+		if (reopen && fd != -1)
+		{
+			(void) close(fd);
+			fd = -1;
+		}
+
+		if (dropped != 0 && dolog)
+		{
+			syslog(LOG_WARNING,
+			       "statistics writer behind; %lu record(s) dropped",
+			       dropped);
+		}
+
+		if (batch != NULL)
+			dkimf_stats_flush(batch, &fd, &fdpath, &fdformat);
+
+		if (die)
+			break;
+	}
+
+	if (fd != -1)
+		(void) close(fd);
+	if (fdpath != NULL)
+		free(fdpath);
+
+	return NULL;
+}
 
 /*
 **  DKIMF_STATS_INIT -- initialize statistics
@@ -72,12 +855,153 @@ static pthread_mutex_t stats_lock;
 **
 **  Return value:
 **  	None.
+**
+**  Notes:
+**  	Starts the writer thread.  Until this is called (e.g. in test
+**  	mode), or if the thread can't be started, records are written
+**  	out as they are made.
 */
 
 void
 dkimf_stats_init(void)
 {
+	int status;
+
 	pthread_mutex_init(&stats_lock, NULL);
+	pthread_cond_init(&stats_cond, NULL);
+
+	if (pthread_key_create(&stats_key, dkimf_stats_freebuf) == 0)
+		stats_keyok = TRUE;
+
+	status = pthread_create(&stats_writer, NULL, dkimf_stats_writer,
+	                        NULL);
+	if (status != 0)
+	{
+		if (dolog)
+		{
+			syslog(LOG_ERR, "pthread_create(): %s",
+			       strerror(status));
+		}
+
+		return;
+	}
+
+	stats_running = TRUE;
+}
+
+/*
+**  DKIMF_STATS_REOPEN -- have the writer reopen its file
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	None.
+*/
+
+void
+dkimf_stats_reopen(void)
+{
+	pthread_mutex_lock(&stats_lock);
+
+	if (stats_running)
+	{
+		stats_reopen = TRUE;
+		pthread_cond_signal(&stats_cond);
+	}
+
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+**  DKIMF_STATS_SHUTDOWN -- write out pending records and stop the writer
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	None.
+*/
+
+void
+dkimf_stats_shutdown(void)
+{
+	pthread_mutex_lock(&stats_lock);
+
+	if (!stats_running)
+	{
+		pthread_mutex_unlock(&stats_lock);
+		return;
+	}
+
+	stats_die = TRUE;
+	pthread_cond_signal(&stats_cond);
+
+	pthread_mutex_unlock(&stats_lock);
+
+	(void) pthread_join(stats_writer, NULL);
+
+	pthread_mutex_lock(&stats_lock);
+	stats_running = FALSE;
+	if (stats_aggpath != NULL)
+	{
+		free(stats_aggpath);
+		stats_aggpath = NULL;
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+**  DKIMF_STATS_QUEUE -- hand a formatted record to the writer
+**
+**  Parameters:
+**  	path -- file to append to
+**  	format -- DKIMS_FORMAT_* of "data"
+**  	data -- formatted record(s)
+**  	len -- bytes at "data"
+**
+**  Return value:
+**  	0 on success, -1 on failure.
+*/
+
+static int
+dkimf_stats_queue(char *path, int format, u_char *data, size_t len)
+{
+	int fd;
+	struct dkimf_stats_rec *rec;
+
+	rec = dkimf_stats_mkrec(path, format, data, len);
+	if (rec == NULL)
+		return -1;
+
+	pthread_mutex_lock(&stats_lock);
+
+	if (!stats_running)
+	{
+		int fdformat;
+		char *fdpath = NULL;
+
+		/* no writer; do it here, as it's serialized anyway */
+		fd = -1;
+		dkimf_stats_flush(rec, &fd, &fdpath, &fdformat);
+
+		pthread_mutex_unlock(&stats_lock);
+
+		if (fdpath != NULL)
+			free(fdpath);
+		if (fd == -1)
+			return -1;
+
+		(void) close(fd);
+
+		return 0;
+	}
+
+	(void) dkimf_stats_append(rec, FALSE);
+
+	pthread_mutex_unlock(&stats_lock);
+
+	return 0;
 }
 
 /*
@@ -85,6 +1009,9 @@ dkimf_stats_init(void)
 **
 **  Parameters:
 **  	path -- path to the DB to update
+**  	format -- DKIMS_FORMAT_* to write
+**  	window -- if non-zero, aggregate into windows this many seconds
+**  	          long rather than writing per-message records
 **  	jobid -- job ID for the current message
 **  	name -- reporter name to record
 **  	prefix -- hashing prefix
@@ -97,8 +1024,8 @@ dkimf_stats_init(void)
 */
 
 int
-dkimf_stats_record(char *path, u_char *jobid, char *name, char *prefix,
-                   Header hdrlist, DKIM *dkimv,
+dkimf_stats_record(char *path, int format, u_int window, u_char *jobid,
+                   char *name, char *prefix, Header hdrlist, DKIM *dkimv,
 #ifdef _FFR_STATSEXT
                    struct statsext *se,
 #endif /* _FFR_STATSEXT */
@@ -108,14 +1035,13 @@ dkimf_stats_record(char *path, u_char *jobid, char *name, char *prefix,
 {
 	int status = 0;
 	int nsigs = 0;
-	int err;
 	int c;
 	ssize_t canonlen;
 	ssize_t signlen;
 	ssize_t msglen;
-	FILE *out;
+	_Bool keep = FALSE;
+	struct dkimf_dstring *out = NULL;
 	unsigned char *from;
-	char *p;
 	DKIM_SIGINFO **sigs;
 	char tmp[BUFRSZ + 1];
 
@@ -123,27 +1049,6 @@ dkimf_stats_record(char *path, u_char *jobid, char *name, char *prefix,
 	assert(jobid != NULL);
 	assert(name != NULL);
 
-	pthread_mutex_lock(&stats_lock);
-
-	/* open the log file */
-	out = fopen(path, "a");
-	if (out == NULL)
-	{
-		if (dolog)
-		{
-			syslog(LOG_ERR, "%s: fopen(): %s", path,
-			       strerror(errno));
-		}
-
-		pthread_mutex_unlock(&stats_lock);
-
-		return -1;
-	}
-
-	/* write version if file is new */
-	if (ftell(out) == 0)
-		fprintf(out, "V%d\n", DKIMS_VERSION);
-
 	/* write info */
 	status = dkim_getsiglist(dkimv, &sigs, &nsigs);
 	if (status != DKIM_STAT_OK)
@@ -151,10 +1056,6 @@ dkimf_stats_record(char *path, u_char *jobid, char *name, char *prefix,
 		if (dolog)
 			syslog(LOG_ERR, "%s: dkim_getsiglist() failed", jobid);
 
-		fclose(out);
-
-		pthread_mutex_unlock(&stats_lock);
-
 		return 0;
 	}
 
@@ -164,14 +1065,73 @@ dkimf_stats_record(char *path, u_char *jobid, char *name, char *prefix,
 		if (dolog)
 			syslog(LOG_ERR, "%s: dkim_getdomain() failed", jobid);
 
-		fclose(out);
+		return 0;
+	}
 
+	/* just count it if aggregating; needs the writer to close windows */
+	if (window > 0)
+	{
+		u_long counted = 0;
+		u_long pass = 0;
+		u_long failbody = 0;
+		u_long sigerror = 0;
+
+		for (c = 0; c < nsigs; c++)
+		{
+			if ((dkim_sig_getflags(sigs[c]) &
+			     DKIM_SIGFLAG_IGNORE) != 0)
+				continue;
+
+			counted++;
+			if ((dkim_sig_getflags(sigs[c]) &
+			     DKIM_SIGFLAG_PASSED) != 0)
+				pass++;
+			if (dkim_sig_getbh(sigs[c]) == DKIM_SIGBH_MISMATCH)
+				failbody++;
+			if (dkim_sig_geterror(sigs[c]) != DKIM_SIGERROR_OK)
+				sigerror++;
+		}
+
+		pthread_mutex_lock(&stats_lock);
+		if (stats_running)
+		{
+			status = dkimf_stats_aggadd(path, format, window,
+			                            name, (char *) from,
+			                            counted, pass, failbody,
+			                            sigerror);
+			pthread_mutex_unlock(&stats_lock);
+
+			return status;
+		}
 		pthread_mutex_unlock(&stats_lock);
+	}
 
-		return 0;
+	/* format into this thread's buffer */
+	if (stats_keyok)
+		out = (struct dkimf_dstring *) pthread_getspecific(stats_key);
+
+	if (out != NULL)
+	{
+		dkimf_dstring_blank(out);
+		keep = TRUE;
 	}
+	else
+	{
+		out = dkimf_dstring_new(BUFRSZ, 0);
+		if (out == NULL)
+		{
+			if (dolog)
+			{
+				syslog(LOG_ERR, "%s: dkimf_dstring_new() failed",
+				       jobid);
+			}
 
-	fprintf(out, "M%s\t%s\t%s", jobid, name, (char *) from);
+			return -1;
+		}
+
+		if (stats_keyok && pthread_setspecific(stats_key, out) == 0)
+			keep = TRUE;
+	}
 
 	memset(tmp, '\0', sizeof tmp);
 
@@ -203,11 +1163,7 @@ dkimf_stats_record(char *path, u_char *jobid, char *name, char *prefix,
 	}
 
 	if (tmp[0] == '\0')
-		fprintf(out, "\tunknown");
-	else
-		fprintf(out, "\t%s", tmp);
-
-	fprintf(out, "\t%lu", time(NULL));
+		strlcpy(tmp, "unknown", sizeof tmp);
 
 	msglen = 0;
 	canonlen = 0;
@@ -218,53 +1174,37 @@ dkimf_stats_record(char *path, u_char *jobid, char *name, char *prefix,
 		                            &canonlen, &signlen);
 	}
 
-	fprintf(out, "\t%lu", (unsigned long) canonlen);
-
-	fprintf(out, "\t%d", nsigs);
+#ifndef _FFR_ATPS
+	atps = -1;
+#endif /* ! _FFR_ATPS */
+#ifndef _FFR_REPUTATION
+	spam = -1;
+#endif /* ! _FFR_REPUTATION */
 
-#ifdef _FFR_ATPS
-	fprintf(out, "\t%d", atps);
-#else /* _FFR_ATPS */
-	fprintf(out, "\t-1");
-#endif /* _FFR_ATPS */
-
-#ifdef _FFR_REPUTATION
-	fprintf(out, "\t%d", spam);
-#else /* _FFR_REPUTATION */
-	fprintf(out, "\t-1");
-#endif /* _FFR_REPUTATION */
-
-	fprintf(out, "\n");
+	dkimf_stats_emit(out, format, 'M', DKIMS_BIN_MCOLS,
+	                 (char *) jobid, name, (char *) from, tmp,
+	                 (unsigned long) time(NULL),
+	                 (unsigned long) canonlen,
+	                 (long) nsigs, (long) atps, (long) spam);
 
 	for (c = 0; c < nsigs; c++)
 	{
 		if ((dkim_sig_getflags(sigs[c]) & DKIM_SIGFLAG_IGNORE) != 0)
 			continue;
 
-		fprintf(out, "S");
-
-		p = (char *) dkim_sig_getdomain(sigs[c]);
-		fprintf(out, "%s", p);
-
-		fprintf(out, "\t%d",
-		        (dkim_sig_getflags(sigs[c]) &
-		         DKIM_SIGFLAG_PASSED) != 0);
-
-		fprintf(out, "\t%d",
-		        dkim_sig_getbh(sigs[c]) == DKIM_SIGBH_MISMATCH);
-
 		(void) dkim_sig_getcanonlen(dkimv, sigs[c], &msglen,
 		                            &canonlen, &signlen);
-		fprintf(out, "\t%ld", (long) signlen);
-
-		err = dkim_sig_geterror(sigs[c]);
 
-		/* syntax error codes */
-		fprintf(out, "\t%d", err);
-
-		fprintf(out, "\t%d", dkim_sig_getdnssec(sigs[c]));
-
-		fprintf(out, "\n");
+		/* syntax error codes go in the fifth column */
+		dkimf_stats_emit(out, format, 'S', DKIMS_BIN_SCOLS,
+		                 (char *) dkim_sig_getdomain(sigs[c]),
+		                 (long) ((dkim_sig_getflags(sigs[c]) &
+		                          DKIM_SIGFLAG_PASSED) != 0),
+		                 (long) (dkim_sig_getbh(sigs[c]) ==
+		                         DKIM_SIGBH_MISMATCH),
+		                 (long) signlen,
+		                 (long) dkim_sig_geterror(sigs[c]),
+		                 (long) dkim_sig_getdnssec(sigs[c]));
 	}
 
 #ifdef _FFR_STATSEXT
@@ -273,15 +1213,20 @@ dkimf_stats_record(char *path, u_char *jobid, char *name, char *prefix,
 		struct statsext *cur;
 
 		for (cur = se; cur != NULL; cur = cur->se_next)
-			fprintf(out, "X%s\t%s\n", cur->se_name, cur->se_value);
+		{
+			dkimf_stats_emit(out, format, 'X', DKIMS_BIN_XCOLS,
+			                 cur->se_name, cur->se_value);
+		}
 	}
 #endif /* _FFR_STATSEXT */
 
-	/* close output */
-	fclose(out);
+	/* hand it off */
+	status = dkimf_stats_queue(path, format, dkimf_dstring_get(out),
+	                           dkimf_dstring_len(out));
 
-	pthread_mutex_unlock(&stats_lock);
+	if (!keep)
+		dkimf_dstring_free(out);
 
-	return 0;
+	return status;
 }
 #endif /* _FFR_STATS */
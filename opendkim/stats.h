@@ -42,10 +42,45 @@
 #define	DKIMS_SI_DNSSEC		5
 #define DKIMS_SI_MAX		5
 
+#define	DKIMS_AI_START		0
+#define	DKIMS_AI_WINDOW		1
+#define	DKIMS_AI_REPORTER	2
+#define	DKIMS_AI_FROMDOMAIN	3
+#define	DKIMS_AI_MESSAGES	4
+#define	DKIMS_AI_SIGNATURES	5
+#define	DKIMS_AI_PASS		6
+#define	DKIMS_AI_FAIL_BODY	7
+#define	DKIMS_AI_SIGERROR	8
+#define	DKIMS_AI_MAX		8
+
+/* file formats */
+#define	DKIMS_FORMAT_TEXT	0
+#define	DKIMS_FORMAT_BINARY	1
+
+/*
+**  A binary file starts with DKIMS_BIN_MAGIC and a 4-byte version.  Each
+**  record is then a 4-byte length of the rest of the record, the record
+**  type ('M', 'S', 'X' or 'A', as in the text format) and the columns
+**  above in order, encoded as listed for that type below:  's' is a
+**  2-byte length and that many bytes, 'i' and 'u' are signed and
+**  unsigned 4-byte integers.  All integers are in network byte order.
+*/
+
+#define	DKIMS_BIN_MAGIC		"ODKIMSTB"
+#define	DKIMS_BIN_MAGICLEN	8
+#define	DKIMS_BIN_VERSION	1
+
+#define	DKIMS_BIN_MCOLS		"ssssuuiii"
+#define	DKIMS_BIN_SCOLS		"siiiii"
+#define	DKIMS_BIN_XCOLS		"ss"
+#define	DKIMS_BIN_ACOLS		"uussuuuuu"
+
 /* PROTOTYPES */
 extern void dkimf_stats_init __P((void));
-extern int dkimf_stats_record __P((char *, u_char *, char *, char *, Header,
-                                   DKIM *,
+extern void dkimf_stats_reopen __P((void));
+extern void dkimf_stats_shutdown __P((void));
+extern int dkimf_stats_record __P((char *, int, u_int, u_char *, char *,
+                                   char *, Header, DKIM *,
 #ifdef _FFR_STATSEXT
                                    struct statsext *,
 #endif /* _FFR_STATSEXT */
@@ -0,0 +1,150 @@
+-- Copyright (c) 2015, The Trusted Domain Project.  All rights reserved.
+
+-- relaxed/simple signing test using a cached SigningTable
+--
+-- The SigningTable is a Lua data set that only matches while a marker file
+-- exists.  Confirms that once the marker is gone, a sender that was looked
+-- up before is still signed from the cache, while a sender that wasn't is
+-- not signed at all.
+
+mt.echo("*** relaxed/simple signing test using tables and dataset caching")
+
+-- setup
+if TESTSOCKET ~= nil then
+	sock = TESTSOCKET
+else
+	sock = "unix:" .. mt.getcwd() .. "/t-sign-rs-tables-cache.sock"
+end
+binpath = mt.getcwd() .. "/.."
+if os.getenv("srcdir") ~= nil then
+	mt.chdir(os.getenv("srcdir"))
+end
+
+-- the SigningTable matches while this exists
+marker = "t-sign-rs-tables-cache.on"
+f = io.open(marker, "w")
+if f == nil then
+	error("can't create " .. marker)
+end
+f:close()
+
+-- try to start the filter
+mt.startfilter(binpath .. "/opendkim", "-x", "t-sign-rs-tables-cache.conf",
+               "-p", sock)
+
+-- try to connect to it
+conn = mt.connect(sock, 40, 0.25)
+if conn == nil then
+	os.remove(marker)
+	error("mt.connect() failed")
+end
+
+-- send connection information
+-- mt.negotiate() is called implicitly
+if mt.conninfo(conn, "localhost", "127.0.0.1") ~= nil then
+	error("mt.conninfo() failed")
+end
+if mt.getreply(conn) ~= SMFIR_CONTINUE then
+	error("mt.conninfo() unexpected reply")
+end
+
+-- send one message from "from"; returns the reply to EOH
+function sendheaders(conn, from)
+	mt.macro(conn, SMFIC_MAIL, "i", "t-sign-rs-tables-cache")
+	if mt.mailfrom(conn, from) ~= nil then
+		error("mt.mailfrom() failed")
+	end
+	if mt.getreply(conn) ~= SMFIR_CONTINUE then
+		error("mt.mailfrom() unexpected reply")
+	end
+
+	-- send headers
+	-- mt.rcptto() is called implicitly
+	if mt.header(conn, "From", from) ~= nil then
+		error("mt.header(From) failed")
+	end
+	if mt.getreply(conn) ~= SMFIR_CONTINUE then
+		error("mt.header(From) unexpected reply")
+	end
+	if mt.header(conn, "Date", "Tue, 22 Dec 2009 13:04:12 -0800") ~= nil then
+		error("mt.header(Date) failed")
+	end
+	if mt.getreply(conn) ~= SMFIR_CONTINUE then
+		error("mt.header(Date) unexpected reply")
+	end
+	if mt.header(conn, "Subject", "Signing test") ~= nil then
+		error("mt.header(Subject) failed")
+	end
+	if mt.getreply(conn) ~= SMFIR_CONTINUE then
+		error("mt.header(Subject) unexpected reply")
+	end
+
+	-- send EOH
+	if mt.eoh(conn) ~= nil then
+		error("mt.eoh() failed")
+	end
+	return mt.getreply(conn)
+end
+
+-- finish a message and confirm that it was signed
+function checksigned(conn)
+	-- send body
+	if mt.bodystring(conn, "This is a test!\r\n") ~= nil then
+		error("mt.bodystring() failed")
+	end
+	if mt.getreply(conn) ~= SMFIR_CONTINUE then
+		error("mt.bodystring() unexpected reply")
+	end
+
+	-- end of message; let the filter react
+	if mt.eom(conn) ~= nil then
+		error("mt.eom() failed")
+	end
+	if mt.getreply(conn) ~= SMFIR_ACCEPT then
+		error("mt.eom() unexpected reply")
+	end
+
+	-- verify that a signature got added
+	if not mt.eom_check(conn, MT_HDRINSERT, "DKIM-Signature") and
+	   not mt.eom_check(conn, MT_HDRADD, "DKIM-Signature") then
+		error("no signature added")
+	end
+
+	-- confirm properties
+	sig = mt.getheader(conn, "DKIM-Signature", 0)
+	if string.find(sig, "c=relaxed/simple", 1, true) == nil then
+		error("signature has wrong c= value")
+	end
+	if string.find(sig, "d=example.com", 1, true) == nil then
+		error("signature has wrong d= value")
+	end
+	if string.find(sig, "s=test", 1, true) == nil then
+		error("signature has wrong s= value")
+	end
+	if string.find(sig, "bh=3VWGQGY+cSNYd1MGM+X6hRXU0stl8JCaQtl4mbX/j2I=", 1, true) == nil then
+		error("signature has wrong bh= value")
+	end
+end
+
+-- first message: looked up in the data set
+if sendheaders(conn, "user@example.com") ~= SMFIR_CONTINUE then
+	os.remove(marker)
+	error("mt.eoh() unexpected reply (first message)")
+end
+checksigned(conn)
+
+-- the data set no longer matches anything
+os.remove(marker)
+
+-- second message: same sender, so answered by the cache
+if sendheaders(conn, "user@example.com") ~= SMFIR_CONTINUE then
+	error("mt.eoh() unexpected reply (cached message)")
+end
+checksigned(conn)
+
+-- third message: new sender, so the data set is asked and says no
+if sendheaders(conn, "user2@example.com") ~= SMFIR_ACCEPT then
+	error("mt.eoh() unexpected reply (uncached message)")
+end
+
+mt.disconnect(conn)
@@ -0,0 +1,179 @@
+-- Copyright (c) 2015, The Trusted Domain Project.  All rights reserved.
+
+-- relaxed/simple signing test using compiled tables
+--
+-- Compiles the SigningTable and a SenderHeaders list with
+-- opendkim-compiletables.  Confirms that lookups in the compiled
+-- SigningTable give the same answers as the flat file, and that the
+-- SenderHeaders list keeps its order ("Sender" before "From") even though
+-- a compiled table groups its records by key.
+
+mt.echo("*** relaxed/simple signing test using compiled tables")
+
+-- setup
+if TESTSOCKET ~= nil then
+	sock = TESTSOCKET
+else
+	sock = "unix:" .. mt.getcwd() .. "/t-sign-rs-tables-ctable.sock"
+end
+binpath = mt.getcwd() .. "/.."
+if os.getenv("srcdir") ~= nil then
+	mt.chdir(os.getenv("srcdir"))
+end
+
+function cleanup()
+	os.remove("t-sign-rs-tables-ctable.sign.ct")
+	os.remove("t-sign-rs-tables-ctable.hdrs.ct")
+end
+
+function fail(msg)
+	cleanup()
+	error(msg)
+end
+
+-- compile the tables
+status = os.execute(binpath .. "/opendkim-compiletables " ..
+                    "file:t-sign-rs-tables.sign " ..
+                    "t-sign-rs-tables-ctable.sign.ct && " ..
+                    binpath .. "/opendkim-compiletables " ..
+                    "file:t-sign-rs-tables-ctable.hdrs " ..
+                    "t-sign-rs-tables-ctable.hdrs.ct")
+if status ~= 0 and status ~= true then
+	fail("opendkim-compiletables failed")
+end
+
+-- try to start the filter
+mt.startfilter(binpath .. "/opendkim", "-x", "t-sign-rs-tables-ctable.conf",
+               "-p", sock)
+
+-- try to connect to it
+conn = mt.connect(sock, 40, 0.25)
+if conn == nil then
+	fail("mt.connect() failed")
+end
+
+-- send connection information
+-- mt.negotiate() is called implicitly
+if mt.conninfo(conn, "localhost", "127.0.0.1") ~= nil then
+	fail("mt.conninfo() failed")
+end
+if mt.getreply(conn) ~= SMFIR_CONTINUE then
+	fail("mt.conninfo() unexpected reply")
+end
+
+-- send one message with the given From: and Sender:; returns the reply
+-- to EOH
+function sendheaders(conn, from, sender)
+	mt.macro(conn, SMFIC_MAIL, "i", "t-sign-rs-tables-ctable")
+	if mt.mailfrom(conn, sender) ~= nil then
+		fail("mt.mailfrom() failed")
+	end
+	if mt.getreply(conn) ~= SMFIR_CONTINUE then
+		fail("mt.mailfrom() unexpected reply")
+	end
+
+	-- send headers
+	-- mt.rcptto() is called implicitly
+	if mt.header(conn, "From", from) ~= nil then
+		fail("mt.header(From) failed")
+	end
+	if mt.getreply(conn) ~= SMFIR_CONTINUE then
+		fail("mt.header(From) unexpected reply")
+	end
+	if mt.header(conn, "Sender", sender) ~= nil then
+		fail("mt.header(Sender) failed")
+	end
+	if mt.getreply(conn) ~= SMFIR_CONTINUE then
+		fail("mt.header(Sender) unexpected reply")
+	end
+	if mt.header(conn, "Date", "Tue, 22 Dec 2009 13:04:12 -0800") ~= nil then
+		fail("mt.header(Date) failed")
+	end
+	if mt.getreply(conn) ~= SMFIR_CONTINUE then
+		fail("mt.header(Date) unexpected reply")
+	end
+	if mt.header(conn, "Subject", "Signing test") ~= nil then
+		fail("mt.header(Subject) failed")
+	end
+	if mt.getreply(conn) ~= SMFIR_CONTINUE then
+		fail("mt.header(Subject) unexpected reply")
+	end
+
+	-- send EOH
+	if mt.eoh(conn) ~= nil then
+		fail("mt.eoh() failed")
+	end
+	return mt.getreply(conn)
+end
+
+-- finish a message and return its signature
+function getsig(conn, which)
+	-- send body
+	if mt.bodystring(conn, "This is a test!\r\n") ~= nil then
+		fail("mt.bodystring() failed")
+	end
+	if mt.getreply(conn) ~= SMFIR_CONTINUE then
+		fail("mt.bodystring() unexpected reply")
+	end
+
+	-- end of message; let the filter react
+	if mt.eom(conn) ~= nil then
+		fail("mt.eom() failed")
+	end
+	if mt.getreply(conn) ~= SMFIR_ACCEPT then
+		fail("mt.eom() unexpected reply (" .. which .. ")")
+	end
+
+	-- verify that a signature got added
+	if not mt.eom_check(conn, MT_HDRINSERT, "DKIM-Signature") and
+	   not mt.eom_check(conn, MT_HDRADD, "DKIM-Signature") then
+		fail("no signature added (" .. which .. ")")
+	end
+
+	-- confirm properties
+	sig = mt.getheader(conn, "DKIM-Signature", 0)
+	if string.find(sig, "c=relaxed/simple", 1, true) == nil then
+		fail("signature has wrong c= value (" .. which .. ")")
+	end
+	if string.find(sig, "d=example.com", 1, true) == nil then
+		fail("signature has wrong d= value (" .. which .. ")")
+	end
+	if string.find(sig, "s=test", 1, true) == nil then
+		fail("signature has wrong s= value (" .. which .. ")")
+	end
+	if string.find(sig, "bh=3VWGQGY+cSNYd1MGM+X6hRXU0stl8JCaQtl4mbX/j2I=", 1, true) == nil then
+		fail("signature has wrong bh= value (" .. which .. ")")
+	end
+
+	return sig
+end
+
+-- Sender: is consulted first, and maps to a key with no signer
+if sendheaders(conn, "nobody@example.net",
+               "user@example.com") ~= SMFIR_CONTINUE then
+	fail("mt.eoh() unexpected reply (first message)")
+end
+sig = getsig(conn, "first message")
+if string.find(sig, "i=signer@example.com", 1, true) ~= nil then
+	fail("signature has unexpected i= value")
+end
+
+-- Sender: maps to a key and a signer
+if sendheaders(conn, "nobody@example.net",
+               "user2@example.com") ~= SMFIR_CONTINUE then
+	fail("mt.eoh() unexpected reply (second message)")
+end
+sig = getsig(conn, "second message")
+if string.find(sig, "i=signer@example.com", 1, true) == nil then
+	fail("signature has wrong i= value")
+end
+
+-- Sender: isn't in the SigningTable, so From: doesn't matter
+if sendheaders(conn, "user@example.com",
+               "nobody@example.net") ~= SMFIR_ACCEPT then
+	fail("mt.eoh() unexpected reply (third message)")
+end
+
+mt.disconnect(conn)
+
+cleanup()
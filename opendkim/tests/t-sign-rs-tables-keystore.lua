@@ -0,0 +1,214 @@
+-- Copyright (c) 2015, The Trusted Domain Project.  All rights reserved.
+
+-- relaxed/simple signing test using KeyStore
+--
+-- Confirms that once a key is in the key store, the next message is signed
+-- without the key file being read again (each read is logged, with LogWhy,
+-- to the file named by LogQueueFile), and that making a directory above
+-- the key's own directory writeable by others, which fails the
+-- RequireSafeKeys check, is noticed without a reload.
+
+mt.echo("*** relaxed/simple signing test using tables and KeyStore")
+
+-- setup
+if TESTSOCKET ~= nil then
+	sock = TESTSOCKET
+else
+	sock = "unix:" .. mt.getcwd() .. "/t-sign-rs-tables-keystore.sock"
+end
+binpath = mt.getcwd() .. "/.."
+if os.getenv("srcdir") ~= nil then
+	mt.chdir(os.getenv("srcdir"))
+end
+
+-- a private copy of the key, in directories only we can use
+keydir = "t-sign-rs-tables-keystore.d"
+logfile = "t-sign-rs-tables-keystore.log"
+os.execute("rm -rf " .. keydir)
+status = os.execute("mkdir -m 0700 " .. keydir .. " " .. keydir .. "/keys && " ..
+                    "cp testkey.private " .. keydir .. "/keys && " ..
+                    "chmod 0600 " .. keydir .. "/keys/testkey.private")
+if status ~= 0 and status ~= true then
+	os.execute("rm -rf " .. keydir)
+	error("can't create " .. keydir)
+end
+
+function cleanup()
+	os.execute("rm -rf " .. keydir)
+	os.remove(logfile)
+end
+
+function fail(msg)
+	cleanup()
+	error(msg)
+end
+
+-- create the log now, so it doesn't change the directory above the key
+-- once the filter is running
+f = io.open(logfile, "w")
+if f == nil then
+	fail("can't create " .. logfile)
+end
+f:close()
+
+-- count reads of the key file logged so far
+function keyreads()
+	local n = 0
+	local f = io.open(logfile, "r")
+	if f == nil then
+		fail("can't open " .. logfile)
+	end
+	for line in f:lines() do
+		if string.find(line, "reading key from", 1, true) ~= nil then
+			n = n + 1
+		end
+	end
+	f:close()
+	return n
+end
+
+-- wait for the log to show at least "want" reads; returns the count
+function waitreads(want)
+	local n = keyreads()
+	for c = 1, 40 do
+		if n >= want then
+			break
+		end
+		mt.sleep(0.1)
+		n = keyreads()
+	end
+
+	-- give a read that shouldn't have happened time to show up too
+	mt.sleep(0.5)
+	return keyreads()
+end
+
+-- try to start the filter
+mt.startfilter(binpath .. "/opendkim", "-x", "t-sign-rs-tables-keystore.conf",
+               "-p", sock)
+
+-- try to connect to it
+conn = mt.connect(sock, 40, 0.25)
+if conn == nil then
+	fail("mt.connect() failed")
+end
+
+-- a key isn't stored while a directory above it was changed (e.g. by
+-- creating the socket) in the same second
+mt.sleep(1.1)
+
+-- send connection information
+-- mt.negotiate() is called implicitly
+if mt.conninfo(conn, "localhost", "127.0.0.1") ~= nil then
+	fail("mt.conninfo() failed")
+end
+if mt.getreply(conn) ~= SMFIR_CONTINUE then
+	fail("mt.conninfo() unexpected reply")
+end
+
+-- send one message; returns the reply to EOH
+function sendheaders(conn)
+	mt.macro(conn, SMFIC_MAIL, "i", "t-sign-rs-tables-keystore")
+	if mt.mailfrom(conn, "user@example.com") ~= nil then
+		fail("mt.mailfrom() failed")
+	end
+	if mt.getreply(conn) ~= SMFIR_CONTINUE then
+		fail("mt.mailfrom() unexpected reply")
+	end
+
+	-- send headers
+	-- mt.rcptto() is called implicitly
+	if mt.header(conn, "From", "user@example.com") ~= nil then
+		fail("mt.header(From) failed")
+	end
+	if mt.getreply(conn) ~= SMFIR_CONTINUE then
+		fail("mt.header(From) unexpected reply")
+	end
+	if mt.header(conn, "Date", "Tue, 22 Dec 2009 13:04:12 -0800") ~= nil then
+		fail("mt.header(Date) failed")
+	end
+	if mt.getreply(conn) ~= SMFIR_CONTINUE then
+		fail("mt.header(Date) unexpected reply")
+	end
+	if mt.header(conn, "Subject", "Signing test") ~= nil then
+		fail("mt.header(Subject) failed")
+	end
+	if mt.getreply(conn) ~= SMFIR_CONTINUE then
+		fail("mt.header(Subject) unexpected reply")
+	end
+
+	-- send EOH; the key is loaded here
+	if mt.eoh(conn) ~= nil then
+		fail("mt.eoh() failed")
+	end
+	return mt.getreply(conn)
+end
+
+-- send one message and confirm that it was signed
+function sendsigned(conn, which)
+	if sendheaders(conn) ~= SMFIR_CONTINUE then
+		fail("mt.eoh() unexpected reply (" .. which .. " message)")
+	end
+
+	-- send body
+	if mt.bodystring(conn, "This is a test!\r\n") ~= nil then
+		fail("mt.bodystring() failed")
+	end
+	if mt.getreply(conn) ~= SMFIR_CONTINUE then
+		fail("mt.bodystring() unexpected reply")
+	end
+
+	-- end of message; let the filter react
+	if mt.eom(conn) ~= nil then
+		fail("mt.eom() failed")
+	end
+	if mt.getreply(conn) ~= SMFIR_ACCEPT then
+		fail("mt.eom() unexpected reply (" .. which .. " message)")
+	end
+
+	-- verify that a signature got added
+	if not mt.eom_check(conn, MT_HDRINSERT, "DKIM-Signature") and
+	   not mt.eom_check(conn, MT_HDRADD, "DKIM-Signature") then
+		fail("no signature added (" .. which .. " message)")
+	end
+
+	-- confirm properties
+	sig = mt.getheader(conn, "DKIM-Signature", 0)
+	if string.find(sig, "d=example.com", 1, true) == nil then
+		fail("signature has wrong d= value")
+	end
+	if string.find(sig, "s=test", 1, true) == nil then
+		fail("signature has wrong s= value")
+	end
+	if string.find(sig, "bh=3VWGQGY+cSNYd1MGM+X6hRXU0stl8JCaQtl4mbX/j2I=", 1, true) == nil then
+		fail("signature has wrong bh= value")
+	end
+end
+
+-- first message: the key is read, checked and stored
+sendsigned(conn, "first")
+if waitreads(1) ~= 1 then
+	fail("key file not read exactly once for the first message")
+end
+
+-- second message: served from the key store
+sendsigned(conn, "second")
+if waitreads(2) ~= 1 then
+	fail("key file read again for the second message")
+end
+
+-- the path no longer passes RequireSafeKeys; the key is read and checked
+-- again, and the message isn't signed
+os.execute("chmod 0777 " .. keydir)
+mt.sleep(0.5)
+
+if sendheaders(conn) ~= SMFIR_TEMPFAIL then
+	fail("mt.eoh() unexpected reply (unsafe directory)")
+end
+if waitreads(2) ~= 2 then
+	fail("key file not read again after its directory changed")
+end
+
+mt.disconnect(conn)
+
+cleanup()
@@ -0,0 +1,208 @@
+-- Copyright (c) 2015, The Trusted Domain Project.  All rights reserved.
+
+-- relaxed/simple signing test using an automatically reloaded SigningTable
+--
+-- The SigningTable is a flat file that is replaced while messages are
+-- being signed, so lookups run while the filter swaps in the new
+-- contents.  Confirms that every lookup sees either the old contents or
+-- the new, and that once the new contents are in use, an answer cached
+-- from the old ones is never given again.
+
+mt.echo("*** relaxed/simple signing test using tables and automatic reload")
+
+-- setup
+if TESTSOCKET ~= nil then
+	sock = TESTSOCKET
+else
+	sock = "unix:" .. mt.getcwd() .. "/t-sign-rs-tables-reload.sock"
+end
+binpath = mt.getcwd() .. "/.."
+if os.getenv("srcdir") ~= nil then
+	mt.chdir(os.getenv("srcdir"))
+end
+
+-- the SigningTable; replaced by renaming a new copy into place
+signtable = "t-sign-rs-tables-reload.sign"
+
+function cleanup()
+	os.remove(signtable)
+	os.remove(signtable .. ".new")
+end
+
+function fail(msg)
+	cleanup()
+	error(msg)
+end
+
+function settable(lines)
+	local f = io.open(signtable .. ".new", "w")
+	if f == nil then
+		fail("can't create " .. signtable .. ".new")
+	end
+	f:write(lines)
+	f:close()
+
+	if not os.rename(signtable .. ".new", signtable) then
+		fail("can't rename " .. signtable .. ".new")
+	end
+end
+
+-- both of these sign user@example.com
+old1 = "user@example.com\ttestkey\n"
+old2 = "user@example.com\ttestkey\nuser3@example.com\ttestkey\n"
+
+-- this one doesn't
+new = "user2@example.com\ttestkey\n"
+
+settable(old1)
+
+-- try to start the filter
+mt.startfilter(binpath .. "/opendkim", "-x", "t-sign-rs-tables-reload.conf",
+               "-p", sock)
+
+-- try to connect to it
+conn = mt.connect(sock, 40, 0.25)
+if conn == nil then
+	fail("mt.connect() failed")
+end
+
+-- send connection information
+-- mt.negotiate() is called implicitly
+if mt.conninfo(conn, "localhost", "127.0.0.1") ~= nil then
+	fail("mt.conninfo() failed")
+end
+if mt.getreply(conn) ~= SMFIR_CONTINUE then
+	fail("mt.conninfo() unexpected reply")
+end
+
+-- send one message from "from"; returns the reply to EOH
+function sendheaders(conn, from)
+	mt.macro(conn, SMFIC_MAIL, "i", "t-sign-rs-tables-reload")
+	if mt.mailfrom(conn, from) ~= nil then
+		fail("mt.mailfrom() failed")
+	end
+	if mt.getreply(conn) ~= SMFIR_CONTINUE then
+		fail("mt.mailfrom() unexpected reply")
+	end
+
+	-- send headers
+	-- mt.rcptto() is called implicitly
+	if mt.header(conn, "From", from) ~= nil then
+		fail("mt.header(From) failed")
+	end
+	if mt.getreply(conn) ~= SMFIR_CONTINUE then
+		fail("mt.header(From) unexpected reply")
+	end
+	if mt.header(conn, "Date", "Tue, 22 Dec 2009 13:04:12 -0800") ~= nil then
+		fail("mt.header(Date) failed")
+	end
+	if mt.getreply(conn) ~= SMFIR_CONTINUE then
+		fail("mt.header(Date) unexpected reply")
+	end
+	if mt.header(conn, "Subject", "Signing test") ~= nil then
+		fail("mt.header(Subject) failed")
+	end
+	if mt.getreply(conn) ~= SMFIR_CONTINUE then
+		fail("mt.header(Subject) unexpected reply")
+	end
+
+	-- send EOH
+	if mt.eoh(conn) ~= nil then
+		fail("mt.eoh() failed")
+	end
+	return mt.getreply(conn)
+end
+
+-- finish a message and confirm that it was signed
+function checksigned(conn, which)
+	-- send body
+	if mt.bodystring(conn, "This is a test!\r\n") ~= nil then
+		fail("mt.bodystring() failed")
+	end
+	if mt.getreply(conn) ~= SMFIR_CONTINUE then
+		fail("mt.bodystring() unexpected reply")
+	end
+
+	-- end of message; let the filter react
+	if mt.eom(conn) ~= nil then
+		fail("mt.eom() failed")
+	end
+	if mt.getreply(conn) ~= SMFIR_ACCEPT then
+		fail("mt.eom() unexpected reply (" .. which .. ")")
+	end
+
+	-- verify that a signature got added
+	if not mt.eom_check(conn, MT_HDRINSERT, "DKIM-Signature") and
+	   not mt.eom_check(conn, MT_HDRADD, "DKIM-Signature") then
+		fail("no signature added (" .. which .. ")")
+	end
+
+	-- confirm properties
+	sig = mt.getheader(conn, "DKIM-Signature", 0)
+	if string.find(sig, "d=example.com", 1, true) == nil then
+		fail("signature has wrong d= value (" .. which .. ")")
+	end
+	if string.find(sig, "s=test", 1, true) == nil then
+		fail("signature has wrong s= value (" .. which .. ")")
+	end
+end
+
+-- first message: looked up in the table and cached
+if sendheaders(conn, "user@example.com") ~= SMFIR_CONTINUE then
+	fail("mt.eoh() unexpected reply (first message)")
+end
+checksigned(conn, "first message")
+
+-- replace the table with copies that still sign the sender while
+-- messages keep coming, so lookups overlap the swaps
+for n = 1, 20 do
+	if n % 2 == 0 then
+		settable(old1)
+	else
+		settable(old2)
+	end
+
+	if sendheaders(conn, "user@example.com") ~= SMFIR_CONTINUE then
+		fail("mt.eoh() unexpected reply (swap " .. n .. ")")
+	end
+	checksigned(conn, "swap " .. n)
+
+	mt.sleep(0.1)
+end
+
+-- now stop signing for the sender; wait for the reload to be noticed
+settable(new)
+
+reloaded = false
+for n = 1, 80 do
+	reply = sendheaders(conn, "user@example.com")
+	if reply == SMFIR_ACCEPT then
+		reloaded = true
+		break
+	elseif reply ~= SMFIR_CONTINUE then
+		fail("mt.eoh() unexpected reply (waiting for reload)")
+	end
+	checksigned(conn, "waiting for reload")
+
+	mt.sleep(0.25)
+end
+if not reloaded then
+	fail("table not reloaded")
+end
+
+-- the old answer must not come back from the cache
+for n = 1, 5 do
+	if sendheaders(conn, "user@example.com") ~= SMFIR_ACCEPT then
+		fail("mt.eoh() unexpected reply (after reload " .. n .. ")")
+	end
+end
+
+-- and the new contents are used
+if sendheaders(conn, "user2@example.com") ~= SMFIR_CONTINUE then
+	fail("mt.eoh() unexpected reply (new sender)")
+end
+checksigned(conn, "new sender")
+
+mt.disconnect(conn)
+
+cleanup()
@@ -212,6 +212,37 @@ struct dkimf_dstring
 	u_char *		ds_buf;
 };
 
+#ifdef _FFR_MSG_ARENA
+/* union dkimf_arena_align -- types whose alignment arena memory must meet */
+union dkimf_arena_align
+{
+	long double		aa_ld;
+	long long		aa_ll;
+	void *			aa_ptr;
+	void			(*aa_func)(void);
+};
+
+# define DKIMF_ARENA_ALIGN	sizeof(union dkimf_arena_align)
+# define DKIMF_ARENA_KEEP	4
+
+/* struct dkimf_arena_chunk -- a block of arena memory */
+struct dkimf_arena_chunk
+{
+	struct dkimf_arena_chunk * ac_next;
+	union dkimf_arena_align	ac_data[];
+};
+
+/* struct dkimf_arena -- an arena (bump) allocator */
+struct dkimf_arena
+{
+	size_t			arena_chunksz;
+	size_t			arena_used;
+	struct dkimf_arena_chunk * arena_cur;
+	struct dkimf_arena_chunk * arena_head;
+	struct dkimf_arena_chunk * arena_big;
+};
+#endif /* _FFR_MSG_ARENA */
+
 /* base64 alphabet */
 static unsigned char alphabet[64] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
@@ -1471,7 +1502,7 @@ dkimf_dstring_printf(struct dkimf_dstring *dstr, char *fmt, ...)
 	len = vsnprintf((char *) dstr->ds_buf + dstr->ds_len, rem, fmt, ap);
 	va_end(ap);
 
-	if (len > rem)
+	if (len >= rem)
 	{
 		if (!dkimf_dstring_resize(dstr, dstr->ds_len + len + 1))
 		{
@@ -1914,3 +1945,266 @@ dkimf_wait_fd(int fd, struct timespec *until)
 	return select(fd + 1, &fds, NULL, NULL, until == NULL ? NULL : &left);
 }
 #endif /* USE_UNBOUND */
+
+#ifdef _FFR_CTABLE
+/*
+**  DKIMF_CTABLE_HASH -- hash a key for a compiled table
+**
+**  Parameters:
+**  	key -- key
+**  	keylen -- bytes at "key"
+**  	seed -- seed
+**
+**  Return value:
+**  	Hash of "key", ignoring case.
+**
+**  Notes:
+**  	This is part of the compiled table file format; changing it
+**  	requires a new DKIMF_CTABLE_VERSION.
+*/
+
+uint32_t
+dkimf_ctable_hash(const char *key, size_t keylen, uint32_t seed)
+{
+	size_t c;
+	uint64_t h;
+
+	assert(key != NULL);
+
+	h = 14695981039346656037ULL ^ ((uint64_t) seed * 0x9e3779b97f4a7c15ULL);
+
+	for (c = 0; c < keylen; c++)
+	{
+		h ^= (uint64_t) tolower((unsigned char) key[c]);
+		h *= 1099511628211ULL;
+	}
+
+	/* mix, so that nearby seeds give unrelated results */
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return (uint32_t) h;
+}
+#endif /* _FFR_CTABLE */
+
+#ifdef _FFR_MSG_ARENA
+/*
+**  DKIMF_ARENA_NEW -- create an arena allocator
+**
+**  Parameters:
+**  	chunksz -- size of each block carved up by the arena
+**
+**  Return value:
+**  	A new arena, or NULL on failure.
+**
+**  Notes:
+**  	Nothing is allocated until the first dkimf_arena_alloc().
+*/
+
+struct dkimf_arena *
+dkimf_arena_new(size_t chunksz)
+{
+	struct dkimf_arena *new;
+
+	if (chunksz == 0)
+		return NULL;
+
+	new = (struct dkimf_arena *) malloc(sizeof *new);
+	if (new == NULL)
+		return NULL;
+
+	memset(new, '\0', sizeof *new);
+	new->arena_chunksz = chunksz;
+
+	return new;
+}
+
+/*
+**  DKIMF_ARENA_ALLOC -- allocate memory from an arena
+**
+**  Parameters:
+**  	arena -- arena
+**  	len -- bytes wanted
+**
+**  Return value:
+**  	Pointer to "len" bytes, suitably aligned for any type, or NULL on
+**  	failure.  The memory is released by dkimf_arena_reset() or
+**  	dkimf_arena_free(), not individually.
+**
+**  Notes:
+**  	Requests larger than a quarter of a block get a block of their own,
+**  	which is given back to the system on the next reset; the ordinary
+**  	blocks are kept for reuse, up to DKIMF_ARENA_KEEP of them.
+*/
+
+void *
+dkimf_arena_alloc(struct dkimf_arena *arena, size_t len)
+{
+	size_t need;
+	struct dkimf_arena_chunk *chunk;
+
+	assert(arena != NULL);
+
+	need = (len + DKIMF_ARENA_ALIGN - 1) & ~((size_t) DKIMF_ARENA_ALIGN - 1);
+	if (need == 0)
+		need = DKIMF_ARENA_ALIGN;
+
+	if (need > arena->arena_chunksz / 4)
+	{
+		chunk = (struct dkimf_arena_chunk *) malloc(sizeof *chunk + need);
+		if (chunk == NULL)
+			return NULL;
+
+		chunk->ac_next = arena->arena_big;
+		arena->arena_big = chunk;
+
+		return (void *) chunk->ac_data;
+	}
+
+	chunk = arena->arena_cur;
+	if (chunk == NULL || arena->arena_used + need > arena->arena_chunksz)
+	{
+		if (chunk != NULL && chunk->ac_next != NULL)
+		{
+			chunk = chunk->ac_next;
+		}
+		else
+		{
+			struct dkimf_arena_chunk *new;
+
+			new = (struct dkimf_arena_chunk *) malloc(sizeof *new +
+			                                          arena->arena_chunksz);
+			if (new == NULL)
+				return NULL;
+
+			new->ac_next = NULL;
+			if (chunk == NULL)
+				arena->arena_head = new;
+			else
+				chunk->ac_next = new;
+
+			chunk = new;
+		}
+
+		arena->arena_cur = chunk;
+		arena->arena_used = 0;
+	}
+
+	arena->arena_used += need;
+
+	return (char *) chunk->ac_data + arena->arena_used - need;
+}
+
+/*
+**  DKIMF_ARENA_STRDUP -- copy a string into an arena
+**
+**  Parameters:
+**  	arena -- arena
+**  	str -- string to copy
+**
+**  Return value:
+**  	The copy, or NULL on failure.
+*/
+
+char *
+dkimf_arena_strdup(struct dkimf_arena *arena, const char *str)
+{
+	size_t len;
+	char *new;
+
+	assert(arena != NULL);
+	assert(str != NULL);
+
+	len = strlen(str) + 1;
+
+	new = (char *) dkimf_arena_alloc(arena, len);
+	if (new != NULL)
+		memcpy(new, str, len);
+
+	return new;
+}
+
+/*
+**  DKIMF_ARENA_RESET -- release everything allocated from an arena
+**
+**  Parameters:
+**  	arena -- arena
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	The arena's blocks are kept for the next round of allocations,
+**  	except for oversized ones and any beyond the first DKIMF_ARENA_KEEP,
+**  	so one unusually large message doesn't pin its memory forever.
+*/
+
+void
+dkimf_arena_reset(struct dkimf_arena *arena)
+{
+	int c;
+	struct dkimf_arena_chunk *chunk;
+	struct dkimf_arena_chunk *next;
+
+	assert(arena != NULL);
+
+	for (chunk = arena->arena_big; chunk != NULL; chunk = next)
+	{
+		next = chunk->ac_next;
+		free(chunk);
+	}
+	arena->arena_big = NULL;
+
+	for (c = 1, chunk = arena->arena_head;
+	     chunk != NULL && c < DKIMF_ARENA_KEEP;
+	     c++, chunk = chunk->ac_next)
+		continue;
+
+	if (chunk != NULL)
+	{
+		next = chunk->ac_next;
+		chunk->ac_next = NULL;
+
+		for (chunk = next; chunk != NULL; chunk = next)
+		{
+			next = chunk->ac_next;
+			free(chunk);
+		}
+	}
+
+	arena->arena_cur = arena->arena_head;
+	arena->arena_used = 0;
+}
+
+/*
+**  DKIMF_ARENA_FREE -- destroy an arena
+**
+**  Parameters:
+**  	arena -- arena
+**
+**  Return value:
+**  	None.
+*/
+
+void
+dkimf_arena_free(struct dkimf_arena *arena)
+{
+	struct dkimf_arena_chunk *chunk;
+	struct dkimf_arena_chunk *next;
+
+	assert(arena != NULL);
+
+	dkimf_arena_reset(arena);
+
+	for (chunk = arena->arena_head; chunk != NULL; chunk = next)
+	{
+		next = chunk->ac_next;
+		free(chunk);
+	}
+
+	free(arena);
+}
+#endif /* _FFR_MSG_ARENA */
@@ -16,6 +16,7 @@
 #include <netinet/in.h>
 #include <regex.h>
 #include <stdio.h>
+#include <stdint.h>
 
 /* opendkim includes */
 #include "build-config.h"
@@ -23,6 +24,9 @@
 
 /* TYPES */
 struct dkimf_dstring;
+#ifdef _FFR_MSG_ARENA
+struct dkimf_arena;
+#endif /* _FFR_MSG_ARENA */
 
 #ifdef _FFR_REPLACE_RULES
 /*
@@ -38,9 +42,19 @@ struct replace
 #endif /* _FFR_REPLACE_RULES */
 
 /* PROTOTYPES */
+#ifdef _FFR_MSG_ARENA
+extern void *dkimf_arena_alloc __P((struct dkimf_arena *, size_t));
+extern void dkimf_arena_free __P((struct dkimf_arena *));
+extern struct dkimf_arena *dkimf_arena_new __P((size_t));
+extern void dkimf_arena_reset __P((struct dkimf_arena *));
+extern char *dkimf_arena_strdup __P((struct dkimf_arena *, const char *));
+#endif /* _FFR_MSG_ARENA */
 extern void dkimf_base64_encode_file __P((int, FILE *, int, int, int));
 extern _Bool dkimf_checkhost __P((DKIMF_DB, char *));
 extern _Bool dkimf_checkip __P((DKIMF_DB, struct sockaddr *));
+#ifdef _FFR_CTABLE
+extern uint32_t dkimf_ctable_hash __P((const char *, size_t, uint32_t));
+#endif /* _FFR_CTABLE */
 #ifdef POPAUTH
 extern _Bool dkimf_checkpopauth __P((DKIMF_DB, struct sockaddr *));
 #endif /* POPAUTH */
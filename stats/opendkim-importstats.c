@@ -1231,6 +1231,12 @@ main(int argc, char **argv)
 		}
 #endif /* _FFR_STATSEXT */
 
+		/* window summaries carry no per-message data to import */
+		else if (c == 'A')
+		{
+			continue;
+		}
+
 		/* unknown record type */
 		else
 		{